@@ -0,0 +1,212 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkFourierSliceProjector_h
+#define itkFourierSliceProjector_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkEuler3DTransform.h"
+#include "itkProjectionGeometry.h"
+#include "itkRegistrationMemoryAccount.h"
+
+#include <complex>
+#include <vector>
+
+namespace itk
+{
+
+/** \class FourierSliceProjector
+ * \brief Approximate DRRs from central slices of the spectrum of the
+ * volume.
+ *
+ * By the Fourier slice theorem, the 2D Fourier transform of the parallel
+ * projection of a volume along a direction is the slice of its 3D Fourier
+ * transform through the origin perpendicular to that direction.
+ * Precompute() computes the 3D FFT of the voxel values above the
+ * threshold once, zero padded by OversamplingFactor. Every projection then
+ * costs the interpolation of a central slice and a 2D inverse FFT instead
+ * of a ray cast per pixel.
+ *
+ * The projection direction is the direction from the source to the
+ * center of the volume. The divergence of the rays is corrected to first
+ * order: every ray is replaced by the parallel ray through its
+ * intersection with the plane through the center of the volume
+ * perpendicular to that direction, and its length is scaled by the
+ * obliquity of the ray. The remaining error grows with the angle between
+ * the rays and the projection direction and with the depth of the volume;
+ * EstimateDivergenceError() bounds the distance between a ray and its
+ * parallel ray within the volume. The approximation suits long source to
+ * isocenter distances, where that distance stays below a voxel.
+ *
+ * The projections are band limited to the finest voxel spacing, and the
+ * trilinear interpolation of the spectrum blurs them; the volume is
+ * corrected for the attenuation this interpolation causes away from its
+ * center. Oversampling reduces the blur at the cost of a larger spectrum.
+ * Sharp edges are smoothed and ring, so the projections suit a coarse
+ * global search rather than the final fit.
+ *
+ * The projector uses the conventions of the
+ * SiddonJacobsRayCastInterpolateImageFunction connected to a
+ * ProjectionGeometry: the volume has its origin at (0,0,0), the geometry
+ * is defined in the fixed world, the volume is displaced by the
+ * Transform, and the physical coordinates of the projection image are
+ * detector coordinates. The projection values are the thresholded line
+ * integrals of that interpolator, in units of the ray vector from the
+ * source to the detector.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TVolumeImage, typename TCoordRep = double>
+class FourierSliceProjector : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(FourierSliceProjector);
+
+  /** Standard class type alias. */
+  using Self = FourierSliceProjector;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(FourierSliceProjector, Object);
+
+  using VolumeType = TVolumeImage;
+  using VolumeConstPointer = typename VolumeType::ConstPointer;
+  using TransformType = Euler3DTransform<TCoordRep>;
+  using TransformPointer = typename TransformType::Pointer;
+  using ProjectionGeometryType = ProjectionGeometry<TCoordRep>;
+  using ProjectionGeometryPointer = typename ProjectionGeometryType::Pointer;
+
+  /** Single precision complex values of the spectrum. */
+  using ComplexType = std::complex<float>;
+
+  /** Set/Get the volume, buffered as a whole. */
+  itkSetConstObjectMacro( Input, VolumeType );
+  itkGetConstObjectMacro( Input, VolumeType );
+
+  /** Set/Get the displacement of the volume. The identity when not set. */
+  itkSetObjectMacro( Transform, TransformType );
+  itkGetConstObjectMacro( Transform, TransformType );
+
+  /** Set/Get the projection geometry, which is required. */
+  itkSetObjectMacro( ProjectionGeometry, ProjectionGeometryType );
+  itkGetConstObjectMacro( ProjectionGeometry, ProjectionGeometryType );
+
+  /** Set/Get the threshold above which the voxels are integrated, less the
+   * threshold. Default is 0. */
+  itkSetMacro( Threshold, double );
+  itkGetConstMacro( Threshold, double );
+
+  /** Set/Get the zero padding of the volume before its FFT, which refines
+   * the sampling of the spectrum, and the memory it takes: 8 bytes per
+   * voxel times the cube of the factor, rounded up to powers of two.
+   * Default is 2. */
+  itkSetClampMacro( OversamplingFactor, unsigned int, 1, 4 );
+  itkGetConstMacro( OversamplingFactor, unsigned int );
+
+  /** Set/Get the memory account the spectrum is declared to, see
+   * RegistrationMemoryAccount. The projector has its own by default, and
+   * again when a null account is set. */
+  virtual void SetMemoryAccount( RegistrationMemoryAccount * account )
+  {
+    if( m_MemoryAccount != account )
+      {
+      // Without an account, the projector has its own again
+      m_MemoryAccount = account ? account : RegistrationMemoryAccount::New().GetPointer();
+      this->Modified();
+      }
+  }
+
+  itkGetModifiableObjectMacro( MemoryAccount, RegistrationMemoryAccount );
+
+  /** Compute the spectrum of the volume. Must be called again after a
+   * change of the volume, the threshold or the oversampling factor. */
+  void Precompute();
+
+  /** Render the buffered region of a projection image in place. */
+  template <typename TProjectionImage>
+  void RenderProjection( TProjectionImage * projection ) const;
+
+  /** Estimate the error of the parallel approximation for the buffered
+   * region of a projection image: the largest distance in mm, within the
+   * volume, between a ray and the parallel ray it is replaced by. */
+  template <typename TProjectionImage>
+  double EstimateDivergenceError( const TProjectionImage * projection ) const;
+
+protected:
+  FourierSliceProjector();
+  ~FourierSliceProjector() override
+  {
+    m_MemoryAccount->ReleaseAllocations( this );
+  }
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  /** Parallel projection frame of the current pose: the source and the
+   * matrix of the ray vectors in the coordinate system of the volume, the
+   * projection direction and the axes of the parallel projection. */
+  struct ProjectionFrame
+  {
+    double Source[3];
+    double RayMatrix[3][3];
+    double Direction[3];
+    double AxisU[3];
+    double AxisV[3];
+  };
+  void ComputeProjectionFrame( ProjectionFrame & frame ) const;
+
+  /** Interpolate the spectrum trilinearly at a continuous frequency
+   * index, zero outside of the sampled band. */
+  std::complex<double> SampleSpectrum( const double frequencyIndex[3] ) const;
+
+  /** Transform the lines along an axis of an array of the given size in
+   * place, forward or backward. */
+  template <typename TComplex>
+  static void TransformLines( TComplex * data, const SizeValueType size[3],
+                              unsigned int axis, bool backward );
+
+  /** Smallest power of two not below n. */
+  static SizeValueType GetTransformSize( SizeValueType n );
+
+  VolumeConstPointer        m_Input;
+  TransformPointer          m_Transform;
+  ProjectionGeometryPointer m_ProjectionGeometry;
+  double                    m_Threshold;
+  unsigned int              m_OversamplingFactor;
+  RegistrationMemoryAccount::Pointer m_MemoryAccount;
+
+  // Spectrum of the volume, with the center of the voxel m_Center at the
+  // origin of the transform
+  std::vector<ComplexType>  m_Spectrum;
+  SizeValueType             m_SpectrumSize[3];
+  double                    m_Spacing[3];
+  double                    m_Center[3];
+  double                    m_Extent[3];
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkFourierSliceProjector.hxx"
+#endif
+
+#endif
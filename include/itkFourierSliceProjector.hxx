@@ -0,0 +1,515 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkFourierSliceProjector_hxx
+#define itkFourierSliceProjector_hxx
+
+#include "itkFourierSliceProjector.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkNumericTraits.h"
+#include "itkMath.h"
+#include "vnl/vnl_vector.h"
+#include "vnl/algo/vnl_fft_1d.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+
+template <typename TVolumeImage, typename TCoordRep>
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::FourierSliceProjector()
+{
+  m_Input = nullptr;
+  m_Transform = nullptr;
+  m_ProjectionGeometry = nullptr;
+  m_Threshold = 0.0;
+  m_OversamplingFactor = 2;
+  m_MemoryAccount = RegistrationMemoryAccount::New();
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    m_SpectrumSize[d] = 0;
+    m_Spacing[d] = 1.0;
+    m_Center[d] = 0.0;
+    m_Extent[d] = 0.0;
+    }
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+SizeValueType
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::GetTransformSize( SizeValueType n )
+{
+  SizeValueType size = 1;
+  while( size < n )
+    {
+    size *= 2;
+    }
+  return size;
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+template <typename TComplex>
+void
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::TransformLines( TComplex * data, const SizeValueType size[3], unsigned int axis, bool backward )
+{
+  const SizeValueType stride[3] = { 1, size[0], size[0] * size[1] };
+  const unsigned int b = ( axis + 1 ) % 3;
+  const unsigned int c = ( axis + 2 ) % 3;
+  const SizeValueType n = size[axis];
+
+  vnl_fft_1d<double> fft( static_cast<int>( n ) );
+  vnl_vector< std::complex<double> > line( static_cast<unsigned int>( n ) );
+  for( SizeValueType j = 0; j < size[c]; j++ )
+    {
+    for( SizeValueType i = 0; i < size[b]; i++ )
+      {
+      TComplex * first = data + i * stride[b] + j * stride[c];
+      for( SizeValueType k = 0; k < n; k++ )
+        {
+        line[k] = std::complex<double>( first[k * stride[axis]] );
+        }
+      if( backward )
+        {
+        fft.bwd_transform( line );
+        }
+      else
+        {
+        fft.fwd_transform( line );
+        }
+      for( SizeValueType k = 0; k < n; k++ )
+        {
+        first[k * stride[axis]] = TComplex( line[k] );
+        }
+      }
+    }
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+void
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::Precompute()
+{
+  if( !m_Input )
+    {
+    itkExceptionMacro(<<"No input volume");
+    }
+  const typename VolumeType::RegionType region = m_Input->GetBufferedRegion();
+  if( region != m_Input->GetLargestPossibleRegion() )
+    {
+    itkExceptionMacro(<<"The volume must be buffered as a whole");
+    }
+
+  // The voxel at the middle of the volume is placed at the origin of the
+  // transform, the others wrap around
+  SizeValueType size[3];
+  SizeValueType middle[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    size[d] = region.GetSize()[d];
+    middle[d] = size[d] / 2;
+    m_Spacing[d] = m_Input->GetSpacing()[d];
+    m_SpectrumSize[d] = GetTransformSize( m_OversamplingFactor * size[d] );
+    m_Center[d] = ( middle[d] + 0.5 ) * m_Spacing[d];
+    m_Extent[d] = size[d] * m_Spacing[d];
+    }
+
+  // The trilinear interpolation of the spectrum multiplies the volume by
+  // sinc^2( pi n / N ) along every axis, n being the distance of a voxel
+  // from the origin in voxels and N the size of the transform: the voxel
+  // values are divided by it beforehand.
+  std::vector<double> correction[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    correction[d].resize( size[d] );
+    for( SizeValueType i = 0; i < size[d]; i++ )
+      {
+      const double x = Math::pi * ( static_cast<double>( i ) - static_cast<double>( middle[d] ) ) / m_SpectrumSize[d];
+      const double sinc = ( x == 0.0 ) ? 1.0 : std::sin( x ) / x;
+      correction[d][i] = 1.0 / ( sinc * sinc );
+      }
+    }
+
+  m_Spectrum.assign( m_SpectrumSize[0] * m_SpectrumSize[1] * m_SpectrumSize[2], ComplexType( 0.0f ) );
+  m_MemoryAccount->SetAllocation( this, "FourierSpectrum", RegistrationMemoryAccount::GetVectorBytes( m_Spectrum ) );
+  const typename VolumeType::PixelType * buffer = m_Input->GetBufferPointer();
+  SizeValueType offset = 0;
+  for( SizeValueType k = 0; k < size[2]; k++ )
+    {
+    const SizeValueType wk = ( k + m_SpectrumSize[2] - middle[2] ) % m_SpectrumSize[2];
+    for( SizeValueType j = 0; j < size[1]; j++ )
+      {
+      const SizeValueType wj = ( j + m_SpectrumSize[1] - middle[1] ) % m_SpectrumSize[1];
+      for( SizeValueType i = 0; i < size[0]; i++, offset++ )
+        {
+        const double value = static_cast<double>( buffer[offset] ) - m_Threshold;
+        if( value > 0.0 )
+          {
+          const SizeValueType wi = ( i + m_SpectrumSize[0] - middle[0] ) % m_SpectrumSize[0];
+          m_Spectrum[wi + m_SpectrumSize[0] * ( wj + m_SpectrumSize[1] * wk )] =
+            ComplexType( static_cast<float>( value * correction[0][i] * correction[1][j] * correction[2][k] ) );
+          }
+        }
+      }
+    }
+
+  for( unsigned int axis = 0; axis < 3; axis++ )
+    {
+    TransformLines( m_Spectrum.data(), m_SpectrumSize, axis, false );
+    }
+  this->Modified();
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+void
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::ComputeProjectionFrame( ProjectionFrame & frame ) const
+{
+  if( !m_ProjectionGeometry )
+    {
+    itkExceptionMacro(<<"No projection geometry");
+    }
+
+  // The geometry is defined in the fixed world, the volume is displaced
+  // by the transform: the rays are mapped back into the volume by the
+  // inverse transform.
+  TransformPointer inverse = TransformType::New();
+  if( m_Transform )
+    {
+    if( !m_Transform->GetInverse( inverse ) )
+      {
+      itkExceptionMacro(<<"The transform is not invertible");
+      }
+    }
+  else
+    {
+    inverse->SetIdentity();
+    }
+  const typename TransformType::OutputPointType source =
+    inverse->TransformPoint( m_ProjectionGeometry->GetSourcePosition() );
+  const typename TransformType::MatrixType & inverseMatrix = inverse->GetMatrix();
+  const typename ProjectionGeometryType::MatrixType & rayMatrix = m_ProjectionGeometry->GetRayMatrix();
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    frame.Source[i] = source[i];
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      frame.RayMatrix[i][j] = inverseMatrix[i][0] * rayMatrix[0][j]
+                            + inverseMatrix[i][1] * rayMatrix[1][j]
+                            + inverseMatrix[i][2] * rayMatrix[2][j];
+      }
+    }
+
+  // The projection direction points from the source to the center of the
+  // volume; the first axis follows the detector rows
+  double norm = 0.0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    frame.Direction[i] = m_Center[i] - frame.Source[i];
+    norm += frame.Direction[i] * frame.Direction[i];
+    }
+  norm = std::sqrt( norm );
+  if( norm == 0.0 )
+    {
+    itkExceptionMacro(<<"The source lies at the center of the volume");
+    }
+  double rowComponent = 0.0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    frame.Direction[i] /= norm;
+    rowComponent += frame.RayMatrix[i][0] * frame.Direction[i];
+    }
+  norm = 0.0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    frame.AxisU[i] = frame.RayMatrix[i][0] - rowComponent * frame.Direction[i];
+    norm += frame.AxisU[i] * frame.AxisU[i];
+    }
+  norm = std::sqrt( norm );
+  if( norm == 0.0 )
+    {
+    itkExceptionMacro(<<"The detector rows are parallel to the projection direction");
+    }
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    frame.AxisU[i] /= norm;
+    }
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    const unsigned int j = ( i + 1 ) % 3;
+    const unsigned int k = ( i + 2 ) % 3;
+    frame.AxisV[i] = frame.Direction[j] * frame.AxisU[k] - frame.Direction[k] * frame.AxisU[j];
+    }
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+std::complex<double>
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::SampleSpectrum( const double frequencyIndex[3] ) const
+{
+  IndexValueType first[3];
+  double weight[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    const double half = 0.5 * static_cast<double>( m_SpectrumSize[d] );
+    if( !( std::fabs( frequencyIndex[d] ) < half - 1.0 ) )
+      {
+      return std::complex<double>( 0.0 );
+      }
+    first[d] = static_cast<IndexValueType>( std::floor( frequencyIndex[d] ) );
+    weight[d] = frequencyIndex[d] - first[d];
+    }
+
+  std::complex<double> value( 0.0 );
+  for( unsigned int n = 0; n < 8; n++ )
+    {
+    double w = 1.0;
+    SizeValueType offset = 0;
+    SizeValueType stride = 1;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      const unsigned int upper = ( n >> d ) & 1;
+      w *= upper ? weight[d] : 1.0 - weight[d];
+      const IndexValueType size = static_cast<IndexValueType>( m_SpectrumSize[d] );
+      const IndexValueType index = ( ( first[d] + upper ) % size + size ) % size;
+      offset += index * stride;
+      stride *= m_SpectrumSize[d];
+      }
+    value += w * std::complex<double>( m_Spectrum[offset] );
+    }
+  return value;
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+template <typename TProjectionImage>
+void
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::RenderProjection( TProjectionImage * projection ) const
+{
+  using ProjectionPixelType = typename TProjectionImage::PixelType;
+
+  if( m_Spectrum.empty() )
+    {
+    itkExceptionMacro(<<"Precompute() has not been called");
+    }
+  ProjectionFrame frame;
+  this->ComputeProjectionFrame( frame );
+
+  // Parallel projection on a square grid of the finest voxel spacing. The
+  // interpolation of the spectrum leaves faint replicas of the volume one
+  // period of the 3D transform away: the grid is large enough for neither
+  // the projection of the volume nor that of its replicas to wrap around
+  // onto it.
+  const double spacing = std::min( std::min( m_Spacing[0], m_Spacing[1] ), m_Spacing[2] );
+  const double diagonal = std::sqrt( m_Extent[0] * m_Extent[0] + m_Extent[1] * m_Extent[1] + m_Extent[2] * m_Extent[2] );
+  double period = 0.0;
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    period = std::max( period, m_SpectrumSize[d] * m_Spacing[d] );
+    }
+  const SizeValueType gridSize = GetTransformSize( static_cast<SizeValueType>( std::ceil( ( diagonal + period ) / spacing ) ) + 2 );
+  const double gridLength = gridSize * spacing;
+
+  // Central slice of the spectrum, in frequency indices of the spectrum
+  std::vector< std::complex<double> > slice( gridSize * gridSize );
+  for( SizeValueType b = 0; b < gridSize; b++ )
+    {
+    const double fb = ( b < gridSize / 2 ) ? double( b ) : double( b ) - gridSize;
+    for( SizeValueType a = 0; a < gridSize; a++ )
+      {
+      const double fa = ( a < gridSize / 2 ) ? double( a ) : double( a ) - gridSize;
+      // The spectrum of the voxel samples times the spectrum of a voxel is
+      // the spectrum of the piecewise constant volume
+      double frequencyIndex[3];
+      double voxel = 1.0;
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        const double frequency = ( fa * frame.AxisU[d] + fb * frame.AxisV[d] ) / gridLength;
+        frequencyIndex[d] = frequency * m_SpectrumSize[d] * m_Spacing[d];
+        const double x = Math::pi * frequency * m_Spacing[d];
+        voxel *= ( x == 0.0 ) ? 1.0 : std::sin( x ) / x;
+        }
+      slice[a + gridSize * b] = voxel * this->SampleSpectrum( frequencyIndex );
+      }
+    }
+
+  // The inverse FFT is not normalized; the spectrum is a sum over voxels
+  const SizeValueType sliceSize[3] = { gridSize, gridSize, 1 };
+  TransformLines( slice.data(), sliceSize, 0, true );
+  TransformLines( slice.data(), sliceSize, 1, true );
+  const double scale = m_Spacing[0] * m_Spacing[1] * m_Spacing[2] / ( gridLength * gridLength );
+
+  double toCenter = 0.0;
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    toCenter += ( m_Center[d] - frame.Source[d] ) * frame.Direction[d];
+    }
+
+  const ProjectionPixelType minOutputValue = NumericTraits<ProjectionPixelType>::NonpositiveMin();
+  const ProjectionPixelType maxOutputValue = NumericTraits<ProjectionPixelType>::max();
+
+  typename TProjectionImage::PointType point;
+  ImageRegionIteratorWithIndex<TProjectionImage> it( projection, projection->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    projection->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    double ray[3];
+    double along = 0.0;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      ray[d] = frame.RayMatrix[d][0] * point[0] + frame.RayMatrix[d][1] * point[1] + frame.RayMatrix[d][2];
+      along += ray[d] * frame.Direction[d];
+      }
+
+    double value = 0.0;
+    if( along > 0.0 )
+      {
+      // Intersection of the ray with the central plane, in grid units
+      const double alpha = toCenter / along;
+      double u = 0.0;
+      double v = 0.0;
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        const double offset = frame.Source[d] + alpha * ray[d] - m_Center[d];
+        u += offset * frame.AxisU[d];
+        v += offset * frame.AxisV[d];
+        }
+      u /= spacing;
+      v /= spacing;
+
+      const double u0 = std::floor( u );
+      const double v0 = std::floor( v );
+      const double wu = u - u0;
+      const double wv = v - v0;
+      const IndexValueType n = static_cast<IndexValueType>( gridSize );
+      const IndexValueType iu = static_cast<IndexValueType>( u0 );
+      const IndexValueType iv = static_cast<IndexValueType>( v0 );
+      if( std::fabs( u ) < 0.5 * gridSize && std::fabs( v ) < 0.5 * gridSize )
+        {
+        auto sample = [&]( IndexValueType i, IndexValueType j )
+          {
+          return slice[( ( i % n + n ) % n ) + gridSize * ( ( j % n + n ) % n )].real();
+          };
+        const double integral = ( 1.0 - wv ) * ( ( 1.0 - wu ) * sample( iu, iv ) + wu * sample( iu + 1, iv ) )
+                              + wv * ( ( 1.0 - wu ) * sample( iu, iv + 1 ) + wu * sample( iu + 1, iv + 1 ) );
+
+        // The line integral of the parallel ray in mm, scaled by the
+        // obliquity of the ray and by the length of the ray vector
+        value = scale * integral / along;
+        }
+      }
+
+    if( value < minOutputValue )
+      {
+      it.Set( minOutputValue );
+      }
+    else if( value > maxOutputValue )
+      {
+      it.Set( maxOutputValue );
+      }
+    else
+      {
+      it.Set( static_cast<ProjectionPixelType>( value ) );
+      }
+    }
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+template <typename TProjectionImage>
+double
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::EstimateDivergenceError( const TProjectionImage * projection ) const
+{
+  ProjectionFrame frame;
+  this->ComputeProjectionFrame( frame );
+
+  // Largest distance of the volume from the central plane
+  double depth = 0.0;
+  for( unsigned int n = 0; n < 8; n++ )
+    {
+    double distance = 0.0;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      const double corner = ( ( n >> d ) & 1 ) ? m_Extent[d] : 0.0;
+      distance += ( corner - m_Center[d] ) * frame.Direction[d];
+      }
+    depth = std::max( depth, std::fabs( distance ) );
+    }
+
+  // Largest angle between the rays and the projection direction, found at
+  // the corners of the region
+  const typename TProjectionImage::RegionType region = projection->GetBufferedRegion();
+  double largestTangent = 0.0;
+  for( unsigned int n = 0; n < 4; n++ )
+    {
+    typename TProjectionImage::IndexType index = region.GetIndex();
+    for( unsigned int d = 0; d < 2; d++ )
+      {
+      if( ( n >> d ) & 1 )
+        {
+        index[d] += static_cast<IndexValueType>( region.GetSize()[d] ) - 1;
+        }
+      }
+    typename TProjectionImage::PointType point;
+    projection->TransformIndexToPhysicalPoint( index, point );
+    double ray[3];
+    double along = 0.0;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      ray[d] = frame.RayMatrix[d][0] * point[0] + frame.RayMatrix[d][1] * point[1] + frame.RayMatrix[d][2];
+      along += ray[d] * frame.Direction[d];
+      }
+    double across = 0.0;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      const double component = ray[d] - along * frame.Direction[d];
+      across += component * component;
+      }
+    largestTangent = std::max( largestTangent, std::sqrt( across ) / std::fabs( along ) );
+    }
+  return depth * largestTangent;
+}
+
+
+template <typename TVolumeImage, typename TCoordRep>
+void
+FourierSliceProjector<TVolumeImage, TCoordRep>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Input: " << m_Input.GetPointer() << std::endl;
+  os << indent << "Transform: " << m_Transform.GetPointer() << std::endl;
+  os << indent << "ProjectionGeometry: " << m_ProjectionGeometry.GetPointer() << std::endl;
+  os << indent << "Threshold: " << m_Threshold << std::endl;
+  os << indent << "OversamplingFactor: " << m_OversamplingFactor << std::endl;
+  os << indent << "MemoryAccount: " << m_MemoryAccount.GetPointer() << std::endl;
+  os << indent << "SpectrumSize: " << m_SpectrumSize[0] << " " << m_SpectrumSize[1]
+     << " " << m_SpectrumSize[2] << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,160 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkLatencyHistogram_h
+#define itkLatencyHistogram_h
+
+#include "itkIntTypes.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <ostream>
+
+namespace itk
+{
+
+/** \class LatencyHistogram
+ * \brief Fixed size histogram of latencies with percentile queries.
+ *
+ * Latencies, in seconds, are counted in logarithmic bins of about 9%
+ * relative width between 1 microsecond and 100 seconds. Recording a
+ * latency does not allocate memory, which makes the histogram usable in
+ * a real-time loop. Percentiles are reported as the upper edge of the bin
+ * holding them, the maximum is exact.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class LatencyHistogram
+{
+public:
+  static constexpr unsigned int BinsPerOctave = 8;
+  static constexpr unsigned int NumberOfBins = 27 * BinsPerOctave;
+
+  LatencyHistogram()
+  {
+    this->Reset();
+  }
+
+  /** Forget all recorded latencies. */
+  void Reset()
+  {
+    m_Counts.fill( 0 );
+    m_NumberOfSamples = 0;
+    m_Sum = 0.0;
+    m_Minimum = 0.0;
+    m_Maximum = 0.0;
+  }
+
+  /** Record a latency in seconds. */
+  void Record( double latency )
+  {
+    latency = std::max( latency, 0.0 );
+    m_Counts[BinIndex( latency )]++;
+    if( m_NumberOfSamples == 0 || latency < m_Minimum )
+      {
+      m_Minimum = latency;
+      }
+    if( m_NumberOfSamples == 0 || latency > m_Maximum )
+      {
+      m_Maximum = latency;
+      }
+    m_Sum += latency;
+    m_NumberOfSamples++;
+  }
+
+  SizeValueType GetNumberOfSamples() const
+  {
+    return m_NumberOfSamples;
+  }
+
+  double GetMinimum() const
+  {
+    return m_Minimum;
+  }
+
+  double GetMaximum() const
+  {
+    return m_Maximum;
+  }
+
+  double GetMean() const
+  {
+    return m_NumberOfSamples > 0 ? m_Sum / m_NumberOfSamples : 0.0;
+  }
+
+  /** Get the latency below which the given fraction (between 0 and 1) of
+   * the samples lie. */
+  double GetPercentile( double fraction ) const
+  {
+    if( m_NumberOfSamples == 0 )
+      {
+      return 0.0;
+      }
+    fraction = std::min( std::max( fraction, 0.0 ), 1.0 );
+    const double rank = std::ceil( fraction * m_NumberOfSamples );
+    SizeValueType cumulated = 0;
+    for( unsigned int bin = 0; bin < NumberOfBins; bin++ )
+      {
+      cumulated += m_Counts[bin];
+      if( cumulated > 0 && cumulated >= rank )
+        {
+        // The last occupied bin is bounded by the exact maximum
+        return std::min( BinUpperEdge( bin ), m_Maximum );
+        }
+      }
+    return m_Maximum;
+  }
+
+  /** Print the sample count, mean, p50, p99 and maximum on one line. */
+  void Print( std::ostream & os ) const
+  {
+    os << "n = " << m_NumberOfSamples
+       << ", mean = " << this->GetMean() << " s"
+       << ", p50 = " << this->GetPercentile( 0.50 ) << " s"
+       << ", p99 = " << this->GetPercentile( 0.99 ) << " s"
+       << ", max = " << m_Maximum << " s";
+  }
+
+private:
+  static constexpr double MinimumLatency = 1e-6;
+
+  static unsigned int BinIndex( double latency )
+  {
+    if( latency <= MinimumLatency )
+      {
+      return 0;
+      }
+    const double bin = std::floor( std::log2( latency / MinimumLatency ) * BinsPerOctave ) + 1;
+    return static_cast<unsigned int>( std::min( bin, static_cast<double>( NumberOfBins - 1 ) ) );
+  }
+
+  static double BinUpperEdge( unsigned int bin )
+  {
+    return MinimumLatency * std::exp2( static_cast<double>( bin ) / BinsPerOctave );
+  }
+
+  std::array<SizeValueType, NumberOfBins> m_Counts;
+  SizeValueType                           m_NumberOfSamples;
+  double                                  m_Sum;
+  double                                  m_Minimum;
+  double                                  m_Maximum;
+};
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,145 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkMeshRayCastInterpolateImageFunction_h
+#define itkMeshRayCastInterpolateImageFunction_h
+
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkThresholdSurfaceMesh.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace itk
+{
+
+/** \class MeshRayCastInterpolateImageFunction
+ * \brief Projective interpolation of the surface of the voxels above the
+ * threshold.
+ *
+ * MeshRayCastInterpolateImageFunction has the geometry of the
+ * SiddonJacobsRayCastInterpolateImageFunction (transform, linac geometry
+ * or ProjectionGeometry, threshold) and can replace it in the metrics and
+ * the registration method. The rays are not traced through the voxels but
+ * intersected with a ThresholdSurfaceMesh of the input image: the DRR is
+ * the thickness of the structures above the threshold weighted by their
+ * mean density. With a bone threshold these are a few rigid structures,
+ * and the cost of a ray grows with the number of faces it meets rather
+ * than with the number of voxels it crosses, which gives a fast, coarse
+ * metric for the global search on large volumes.
+ *
+ * The mesh is extracted on first use, and again when the input image, the
+ * threshold or MeanDensityPerRegion has changed; like the ray casting of
+ * the superclass, it expects the input image to have its origin at
+ * (0,0,0), e.g. a prepared volume. Evaluate(), EvaluateLine() and
+ * RenderProjection() intersect the mesh; RenderProjectionWith() and
+ * RenderProjectionInSlabs() still trace the voxels. The volume replicas
+ * are not used by the mesh.
+ *
+ * \warning This interpolator works for 3-dimensional images only.
+ *
+ * \ingroup ImageFunctions
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TInputImage, typename TCoordRep = float, typename TKernelReal = TCoordRep >
+class MeshRayCastInterpolateImageFunction :
+    public SiddonJacobsRayCastInterpolateImageFunction<TInputImage, TCoordRep, TKernelReal>
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(MeshRayCastInterpolateImageFunction);
+
+  /** Standard class type alias. */
+  using Self = MeshRayCastInterpolateImageFunction;
+  using Superclass = SiddonJacobsRayCastInterpolateImageFunction<TInputImage, TCoordRep, TKernelReal>;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(MeshRayCastInterpolateImageFunction, SiddonJacobsRayCastInterpolateImageFunction);
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Types transferred from the base class */
+  using InputImageType = typename Superclass::InputImageType;
+  using PointType = typename Superclass::PointType;
+  using KernelRealType = typename Superclass::KernelRealType;
+
+  using MeshType = ThresholdSurfaceMesh<InputImageType>;
+
+  /** Set/Get whether the density of the voxels above the threshold is
+   * averaged over their 6-connected region rather than over the whole
+   * volume. Default is true. */
+  itkSetMacro( MeanDensityPerRegion, bool );
+  itkGetConstMacro( MeanDensityPerRegion, bool );
+  itkBooleanMacro( MeanDensityPerRegion );
+
+  /** Render the buffered region of a projection image in place as
+   * SiddonJacobsRayCastInterpolateImageFunction::RenderProjection() does,
+   * intersecting the rays with the mesh. */
+  template <typename TProjectionImage>
+  void RenderProjection( TProjectionImage * projection,
+                         RayCastWorkerPool * pool = nullptr ) const;
+
+  /** Get the mesh of the input image, extracting it if needed. */
+  const MeshType * GetMesh() const
+  {
+    this->UpdateMesh();
+    return m_Mesh.GetPointer();
+  }
+
+protected:
+  MeshRayCastInterpolateImageFunction();
+  ~MeshRayCastInterpolateImageFunction() override {};
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+  /** Integrate the density along the ray by intersecting the mesh. */
+  KernelRealType ComputeRayIntegral( const PointType & sourceWorld, const KernelRealType rayVector[3] ) const override;
+
+  /** Make sure the mesh matches the current input image and threshold. */
+  void UpdateMesh() const
+  {
+    if( this->GetMeshSourceMTime() > m_MeshMTime.load( std::memory_order_acquire ) )
+      {
+      this->ComputeMesh();
+      }
+  }
+
+private:
+  ModifiedTimeType GetMeshSourceMTime() const;
+  void ComputeMesh() const;
+
+  bool m_MeanDensityPerRegion;
+
+  // Mesh extracted from the input image, with the input it was extracted
+  // from: it is only extracted again when one of them changed
+  mutable std::mutex                    m_MeshMutex;
+  mutable std::atomic<ModifiedTimeType> m_MeshMTime;
+  mutable typename MeshType::Pointer    m_Mesh;
+  mutable const InputImageType *        m_MeshVolume;
+  mutable ModifiedTimeType              m_MeshVolumeMTime;
+  mutable double                        m_MeshThreshold;
+  mutable bool                          m_MeshMeanDensityPerRegion;
+};
+
+} // namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkMeshRayCastInterpolateImageFunction.hxx"
+#endif
+
+#endif
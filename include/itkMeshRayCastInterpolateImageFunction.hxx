@@ -0,0 +1,196 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkMeshRayCastInterpolateImageFunction_hxx
+#define itkMeshRayCastInterpolateImageFunction_hxx
+
+#include "itkMeshRayCastInterpolateImageFunction.h"
+
+#include <algorithm>
+
+namespace itk
+{
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::MeshRayCastInterpolateImageFunction()
+{
+  m_MeanDensityPerRegion = true;
+  m_MeshMTime = 0;
+  m_Mesh = nullptr;
+  m_MeshVolume = nullptr;
+  m_MeshVolumeMTime = 0;
+  m_MeshThreshold = 0.0;
+  m_MeshMeanDensityPerRegion = true;
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void
+MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "MeanDensityPerRegion: " << m_MeanDensityPerRegion << std::endl;
+  os << indent << "Mesh: " << m_Mesh.GetPointer() << std::endl;
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+typename MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >::KernelRealType
+MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::ComputeRayIntegral( const PointType & sourceWorld, const KernelRealType rayVector[3] ) const
+{
+  this->UpdateMesh();
+
+  double source[3];
+  double ray[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    source[d] = static_cast<double>( sourceWorld[d] );
+    ray[d] = static_cast<double>( rayVector[d] );
+    }
+  return static_cast<KernelRealType>( m_Mesh->ComputeRayIntegral( source, ray ) );
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TProjectionImage>
+void
+MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::RenderProjection( TProjectionImage * projection, RayCastWorkerPool * pool ) const
+{
+  static_assert( TProjectionImage::ImageDimension == InputImageType::ImageDimension,
+                 "The projection image must have the dimension of the volume" );
+
+  using ProjectionPixelType = typename TProjectionImage::PixelType;
+
+  const typename TProjectionImage::SizeType size = projection->GetBufferedRegion().GetSize();
+  const SizeValueType rowLength = size[0];
+  SizeValueType numberOfRows = 1;
+  for( unsigned int d = 1; d < TProjectionImage::ImageDimension; d++ )
+    {
+    numberOfRows *= size[d];
+    }
+  if( rowLength == 0 || numberOfRows == 0 )
+    {
+    return;
+    }
+
+  // Bring the ray setup and the mesh up to date once, before the workers
+  // share them
+  this->UpdateRaySetup();
+  this->UpdateMesh();
+  const MeshType * mesh = m_Mesh.GetPointer();
+
+  double source[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    source[d] = static_cast<double>( this->GetRaySource()[d] );
+    }
+
+  ProjectionPixelType * buffer = projection->GetBufferPointer();
+
+  // Render the part [beginColumn, endColumn) of the rows [beginRow, endRow)
+  auto renderTile = [&]( SizeValueType beginColumn, SizeValueType endColumn,
+                         SizeValueType beginRow, SizeValueType endRow, unsigned int )
+    {
+    PointType start;
+    typename PointType::VectorType step;
+    OffsetValueType offset;
+    for( SizeValueType row = beginRow; row < endRow; row++ )
+      {
+      Superclass::GetProjectionRow( projection, row, start, step, offset );
+      ProjectionPixelType * rowBuffer = buffer + offset;
+      this->template CastLine< KernelRealType >( start, step, beginColumn, endColumn,
+        [&]( SizeValueType k, const KernelRealType rayVector[3] )
+        {
+        const double ray[3] = { static_cast<double>( rayVector[0] ),
+                                static_cast<double>( rayVector[1] ),
+                                static_cast<double>( rayVector[2] ) };
+        rowBuffer[k] = Superclass::template ClampOutput<ProjectionPixelType>( mesh->ComputeRayIntegral( source, ray ) );
+        } );
+      }
+    };
+
+  if( pool )
+    {
+    pool->ParallelForTiles( rowLength, numberOfRows, renderTile );
+    }
+  else
+    {
+    renderTile( 0, rowLength, 0, numberOfRows, 0 );
+    }
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+ModifiedTimeType
+MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::GetMeshSourceMTime() const
+{
+  ModifiedTimeType mtime = this->GetMTime();
+  if( const InputImageType * volume = this->GetInputImage() )
+    {
+    mtime = std::max( mtime, volume->GetMTime() );
+    }
+  return mtime;
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void
+MeshRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::ComputeMesh() const
+{
+  std::lock_guard<std::mutex> lock( m_MeshMutex );
+
+  // Another thread may have updated the mesh while we were waiting
+  const ModifiedTimeType mtime = this->GetMeshSourceMTime();
+  if( mtime <= m_MeshMTime.load( std::memory_order_relaxed ) )
+    {
+    return;
+    }
+
+  const InputImageType * volume = this->GetInputImage();
+  if( !volume )
+    {
+    itkExceptionMacro(<<"No input image to extract the mesh from");
+    }
+
+  // The interpolator is also modified by changes of the geometry, which do
+  // not affect the mesh
+  if( !m_Mesh || volume != m_MeshVolume || volume->GetMTime() != m_MeshVolumeMTime ||
+      this->m_Threshold != m_MeshThreshold || m_MeanDensityPerRegion != m_MeshMeanDensityPerRegion )
+    {
+    typename MeshType::Pointer mesh = MeshType::New();
+    mesh->Build( volume, this->m_Threshold, m_MeanDensityPerRegion );
+    m_Mesh = mesh;
+    this->m_MemoryAccount->SetAllocation( this, "SurfaceMesh", mesh->GetMemorySize() );
+    m_MeshVolume = volume;
+    m_MeshVolumeMTime = volume->GetMTime();
+    m_MeshThreshold = this->m_Threshold;
+    m_MeshMeanDensityPerRegion = m_MeanDensityPerRegion;
+    }
+
+  m_MeshMTime.store( mtime, std::memory_order_release );
+}
+
+} // namespace itk
+
+#endif
@@ -22,6 +22,8 @@
 #include "itkCovariantVector.h"
 #include "itkPoint.h"
 
+#include <vector>
+
 
 namespace itk
 {
@@ -37,6 +39,11 @@ namespace itk
  * Interpolators. The correlation is normalized by the autocorrelations of both
  * the fixed and moving images.
  *
+ * When a worker pool is connected, the rows of each fixed image region are
+ * split over the workers. Every worker accumulates its own sums, which are
+ * combined in worker order; no memory is allocated per evaluation once the
+ * metric is initialized.
+ *
  * \ingroup RegistrationMetrics
  * \ingroup TwoProjectionRegistration
  */
@@ -75,6 +82,9 @@ public:
   using MovingImageType = typename Superclass::MovingImageType;
   using FixedImageConstPointer = typename Superclass::FixedImageConstPointer;
   using MovingImageConstPointer = typename Superclass::MovingImageConstPointer;
+  using FixedImageRegionType = typename Superclass::FixedImageRegionType;
+  using FixedImageMaskType = typename Superclass::FixedImageMaskType;
+  using InterpolatorType = typename Superclass::InterpolatorType;
 
 
   /** Get the derivatives of the match measure. */
@@ -96,13 +106,57 @@ public:
   itkGetConstReferenceMacro( SubtractMean, bool );
   itkBooleanMacro( SubtractMean );
 
+  /** Initialize the metric and the per worker accumulators. */
+  void Initialize() override;
+
 protected:
   NormalizedCorrelationTwoImageToOneImageMetric();
   ~NormalizedCorrelationTwoImageToOneImageMetric() override {};
   void PrintSelf(std::ostream& os, Indent indent) const override;
 
 private:
+  using AccumulateType = typename NumericTraits< MeasureType >::AccumulateType;
+
+  /** Sums accumulated by one worker or over one tile, padded to avoid
+   * false sharing */
+  struct CorrelationSums
+  {
+    AccumulateType sff;
+    AccumulateType smm;
+    AccumulateType sfm;
+    AccumulateType sf;
+    AccumulateType sm;
+    SizeValueType  count;
+    char           padding[64];
+  };
+
+  static void ResetSums( CorrelationSums & sums );
+
+  /** Add up n sums, recursively in halves. */
+  static CorrelationSums SumPairwise( const CorrelationSums * sums, SizeValueType n );
+
+  /** Compute the correlation between one fixed image and the moving image */
+  MeasureType ComputeCorrelation( const FixedImageType * fixedImage,
+                                  const FixedImageRegionType & region,
+                                  const FixedImageMaskType * fixedImageMask,
+                                  const InterpolatorType * interpolator ) const;
+
+  /** Accumulate the sums over the columns [beginColumn, endColumn) of a
+   * range of rows of a fixed image region */
+  void AccumulateRows( const FixedImageType * fixedImage,
+                       const FixedImageRegionType & region,
+                       const FixedImageMaskType * fixedImageMask,
+                       const InterpolatorType * interpolator,
+                       SizeValueType beginColumn,
+                       SizeValueType endColumn,
+                       SizeValueType beginRow,
+                       SizeValueType endRow,
+                       CorrelationSums & sums ) const;
+
   bool    m_SubtractMean;
+
+  mutable std::vector<CorrelationSums> m_WorkerSums;
+  mutable std::vector<CorrelationSums> m_TileSums;
 };
 
 } // end namespace itk
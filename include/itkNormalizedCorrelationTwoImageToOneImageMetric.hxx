@@ -19,7 +19,8 @@
 #define itkNormalizedCorrelationTwoImageToOneImageMetric_hxx
 
 #include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
-#include "itkImageRegionConstIteratorWithIndex.h"
+
+#include <algorithm>
 
 namespace itk
 {
@@ -32,6 +33,20 @@ NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
 }
 
 
+template <typename TFixedImage, typename TMovingImage>
+void
+NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::Initialize()
+{
+  Superclass::Initialize();
+
+  const unsigned int numberOfWorkers = this->m_WorkerPool ? this->m_WorkerPool->GetNumberOfWorkers() : 1;
+  m_WorkerSums.resize( numberOfWorkers );
+  this->m_MemoryAccount->SetAllocation( this, "MetricWorkerSums",
+                                        RegistrationMemoryAccount::GetVectorBytes( m_WorkerSums ) );
+}
+
+
 template <typename TFixedImage, typename TMovingImage>
 typename NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>::MeasureType
 NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
@@ -52,69 +67,177 @@ NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
     itkExceptionMacro( << "Fixed image2 has not been assigned" );
     }
 
-  using FixedIteratorType = itk::ImageRegionConstIteratorWithIndex<FixedImageType>;
+  this->ThrowIfCancellationRequested();
 
-  using AccumulateType = typename NumericTraits< MeasureType >::AccumulateType;
+  TraceSpan span( this->m_Tracer, "GetValue", "metric" );
 
+  PerformanceCounterBuffer counts;
+  counts.Add( PerformanceCounterBuffer::MetricEvaluations, 1 );
+  this->m_PerformanceCounters->Flush( counts );
 
-  // Calculate the measure value between fixed image 1 and the moving image
+  this->SetTransformParameters( parameters );
 
-  FixedIteratorType ti1( fixedImage1, this->GetFixedImageRegion1() );
+  // Calculate the measure value between fixed image 1 and the moving image
+  MeasureType measure1;
+    {
+    TraceSpan viewSpan( this->m_Tracer, "View", "metric", "view", 1 );
+    measure1 = this->ComputeCorrelation( fixedImage1,
+                                         this->GetFixedImageRegion1(),
+                                         this->m_FixedImageMask1,
+                                         this->m_Interpolator1 );
+    }
 
-  typename FixedImageType::IndexType index;
+  // Calculate the measure value between fixed image 2 and the moving image
+  MeasureType measure2;
+    {
+    TraceSpan viewSpan( this->m_Tracer, "View", "metric", "view", 2 );
+    measure2 = this->ComputeCorrelation( fixedImage2,
+                                         this->GetFixedImageRegion2(),
+                                         this->m_FixedImageMask2,
+                                         this->m_Interpolator2 );
+    }
 
-  MeasureType measure1;
+  return (measure1 + measure2)/2.0;
 
-  this->m_NumberOfPixelsCounted = 0;
+}
 
-  this->SetTransformParameters( parameters );
 
-  AccumulateType sff = NumericTraits< AccumulateType >::ZeroValue();
-  AccumulateType smm = NumericTraits< AccumulateType >::ZeroValue();
-  AccumulateType sfm = NumericTraits< AccumulateType >::ZeroValue();
-  AccumulateType sf  = NumericTraits< AccumulateType >::ZeroValue();
-  AccumulateType sm  = NumericTraits< AccumulateType >::ZeroValue();
-  typename Superclass::InputPointType inputPoint;
+template <typename TFixedImage, typename TMovingImage>
+typename NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>::MeasureType
+NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::ComputeCorrelation( const FixedImageType * fixedImage,
+                      const FixedImageRegionType & region,
+                      const FixedImageMaskType * fixedImageMask,
+                      const InterpolatorType * interpolator ) const
+{
+  const SizeValueType numberOfRows = this->GetNumberOfRows( region );
+  const SizeValueType rowLength = region.GetSize()[0];
+  CorrelationSums total;
+  PerformanceCounterBuffer reductionCounts;
 
-  while(!ti1.IsAtEnd())
+  if( this->m_DeterministicReduction )
     {
+    // Fixed tiles, whatever the number of workers and the scheduling, and
+    // a fixed order of combination of their sums
+    const SizeValueType tileSize = this->m_ReductionTileSize;
+    const SizeValueType tilesX = ( rowLength + tileSize - 1 ) / tileSize;
+    const SizeValueType tilesY = ( numberOfRows + tileSize - 1 ) / tileSize;
+    const SizeValueType numberOfTiles = tilesX * tilesY;
+
+    // Only a larger region than in the previous evaluations allocates
+    if( m_TileSums.size() < numberOfTiles )
+      {
+      m_TileSums.resize( numberOfTiles );
+      this->m_MemoryAccount->SetAllocation( this, "MetricTileSums",
+                                            RegistrationMemoryAccount::GetVectorBytes( m_TileSums ) );
+      }
 
-    index = ti1.GetIndex();
-
-    fixedImage1->TransformIndexToPhysicalPoint( index, inputPoint );
+    auto accumulateTiles = [&]( SizeValueType beginTile, SizeValueType endTile, unsigned int )
+      {
+      for( SizeValueType tile = beginTile; tile < endTile; tile++ )
+        {
+        const SizeValueType tileX = tile % tilesX;
+        const SizeValueType tileY = tile / tilesX;
+        CorrelationSums & sums = m_TileSums[tile];
+        ResetSums( sums );
+        PerformanceCounterBuffer counts;
+          {
+          TraceSpan tileSpan( this->m_Tracer, "Tile", "metric", "tile", static_cast<int64_t>( tile ) );
+          PerformanceCounterTimer timer( counts, PerformanceCounterBuffer::TraversalTime );
+          this->AccumulateRows( fixedImage, region, fixedImageMask, interpolator,
+                                tileX * tileSize, std::min( rowLength, ( tileX + 1 ) * tileSize ),
+                                tileY * tileSize, std::min( numberOfRows, ( tileY + 1 ) * tileSize ),
+                                sums );
+          }
+        this->m_PerformanceCounters->Flush( counts );
+        }
+      };
 
-    if( this->m_FixedImageMask1 && !this->m_FixedImageMask1->IsInside( inputPoint ) )
+    if( this->m_WorkerPool )
+      {
+      this->m_WorkerPool->ParallelForDynamic( numberOfTiles, accumulateTiles );
+      }
+    else
       {
-      ++ti1;
-      continue;
+      accumulateTiles( 0, numberOfTiles, 0 );
       }
 
-//    typename Superclass::OutputPointType transformedPoint = this->m_Transform->TransformPoint( inputPoint );
+    // The workers stop early on cancellation, leaving partial sums
+    this->ThrowIfCancellationRequested();
 
-    if( this->m_MovingImageMask && !this->m_MovingImageMask->IsInside( inputPoint ) )
+    TraceSpan reductionSpan( this->m_Tracer, "Reduction", "metric" );
+    PerformanceCounterTimer timer( reductionCounts, PerformanceCounterBuffer::ReductionTime );
+    total = SumPairwise( m_TileSums.data(), numberOfTiles );
+    }
+  else
+    {
+    const unsigned int numberOfWorkers = this->m_WorkerPool ? this->m_WorkerPool->GetNumberOfWorkers() : 1;
+
+    // Only a change of the number of workers after Initialize() allocates
+    if( m_WorkerSums.size() < numberOfWorkers )
+      {
+      m_WorkerSums.resize( numberOfWorkers );
+      this->m_MemoryAccount->SetAllocation( this, "MetricWorkerSums",
+                                            RegistrationMemoryAccount::GetVectorBytes( m_WorkerSums ) );
+      }
+    for( unsigned int w = 0; w < numberOfWorkers; w++ )
       {
-      ++ti1;
-      continue;
+      ResetSums( m_WorkerSums[w] );
       }
 
-    if( this->m_Interpolator1->IsInsideBuffer( inputPoint ) )
+    auto accumulate = [&]( SizeValueType beginColumn, SizeValueType endColumn,
+                           SizeValueType beginRow, SizeValueType endRow, unsigned int workerId )
       {
-      const RealType movingValue  = this->m_Interpolator1->Evaluate( inputPoint );
-      const RealType fixedValue   = ti1.Get();
-      sff += fixedValue  * fixedValue;
-      smm += movingValue * movingValue;
-      sfm += fixedValue  * movingValue;
-      if ( this->m_SubtractMean )
+      PerformanceCounterBuffer counts;
         {
-        sf += fixedValue;
-        sm += movingValue;
+        TraceSpan tileSpan( this->m_Tracer, "Tile", "metric", "row", static_cast<int64_t>( beginRow ) );
+        PerformanceCounterTimer timer( counts, PerformanceCounterBuffer::TraversalTime );
+        this->AccumulateRows( fixedImage, region, fixedImageMask, interpolator,
+                              beginColumn, endColumn, beginRow, endRow, m_WorkerSums[workerId] );
         }
-      this->m_NumberOfPixelsCounted++;
+      this->m_PerformanceCounters->Flush( counts );
+      };
+
+    // The cost of the rays varies strongly over the region: the tiles are
+    // balanced over the workers by work stealing
+    if( this->m_WorkerPool )
+      {
+      this->m_WorkerPool->ParallelForTiles( rowLength, numberOfRows, accumulate );
+      }
+    else
+      {
+      accumulate( 0, rowLength, 0, numberOfRows, 0 );
       }
 
-    ++ti1;
+    // The workers stop early on cancellation, leaving partial sums
+    this->ThrowIfCancellationRequested();
+
+    // Combine the sums of the workers in a fixed order
+    TraceSpan reductionSpan( this->m_Tracer, "Reduction", "metric" );
+    PerformanceCounterTimer timer( reductionCounts, PerformanceCounterBuffer::ReductionTime );
+    ResetSums( total );
+    for( unsigned int w = 0; w < numberOfWorkers; w++ )
+      {
+      const CorrelationSums & sums = m_WorkerSums[w];
+      total.sff += sums.sff;
+      total.smm += sums.smm;
+      total.sfm += sums.sfm;
+      total.sf  += sums.sf;
+      total.sm  += sums.sm;
+      total.count += sums.count;
+      }
     }
 
+  AccumulateType sff = total.sff;
+  AccumulateType smm = total.smm;
+  AccumulateType sfm = total.sfm;
+  const AccumulateType sf = total.sf;
+  const AccumulateType sm = total.sm;
+  this->m_NumberOfPixelsCounted = total.count;
+
+  reductionCounts.Add( PerformanceCounterBuffer::PixelsCounted, total.count );
+  this->m_PerformanceCounters->Flush( reductionCounts );
+
   if ( this->m_SubtractMean && this->m_NumberOfPixelsCounted > 0 )
     {
     sff -= ( sf * sf / this->m_NumberOfPixelsCounted );
@@ -122,94 +245,112 @@ NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
     sfm -= ( sf * sm / this->m_NumberOfPixelsCounted );
     }
 
-  RealType denom = -1.0 * sqrt( sff * smm );
+  const RealType denom = -1.0 * sqrt( sff * smm );
 
   if( this->m_NumberOfPixelsCounted > 0 && denom != 0.0)
     {
-    measure1 = sfm / denom;
+    return sfm / denom;
     }
-  else
-    {
-    measure1 = NumericTraits< MeasureType >::Zero;
-    }
-
-
-  // Calculate the measure value between fixed image 2 and the moving image
-
-  FixedIteratorType ti2( fixedImage2, this->GetFixedImageRegion2() );
-
-  MeasureType measure2;
-
-  this->m_NumberOfPixelsCounted = 0;
+  return NumericTraits< MeasureType >::Zero;
+}
 
-  this->SetTransformParameters( parameters );
 
-  sff = NumericTraits< AccumulateType >::ZeroValue();
-  smm = NumericTraits< AccumulateType >::ZeroValue();
-  sfm = NumericTraits< AccumulateType >::ZeroValue();
-  sf  = NumericTraits< AccumulateType >::ZeroValue();
-  sm  = NumericTraits< AccumulateType >::ZeroValue();
+template <typename TFixedImage, typename TMovingImage>
+void
+NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::AccumulateRows( const FixedImageType * fixedImage,
+                  const FixedImageRegionType & region,
+                  const FixedImageMaskType * fixedImageMask,
+                  const InterpolatorType * interpolator,
+                  SizeValueType beginColumn,
+                  SizeValueType endColumn,
+                  SizeValueType beginRow,
+                  SizeValueType endRow,
+                  CorrelationSums & sums ) const
+{
+  typename Superclass::InputPointType inputPoint;
 
-  while(!ti2.IsAtEnd())
+  for( SizeValueType row = beginRow; row < endRow; row++ )
     {
-
-    index = ti2.GetIndex();
-
-//    typename Superclass::InputPointType inputPoint;
-    fixedImage2->TransformIndexToPhysicalPoint( index, inputPoint );
-
-    if( this->m_FixedImageMask2 && !this->m_FixedImageMask2->IsInside( inputPoint ) )
+    if( this->IsCancellationRequested() )
       {
-      ++ti2;
-      continue;
+      return;
       }
 
-//    typename Superclass::OutputPointType transformedPoint = this->m_Transform->TransformPoint( inputPoint );
+    typename FixedImageType::IndexType index = this->GetRowIndex( region, row );
+    index[0] += static_cast<IndexValueType>( beginColumn );
 
-    if( this->m_MovingImageMask && !this->m_MovingImageMask->IsInside( inputPoint ) )
+    for( SizeValueType k = beginColumn; k < endColumn; k++, index[0]++ )
       {
-      ++ti2;
-      continue;
-      }
+      fixedImage->TransformIndexToPhysicalPoint( index, inputPoint );
 
-    if( this->m_Interpolator2->IsInsideBuffer( inputPoint ) )
-      {
-      const RealType movingValue  = this->m_Interpolator2->Evaluate( inputPoint );
-      const RealType fixedValue   = ti2.Get();
-      sff += fixedValue  * fixedValue;
-      smm += movingValue * movingValue;
-      sfm += fixedValue  * movingValue;
-      if ( this->m_SubtractMean )
+      if( fixedImageMask && !fixedImageMask->IsInside( inputPoint ) )
         {
-        sf += fixedValue;
-        sm += movingValue;
+        continue;
         }
-      this->m_NumberOfPixelsCounted++;
-      }
 
-    ++ti2;
-    }
+      if( this->m_MovingImageMask && !this->m_MovingImageMask->IsInside( inputPoint ) )
+        {
+        continue;
+        }
 
-  if ( this->m_SubtractMean && this->m_NumberOfPixelsCounted > 0 )
-    {
-    sff -= ( sf * sf / this->m_NumberOfPixelsCounted );
-    smm -= ( sm * sm / this->m_NumberOfPixelsCounted );
-    sfm -= ( sf * sm / this->m_NumberOfPixelsCounted );
+      if( interpolator->IsInsideBuffer( inputPoint ) )
+        {
+        const RealType movingValue  = interpolator->Evaluate( inputPoint );
+        const RealType fixedValue   = fixedImage->GetPixel( index );
+        sums.sff += fixedValue  * fixedValue;
+        sums.smm += movingValue * movingValue;
+        sums.sfm += fixedValue  * movingValue;
+        if ( this->m_SubtractMean )
+          {
+          sums.sf += fixedValue;
+          sums.sm += movingValue;
+          }
+        sums.count++;
+        }
+      }
     }
+}
 
-  denom = -1.0 * sqrt( sff * smm );
 
-  if( this->m_NumberOfPixelsCounted > 0 && denom != 0.0)
+template <typename TFixedImage, typename TMovingImage>
+void
+NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::ResetSums( CorrelationSums & sums )
+{
+  sums.sff = NumericTraits< AccumulateType >::ZeroValue();
+  sums.smm = NumericTraits< AccumulateType >::ZeroValue();
+  sums.sfm = NumericTraits< AccumulateType >::ZeroValue();
+  sums.sf  = NumericTraits< AccumulateType >::ZeroValue();
+  sums.sm  = NumericTraits< AccumulateType >::ZeroValue();
+  sums.count = 0;
+}
+
+
+template <typename TFixedImage, typename TMovingImage>
+typename NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>::CorrelationSums
+NormalizedCorrelationTwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::SumPairwise( const CorrelationSums * sums, SizeValueType n )
+{
+  CorrelationSums total;
+  if( n == 0 )
     {
-    measure2 = sfm / denom;
+    ResetSums( total );
+    return total;
     }
-  else
+  if( n == 1 )
     {
-    measure2 = NumericTraits< MeasureType >::Zero;
+    return sums[0];
     }
-
-  return (measure1 + measure2)/2.0;
-
+  total = SumPairwise( sums, n / 2 );
+  const CorrelationSums second = SumPairwise( sums + n / 2, n - n / 2 );
+  total.sff += second.sff;
+  total.smm += second.smm;
+  total.sfm += second.sfm;
+  total.sf  += second.sf;
+  total.sm  += second.sm;
+  total.count += second.count;
+  return total;
 }
 
 
@@ -0,0 +1,238 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkNumaTopology_h
+#define itkNumaTopology_h
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace itk
+{
+
+/** \class NumaTopology
+ * \brief NUMA nodes of the machine and placement of memory on them.
+ *
+ * The online nodes and their processors are read from
+ * /sys/devices/system/node. The numbers of the nodes are not necessarily
+ * contiguous, e.g. after a node was taken offline. Memory is placed with
+ * the mbind system call, which moves the pages already allocated and sets
+ * the policy of the pages allocated later. No NUMA library is required.
+ *
+ * On systems other than Linux, and on Linux without NUMA support, the
+ * machine has a single node and the placement functions return false.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class NumaTopology
+{
+public:
+  using ProcessorSetType = std::vector<int>;
+  using NodeSetType = std::vector<unsigned int>;
+
+  /** Get the numbers of the online NUMA nodes, in increasing order. Node 0
+   * alone if the topology is not available. */
+  static NodeSetType GetNodes()
+  {
+    NodeSetType nodes;
+#if defined(__linux__)
+    std::ifstream nodeList( "/sys/devices/system/node/online" );
+    std::string ranges;
+    if( std::getline( nodeList, ranges ) )
+      {
+      for( int node : ParseList( ranges ) )
+        {
+        nodes.push_back( static_cast<unsigned int>( node ) );
+        }
+      }
+#endif
+    if( nodes.empty() )
+      {
+      nodes.push_back( 0 );
+      }
+    return nodes;
+  }
+
+  /** Get the number of online NUMA nodes, at least 1. */
+  static unsigned int GetNumberOfNodes()
+  {
+    return static_cast<unsigned int>( GetNodes().size() );
+  }
+
+  /** Get the processors of a node. Empty if the node does not exist or
+   * the topology is not available. */
+  static ProcessorSetType GetProcessorsOfNode( unsigned int node )
+  {
+    ProcessorSetType processors;
+#if defined(__linux__)
+    std::ifstream cpuList( "/sys/devices/system/node/node" + std::to_string( node ) + "/cpulist" );
+    std::string ranges;
+    if( std::getline( cpuList, ranges ) )
+      {
+      processors = ParseList( ranges );
+      }
+#else
+    (void)node;
+#endif
+    return processors;
+  }
+
+  /** Get the node of a processor, or -1 if unknown. */
+  static int GetNodeOfProcessor( int processor )
+  {
+    for( unsigned int node : GetNodes() )
+      {
+      for( int nodeProcessor : GetProcessorsOfNode( node ) )
+        {
+        if( nodeProcessor == processor )
+          {
+          return static_cast<int>( node );
+          }
+        }
+      }
+    return -1;
+  }
+
+  /** Get the processors of all nodes, alternating between the nodes, so
+   * that consecutive workers pinned to the set are spread over the
+   * nodes. */
+  static ProcessorSetType GetInterleavedProcessorSet()
+  {
+    std::vector<ProcessorSetType> nodes;
+    std::size_t maximumSize = 0;
+    for( unsigned int node : GetNodes() )
+      {
+      nodes.push_back( GetProcessorsOfNode( node ) );
+      maximumSize = std::max( maximumSize, nodes.back().size() );
+      }
+    ProcessorSetType processors;
+    for( std::size_t i = 0; i < maximumSize; i++ )
+      {
+      for( const ProcessorSetType & node : nodes )
+        {
+        if( i < node.size() )
+          {
+          processors.push_back( node[i] );
+          }
+        }
+      }
+    return processors;
+  }
+
+  /** Place the pages of a buffer on a node. Only the pages entirely within
+   * the buffer are placed, so that the neighbouring allocations are left
+   * alone. Returns false if not supported or failed. */
+  static bool BindMemory( const void * buffer, std::size_t numberOfBytes, unsigned int node )
+  {
+    std::vector<unsigned long> mask( MaskSize( node + 1 ), 0 );
+    mask[node / BitsPerMaskWord] |= 1UL << ( node % BitsPerMaskWord );
+    return SetMemoryPolicy( buffer, numberOfBytes, BindPolicy, mask );
+  }
+
+  /** Interleave the pages of a buffer over all online nodes. Only the
+   * pages entirely within the buffer are placed. Returns false if not
+   * supported or failed. */
+  static bool InterleaveMemory( const void * buffer, std::size_t numberOfBytes )
+  {
+    const NodeSetType nodes = GetNodes();
+    std::vector<unsigned long> mask( MaskSize( nodes.back() + 1 ), 0 );
+    for( unsigned int node : nodes )
+      {
+      mask[node / BitsPerMaskWord] |= 1UL << ( node % BitsPerMaskWord );
+      }
+    return SetMemoryPolicy( buffer, numberOfBytes, InterleavePolicy, mask );
+  }
+
+private:
+  // Values of MPOL_BIND, MPOL_INTERLEAVE and MPOL_MF_MOVE of <numaif.h>
+  static constexpr int      BindPolicy = 2;
+  static constexpr int      InterleavePolicy = 3;
+  static constexpr unsigned MoveFlag = 1u << 1;
+  static constexpr unsigned BitsPerMaskWord = 8 * sizeof( unsigned long );
+
+  /** Parse a list of ranges such as "0-3,8-11", as used by sysfs. */
+  static std::vector<int> ParseList( const std::string & ranges )
+  {
+    std::vector<int> values;
+    std::stringstream rangeStream( ranges );
+    std::string range;
+    while( std::getline( rangeStream, range, ',' ) )
+      {
+      if( range.empty() )
+        {
+        continue;
+        }
+      const std::string::size_type dash = range.find( '-' );
+      const int first = std::stoi( range.substr( 0, dash ) );
+      const int last = ( dash == std::string::npos ) ? first : std::stoi( range.substr( dash + 1 ) );
+      for( int value = first; value <= last; value++ )
+        {
+        values.push_back( value );
+        }
+      }
+    return values;
+  }
+
+  static std::size_t MaskSize( unsigned int numberOfNodes )
+  {
+    return ( numberOfNodes + BitsPerMaskWord - 1 ) / BitsPerMaskWord;
+  }
+
+  static bool SetMemoryPolicy( const void * buffer, std::size_t numberOfBytes,
+                               int policy, const std::vector<unsigned long> & mask )
+  {
+#if defined(__linux__) && defined(SYS_mbind)
+    if( !buffer || numberOfBytes == 0 )
+      {
+      return false;
+      }
+    // mbind works on whole pages: the pages shared with the neighbouring
+    // allocations keep their placement
+    const std::uintptr_t pageSize = static_cast<std::uintptr_t>( sysconf( _SC_PAGESIZE ) );
+    const std::uintptr_t begin = ( reinterpret_cast<std::uintptr_t>( buffer ) + pageSize - 1 ) / pageSize * pageSize;
+    const std::uintptr_t end = ( reinterpret_cast<std::uintptr_t>( buffer ) + numberOfBytes ) / pageSize * pageSize;
+    if( end <= begin )
+      {
+      // No whole page to place
+      return true;
+      }
+    const unsigned long maximumNode = mask.size() * BitsPerMaskWord + 1;
+    return syscall( SYS_mbind, reinterpret_cast<void *>( begin ), end - begin, policy,
+                    mask.data(), maximumNode, MoveFlag ) == 0;
+#else
+    (void)buffer;
+    (void)numberOfBytes;
+    (void)policy;
+    (void)mask;
+    return false;
+#endif
+  }
+};
+
+} // end namespace itk
+
+#endif
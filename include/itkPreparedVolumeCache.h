@@ -0,0 +1,213 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkPreparedVolumeCache_h
+#define itkPreparedVolumeCache_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkPreparedVolumeFile.h"
+#include "itkRegistrationMemoryAccount.h"
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace itk
+{
+
+/** \class PreparedVolumeCache
+ * \brief Least recently used cache of volumes prepared for ray casting.
+ *
+ * A prepared volume has its origin at (0,0,0), as required by the
+ * SiddonJacobsRayCastInterpolateImageFunction, and the intensity
+ * threshold already subtracted: voxels hold max(value - threshold, 0). A
+ * prepared volume is therefore projected with a zero interpolator
+ * threshold and gives the same ray integrals as the original volume with
+ * the threshold. For integer pixel types and a fractional threshold, the
+ * positive differences are rounded up: the same voxels are selected, and
+ * each one contributes less than one intensity unit more.
+ *
+ * Volumes are keyed by file name and threshold. On a miss the volume is
+ * read by a loader given by the caller, prepared and inserted; concurrent
+ * requests for the same key wait for a single load. When the cache holds
+ * more than MaximumNumberOfVolumes volumes, or when its resident volumes
+ * take more than MaximumMemorySize bytes, the least recently used ones
+ * are evicted. Evicted volumes stay valid for the holders of a pointer.
+ * The resident bytes are declared to the memory account of the cache.
+ *
+ * When a cache directory is set, prepared volumes are also kept on disk
+ * as PreparedVolumeFile files named after a key of the source file path,
+ * size and modification time and of the threshold. A miss first maps the
+ * file of the volume, if it exists and is up to date, instead of loading
+ * and preparing it; the mapped pages are shared by all processes using
+ * the same directory. A volume loaded by the loader is written to the
+ * directory, with the hash of the source content, and mapped. It is not
+ * written if the source changed while it was loaded. With
+ * VerifySourceHash, a mapped file is only used if the source content
+ * still has its hash, at the cost of reading the source.
+ *
+ * All methods are thread safe.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TVolumeImage>
+class PreparedVolumeCache : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(PreparedVolumeCache);
+
+  /** Standard class type alias. */
+  using Self = PreparedVolumeCache;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(PreparedVolumeCache, Object);
+
+  using VolumeType = TVolumeImage;
+  using VolumePointer = typename VolumeType::Pointer;
+  using VolumeConstPointer = typename VolumeType::ConstPointer;
+
+  /** Function reading a volume from a file. */
+  using LoaderType = std::function< VolumePointer( const std::string & ) >;
+
+  /** Set/Get the maximum number of resident volumes. Default is 4. */
+  void SetMaximumNumberOfVolumes( SizeValueType maximumNumberOfVolumes );
+  SizeValueType GetMaximumNumberOfVolumes() const;
+
+  /** Set/Get the memory ceiling of the resident volumes, in bytes. The
+   * most recently used volume is kept even when it alone exceeds the
+   * ceiling. Default is 0, no ceiling. */
+  void SetMaximumMemorySize( SizeValueType maximumMemorySize );
+  SizeValueType GetMaximumMemorySize() const;
+
+  /** Get the size of the resident volumes, in bytes. A mapped prepared
+   * volume counts as a whole. */
+  SizeValueType GetMemorySize() const;
+
+  /** Set/Get the memory account the resident volumes are declared to, see
+   * RegistrationMemoryAccount. The cache has its own by default, and
+   * again when a null account is set. */
+  void SetMemoryAccount( RegistrationMemoryAccount * account );
+  RegistrationMemoryAccount * GetMemoryAccount() const;
+
+  /** Set/Get the directory of the prepared volume files. Empty by
+   * default, i.e. volumes are only held in memory. */
+  void SetCacheDirectory( const std::string & directory );
+  std::string GetCacheDirectory() const;
+
+  /** Set/Get whether the content of the source file is hashed and
+   * compared with the hash recorded in the prepared volume file before
+   * the file is used. Default is false: the file is looked up by the
+   * path, size and modification time of the source only. */
+  void SetVerifySourceHash( bool verify );
+  bool GetVerifySourceHash() const;
+
+  /** Get the prepared volume for a file and threshold, loading and
+   * preparing it with the loader on a miss. Exceptions of the loader are
+   * passed to every caller waiting for the volume. If given, hit is set
+   * to whether the volume was resident or being loaded by another call. */
+  VolumeConstPointer GetVolume( const std::string & fileName,
+                                double threshold,
+                                const LoaderType & loader,
+                                bool * hit = nullptr );
+
+  /** Check whether a volume is resident, without changing its recency. */
+  bool Contains( const std::string & fileName, double threshold ) const;
+
+  /** Get the number of resident volumes, and the number of hits and misses
+   * since the creation of the cache. */
+  SizeValueType GetNumberOfVolumes() const;
+  SizeValueType GetNumberOfHits() const;
+  SizeValueType GetNumberOfMisses() const;
+
+  /** Get the number of misses served by mapping a prepared volume file. */
+  SizeValueType GetNumberOfFileHits() const;
+
+  /** Remove all volumes. */
+  void Clear();
+
+  /** Prepare a volume in place: move its origin to (0,0,0) and subtract
+   * the threshold from its voxels, clamping at zero. Positive differences
+   * are rounded up for integer pixel types. */
+  static void PrepareVolume( VolumeType * volume, double threshold );
+
+protected:
+  PreparedVolumeCache();
+  ~PreparedVolumeCache() override
+  {
+    m_MemoryAccount->ReleaseAllocations( this );
+  }
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  using KeyType = std::pair< std::string, double >;
+  using EntryType = std::pair< KeyType, std::shared_future< VolumeConstPointer > >;
+  using ListType = std::list< EntryType >;
+
+  /** Evict the least recently used, completely loaded volumes until the
+   * cache holds at most MaximumNumberOfVolumes within MaximumMemorySize.
+   * Called with the lock; returns the size of the resident volumes. */
+  SizeValueType EvictVolumes();
+
+  /** Size of the resident, completely loaded volumes. Called with the
+   * lock. */
+  SizeValueType ComputeMemorySize() const;
+
+  /** Declare the size of the resident volumes to the memory account.
+   * Called without the lock, so that the observers of the account may
+   * use the cache. */
+  void AccountMemory( RegistrationMemoryAccount * account, SizeValueType bytes );
+
+  /** Load and prepare a volume on a miss, through the cache directory if
+   * one is given. Called without the lock. */
+  VolumeConstPointer LoadVolume( const std::string & fileName,
+                                 double threshold,
+                                 const LoaderType & loader,
+                                 const std::string & directory,
+                                 bool verifySourceHash );
+
+  mutable std::mutex                                        m_Mutex;
+  ListType                                                  m_Entries;
+  std::map< KeyType, typename ListType::iterator >          m_Index;
+  SizeValueType                                             m_MaximumNumberOfVolumes;
+  SizeValueType                                             m_MaximumMemorySize;
+  SizeValueType                                             m_NumberOfHits;
+  SizeValueType                                             m_NumberOfMisses;
+  SizeValueType                                             m_NumberOfFileHits;
+  std::string                                               m_CacheDirectory;
+  bool                                                      m_VerifySourceHash;
+  RegistrationMemoryAccount::Pointer                        m_MemoryAccount;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkPreparedVolumeCache.hxx"
+#endif
+
+#endif
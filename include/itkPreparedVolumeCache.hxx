@@ -0,0 +1,503 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkPreparedVolumeCache_hxx
+#define itkPreparedVolumeCache_hxx
+
+#include "itkPreparedVolumeCache.h"
+#include "itkImageRegionIterator.h"
+
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace itk
+{
+
+template <typename TVolumeImage>
+PreparedVolumeCache<TVolumeImage>
+::PreparedVolumeCache()
+{
+  m_MaximumNumberOfVolumes = 4;
+  m_NumberOfHits = 0;
+  m_NumberOfMisses = 0;
+  m_NumberOfFileHits = 0;
+  m_MaximumMemorySize = 0;
+  m_VerifySourceHash = false;
+  m_MemoryAccount = RegistrationMemoryAccount::New();
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::SetMaximumNumberOfVolumes( SizeValueType maximumNumberOfVolumes )
+{
+  RegistrationMemoryAccount::Pointer account;
+  SizeValueType bytes;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  m_MaximumNumberOfVolumes = ( maximumNumberOfVolumes < 1 ? 1 : maximumNumberOfVolumes );
+  bytes = this->EvictVolumes();
+  account = m_MemoryAccount;
+  }
+  this->AccountMemory( account, bytes );
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetMaximumNumberOfVolumes() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_MaximumNumberOfVolumes;
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::SetMaximumMemorySize( SizeValueType maximumMemorySize )
+{
+  RegistrationMemoryAccount::Pointer account;
+  SizeValueType bytes;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  m_MaximumMemorySize = maximumMemorySize;
+  bytes = this->EvictVolumes();
+  account = m_MemoryAccount;
+  }
+  this->AccountMemory( account, bytes );
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetMaximumMemorySize() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_MaximumMemorySize;
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetMemorySize() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return this->ComputeMemorySize();
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::SetMemoryAccount( RegistrationMemoryAccount * account )
+{
+  const RegistrationMemoryAccount::Pointer newAccount =
+    account ? account : RegistrationMemoryAccount::New().GetPointer();
+  RegistrationMemoryAccount::Pointer previous;
+  SizeValueType bytes;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  previous = m_MemoryAccount;
+  m_MemoryAccount = newAccount;
+  bytes = this->ComputeMemorySize();
+  }
+  if( previous != newAccount )
+    {
+    previous->ReleaseAllocations( this );
+    this->AccountMemory( newAccount, bytes );
+    }
+}
+
+
+template <typename TVolumeImage>
+RegistrationMemoryAccount *
+PreparedVolumeCache<TVolumeImage>
+::GetMemoryAccount() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_MemoryAccount.GetPointer();
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::SetCacheDirectory( const std::string & directory )
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  m_CacheDirectory = directory;
+}
+
+
+template <typename TVolumeImage>
+std::string
+PreparedVolumeCache<TVolumeImage>
+::GetCacheDirectory() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_CacheDirectory;
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::SetVerifySourceHash( bool verify )
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  m_VerifySourceHash = verify;
+}
+
+
+template <typename TVolumeImage>
+bool
+PreparedVolumeCache<TVolumeImage>
+::GetVerifySourceHash() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_VerifySourceHash;
+}
+
+
+template <typename TVolumeImage>
+typename PreparedVolumeCache<TVolumeImage>::VolumeConstPointer
+PreparedVolumeCache<TVolumeImage>
+::GetVolume( const std::string & fileName, double threshold, const LoaderType & loader, bool * hit )
+{
+  const KeyType key( fileName, threshold );
+
+  std::promise< VolumeConstPointer > promise;
+  std::shared_future< VolumeConstPointer > volume;
+  std::string directory;
+  bool verifySourceHash = false;
+  bool load = false;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  directory = m_CacheDirectory;
+  verifySourceHash = m_VerifySourceHash;
+  auto found = m_Index.find( key );
+  if( found != m_Index.end() )
+    {
+    // The volume may still be loading, it is waited for without the lock
+    m_Entries.splice( m_Entries.begin(), m_Entries, found->second );
+    volume = found->second->second;
+    m_NumberOfHits++;
+    }
+  else
+    {
+    volume = promise.get_future().share();
+    m_Entries.emplace_front( key, volume );
+    m_Index[key] = m_Entries.begin();
+    m_NumberOfMisses++;
+    load = true;
+    }
+  }
+
+  if( hit )
+    {
+    *hit = !load;
+    }
+
+  if( load )
+    {
+    try
+      {
+      promise.set_value( this->LoadVolume( fileName, threshold, loader, directory, verifySourceHash ) );
+      }
+    catch( ... )
+      {
+      // Forget the failed entry, the waiting callers get the exception
+      {
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      auto found = m_Index.find( key );
+      if( found != m_Index.end() )
+        {
+        m_Entries.erase( found->second );
+        m_Index.erase( found );
+        }
+      }
+      promise.set_exception( std::current_exception() );
+      }
+
+    RegistrationMemoryAccount::Pointer account;
+    SizeValueType bytes;
+    {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    bytes = this->EvictVolumes();
+    account = m_MemoryAccount;
+    }
+    this->AccountMemory( account, bytes );
+    }
+
+  return volume.get();
+}
+
+
+template <typename TVolumeImage>
+typename PreparedVolumeCache<TVolumeImage>::VolumeConstPointer
+PreparedVolumeCache<TVolumeImage>
+::LoadVolume( const std::string & fileName,
+              double threshold,
+              const LoaderType & loader,
+              const std::string & directory,
+              bool verifySourceHash )
+{
+  using FileType = PreparedVolumeFile< VolumeType >;
+  typename FileType::Pointer file = FileType::New();
+  std::string preparedFileName;
+  uint64_t sourceKey = 0;
+  if( !directory.empty() )
+    {
+    // Looking the file up only takes a stat() of the source
+    sourceKey = FileType::ComputeSourceKey( fileName, threshold );
+    if( sourceKey != 0 )
+      {
+      std::ostringstream name;
+      name << directory << "/" << std::hex << std::setw( 16 ) << std::setfill( '0' ) << sourceKey << ".tpv";
+      preparedFileName = name.str();
+      if( file->Read( preparedFileName, sourceKey )
+          && ( !verifySourceHash || FileType::ComputeSourceHash( fileName, threshold ) == file->GetSourceHash() ) )
+        {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        m_NumberOfFileHits++;
+        return file->GetVolume();
+        }
+      }
+    }
+
+  VolumePointer loaded = loader( fileName );
+  if( !loaded )
+    {
+    itkExceptionMacro(<<"Loader returned no volume for " << fileName);
+    }
+  PrepareVolume( loaded, threshold );
+
+  // The file is only written if the source did not change while it was
+  // loaded and hashed, otherwise its key would not match its content
+  const uint64_t sourceHash = preparedFileName.empty() ? 0 : FileType::ComputeSourceHash( fileName, threshold );
+  if( !preparedFileName.empty() && sourceHash != 0
+      && FileType::ComputeSourceKey( fileName, threshold ) == sourceKey )
+    {
+    // Serve the mapped file, so that the pages are shared with the other
+    // processes; the loaded volume is used if the file cannot be written.
+    try
+      {
+      file->Write( preparedFileName, loaded, threshold, sourceKey, sourceHash );
+      if( file->Read( preparedFileName, sourceKey ) )
+        {
+        return file->GetVolume();
+        }
+      }
+    catch( ExceptionObject & err )
+      {
+      itkWarningMacro(<<"Cannot write the prepared volume file: " << err.GetDescription());
+      }
+    }
+  return VolumeConstPointer( loaded.GetPointer() );
+}
+
+
+template <typename TVolumeImage>
+bool
+PreparedVolumeCache<TVolumeImage>
+::Contains( const std::string & fileName, double threshold ) const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_Index.count( KeyType( fileName, threshold ) ) > 0;
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetNumberOfVolumes() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_Entries.size();
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetNumberOfHits() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_NumberOfHits;
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetNumberOfMisses() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_NumberOfMisses;
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::GetNumberOfFileHits() const
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  return m_NumberOfFileHits;
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::Clear()
+{
+  RegistrationMemoryAccount::Pointer account;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  m_Entries.clear();
+  m_Index.clear();
+  account = m_MemoryAccount;
+  }
+  this->AccountMemory( account, 0 );
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::EvictVolumes()
+{
+  SizeValueType bytes = this->ComputeMemorySize();
+  auto entry = m_Entries.end();
+  while( entry != m_Entries.begin() )
+    {
+    const bool overNumber = m_Entries.size() > m_MaximumNumberOfVolumes;
+    const bool overMemory = m_MaximumMemorySize > 0 && bytes > m_MaximumMemorySize;
+    if( !overNumber && !overMemory )
+      {
+      break;
+      }
+    --entry;
+    // The most recently used volume is only evicted for the number of
+    // volumes, the caller of GetVolume() is about to use it
+    if( entry == m_Entries.begin() && !overNumber )
+      {
+      break;
+      }
+    // Volumes being loaded are kept, their loader still refers to them
+    if( entry->second.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready )
+      {
+      bytes -= RegistrationMemoryAccount::GetImageBytes( entry->second.get().GetPointer() );
+      m_Index.erase( entry->first );
+      entry = m_Entries.erase( entry );
+      }
+    }
+  return bytes;
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+PreparedVolumeCache<TVolumeImage>
+::ComputeMemorySize() const
+{
+  // Failed loads are removed before their exception is set: the ready
+  // entries hold a volume
+  SizeValueType bytes = 0;
+  for( const auto & entry : m_Entries )
+    {
+    if( entry.second.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready )
+      {
+      bytes += RegistrationMemoryAccount::GetImageBytes( entry.second.get().GetPointer() );
+      }
+    }
+  return bytes;
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::AccountMemory( RegistrationMemoryAccount * account, SizeValueType bytes )
+{
+  account->SetAllocation( this, "PreparedVolumeCache", bytes );
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::PrepareVolume( VolumeType * volume, double threshold )
+{
+  typename VolumeType::PointType origin;
+  origin.Fill( 0.0 );
+  volume->SetOrigin( origin );
+
+  using PixelType = typename VolumeType::PixelType;
+  ImageRegionIterator< VolumeType > it( volume, volume->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    double value = static_cast<double>( it.Get() ) - threshold;
+    if( !NumericTraits<PixelType>::IsInteger || !( value > 0.0 ) )
+      {
+      it.Set( value > 0.0 ? static_cast<PixelType>( value ) : NumericTraits<PixelType>::ZeroValue() );
+      continue;
+      }
+    // Integer pixels cannot hold the fractional part left by a fractional
+    // threshold. Round up, so that every voxel above the threshold stays
+    // above zero and is still selected by the "> threshold" test of the
+    // interpolator, as it is in the original volume.
+    value = std::ceil( value );
+    it.Set( value < static_cast<double>( NumericTraits<PixelType>::max() )
+            ? static_cast<PixelType>( value ) : NumericTraits<PixelType>::max() );
+    }
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeCache<TVolumeImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  os << indent << "MaximumNumberOfVolumes: " << m_MaximumNumberOfVolumes << std::endl;
+  os << indent << "MaximumMemorySize: " << m_MaximumMemorySize << std::endl;
+  os << indent << "MemorySize: " << this->ComputeMemorySize() << std::endl;
+  os << indent << "NumberOfVolumes: " << m_Entries.size() << std::endl;
+  os << indent << "NumberOfHits: " << m_NumberOfHits << std::endl;
+  os << indent << "NumberOfMisses: " << m_NumberOfMisses << std::endl;
+  os << indent << "NumberOfFileHits: " << m_NumberOfFileHits << std::endl;
+  os << indent << "CacheDirectory: " << m_CacheDirectory << std::endl;
+  os << indent << "VerifySourceHash: " << m_VerifySourceHash << std::endl;
+  os << indent << "MemoryAccount: " << m_MemoryAccount.GetPointer() << std::endl;
+  for( const auto & entry : m_Entries )
+    {
+    os << indent << "  " << entry.first.first << " (threshold " << entry.first.second << ")" << std::endl;
+    }
+}
+
+} // end namespace itk
+
+#endif
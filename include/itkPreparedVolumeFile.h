@@ -0,0 +1,300 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkPreparedVolumeFile_h
+#define itkPreparedVolumeFile_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImportImageContainer.h"
+#include "itkNumericTraits.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+
+/** \class MappedImportImageContainer
+ * \brief Pixel container referring to the pixels of a mapped file.
+ *
+ * The container does not own its pixels; it keeps the mapping they belong
+ * to alive as long as the container, and therefore the image, exists.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TElement>
+class MappedImportImageContainer : public ImportImageContainer<SizeValueType, TElement>
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(MappedImportImageContainer);
+
+  /** Standard class type alias. */
+  using Self = MappedImportImageContainer;
+  using Superclass = ImportImageContainer<SizeValueType, TElement>;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(MappedImportImageContainer, ImportImageContainer);
+
+  /** Set the mapping holding the pixels. */
+  void SetMapping( const std::shared_ptr<const void> & mapping )
+  {
+    m_Mapping = mapping;
+  }
+
+protected:
+  MappedImportImageContainer() = default;
+  ~MappedImportImageContainer() override = default;
+
+private:
+  std::shared_ptr<const void> m_Mapping;
+};
+
+
+/** \class PreparedVolumeFile
+ * \brief File format for volumes prepared for ray casting.
+ *
+ * A prepared volume file holds a volume as prepared by the
+ * PreparedVolumeCache, i.e. with the threshold subtracted and the origin
+ * at (0,0,0), together with the data derived from it:
+ *
+ * - the voxels of NumberOfLevels pyramid levels, level 0 being the volume
+ *   itself and every further level halving the resolution of the previous
+ *   one by averaging blocks of 2x2x2 voxels;
+ * - for every level, a grid of the minimum and maximum voxel values of
+ *   cells of GridCellSize^3 voxels;
+ * - optionally, the voxels of level 0 in a bricked layout, where bricks of
+ *   BrickSize^3 voxels are stored one after the other, padded with zeros.
+ *
+ * The header records the pixel type, the geometry and the threshold. It
+ * also records the key the file is looked up by, computed from the path,
+ * size and modification time of the source file and the threshold, see
+ * ComputeSourceKey(), and a hash of the content of the source file and
+ * the threshold, see ComputeSourceHash(). The key costs a stat() of the
+ * source; the hash reads it entirely, and is only checked on request.
+ * Sections start at page aligned offsets.
+ *
+ * Read() maps the file copy-on-write, so that the processes reading the
+ * same file share its pages: the images returned by GetVolume() refer to
+ * the mapped pages without copying and keep the mapping alive. They are
+ * not meant to be modified; a modification only makes a private copy of
+ * the page written and never changes the file. Where memory mapping is
+ * not available, the file is read into memory instead.
+ *
+ * GetSlab() returns a slab of slices of a level without mapping the
+ * other slices into memory, for the rendering of volumes larger than the
+ * memory in slabs, see
+ * SiddonJacobsRayCastInterpolateImageFunction::RenderProjectionInSlabs().
+ * ReleaseSlab() drops the pages of a slab that is no longer needed.
+ *
+ * Write() writes to a temporary file that is renamed once complete, so
+ * that concurrent readers see either no file or a complete one.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TVolumeImage>
+class PreparedVolumeFile : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(PreparedVolumeFile);
+
+  /** Standard class type alias. */
+  using Self = PreparedVolumeFile;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(PreparedVolumeFile, Object);
+
+  using VolumeType = TVolumeImage;
+  using VolumePointer = typename VolumeType::Pointer;
+  using VolumeConstPointer = typename VolumeType::ConstPointer;
+  using PixelType = typename VolumeType::PixelType;
+  using SizeType = typename VolumeType::SizeType;
+
+  static_assert( VolumeType::ImageDimension == 3, "Prepared volumes are three dimensional" );
+
+  /** Version of the file format. */
+  static constexpr uint32_t Version = 2;
+
+  /** Maximum number of pyramid levels. */
+  static constexpr unsigned int MaximumNumberOfLevels = 8;
+
+  /** Minimum and maximum of the voxels of a cell of the acceleration grid. */
+  struct MinMaxType
+  {
+    PixelType Minimum;
+    PixelType Maximum;
+  };
+
+  /** Set/Get the number of pyramid levels written. Default is 1, i.e. the
+   * volume only. Read() sets it to the number of levels of the file. */
+  itkSetClampMacro( NumberOfLevels, unsigned int, 1, MaximumNumberOfLevels );
+  itkGetConstMacro( NumberOfLevels, unsigned int );
+
+  /** Set/Get the edge length, in voxels, of the cells of the minimum and
+   * maximum grid. Default is 8. */
+  itkSetClampMacro( GridCellSize, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( GridCellSize, unsigned int );
+
+  /** Set/Get the edge length, in voxels, of the bricks of the bricked
+   * layout. Default is 0, i.e. no bricked layout. */
+  itkSetMacro( BrickSize, unsigned int );
+  itkGetConstMacro( BrickSize, unsigned int );
+
+  /** Get the threshold, the source key and the source hash of the file
+   * read. */
+  itkGetConstMacro( Threshold, double );
+  itkGetConstMacro( SourceKey, uint64_t );
+  itkGetConstMacro( SourceHash, uint64_t );
+
+  /** Write a prepared volume. Throws an exception on failure. */
+  void Write( const std::string & fileName,
+              const VolumeType * volume,
+              double threshold,
+              uint64_t sourceKey,
+              uint64_t sourceHash ) const;
+
+  /** Map a prepared volume file. Returns false, leaving the object empty,
+   * if the file does not exist, is not a valid prepared volume file of
+   * the pixel type, or was written for another source key. */
+  bool Read( const std::string & fileName, uint64_t sourceKey );
+
+  /** Check whether a file is mapped. */
+  bool IsMapped() const
+  {
+    return m_Mapping != nullptr;
+  }
+
+  /** Get a pyramid level of the file read. Level 0 is the volume. */
+  VolumeConstPointer GetVolume( unsigned int level = 0 ) const;
+
+  /** Get the slices [zBegin, zEnd) of a pyramid level of the file read.
+   * The largest possible region of the returned image is the whole level,
+   * its buffered region is the slab. */
+  VolumeConstPointer GetSlab( unsigned int level, IndexValueType zBegin, IndexValueType zEnd ) const;
+
+  /** Drop the mapped pages of the slices [zBegin, zEnd) of a pyramid level
+   * from the memory of the process. They are read again from the file if
+   * accessed later; modifications of these pages are lost. */
+  void ReleaseSlab( unsigned int level, IndexValueType zBegin, IndexValueType zEnd ) const;
+
+  /** Get the minimum and maximum grid of a pyramid level of the file read,
+   * and the number of its cells along each axis. */
+  const MinMaxType * GetMinMaxGrid( unsigned int level, SizeType & gridSize ) const;
+
+  /** Get the bricked voxels of the file read, or nullptr if the file has
+   * no bricked layout. Brick (i,j,k) starts at voxel
+   * ((k * nj + j) * ni + i) * BrickSize^3, with ni, nj, nk the number of
+   * bricks along each axis; voxels are ordered x fastest within a brick. */
+  const PixelType * GetBrickedVoxels() const;
+
+  /** Hash the content of a source file and the threshold. For an Analyze
+   * image, the companion .hdr or .img file is hashed as well. Returns 0 if
+   * the file cannot be read. */
+  static uint64_t ComputeSourceHash( const std::string & fileName, double threshold );
+
+  /** Hash the absolute path, the size and the modification time of a
+   * source file, and the threshold, without reading the file. For an
+   * Analyze image, the companion .hdr or .img file is included as well.
+   * Returns 0 if the file does not exist. Where the file status is not
+   * available, this is the ComputeSourceHash(). */
+  static uint64_t ComputeSourceKey( const std::string & fileName, double threshold );
+
+protected:
+  PreparedVolumeFile();
+  ~PreparedVolumeFile() override {};
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  struct LevelEntry
+  {
+    uint64_t Size[3];
+    double   Spacing[3];
+    uint64_t VoxelOffset;
+    uint64_t GridSize[3];
+    uint64_t GridOffset;
+  };
+
+  struct Header
+  {
+    char       Magic[8];
+    uint32_t   Version;
+    uint32_t   HeaderSize;
+    uint32_t   PixelCode;
+    uint32_t   NumberOfLevels;
+    uint32_t   GridCellSize;
+    uint32_t   BrickSize;
+    double     Threshold;
+    uint64_t   SourceKey;
+    uint64_t   SourceHash;
+    double     Direction[9];
+    uint64_t   NumberOfBricks[3];
+    uint64_t   BrickOffset;
+    uint64_t   FileSize;
+    LevelEntry Levels[MaximumNumberOfLevels];
+  };
+
+  /** Sections start at multiples of the largest common page size. */
+  static constexpr uint64_t SectionAlignment = 4096;
+  static constexpr char     Magic[8] = { 'I', 'T', 'K', 'P', 'V', 'O', 'L', '\0' };
+
+  static uint64_t AlignOffset( uint64_t offset );
+
+  /** Code identifying the pixel type: its size, whether it is an integer
+   * and whether it is signed. */
+  static uint32_t GetPixelCode();
+
+  /** Average blocks of 2x2x2 voxels. Partial blocks at the upper borders
+   * average the voxels they hold. */
+  static void Downsample( const std::vector<PixelType> & voxels, const uint64_t size[3],
+                          std::vector<PixelType> & downsampled, uint64_t downsampledSize[3] );
+
+  /** Compute the minimum and maximum of the voxels of every grid cell. */
+  static void ComputeMinMaxGrid( const std::vector<PixelType> & voxels, const uint64_t size[3],
+                                 unsigned int cellSize,
+                                 std::vector<MinMaxType> & grid, uint64_t gridSize[3] );
+
+  std::shared_ptr<const void> m_Mapping;
+  Header                      m_Header;
+
+  unsigned int                m_NumberOfLevels;
+  unsigned int                m_GridCellSize;
+  unsigned int                m_BrickSize;
+  double                      m_Threshold;
+  uint64_t                    m_SourceKey;
+  uint64_t                    m_SourceHash;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkPreparedVolumeFile.hxx"
+#endif
+
+#endif
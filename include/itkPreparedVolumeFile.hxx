@@ -0,0 +1,737 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkPreparedVolumeFile_hxx
+#define itkPreparedVolumeFile_hxx
+
+#include "itkPreparedVolumeFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ITK_PREPARED_VOLUME_FILE_MMAP
+#endif
+
+namespace itk
+{
+
+template <typename TVolumeImage>
+constexpr uint32_t PreparedVolumeFile<TVolumeImage>::Version;
+
+template <typename TVolumeImage>
+constexpr unsigned int PreparedVolumeFile<TVolumeImage>::MaximumNumberOfLevels;
+
+template <typename TVolumeImage>
+constexpr uint64_t PreparedVolumeFile<TVolumeImage>::SectionAlignment;
+
+template <typename TVolumeImage>
+constexpr char PreparedVolumeFile<TVolumeImage>::Magic[8];
+
+
+template <typename TVolumeImage>
+PreparedVolumeFile<TVolumeImage>
+::PreparedVolumeFile()
+{
+  std::memset( &m_Header, 0, sizeof( m_Header ) );
+  m_NumberOfLevels = 1;
+  m_GridCellSize = 8;
+  m_BrickSize = 0;
+  m_Threshold = 0.0;
+  m_SourceKey = 0;
+  m_SourceHash = 0;
+}
+
+
+template <typename TVolumeImage>
+uint32_t
+PreparedVolumeFile<TVolumeImage>
+::GetPixelCode()
+{
+  return static_cast<uint32_t>( sizeof( PixelType ) )
+    | ( std::numeric_limits<PixelType>::is_integer ? 0x100u : 0u )
+    | ( std::numeric_limits<PixelType>::is_signed ? 0x200u : 0u );
+}
+
+
+template <typename TVolumeImage>
+uint64_t
+PreparedVolumeFile<TVolumeImage>
+::AlignOffset( uint64_t offset )
+{
+  return ( offset + SectionAlignment - 1 ) / SectionAlignment * SectionAlignment;
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeFile<TVolumeImage>
+::Downsample( const std::vector<PixelType> & voxels, const uint64_t size[3],
+              std::vector<PixelType> & downsampled, uint64_t downsampledSize[3] )
+{
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    downsampledSize[i] = std::max<uint64_t>( ( size[i] + 1 ) / 2, 1 );
+    }
+  downsampled.assign( downsampledSize[0] * downsampledSize[1] * downsampledSize[2], PixelType() );
+
+  for( uint64_t z = 0; z < downsampledSize[2]; z++ )
+    {
+    for( uint64_t y = 0; y < downsampledSize[1]; y++ )
+      {
+      for( uint64_t x = 0; x < downsampledSize[0]; x++ )
+        {
+        double sum = 0.0;
+        unsigned int count = 0;
+        for( uint64_t k = 2 * z; k < std::min( 2 * z + 2, size[2] ); k++ )
+          {
+          for( uint64_t j = 2 * y; j < std::min( 2 * y + 2, size[1] ); j++ )
+            {
+            for( uint64_t i = 2 * x; i < std::min( 2 * x + 2, size[0] ); i++ )
+              {
+              sum += static_cast<double>( voxels[( k * size[1] + j ) * size[0] + i] );
+              count++;
+              }
+            }
+          }
+        downsampled[( z * downsampledSize[1] + y ) * downsampledSize[0] + x] =
+          static_cast<PixelType>( sum / count );
+        }
+      }
+    }
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeFile<TVolumeImage>
+::ComputeMinMaxGrid( const std::vector<PixelType> & voxels, const uint64_t size[3],
+                     unsigned int cellSize,
+                     std::vector<MinMaxType> & grid, uint64_t gridSize[3] )
+{
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    gridSize[i] = ( size[i] + cellSize - 1 ) / cellSize;
+    }
+  MinMaxType empty;
+  empty.Minimum = NumericTraits<PixelType>::max();
+  empty.Maximum = NumericTraits<PixelType>::NonpositiveMin();
+  grid.assign( gridSize[0] * gridSize[1] * gridSize[2], empty );
+
+  for( uint64_t k = 0; k < size[2]; k++ )
+    {
+    for( uint64_t j = 0; j < size[1]; j++ )
+      {
+      MinMaxType * row = &grid[( ( k / cellSize ) * gridSize[1] + j / cellSize ) * gridSize[0]];
+      const PixelType * voxel = &voxels[( k * size[1] + j ) * size[0]];
+      for( uint64_t i = 0; i < size[0]; i++ )
+        {
+        MinMaxType & cell = row[i / cellSize];
+        cell.Minimum = std::min( cell.Minimum, voxel[i] );
+        cell.Maximum = std::max( cell.Maximum, voxel[i] );
+        }
+      }
+    }
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeFile<TVolumeImage>
+::Write( const std::string & fileName,
+         const VolumeType * volume,
+         double threshold,
+         uint64_t sourceKey,
+         uint64_t sourceHash ) const
+{
+  if( !volume || !volume->GetPixelContainer() )
+    {
+    itkExceptionMacro(<<"No volume to write");
+    }
+
+  Header header;
+  std::memset( &header, 0, sizeof( header ) );
+  std::memcpy( header.Magic, Magic, sizeof( header.Magic ) );
+  header.Version = Version;
+  header.HeaderSize = sizeof( Header );
+  header.PixelCode = GetPixelCode();
+  header.NumberOfLevels = m_NumberOfLevels;
+  header.GridCellSize = m_GridCellSize;
+  header.BrickSize = m_BrickSize;
+  header.Threshold = threshold;
+  header.SourceKey = sourceKey;
+  header.SourceHash = sourceHash;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      header.Direction[3 * i + j] = volume->GetDirection()[i][j];
+      }
+    }
+
+  // Pyramid levels and their minimum and maximum grids
+  const SizeType size = volume->GetBufferedRegion().GetSize();
+  std::vector< std::vector<PixelType> > levels( m_NumberOfLevels );
+  std::vector< std::vector<MinMaxType> > grids( m_NumberOfLevels );
+  levels[0].assign( volume->GetBufferPointer(),
+                    volume->GetBufferPointer() + volume->GetPixelContainer()->Size() );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    header.Levels[0].Size[i] = size[i];
+    header.Levels[0].Spacing[i] = volume->GetSpacing()[i];
+    }
+  for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+    {
+    LevelEntry & entry = header.Levels[level];
+    if( level > 0 )
+      {
+      const LevelEntry & previous = header.Levels[level - 1];
+      Downsample( levels[level - 1], previous.Size, levels[level], entry.Size );
+      for( unsigned int i = 0; i < 3; i++ )
+        {
+        entry.Spacing[i] = 2.0 * previous.Spacing[i];
+        }
+      }
+    ComputeMinMaxGrid( levels[level], entry.Size, m_GridCellSize, grids[level], entry.GridSize );
+    }
+
+  // Bricked layout of level 0, padded with zeros
+  std::vector<PixelType> bricks;
+  if( m_BrickSize > 0 )
+    {
+    const uint64_t b = m_BrickSize;
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      header.NumberOfBricks[i] = ( header.Levels[0].Size[i] + b - 1 ) / b;
+      }
+    bricks.assign( header.NumberOfBricks[0] * header.NumberOfBricks[1] * header.NumberOfBricks[2] * b * b * b,
+                   PixelType() );
+    const uint64_t * s = header.Levels[0].Size;
+    for( uint64_t k = 0; k < s[2]; k++ )
+      {
+      for( uint64_t j = 0; j < s[1]; j++ )
+        {
+        for( uint64_t i = 0; i < s[0]; i++ )
+          {
+          const uint64_t brick = ( ( k / b ) * header.NumberOfBricks[1] + j / b ) * header.NumberOfBricks[0] + i / b;
+          const uint64_t inBrick = ( ( k % b ) * b + j % b ) * b + i % b;
+          bricks[brick * b * b * b + inBrick] = levels[0][( k * s[1] + j ) * s[0] + i];
+          }
+        }
+      }
+    }
+
+  // Section offsets
+  uint64_t offset = AlignOffset( sizeof( Header ) );
+  for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+    {
+    header.Levels[level].VoxelOffset = offset;
+    offset = AlignOffset( offset + levels[level].size() * sizeof( PixelType ) );
+    header.Levels[level].GridOffset = offset;
+    offset = AlignOffset( offset + grids[level].size() * sizeof( MinMaxType ) );
+    }
+  if( m_BrickSize > 0 )
+    {
+    header.BrickOffset = offset;
+    offset = AlignOffset( offset + bricks.size() * sizeof( PixelType ) );
+    }
+  header.FileSize = offset;
+
+  // Write a temporary file and rename it once complete
+  std::string temporaryFileName = fileName + ".tmp"
+    + std::to_string( std::hash<std::thread::id>()( std::this_thread::get_id() ) );
+#if defined(ITK_PREPARED_VOLUME_FILE_MMAP)
+  temporaryFileName += "." + std::to_string( getpid() );
+#endif
+
+  std::ofstream file( temporaryFileName.c_str(), std::ios::binary | std::ios::trunc );
+  if( !file )
+    {
+    itkExceptionMacro(<<"Cannot create " << temporaryFileName);
+    }
+  uint64_t position = 0;
+  auto writeSection = [&file, &position]( uint64_t sectionOffset, const void * data, uint64_t numberOfBytes )
+    {
+    const char zeros[64] = {};
+    while( position < sectionOffset )
+      {
+      const uint64_t padding = std::min<uint64_t>( sectionOffset - position, sizeof( zeros ) );
+      file.write( zeros, padding );
+      position += padding;
+      }
+    file.write( static_cast<const char *>( data ), numberOfBytes );
+    position += numberOfBytes;
+    };
+  writeSection( 0, &header, sizeof( Header ) );
+  for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+    {
+    writeSection( header.Levels[level].VoxelOffset, levels[level].data(), levels[level].size() * sizeof( PixelType ) );
+    writeSection( header.Levels[level].GridOffset, grids[level].data(), grids[level].size() * sizeof( MinMaxType ) );
+    }
+  if( m_BrickSize > 0 )
+    {
+    writeSection( header.BrickOffset, bricks.data(), bricks.size() * sizeof( PixelType ) );
+    }
+  writeSection( header.FileSize, nullptr, 0 );
+  file.close();
+
+  if( !file || std::rename( temporaryFileName.c_str(), fileName.c_str() ) != 0 )
+    {
+    std::remove( temporaryFileName.c_str() );
+    itkExceptionMacro(<<"Cannot write " << fileName);
+    }
+}
+
+
+template <typename TVolumeImage>
+bool
+PreparedVolumeFile<TVolumeImage>
+::Read( const std::string & fileName, uint64_t sourceKey )
+{
+  m_Mapping.reset();
+  std::memset( &m_Header, 0, sizeof( m_Header ) );
+
+  std::shared_ptr<const void> mapping;
+  uint64_t fileSize = 0;
+#if defined(ITK_PREPARED_VOLUME_FILE_MMAP)
+  const int descriptor = open( fileName.c_str(), O_RDONLY );
+  if( descriptor < 0 )
+    {
+    return false;
+    }
+  struct stat status;
+  if( fstat( descriptor, &status ) != 0 || static_cast<uint64_t>( status.st_size ) < sizeof( Header ) )
+    {
+    close( descriptor );
+    return false;
+    }
+  fileSize = static_cast<uint64_t>( status.st_size );
+  // A private, copy-on-write mapping: the pages are shared with the other
+  // processes reading the file until written, and writes to the images of
+  // the file, which are not meant to be made, never reach the file nor
+  // fault on read-only pages
+  void * address = mmap( nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0 );
+  close( descriptor );
+  if( address == MAP_FAILED )
+    {
+    return false;
+    }
+  mapping = std::shared_ptr<const void>( address, [fileSize]( const void * a )
+    {
+    munmap( const_cast<void *>( a ), fileSize );
+    } );
+#else
+  std::ifstream file( fileName.c_str(), std::ios::binary | std::ios::ate );
+  if( !file )
+    {
+    return false;
+    }
+  fileSize = static_cast<uint64_t>( file.tellg() );
+  if( fileSize < sizeof( Header ) )
+    {
+    return false;
+    }
+  std::shared_ptr<char> buffer( new char[fileSize], std::default_delete<char[]>() );
+  file.seekg( 0 );
+  if( !file.read( buffer.get(), fileSize ) )
+    {
+    return false;
+    }
+  mapping = buffer;
+#endif
+
+  Header header;
+  std::memcpy( &header, mapping.get(), sizeof( Header ) );
+  if( std::memcmp( header.Magic, Magic, sizeof( header.Magic ) ) != 0
+      || header.Version != Version
+      || header.HeaderSize != sizeof( Header )
+      || header.PixelCode != GetPixelCode()
+      || header.SourceKey != sourceKey
+      || header.FileSize != fileSize
+      || header.NumberOfLevels < 1 || header.NumberOfLevels > MaximumNumberOfLevels
+      || header.GridCellSize < 1 )
+    {
+    return false;
+    }
+
+  // Every section must lie within the file
+  auto inFile = [fileSize]( uint64_t offset, const uint64_t size[3], uint64_t elementSize )
+    {
+    const uint64_t count = size[0] * size[1] * size[2];
+    return offset % SectionAlignment == 0
+      && offset <= fileSize
+      && count <= ( fileSize - offset ) / elementSize;
+    };
+  for( unsigned int level = 0; level < header.NumberOfLevels; level++ )
+    {
+    const LevelEntry & entry = header.Levels[level];
+    if( !inFile( entry.VoxelOffset, entry.Size, sizeof( PixelType ) )
+        || !inFile( entry.GridOffset, entry.GridSize, sizeof( MinMaxType ) ) )
+      {
+      return false;
+      }
+    }
+  if( header.BrickSize > 0 )
+    {
+    const uint64_t b = header.BrickSize;
+    const uint64_t brickedSize[3] = { header.NumberOfBricks[0] * b, header.NumberOfBricks[1] * b,
+                                      header.NumberOfBricks[2] * b };
+    if( !inFile( header.BrickOffset, brickedSize, sizeof( PixelType ) ) )
+      {
+      return false;
+      }
+    }
+
+  m_Header = header;
+  m_Mapping = mapping;
+  m_NumberOfLevels = header.NumberOfLevels;
+  m_GridCellSize = header.GridCellSize;
+  m_BrickSize = header.BrickSize;
+  m_Threshold = header.Threshold;
+  m_SourceKey = header.SourceKey;
+  m_SourceHash = header.SourceHash;
+  this->Modified();
+  return true;
+}
+
+
+template <typename TVolumeImage>
+typename PreparedVolumeFile<TVolumeImage>::VolumeConstPointer
+PreparedVolumeFile<TVolumeImage>
+::GetVolume( unsigned int level ) const
+{
+  if( !m_Mapping || level >= m_Header.NumberOfLevels )
+    {
+    itkExceptionMacro(<<"No level " << level << " in the prepared volume file");
+    }
+  const LevelEntry & entry = m_Header.Levels[level];
+
+  typename VolumeType::RegionType region;
+  typename VolumeType::SpacingType spacing;
+  typename VolumeType::PointType origin;
+  typename VolumeType::DirectionType direction;
+  SizeType size;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    size[i] = static_cast<SizeValueType>( entry.Size[i] );
+    spacing[i] = entry.Spacing[i];
+    origin[i] = 0.0;
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      direction[i][j] = m_Header.Direction[3 * i + j];
+      }
+    }
+  region.SetSize( size );
+
+  VolumePointer volume = VolumeType::New();
+  volume->SetRegions( region );
+  volume->SetSpacing( spacing );
+  volume->SetOrigin( origin );
+  volume->SetDirection( direction );
+
+  // The image refers to the mapped voxels and keeps the mapping alive
+  using ContainerType = MappedImportImageContainer<PixelType>;
+  typename ContainerType::Pointer container = ContainerType::New();
+  const PixelType * voxels = reinterpret_cast<const PixelType *>(
+    static_cast<const char *>( m_Mapping.get() ) + entry.VoxelOffset );
+  container->SetImportPointer( const_cast<PixelType *>( voxels ), region.GetNumberOfPixels(), false );
+  container->SetMapping( m_Mapping );
+  volume->SetPixelContainer( container );
+
+  return VolumeConstPointer( volume.GetPointer() );
+}
+
+
+template <typename TVolumeImage>
+typename PreparedVolumeFile<TVolumeImage>::VolumeConstPointer
+PreparedVolumeFile<TVolumeImage>
+::GetSlab( unsigned int level, IndexValueType zBegin, IndexValueType zEnd ) const
+{
+  VolumeConstPointer whole = this->GetVolume( level );
+  const typename VolumeType::RegionType largestRegion = whole->GetLargestPossibleRegion();
+  const IndexValueType numberOfSlices = static_cast<IndexValueType>( largestRegion.GetSize()[2] );
+  if( zBegin < 0 || zEnd > numberOfSlices || zBegin >= zEnd )
+    {
+    itkExceptionMacro(<<"Invalid slab " << zBegin << " to " << zEnd << " of " << numberOfSlices << " slices");
+    }
+
+  typename VolumeType::RegionType slabRegion = largestRegion;
+  slabRegion.SetIndex( 2, zBegin );
+  slabRegion.SetSize( 2, static_cast<SizeValueType>( zEnd - zBegin ) );
+
+  VolumePointer slab = VolumeType::New();
+  slab->CopyInformation( whole );
+  slab->SetLargestPossibleRegion( largestRegion );
+  slab->SetBufferedRegion( slabRegion );
+  slab->SetRequestedRegion( slabRegion );
+
+  // The slab refers to its slices of the mapped level
+  using ContainerType = MappedImportImageContainer<PixelType>;
+  typename ContainerType::Pointer container = ContainerType::New();
+  const SizeValueType sliceSize = largestRegion.GetSize()[0] * largestRegion.GetSize()[1];
+  const PixelType * voxels = whole->GetBufferPointer() + sliceSize * zBegin;
+  container->SetImportPointer( const_cast<PixelType *>( voxels ), slabRegion.GetNumberOfPixels(), false );
+  container->SetMapping( m_Mapping );
+  slab->SetPixelContainer( container );
+
+  return VolumeConstPointer( slab.GetPointer() );
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeFile<TVolumeImage>
+::ReleaseSlab( unsigned int level, IndexValueType zBegin, IndexValueType zEnd ) const
+{
+#if defined(ITK_PREPARED_VOLUME_FILE_MMAP)
+  if( !m_Mapping || level >= m_Header.NumberOfLevels || zBegin >= zEnd )
+    {
+    return;
+    }
+  const LevelEntry & entry = m_Header.Levels[level];
+  const uint64_t sliceBytes = entry.Size[0] * entry.Size[1] * sizeof( PixelType );
+  const uint64_t begin = entry.VoxelOffset + sliceBytes * static_cast<uint64_t>( std::max<IndexValueType>( zBegin, 0 ) );
+  const uint64_t end = entry.VoxelOffset + sliceBytes * std::min<uint64_t>( zEnd, entry.Size[2] );
+
+  // Only the pages entirely within the slab are dropped. Pages written
+  // since they were mapped lose their changes.
+  const uint64_t pageSize = static_cast<uint64_t>( sysconf( _SC_PAGESIZE ) );
+  const uint64_t firstPage = ( begin + pageSize - 1 ) / pageSize * pageSize;
+  const uint64_t lastPage = end / pageSize * pageSize;
+  if( firstPage < lastPage )
+    {
+    char * address = const_cast<char *>( static_cast<const char *>( m_Mapping.get() ) ) + firstPage;
+    madvise( address, lastPage - firstPage, MADV_DONTNEED );
+    }
+#else
+  (void)level;
+  (void)zBegin;
+  (void)zEnd;
+#endif
+}
+
+
+template <typename TVolumeImage>
+const typename PreparedVolumeFile<TVolumeImage>::MinMaxType *
+PreparedVolumeFile<TVolumeImage>
+::GetMinMaxGrid( unsigned int level, SizeType & gridSize ) const
+{
+  if( !m_Mapping || level >= m_Header.NumberOfLevels )
+    {
+    itkExceptionMacro(<<"No level " << level << " in the prepared volume file");
+    }
+  const LevelEntry & entry = m_Header.Levels[level];
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    gridSize[i] = static_cast<SizeValueType>( entry.GridSize[i] );
+    }
+  return reinterpret_cast<const MinMaxType *>(
+    static_cast<const char *>( m_Mapping.get() ) + entry.GridOffset );
+}
+
+
+template <typename TVolumeImage>
+const typename PreparedVolumeFile<TVolumeImage>::PixelType *
+PreparedVolumeFile<TVolumeImage>
+::GetBrickedVoxels() const
+{
+  if( !m_Mapping || m_Header.BrickSize == 0 )
+    {
+    return nullptr;
+    }
+  return reinterpret_cast<const PixelType *>(
+    static_cast<const char *>( m_Mapping.get() ) + m_Header.BrickOffset );
+}
+
+
+template <typename TVolumeImage>
+uint64_t
+PreparedVolumeFile<TVolumeImage>
+::ComputeSourceHash( const std::string & fileName, double threshold )
+{
+  // 64 bit FNV-1a, applied to 8 byte words
+  constexpr uint64_t prime = 1099511628211ULL;
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash]( uint64_t word )
+    {
+    hash ^= word;
+    hash *= prime;
+    };
+
+  auto hashFile = [&mix]( const std::string & name )
+    {
+    std::ifstream file( name.c_str(), std::ios::binary );
+    if( !file )
+      {
+      return false;
+      }
+    std::vector<char> chunk( 1 << 20 );
+    uint64_t length = 0;
+    while( file )
+      {
+      file.read( chunk.data(), chunk.size() );
+      const std::size_t count = static_cast<std::size_t>( file.gcount() );
+      std::size_t i = 0;
+      for( ; i + sizeof( uint64_t ) <= count; i += sizeof( uint64_t ) )
+        {
+        uint64_t word;
+        std::memcpy( &word, chunk.data() + i, sizeof( word ) );
+        mix( word );
+        }
+      for( ; i < count; i++ )
+        {
+        mix( static_cast<unsigned char>( chunk[i] ) );
+        }
+      length += count;
+      }
+    mix( length );
+    return true;
+    };
+
+  if( !hashFile( fileName ) )
+    {
+    return 0;
+    }
+
+  // The geometry of an Analyze image is held by its header
+  const std::string::size_type dot = fileName.find_last_of( '.' );
+  if( dot != std::string::npos )
+    {
+    const std::string extension = fileName.substr( dot );
+    if( extension == ".img" )
+      {
+      hashFile( fileName.substr( 0, dot ) + ".hdr" );
+      }
+    else if( extension == ".hdr" )
+      {
+      hashFile( fileName.substr( 0, dot ) + ".img" );
+      }
+    }
+
+  uint64_t thresholdBits;
+  std::memcpy( &thresholdBits, &threshold, sizeof( thresholdBits ) );
+  mix( thresholdBits );
+  mix( Version );
+  return hash;
+}
+
+
+template <typename TVolumeImage>
+uint64_t
+PreparedVolumeFile<TVolumeImage>
+::ComputeSourceKey( const std::string & fileName, double threshold )
+{
+#if defined(ITK_PREPARED_VOLUME_FILE_MMAP)
+  // 64 bit FNV-1a, as ComputeSourceHash()
+  constexpr uint64_t prime = 1099511628211ULL;
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash]( uint64_t word )
+    {
+    hash ^= word;
+    hash *= prime;
+    };
+
+  auto keyFile = [&mix]( const std::string & name )
+    {
+    struct stat status;
+    if( stat( name.c_str(), &status ) != 0 )
+      {
+      return false;
+      }
+    char * resolved = realpath( name.c_str(), nullptr );
+    const std::string path = resolved ? resolved : name;
+    std::free( resolved );
+    for( const char c : path )
+      {
+      mix( static_cast<unsigned char>( c ) );
+      }
+    mix( path.size() );
+    mix( static_cast<uint64_t>( status.st_size ) );
+#if defined(__APPLE__)
+    mix( static_cast<uint64_t>( status.st_mtimespec.tv_sec ) );
+    mix( static_cast<uint64_t>( status.st_mtimespec.tv_nsec ) );
+#else
+    mix( static_cast<uint64_t>( status.st_mtim.tv_sec ) );
+    mix( static_cast<uint64_t>( status.st_mtim.tv_nsec ) );
+#endif
+    mix( static_cast<uint64_t>( status.st_ino ) );
+    return true;
+    };
+
+  if( !keyFile( fileName ) )
+    {
+    return 0;
+    }
+
+  // The geometry of an Analyze image is held by its header
+  const std::string::size_type dot = fileName.find_last_of( '.' );
+  if( dot != std::string::npos )
+    {
+    const std::string extension = fileName.substr( dot );
+    if( extension == ".img" )
+      {
+      keyFile( fileName.substr( 0, dot ) + ".hdr" );
+      }
+    else if( extension == ".hdr" )
+      {
+      keyFile( fileName.substr( 0, dot ) + ".img" );
+      }
+    }
+
+  uint64_t thresholdBits;
+  std::memcpy( &thresholdBits, &threshold, sizeof( thresholdBits ) );
+  mix( thresholdBits );
+  mix( Version );
+  return hash;
+#else
+  return ComputeSourceHash( fileName, threshold );
+#endif
+}
+
+
+template <typename TVolumeImage>
+void
+PreparedVolumeFile<TVolumeImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "NumberOfLevels: " << m_NumberOfLevels << std::endl;
+  os << indent << "GridCellSize: " << m_GridCellSize << std::endl;
+  os << indent << "BrickSize: " << m_BrickSize << std::endl;
+  os << indent << "Mapped: " << ( m_Mapping ? "yes" : "no" ) << std::endl;
+  if( m_Mapping )
+    {
+    os << indent << "Threshold: " << m_Threshold << std::endl;
+    os << indent << "SourceKey: " << std::hex << m_SourceKey << std::dec << std::endl;
+    os << indent << "SourceHash: " << std::hex << m_SourceHash << std::dec << std::endl;
+    os << indent << "FileSize: " << m_Header.FileSize << std::endl;
+    }
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,173 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkProjectionBatchEvaluator_h
+#define itkProjectionBatchEvaluator_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkArray.h"
+#include "itkImage.h"
+#include "itkProjectionGeometry.h"
+#include "itkRayCastWorkerPool.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
+#include "vnl/vnl_matrix.h"
+
+namespace itk
+{
+
+/** \class ProjectionBatchEvaluator
+ * \brief Render DRRs and evaluate the two-projection metric for a batch of
+ * poses in a single call.
+ *
+ * The evaluator is the entry point of the Python API of the module (see
+ * twoprojectionregistration.py in the wrapping directory), where crossing
+ * the binding once per pose costs more than the ray casting of small
+ * DRRs. A batch is a matrix with one pose per row, the six parameters of
+ * an Euler3DTransform about Center; the whole batch is processed in C++.
+ *
+ * The images are not copied. The input volume is only read, and the DRRs
+ * of RenderProjections() are written in place into the slices of a stack
+ * allocated by the caller, slice k holding the DRR of pose k; in Python
+ * both are views of NumPy arrays. The volume has its origin at (0,0,0),
+ * e.g. a prepared volume, and the projections are in the conventions of
+ * a ProjectionGeometry: the physical coordinates of their first two axes
+ * are detector coordinates, the third is ignored.
+ *
+ * When a RayCastWorkerPool is connected, every DRR and every metric
+ * evaluation is split over its workers.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TVolumeImage>
+class ProjectionBatchEvaluator : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(ProjectionBatchEvaluator);
+
+  /** Standard class type alias. */
+  using Self = ProjectionBatchEvaluator;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ProjectionBatchEvaluator, Object);
+
+  using VolumeType = TVolumeImage;
+  using VolumeConstPointer = typename VolumeType::ConstPointer;
+
+  /** Stack of single precision projections, one slice per pose. The fixed
+   * images of the metric have the same type, with a single slice. */
+  using ProjectionImageType = Image<float, 3>;
+
+  using InterpolatorType = SiddonJacobsRayCastInterpolateImageFunction<VolumeType, double, float>;
+  using TransformType = typename InterpolatorType::TransformType;
+  using PointType = typename TransformType::InputPointType;
+  using ParametersType = typename TransformType::ParametersType;
+  using ProjectionGeometryType = ProjectionGeometry<double>;
+  using MetricType = NormalizedCorrelationTwoImageToOneImageMetric<ProjectionImageType, VolumeType>;
+
+  /** Poses, one row of six Euler parameters per pose: the three angles in
+   * radians, then the translation in mm. */
+  using PoseArrayType = vnl_matrix<double>;
+
+  /** Metric values, one per pose. */
+  using MeasureArrayType = Array<double>;
+
+  /** Set/Get the volume, buffered as a whole. */
+  itkSetConstObjectMacro( Input, VolumeType );
+  itkGetConstObjectMacro( Input, VolumeType );
+
+  /** Set/Get the threshold above which the voxels are integrated, less the
+   * threshold. Default is 0. */
+  itkSetMacro( Threshold, double );
+  itkGetConstMacro( Threshold, double );
+
+  /** Set/Get the center of rotation of the poses. Default is (0,0,0). */
+  itkSetMacro( Center, PointType );
+  itkGetConstReferenceMacro( Center, PointType );
+
+  /** Set/Get the order of the rotations of the poses, see
+   * Euler3DTransform::SetComputeZYX(). Default is false. */
+  itkSetMacro( ComputeZYX, bool );
+  itkGetConstMacro( ComputeZYX, bool );
+  itkBooleanMacro( ComputeZYX );
+
+  /** Set/Get whether the metric subtracts the mean intensities. Default is
+   * true. */
+  itkSetMacro( SubtractMean, bool );
+  itkGetConstMacro( SubtractMean, bool );
+  itkBooleanMacro( SubtractMean );
+
+  /** Set/Get the workers the DRRs and the metric are split over. None by
+   * default. */
+  itkSetObjectMacro( WorkerPool, RayCastWorkerPool );
+  itkGetConstObjectMacro( WorkerPool, RayCastWorkerPool );
+
+  /** Render the DRRs of a batch of poses seen through a geometry into the
+   * slices of the buffered region of the projection stack, which must
+   * have one slice per pose. */
+  void RenderProjections( ProjectionGeometryType * geometry,
+                          const PoseArrayType & poses,
+                          ProjectionImageType * projections ) const;
+
+  /** Evaluate the metric of a batch of poses against two fixed images
+   * seen through their geometries. The values are those of
+   * NormalizedCorrelationTwoImageToOneImageMetric::GetValue(). */
+  MeasureArrayType EvaluateMetric( ProjectionGeometryType * geometry1,
+                                   const ProjectionImageType * fixedImage1,
+                                   ProjectionGeometryType * geometry2,
+                                   const ProjectionImageType * fixedImage2,
+                                   const PoseArrayType & poses ) const;
+
+protected:
+  ProjectionBatchEvaluator();
+  ~ProjectionBatchEvaluator() override {};
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  /** Check the volume and the poses of a batch. */
+  void VerifyBatch( const PoseArrayType & poses ) const;
+
+  typename TransformType::Pointer CreateTransform() const;
+
+  typename InterpolatorType::Pointer CreateInterpolator( ProjectionGeometryType * geometry,
+                                                         TransformType * transform ) const;
+
+  /** Parameters of a pose of a batch. */
+  static ParametersType GetPose( const PoseArrayType & poses, unsigned int pose );
+
+  VolumeConstPointer          m_Input;
+  double                      m_Threshold;
+  PointType                   m_Center;
+  bool                        m_ComputeZYX;
+  bool                        m_SubtractMean;
+  RayCastWorkerPool::Pointer  m_WorkerPool;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkProjectionBatchEvaluator.hxx"
+#endif
+
+#endif
@@ -0,0 +1,200 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkProjectionBatchEvaluator_hxx
+#define itkProjectionBatchEvaluator_hxx
+
+#include "itkProjectionBatchEvaluator.h"
+
+namespace itk
+{
+
+template <typename TVolumeImage>
+ProjectionBatchEvaluator<TVolumeImage>
+::ProjectionBatchEvaluator()
+{
+  m_Input = nullptr;
+  m_Threshold = 0.0;
+  m_Center.Fill( 0.0 );
+  m_ComputeZYX = false;
+  m_SubtractMean = true;
+  m_WorkerPool = nullptr;
+}
+
+
+template <typename TVolumeImage>
+void
+ProjectionBatchEvaluator<TVolumeImage>
+::VerifyBatch( const PoseArrayType & poses ) const
+{
+  if( !m_Input )
+    {
+    itkExceptionMacro(<<"No input volume");
+    }
+  if( poses.cols() != TransformType::ParametersDimension )
+    {
+    itkExceptionMacro(<<"The poses have " << poses.cols() << " parameters instead of "
+                      << TransformType::ParametersDimension);
+    }
+}
+
+
+template <typename TVolumeImage>
+typename ProjectionBatchEvaluator<TVolumeImage>::TransformType::Pointer
+ProjectionBatchEvaluator<TVolumeImage>
+::CreateTransform() const
+{
+  typename TransformType::Pointer transform = TransformType::New();
+  transform->SetComputeZYX( m_ComputeZYX );
+  transform->SetCenter( m_Center );
+  return transform;
+}
+
+
+template <typename TVolumeImage>
+typename ProjectionBatchEvaluator<TVolumeImage>::InterpolatorType::Pointer
+ProjectionBatchEvaluator<TVolumeImage>
+::CreateInterpolator( ProjectionGeometryType * geometry, TransformType * transform ) const
+{
+  if( !geometry )
+    {
+    itkExceptionMacro(<<"No projection geometry");
+    }
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetThreshold( m_Threshold );
+  interpolator->SetTransform( transform );
+  interpolator->SetProjectionGeometry( geometry );
+  interpolator->SetInputImage( m_Input );
+  interpolator->Initialize();
+  return interpolator;
+}
+
+
+template <typename TVolumeImage>
+typename ProjectionBatchEvaluator<TVolumeImage>::ParametersType
+ProjectionBatchEvaluator<TVolumeImage>
+::GetPose( const PoseArrayType & poses, unsigned int pose )
+{
+  ParametersType parameters( TransformType::ParametersDimension );
+  for( unsigned int i = 0; i < TransformType::ParametersDimension; i++ )
+    {
+    parameters[i] = poses( pose, i );
+    }
+  return parameters;
+}
+
+
+template <typename TVolumeImage>
+void
+ProjectionBatchEvaluator<TVolumeImage>
+::RenderProjections( ProjectionGeometryType * geometry,
+                     const PoseArrayType & poses,
+                     ProjectionImageType * projections ) const
+{
+  this->VerifyBatch( poses );
+  if( !projections )
+    {
+    itkExceptionMacro(<<"No projection stack");
+    }
+  const typename ProjectionImageType::RegionType region = projections->GetBufferedRegion();
+  if( region.GetSize()[2] != poses.rows() )
+    {
+    itkExceptionMacro(<<"The projection stack has " << region.GetSize()[2] << " slices for "
+                      << poses.rows() << " poses");
+    }
+
+  typename TransformType::Pointer transform = this->CreateTransform();
+  typename InterpolatorType::Pointer interpolator = this->CreateInterpolator( geometry, transform );
+
+  // Every DRR is rendered into a view of its slice of the stack
+  const SizeValueType sliceSize = region.GetSize()[0] * region.GetSize()[1];
+  typename ProjectionImageType::RegionType sliceRegion = region;
+  sliceRegion.SetSize( 2, 1 );
+  typename ProjectionImageType::Pointer slice = ProjectionImageType::New();
+  slice->CopyInformation( projections );
+
+  for( unsigned int pose = 0; pose < poses.rows(); pose++ )
+    {
+    sliceRegion.SetIndex( 2, region.GetIndex()[2] + static_cast<IndexValueType>( pose ) );
+    slice->SetBufferedRegion( sliceRegion );
+    slice->SetRequestedRegion( sliceRegion );
+    slice->GetPixelContainer()->SetImportPointer( projections->GetBufferPointer() + pose * sliceSize,
+                                                  sliceSize, false );
+
+    transform->SetParameters( GetPose( poses, pose ) );
+    interpolator->RenderProjection( slice.GetPointer(), m_WorkerPool.GetPointer() );
+    }
+}
+
+
+template <typename TVolumeImage>
+typename ProjectionBatchEvaluator<TVolumeImage>::MeasureArrayType
+ProjectionBatchEvaluator<TVolumeImage>
+::EvaluateMetric( ProjectionGeometryType * geometry1,
+                  const ProjectionImageType * fixedImage1,
+                  ProjectionGeometryType * geometry2,
+                  const ProjectionImageType * fixedImage2,
+                  const PoseArrayType & poses ) const
+{
+  this->VerifyBatch( poses );
+  if( !fixedImage1 || !fixedImage2 )
+    {
+    itkExceptionMacro(<<"The metric needs two fixed images");
+    }
+
+  typename TransformType::Pointer transform = this->CreateTransform();
+
+  typename MetricType::Pointer metric = MetricType::New();
+  metric->ComputeGradientOff();
+  metric->SetSubtractMean( m_SubtractMean );
+  metric->SetWorkerPool( m_WorkerPool );
+  metric->SetMovingImage( m_Input );
+  metric->SetFixedImage1( fixedImage1 );
+  metric->SetFixedImage2( fixedImage2 );
+  metric->SetFixedImageRegion1( fixedImage1->GetBufferedRegion() );
+  metric->SetFixedImageRegion2( fixedImage2->GetBufferedRegion() );
+  metric->SetTransform( transform );
+  metric->SetInterpolator1( this->CreateInterpolator( geometry1, transform ) );
+  metric->SetInterpolator2( this->CreateInterpolator( geometry2, transform ) );
+  metric->Initialize();
+
+  MeasureArrayType values( poses.rows() );
+  for( unsigned int pose = 0; pose < poses.rows(); pose++ )
+    {
+    values[pose] = metric->GetValue( GetPose( poses, pose ) );
+    }
+  return values;
+}
+
+
+template <typename TVolumeImage>
+void
+ProjectionBatchEvaluator<TVolumeImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Input: " << m_Input.GetPointer() << std::endl;
+  os << indent << "Threshold: " << m_Threshold << std::endl;
+  os << indent << "Center: " << m_Center << std::endl;
+  os << indent << "ComputeZYX: " << m_ComputeZYX << std::endl;
+  os << indent << "SubtractMean: " << m_SubtractMean << std::endl;
+  os << indent << "WorkerPool: " << m_WorkerPool.GetPointer() << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,147 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkProjectionGeometry_h
+#define itkProjectionGeometry_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkPoint.h"
+#include "itkVector.h"
+#include "itkMatrix.h"
+
+namespace itk
+{
+
+/** \class ProjectionGeometry
+ * \brief Source and detector geometry of a single projection view.
+ *
+ * ProjectionGeometry describes a point source and a planar detector in
+ * the fixed (room) coordinate system. A point p of the projection image,
+ * expressed in physical coordinates, is placed on the detector at
+ *
+ *   DetectorOrigin + p[0] * DetectorRowDirection + p[1] * DetectorColumnDirection
+ *
+ * and the third coordinate of p is ignored. The ray leaving the source
+ * towards that detector point is therefore an affine function of p,
+ *
+ *   ray(p) = RayMatrix * ( p[0], p[1], 1 )
+ *
+ * so that a ray can be generated with a single matrix-vector product.
+ *
+ * The view can be defined from a source position and a detector frame,
+ * from a 3x4 projection matrix, or from the linac geometry (isocenter,
+ * source to isocenter distance and gantry angle) that the
+ * SiddonJacobsRayCastInterpolateImageFunction uses by default.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TScalar = double>
+class ProjectionGeometry : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(ProjectionGeometry);
+
+  /** Standard class type alias. */
+  using Self = ProjectionGeometry;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ProjectionGeometry, Object);
+
+  using ScalarType = TScalar;
+  using PointType = Point<TScalar, 3>;
+  using VectorType = Vector<TScalar, 3>;
+  using MatrixType = Matrix<TScalar, 3, 3>;
+  using ProjectionMatrixType = Matrix<TScalar, 3, 4>;
+
+  /** Define the view by the source position and the detector frame. The
+   * detector origin is the world position of the detector point (0,0) and
+   * the row and column directions are the world directions of the first
+   * and second detector axes. The directions are normalized. */
+  void SetSourceAndDetector( const PointType & source,
+                             const PointType & detectorOrigin,
+                             const VectorType & detectorRowDirection,
+                             const VectorType & detectorColumnDirection );
+
+  /** Define the view by a 3x4 projection matrix P mapping homogeneous world
+   * points onto homogeneous detector coordinates in mm. The source is the
+   * null space of P and the detector plane is placed at the focal length
+   * encoded in P, so that rays have their physical length. The third
+   * homogeneous coordinate must be positive in front of the source, as in
+   * the matrix returned by GetProjectionMatrix(). */
+  void SetProjectionMatrix( const ProjectionMatrixType & matrix );
+
+  /** Define the view equivalent to the default linac geometry: the gantry
+   * rotates about the z axis through the isocenter, the source lies at
+   * focalPointToIsocenterDistance from the isocenter and the detector
+   * plane passes through the isocenter. The projection angle is in
+   * radians. */
+  void SetLinacGeometry( const PointType & isocenter,
+                         double focalPointToIsocenterDistance,
+                         double projectionAngle );
+
+  /** Get the source position in world coordinates. */
+  itkGetConstReferenceMacro( SourcePosition, PointType );
+
+  /** Get the world position of the detector point (0,0). */
+  itkGetConstReferenceMacro( DetectorOrigin, PointType );
+
+  /** Get the world directions of the detector axes. */
+  itkGetConstReferenceMacro( DetectorRowDirection, VectorType );
+  itkGetConstReferenceMacro( DetectorColumnDirection, VectorType );
+
+  /** Get the matrix mapping ( p[0], p[1], 1 ) onto the world ray vector
+   * from the source to the detector point p. */
+  itkGetConstReferenceMacro( RayMatrix, MatrixType );
+
+  /** Compute the 3x4 projection matrix of the view. */
+  ProjectionMatrixType GetProjectionMatrix() const;
+
+  /** Map a detector point onto world coordinates. */
+  PointType TransformDetectorPointToWorld( const PointType & detectorPoint ) const;
+
+  /** Compute the world ray vector from the source to a detector point. */
+  VectorType ComputeRayVector( const PointType & detectorPoint ) const;
+
+protected:
+  ProjectionGeometry();
+  ~ProjectionGeometry() override {};
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  void ComputeRayMatrix();
+
+  PointType        m_SourcePosition;
+  PointType        m_DetectorOrigin;
+  VectorType       m_DetectorRowDirection;
+  VectorType       m_DetectorColumnDirection;
+  MatrixType       m_RayMatrix;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkProjectionGeometry.hxx"
+#endif
+
+#endif
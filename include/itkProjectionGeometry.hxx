@@ -0,0 +1,247 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkProjectionGeometry_hxx
+#define itkProjectionGeometry_hxx
+
+#include "itkProjectionGeometry.h"
+
+#include <cmath>
+
+namespace itk
+{
+
+template <typename TScalar>
+ProjectionGeometry<TScalar>
+::ProjectionGeometry()
+{
+  // Default to the linac geometry at zero gantry angle with the isocenter
+  // at the origin and a 1000 mm source to isocenter distance.
+  PointType isocenter;
+  isocenter.Fill( 0.0 );
+  this->SetLinacGeometry( isocenter, 1000.0, 0.0 );
+}
+
+
+template <typename TScalar>
+void
+ProjectionGeometry<TScalar>
+::SetSourceAndDetector( const PointType & source,
+                        const PointType & detectorOrigin,
+                        const VectorType & detectorRowDirection,
+                        const VectorType & detectorColumnDirection )
+{
+  if( detectorRowDirection.GetNorm() == 0.0 || detectorColumnDirection.GetNorm() == 0.0 )
+    {
+    itkExceptionMacro(<<"Detector directions must not be null vectors");
+    }
+
+  m_SourcePosition = source;
+  m_DetectorOrigin = detectorOrigin;
+  m_DetectorRowDirection = detectorRowDirection;
+  m_DetectorRowDirection.Normalize();
+  m_DetectorColumnDirection = detectorColumnDirection;
+  m_DetectorColumnDirection.Normalize();
+
+  this->ComputeRayMatrix();
+  this->Modified();
+}
+
+
+template <typename TScalar>
+void
+ProjectionGeometry<TScalar>
+::SetProjectionMatrix( const ProjectionMatrixType & matrix )
+{
+  MatrixType m;
+  VectorType p4;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      m[i][j] = matrix[i][j];
+      }
+    p4[i] = matrix[i][3];
+    }
+
+  // Normalize P so that the third row of M is a unit vector. The third
+  // homogeneous coordinate is then the depth along the principal axis.
+  // Its sign is kept: the sign of the determinant of M only tells the
+  // handedness of the detector frame, which is left-handed in the linac
+  // geometry.
+  double norm3 = 0.0;
+  for( unsigned int j = 0; j < 3; j++ )
+    {
+    norm3 += m[2][j] * m[2][j];
+    }
+  norm3 = std::sqrt( norm3 );
+  if( norm3 == 0.0 )
+    {
+    itkExceptionMacro(<<"Projection matrix has a null principal axis");
+    }
+  const double scale = 1.0 / norm3;
+  m *= scale;
+  p4 *= scale;
+
+  // With P = K [R|t] and zero skew in the second row of K, the norm of
+  // m2 x m3 is the focal length, i.e. the source to detector distance.
+  VectorType m2;
+  VectorType m3;
+  for( unsigned int j = 0; j < 3; j++ )
+    {
+    m2[j] = m[1][j];
+    m3[j] = m[2][j];
+    }
+  const double focalLength = CrossProduct( m2, m3 ).GetNorm();
+  if( focalLength == 0.0 )
+    {
+    itkExceptionMacro(<<"Projection matrix has a null focal length");
+    }
+
+  const MatrixType inverse( m.GetInverse() );
+
+  // The source is the null space of P: S = -M^-1 p4.
+  const VectorType source = inverse * p4;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    m_SourcePosition[i] = -source[i];
+    }
+
+  // The detector point (u,v) lies at S + f M^-1 (u,v,1).
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    m_DetectorRowDirection[i] = focalLength * inverse[i][0];
+    m_DetectorColumnDirection[i] = focalLength * inverse[i][1];
+    m_DetectorOrigin[i] = m_SourcePosition[i] + focalLength * inverse[i][2];
+    }
+
+  this->ComputeRayMatrix();
+  this->Modified();
+}
+
+
+template <typename TScalar>
+void
+ProjectionGeometry<TScalar>
+::SetLinacGeometry( const PointType & isocenter,
+                    double focalPointToIsocenterDistance,
+                    double projectionAngle )
+{
+  // The gantry rotates about the z axis. At zero angle the source lies on
+  // the negative y side of the isocenter and projects towards positive y.
+  const double c = std::cos( projectionAngle );
+  const double s = std::sin( projectionAngle );
+
+  PointType source;
+  source[0] = isocenter[0] + focalPointToIsocenterDistance * s;
+  source[1] = isocenter[1] - focalPointToIsocenterDistance * c;
+  source[2] = isocenter[2];
+
+  VectorType row;
+  row[0] = c;
+  row[1] = s;
+  row[2] = 0.0;
+
+  VectorType column;
+  column[0] = 0.0;
+  column[1] = 0.0;
+  column[2] = 1.0;
+
+  this->SetSourceAndDetector( source, isocenter, row, column );
+}
+
+
+template <typename TScalar>
+void
+ProjectionGeometry<TScalar>
+::ComputeRayMatrix()
+{
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    m_RayMatrix[i][0] = m_DetectorRowDirection[i];
+    m_RayMatrix[i][1] = m_DetectorColumnDirection[i];
+    m_RayMatrix[i][2] = m_DetectorOrigin[i] - m_SourcePosition[i];
+    }
+}
+
+
+template <typename TScalar>
+typename ProjectionGeometry<TScalar>::ProjectionMatrixType
+ProjectionGeometry<TScalar>
+::GetProjectionMatrix() const
+{
+  // A point X lies on the ray through the detector point (u,v) when
+  // RayMatrix^-1 (X - S) is proportional to (u,v,1).
+  const MatrixType inverse( m_RayMatrix.GetInverse() );
+  const VectorType offset = inverse * ( m_SourcePosition.GetVectorFromOrigin() );
+
+  ProjectionMatrixType matrix;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      matrix[i][j] = inverse[i][j];
+      }
+    matrix[i][3] = -offset[i];
+    }
+  return matrix;
+}
+
+
+template <typename TScalar>
+typename ProjectionGeometry<TScalar>::PointType
+ProjectionGeometry<TScalar>
+::TransformDetectorPointToWorld( const PointType & detectorPoint ) const
+{
+  return m_DetectorOrigin
+    + m_DetectorRowDirection * detectorPoint[0]
+    + m_DetectorColumnDirection * detectorPoint[1];
+}
+
+
+template <typename TScalar>
+typename ProjectionGeometry<TScalar>::VectorType
+ProjectionGeometry<TScalar>
+::ComputeRayVector( const PointType & detectorPoint ) const
+{
+  VectorType ray;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ray[i] = m_RayMatrix[i][0] * detectorPoint[0]
+           + m_RayMatrix[i][1] * detectorPoint[1]
+           + m_RayMatrix[i][2];
+    }
+  return ray;
+}
+
+
+template <typename TScalar>
+void
+ProjectionGeometry<TScalar>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "Source Position: " << m_SourcePosition << std::endl;
+  os << indent << "Detector Origin: " << m_DetectorOrigin << std::endl;
+  os << indent << "Detector Row Direction: " << m_DetectorRowDirection << std::endl;
+  os << indent << "Detector Column Direction: " << m_DetectorColumnDirection << std::endl;
+  os << indent << "Ray Matrix: " << std::endl << m_RayMatrix;
+}
+
+} // end namespace itk
+
+#endif
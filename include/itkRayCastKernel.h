@@ -0,0 +1,921 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRayCastKernel_h
+#define itkRayCastKernel_h
+
+#include "itkIntTypes.h"
+#include "itkNumericTraits.h"
+#include "itkFixedArray.h"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+namespace itk
+{
+
+/** \file itkRayCastKernel.h
+ * \brief Policies of the ray casting kernel.
+ *
+ * A ray is cast through a volume by combining three policies, chosen at
+ * compile time so that every combination compiles to its own loop:
+ *
+ * - a traversal, which visits the voxels along the ray:
+ *   SiddonRayTraversal, FixedPointSiddonRayTraversal or JosephRayTraversal;
+ * - a voxel access, which reads the voxel values: PlainVoxelAccess,
+ *   BrickedVoxelAccess or QuantizedVoxelAccess;
+ * - an accumulator, which combines the values along the ray:
+ *   SumRayAccumulator, ThresholdedSumRayAccumulator,
+ *   MaximumIntensityRayAccumulator or MultiChannelSumRayAccumulator.
+ *
+ * The precision of the ray coordinates is the template parameter of the
+ * traversal: float halves the size of the ray state, double is the
+ * validation path. RayCastKernel casts one ray with a given combination.
+ *
+ * The volume has its origin at (0,0,0): voxel (i,j,k) covers
+ * [i,i+1) x [j,j+1) x [k,k+1) times the spacing. A ray is given by its
+ * source and its vector, the points of the ray being source + alpha *
+ * vector; the length of a ray segment is measured in alpha.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+
+
+/** \class SiddonRayEntry
+ * \brief Entry of a ray into the volume, as the Siddon-Jacobs algorithm
+ * starts from it.
+ *
+ * The entry is computed in double precision and shared by the Siddon
+ * traversals, so that they start from the same voxel and the same plane
+ * intersections whatever the precision they run in.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+struct SiddonRayEntry
+{
+  double         Alpha[3];     // First intersections with the x, y and z-planes
+  double         AlphaU[3];    // Increments between the planes
+  double         AlphaMax;     // Exit of the ray from the volume
+  IndexValueType Index[3];     // Voxel of the first intersection
+  int            IndexStep[3]; // Voxel index increments along the ray
+
+  /** Compute the entry of the ray into a volume of the given spacing and
+   * size. */
+  template <typename TReal>
+  void Compute( const double source[3], const TReal ray[3],
+                const double spacing[3], const SizeValueType size[3] )
+  {
+    double alphaNMin[3];
+    double alphaNMax[3];
+
+    /* Calculate the parametric values of the first and the last
+    intersection points of the ray with the X, Y, and Z-planes that
+    define the CT volume. */
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      if( ray[d] != 0 )
+        {
+        const double alpha1 = ( 0.0 - source[d] ) / ray[d];
+        const double alphaN = ( size[d] * spacing[d] - source[d] ) / ray[d];
+        alphaNMin[d] = std::min( alpha1, alphaN );
+        alphaNMax[d] = std::max( alpha1, alphaN );
+        }
+      else
+        {
+        alphaNMin[d] = -2;
+        alphaNMax[d] = 2;
+        }
+      }
+
+    /* Get the very first and the last alpha values when the ray
+    intersects with the CT volume. */
+    const double alphaMin = std::max( std::max( alphaNMin[0], alphaNMin[1] ), alphaNMin[2] );
+    AlphaMax = std::min( std::min( alphaNMax[0], alphaNMax[1] ), alphaNMax[2] );
+
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      /* Transform the first intersection of the ray with the CT volume
+      to a continuous index. */
+      const double firstIntersection = source[d] + alphaMin * ray[d];
+      const double firstIntersectionIndex = firstIntersection / spacing[d];
+
+      /* The voxel of the first intersection is the one the ray runs into:
+      on a plane, the voxel after the plane along the ray. The first
+      intersection lies on the boundary of the volume, up to the rounding of
+      alphaMin, which must not decide whether the ray starts outside of the
+      volume: the voxel is clamped into the volume if the ray enters it. */
+      IndexStep[d] = ( ray[d] > 0 ) ? 1 : -1;
+      Index[d] = static_cast<IndexValueType>( ( ray[d] < 0 ) ? std::ceil( firstIntersectionIndex ) - 1.0
+                                                             : std::floor( firstIntersectionIndex ) );
+      if( ( ray[d] != 0 ) && ( alphaMin < AlphaMax ) )
+        {
+        Index[d] = std::min( std::max( Index[d], IndexValueType( 0 ) ), static_cast<IndexValueType>( size[d] ) - 1 );
+        }
+
+      /* Calculate the parametric value of the first intersection of the
+      ray with a plane after the ray entered the CT volume, the increment
+      of alpha between the planes and the increment of the voxel index. */
+      if( ray[d] == 0 )
+        {
+        Alpha[d] = 2;
+        AlphaU[d] = 999;
+        }
+      else
+        {
+        const IndexValueType nextPlane = Index[d] + ( ( ray[d] > 0 ) ? 1 : 0 );
+        Alpha[d] = ( nextPlane * spacing[d] - source[d] ) / ray[d];
+        AlphaU[d] = spacing[d] / std::fabs( static_cast<double>( ray[d] ) );
+        }
+      }
+  }
+};
+
+
+/** \class SiddonRayTraversal
+ * \brief Exact traversal of the voxels intersected by a ray.
+ *
+ * The Siddon-Jacobs algorithm visits every voxel intersected by the ray,
+ * with the length of the intersection. The traversal can be suspended at
+ * the first voxel outside a range of slices and resumed later, for the
+ * rendering of volumes held in slabs.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TReal = float>
+class SiddonRayTraversal
+{
+public:
+  using RealType = TReal;
+
+  /** Compute the entry of the ray into a volume of the given spacing and
+   * size. The entry is computed in double precision whatever RealType:
+   * the first intersection lies on a plane of the volume, and the voxel it
+   * is attributed to would otherwise depend on the rounding of RealType.
+   * The traversal itself runs in RealType. */
+  void Initialize( const double source[3], const RealType ray[3],
+                   const double spacing[3], const SizeValueType size[3] )
+  {
+    SiddonRayEntry entry;
+    entry.Compute( source, ray, spacing, size );
+
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      m_Alpha[d] = static_cast<RealType>( entry.Alpha[d] );
+      m_AlphaU[d] = static_cast<RealType>( entry.AlphaU[d] );
+      m_IndexStep[d] = entry.IndexStep[d];
+      m_Index[d] = entry.Index[d];
+      m_Size[d] = static_cast<IndexValueType>( size[d] );
+      }
+    m_AlphaMax = static_cast<RealType>( entry.AlphaMax );
+
+    /* Initialize the current ray position. */
+    m_AlphaCmin = std::min( std::min( m_Alpha[0], m_Alpha[1] ), m_Alpha[2] );
+    m_AlphaCminPrev = m_AlphaCmin;
+    m_Pending = false;
+  }
+
+  /** Trace the ray through the slices [zBegin, zEnd) of the volume, which
+   * the voxel access must provide. The traversal is suspended at the first
+   * voxel outside the slices. Returns true when the ray has left the
+   * volume. */
+  template <typename TVoxelAccess, typename TAccumulator>
+  bool Trace( const TVoxelAccess & access, TAccumulator & accumulator,
+              IndexValueType zBegin = NumericTraits<IndexValueType>::NonpositiveMin(),
+              IndexValueType zEnd = NumericTraits<IndexValueType>::max() )
+  {
+    RealType alphaX = m_Alpha[0];
+    RealType alphaY = m_Alpha[1];
+    RealType alphaZ = m_Alpha[2];
+    RealType alphaCmin = m_AlphaCmin;
+    RealType alphaCminPrev = m_AlphaCminPrev;
+    IndexValueType i = m_Index[0];
+    IndexValueType j = m_Index[1];
+    IndexValueType k = m_Index[2];
+
+    if( m_Pending )
+      {
+      /* The voxel the traversal was suspended at lies in a later slab. */
+      if( ( k < zBegin ) || ( k >= zEnd ) )
+        {
+        return false;
+        }
+      accumulator.Add( alphaCmin - alphaCminPrev, access.GetValue( i, j, k ) );
+      m_Pending = false;
+      }
+
+    while( alphaCmin < m_AlphaMax ) /* Check if the ray is still in the CT volume */
+      {
+      /* Store the current ray position */
+      alphaCminPrev = alphaCmin;
+
+      if( ( alphaX <= alphaY ) && ( alphaX <= alphaZ ) )
+        {
+        /* Current ray front intercepts with x-plane. Update alphaX. */
+        alphaCmin = alphaX;
+        i += m_IndexStep[0];
+        alphaX = alphaX + m_AlphaU[0];
+        }
+      else if( ( alphaY <= alphaX ) && ( alphaY <= alphaZ ) )
+        {
+        /* Current ray front intercepts with y-plane. Update alphaY. */
+        alphaCmin = alphaY;
+        j += m_IndexStep[1];
+        alphaY = alphaY + m_AlphaU[1];
+        }
+      else
+        {
+        /* Current ray front intercepts with z-plane. Update alphaZ. */
+        alphaCmin = alphaZ;
+        k += m_IndexStep[2];
+        alphaZ = alphaZ + m_AlphaU[2];
+        }
+
+      if( ( i >= 0 ) && ( i < m_Size[0] ) &&
+          ( j >= 0 ) && ( j < m_Size[1] ) &&
+          ( k >= 0 ) && ( k < m_Size[2] ) )
+        {
+        if( ( k < zBegin ) || ( k >= zEnd ) )
+          {
+          /* The voxel is not in the current slab: suspend the traversal. */
+          m_Pending = true;
+          break;
+          }
+        accumulator.Add( alphaCmin - alphaCminPrev, access.GetValue( i, j, k ) );
+        }
+      }
+
+    m_Alpha[0] = alphaX;
+    m_Alpha[1] = alphaY;
+    m_Alpha[2] = alphaZ;
+    m_AlphaCmin = alphaCmin;
+    m_AlphaCminPrev = alphaCminPrev;
+    m_Index[0] = i;
+    m_Index[1] = j;
+    m_Index[2] = k;
+    return !m_Pending;
+  }
+
+  /** Get the voxel index increment along an axis, +1 or -1. */
+  int GetIndexStep( unsigned int axis ) const
+  {
+    return m_IndexStep[axis];
+  }
+
+private:
+  RealType       m_Alpha[3];      // Next intersections with the x, y and z-planes
+  RealType       m_AlphaU[3];     // Increments between the planes
+  RealType       m_AlphaCmin;     // Current ray position
+  RealType       m_AlphaCminPrev; // Previous ray position
+  RealType       m_AlphaMax;      // Exit of the ray from the volume
+  IndexValueType m_Index[3];      // Current voxel
+  IndexValueType m_Size[3];
+  int            m_IndexStep[3];  // Voxel index increments along the ray
+  bool           m_Pending;       // The current voxel is not yet accumulated
+};
+
+
+/** \class FixedPointSiddonRayTraversal
+ * \brief Siddon-Jacobs traversal with fixed point plane intersections.
+ *
+ * The traversal visits the voxels in the order of SiddonRayTraversal, but
+ * holds the parametric values of the next plane intersections as 64-bit
+ * integers, counted in units of 2^-48 of the path of the ray through the
+ * volume from the first intersection. The axis of the next intersection is
+ * selected from the bits of the three comparisons rather than by a chain of
+ * branches, which the processor would mispredict for oblique rays. Only the
+ * plane selection is branch-free: the loop still branches on whether the
+ * voxel lies in the volume, a single test of the three indices, and on
+ * whether it lies in the current slab. Both go the same way for every
+ * voxel of a ray but at its entry and its exit.
+ *
+ * The entry is computed in double precision, by SiddonRayEntry, and the
+ * voxel sequence depends on integer arithmetic only from there on, hence
+ * neither on the compiler nor on the optimization level. An intersection
+ * deviates from the exact one by at most one unit per plane crossed along
+ * its axis, i.e. 2^-37 of the path after 2048 planes: the voxel
+ * sequence is the one of SiddonRayTraversal<double> except where two
+ * intersections are closer than that. The lengths are converted to
+ * RealType for the accumulator.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TReal = float>
+class FixedPointSiddonRayTraversal
+{
+public:
+  using RealType = TReal;
+  using FixedPointType = int64_t;
+
+  /** Compute the entry of the ray into a volume of the given spacing and
+   * size, and convert the plane intersections to fixed point. */
+  void Initialize( const double source[3], const RealType ray[3],
+                   const double spacing[3], const SizeValueType size[3] )
+  {
+    SiddonRayEntry entry;
+    entry.Compute( source, ray, spacing, size );
+
+    /* The first intersection is the origin of the fixed point values, and
+    the path through the volume spans 2^48 units. Intersections further
+    than 2^61 units, e.g. along an axis the ray is parallel to, are never
+    reached and are clamped to keep the sums in range. */
+    const double origin = std::min( std::min( entry.Alpha[0], entry.Alpha[1] ), entry.Alpha[2] );
+    const double path = entry.AlphaMax - origin;
+    const double far = static_cast<double>( FixedPointType( 1 ) << 61 );
+    const double scale = ( path > 0 ) ? static_cast<double>( FixedPointType( 1 ) << 48 ) / path : 0.0;
+
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      m_Alpha[d] = static_cast<FixedPointType>( std::llround( std::min( ( entry.Alpha[d] - origin ) * scale, far ) ) );
+      m_AlphaU[d] = static_cast<FixedPointType>( std::llround( std::min( entry.AlphaU[d] * scale, far ) ) );
+      m_IndexStep[d] = entry.IndexStep[d];
+      m_Index[d] = entry.Index[d];
+      m_Size[d] = static_cast<IndexValueType>( size[d] );
+      }
+    m_AlphaMax = ( path > 0 ) ? ( FixedPointType( 1 ) << 48 ) : 0;
+    m_Unit = static_cast<RealType>( ( path > 0 ) ? path / static_cast<double>( FixedPointType( 1 ) << 48 ) : 0.0 );
+
+    /* Initialize the current ray position. */
+    m_AlphaCmin = 0;
+    m_AlphaCminPrev = 0;
+    m_Pending = false;
+  }
+
+  /** Trace the ray through the slices [zBegin, zEnd) of the volume, which
+   * the voxel access must provide. The traversal is suspended at the first
+   * voxel outside the slices. Returns true when the ray has left the
+   * volume. */
+  template <typename TVoxelAccess, typename TAccumulator>
+  bool Trace( const TVoxelAccess & access, TAccumulator & accumulator,
+              IndexValueType zBegin = NumericTraits<IndexValueType>::NonpositiveMin(),
+              IndexValueType zEnd = NumericTraits<IndexValueType>::max() )
+  {
+    FixedPointType alpha[3] = { m_Alpha[0], m_Alpha[1], m_Alpha[2] };
+    IndexValueType index[3] = { m_Index[0], m_Index[1], m_Index[2] };
+    FixedPointType alphaCmin = m_AlphaCmin;
+    FixedPointType alphaCminPrev = m_AlphaCminPrev;
+
+    if( m_Pending )
+      {
+      /* The voxel the traversal was suspended at lies in a later slab. */
+      if( ( index[2] < zBegin ) || ( index[2] >= zEnd ) )
+        {
+        return false;
+        }
+      accumulator.Add( static_cast<RealType>( alphaCmin - alphaCminPrev ) * m_Unit,
+                       access.GetValue( index[0], index[1], index[2] ) );
+      m_Pending = false;
+      }
+
+    while( alphaCmin < m_AlphaMax ) /* Check if the ray is still in the CT volume */
+      {
+      /* Store the current ray position */
+      alphaCminPrev = alphaCmin;
+
+      /* Select the plane the ray front intercepts, x before y before z on
+      ties as in SiddonRayTraversal: 0 when the x bit is set, else 1 when
+      the y bit is set, else 2. */
+      const unsigned int xFirst = static_cast<unsigned int>( alpha[0] <= alpha[1] ) & static_cast<unsigned int>( alpha[0] <= alpha[2] );
+      const unsigned int yFirst = static_cast<unsigned int>( alpha[1] <= alpha[0] ) & static_cast<unsigned int>( alpha[1] <= alpha[2] );
+      const unsigned int axis = ( 1 - xFirst ) * ( 2 - yFirst );
+
+      alphaCmin = alpha[axis];
+      index[axis] += m_IndexStep[axis];
+      alpha[axis] += m_AlphaU[axis];
+
+      /* A negative index converts to an unsigned value above the size: the
+      voxel is in the volume if the three unsigned indices are below the
+      sizes, which is tested with a single branch. */
+      const unsigned int inside = static_cast<unsigned int>( static_cast<SizeValueType>( index[0] ) < static_cast<SizeValueType>( m_Size[0] ) )
+                                & static_cast<unsigned int>( static_cast<SizeValueType>( index[1] ) < static_cast<SizeValueType>( m_Size[1] ) )
+                                & static_cast<unsigned int>( static_cast<SizeValueType>( index[2] ) < static_cast<SizeValueType>( m_Size[2] ) );
+      if( inside )
+        {
+        if( ( index[2] < zBegin ) || ( index[2] >= zEnd ) )
+          {
+          /* The voxel is not in the current slab: suspend the traversal. */
+          m_Pending = true;
+          break;
+          }
+        accumulator.Add( static_cast<RealType>( alphaCmin - alphaCminPrev ) * m_Unit,
+                         access.GetValue( index[0], index[1], index[2] ) );
+        }
+      }
+
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      m_Alpha[d] = alpha[d];
+      m_Index[d] = index[d];
+      }
+    m_AlphaCmin = alphaCmin;
+    m_AlphaCminPrev = alphaCminPrev;
+    return !m_Pending;
+  }
+
+  /** Get the voxel index increment along an axis, +1 or -1. */
+  int GetIndexStep( unsigned int axis ) const
+  {
+    return m_IndexStep[axis];
+  }
+
+private:
+  FixedPointType m_Alpha[3];      // Next intersections with the x, y and z-planes
+  FixedPointType m_AlphaU[3];     // Increments between the planes
+  FixedPointType m_AlphaCmin;     // Current ray position
+  FixedPointType m_AlphaCminPrev; // Previous ray position
+  FixedPointType m_AlphaMax;      // Exit of the ray from the volume
+  RealType       m_Unit;          // Ray length of one fixed point unit
+  IndexValueType m_Index[3];      // Current voxel
+  IndexValueType m_Size[3];
+  int            m_IndexStep[3];  // Voxel index increments along the ray
+  bool           m_Pending;       // The current voxel is not yet accumulated
+};
+
+
+/** \class JosephRayTraversal
+ * \brief Traversal of a ray slice by slice with bilinear interpolation.
+ *
+ * Joseph's method steps along the axis the ray is most parallel to, one
+ * slice at a time, and interpolates the voxel values bilinearly within
+ * every slice at the point where the ray crosses its center. Every sample
+ * stands for the same ray length. Voxels outside the volume count as 0.
+ * The voxel values must be scalars.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TReal = float>
+class JosephRayTraversal
+{
+public:
+  using RealType = TReal;
+
+  /** Compute the slices crossed by the ray in a volume of the given
+   * spacing and size. */
+  void Initialize( const double source[3], const RealType ray[3],
+                   const double spacing[3], const SizeValueType size[3] )
+  {
+    RealType alphaMin = NumericTraits<RealType>::NonpositiveMin();
+    RealType alphaMax = NumericTraits<RealType>::max();
+    m_Axis = 0;
+    RealType largestSlope = 0;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      m_Source[d] = static_cast<RealType>( source[d] );
+      m_Ray[d] = ray[d];
+      m_Spacing[d] = static_cast<RealType>( spacing[d] );
+      m_Size[d] = static_cast<IndexValueType>( size[d] );
+      if( ray[d] != 0 )
+        {
+        const RealType alpha1 = ( 0 - m_Source[d] ) / ray[d];
+        const RealType alphaN = ( m_Size[d] * m_Spacing[d] - m_Source[d] ) / ray[d];
+        alphaMin = std::max( alphaMin, std::min( alpha1, alphaN ) );
+        alphaMax = std::min( alphaMax, std::max( alpha1, alphaN ) );
+        }
+      else if( m_Source[d] < 0 || m_Source[d] >= m_Size[d] * m_Spacing[d] )
+        {
+        alphaMax = alphaMin; // Parallel to the volume and outside of it
+        }
+      const RealType slope = std::fabs( ray[d] ) / m_Spacing[d];
+      if( slope > largestSlope )
+        {
+        largestSlope = slope;
+        m_Axis = d;
+        }
+      }
+
+    m_FirstSlice = 0;
+    m_LastSlice = -1;
+    if( largestSlope == 0 || !( alphaMin < alphaMax ) )
+      {
+      return;
+      }
+
+    // Continuous slice index, the slice centers being at integers
+    const unsigned int a = m_Axis;
+    const RealType sliceAtMin = ( m_Source[a] + alphaMin * m_Ray[a] ) / m_Spacing[a] - RealType( 0.5 );
+    const RealType sliceAtMax = ( m_Source[a] + alphaMax * m_Ray[a] ) / m_Spacing[a] - RealType( 0.5 );
+    m_FirstSlice = std::max<IndexValueType>( 0,
+      static_cast<IndexValueType>( std::ceil( std::min( sliceAtMin, sliceAtMax ) ) ) );
+    m_LastSlice = std::min<IndexValueType>( m_Size[a] - 1,
+      static_cast<IndexValueType>( std::floor( std::max( sliceAtMin, sliceAtMax ) ) ) );
+    m_Step = m_Spacing[a] / std::fabs( m_Ray[a] );
+  }
+
+  /** Trace the ray through the whole volume. */
+  template <typename TVoxelAccess, typename TAccumulator>
+  void Trace( const TVoxelAccess & access, TAccumulator & accumulator ) const
+  {
+    using ValueType = typename TVoxelAccess::ValueType;
+    static_assert( std::is_arithmetic<ValueType>::value, "Joseph's method interpolates scalar values" );
+
+    const unsigned int a = m_Axis;
+    const unsigned int b = ( a + 1 ) % 3;
+    const unsigned int c = ( a + 2 ) % 3;
+
+    IndexValueType index[3];
+    for( IndexValueType slice = m_FirstSlice; slice <= m_LastSlice; slice++ )
+      {
+      const RealType alpha = ( ( slice + RealType( 0.5 ) ) * m_Spacing[a] - m_Source[a] ) / m_Ray[a];
+      const RealType pb = ( m_Source[b] + alpha * m_Ray[b] ) / m_Spacing[b] - RealType( 0.5 );
+      const RealType pc = ( m_Source[c] + alpha * m_Ray[c] ) / m_Spacing[c] - RealType( 0.5 );
+      const IndexValueType ib = static_cast<IndexValueType>( std::floor( pb ) );
+      const IndexValueType ic = static_cast<IndexValueType>( std::floor( pc ) );
+      const RealType wb = pb - ib;
+      const RealType wc = pc - ic;
+
+      RealType value = 0;
+      index[a] = slice;
+      for( unsigned int n = 0; n < 4; n++ )
+        {
+        index[b] = ib + ( n & 1 );
+        index[c] = ic + ( n >> 1 );
+        if( index[b] >= 0 && index[b] < m_Size[b] && index[c] >= 0 && index[c] < m_Size[c] )
+          {
+          const RealType weight = ( ( n & 1 ) ? wb : 1 - wb ) * ( ( n >> 1 ) ? wc : 1 - wc );
+          value += weight * static_cast<RealType>( access.GetValue( index[0], index[1], index[2] ) );
+          }
+        }
+      accumulator.Add( m_Step, static_cast<ValueType>( value ) );
+      }
+  }
+
+private:
+  RealType       m_Source[3];
+  RealType       m_Ray[3];
+  RealType       m_Spacing[3];
+  IndexValueType m_Size[3];
+  unsigned int   m_Axis;       // Axis the ray is most parallel to
+  IndexValueType m_FirstSlice;
+  IndexValueType m_LastSlice;
+  RealType       m_Step;       // Ray length between two slices
+};
+
+
+/** \class PlainVoxelAccess
+ * \brief Access to the voxels of a buffer in the image layout.
+ *
+ * The buffer holds a region of the volume, x fastest, e.g. the buffered
+ * region of an image, which may be a slab of slices.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TPixel, typename TValue = float>
+class PlainVoxelAccess
+{
+public:
+  using PixelType = TPixel;
+  using ValueType = TValue;
+
+  PlainVoxelAccess( const PixelType * buffer,
+                    const IndexValueType bufferedIndex[3],
+                    const SizeValueType bufferedSize[3] )
+  {
+    this->SetBuffer( buffer, bufferedIndex, bufferedSize );
+  }
+
+  /** Access the buffered region of an image. */
+  template <typename TImage>
+  explicit PlainVoxelAccess( const TImage * image )
+  {
+    const typename TImage::RegionType region = image->GetBufferedRegion();
+    IndexValueType bufferedIndex[3];
+    SizeValueType  bufferedSize[3];
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      bufferedIndex[d] = region.GetIndex()[d];
+      bufferedSize[d] = region.GetSize()[d];
+      }
+    this->SetBuffer( image->GetBufferPointer(), bufferedIndex, bufferedSize );
+  }
+
+  ValueType GetValue( IndexValueType i, IndexValueType j, IndexValueType k ) const
+  {
+    return static_cast<ValueType>( m_Buffer[i + j * m_Stride[0] + k * m_Stride[1] + m_Offset] );
+  }
+
+private:
+  void SetBuffer( const PixelType * buffer,
+                  const IndexValueType bufferedIndex[3],
+                  const SizeValueType bufferedSize[3] )
+  {
+    m_Buffer = buffer;
+    m_Stride[0] = static_cast<OffsetValueType>( bufferedSize[0] );
+    m_Stride[1] = static_cast<OffsetValueType>( bufferedSize[0] * bufferedSize[1] );
+    m_Offset = -( bufferedIndex[0] + bufferedIndex[1] * m_Stride[0] + bufferedIndex[2] * m_Stride[1] );
+  }
+
+  const PixelType * m_Buffer;
+  OffsetValueType   m_Stride[2]; // Offsets between rows and between slices
+  OffsetValueType   m_Offset;    // Offset of voxel (0,0,0)
+};
+
+
+/** \class BrickedVoxelAccess
+ * \brief Access to the voxels of a volume stored in bricks.
+ *
+ * The volume is stored in cubic bricks of BrickSize^3 voxels, one after the
+ * other, x fastest within a brick and across the bricks, as written by
+ * PreparedVolumeFile. Voxels close to each other in any direction are
+ * close in memory, which suits rays crossing the volume along z.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TPixel, typename TValue = float>
+class BrickedVoxelAccess
+{
+public:
+  using PixelType = TPixel;
+  using ValueType = TValue;
+
+  BrickedVoxelAccess( const PixelType * bricks, const SizeValueType size[3], unsigned int brickSize )
+  {
+    m_Bricks = bricks;
+    m_BrickSize = static_cast<IndexValueType>( brickSize );
+    const SizeValueType bricksX = ( size[0] + brickSize - 1 ) / brickSize;
+    const SizeValueType bricksY = ( size[1] + brickSize - 1 ) / brickSize;
+    m_BrickLength = static_cast<OffsetValueType>( brickSize ) * brickSize * brickSize;
+    m_BrickStride[0] = static_cast<OffsetValueType>( bricksX );
+    m_BrickStride[1] = static_cast<OffsetValueType>( bricksX * bricksY );
+  }
+
+  ValueType GetValue( IndexValueType i, IndexValueType j, IndexValueType k ) const
+  {
+    const IndexValueType bi = i / m_BrickSize;
+    const IndexValueType bj = j / m_BrickSize;
+    const IndexValueType bk = k / m_BrickSize;
+    const OffsetValueType brick = bi + bj * m_BrickStride[0] + bk * m_BrickStride[1];
+    const OffsetValueType voxel = ( i - bi * m_BrickSize )
+                                + ( ( j - bj * m_BrickSize ) + ( k - bk * m_BrickSize ) * m_BrickSize ) * m_BrickSize;
+    return static_cast<ValueType>( m_Bricks[brick * m_BrickLength + voxel] );
+  }
+
+private:
+  const PixelType * m_Bricks;
+  IndexValueType    m_BrickSize;
+  OffsetValueType   m_BrickLength;    // Voxels per brick
+  OffsetValueType   m_BrickStride[2]; // Bricks per row and per slice of bricks
+};
+
+
+/** \class QuantizedVoxelAccess
+ * \brief Access to the voxels of a volume compressed to integer codes.
+ *
+ * The volume is stored as codes of a small integer type, x fastest, and
+ * the value of a voxel is Offset + Scale * code. Quantize() compresses a
+ * buffer of voxels linearly over the range of the code type, e.g. to 8 or
+ * 16 bits per voxel, which divides the memory traffic of the traversal.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TCode, typename TValue = float>
+class QuantizedVoxelAccess
+{
+public:
+  using CodeType = TCode;
+  using ValueType = TValue;
+
+  static_assert( std::is_integral<CodeType>::value, "The codes must be integers" );
+
+  QuantizedVoxelAccess( const CodeType * codes, const SizeValueType size[3], double scale, double offset )
+  {
+    m_Codes = codes;
+    m_Stride[0] = static_cast<OffsetValueType>( size[0] );
+    m_Stride[1] = static_cast<OffsetValueType>( size[0] * size[1] );
+    m_Scale = scale;
+    m_Offset = offset;
+  }
+
+  ValueType GetValue( IndexValueType i, IndexValueType j, IndexValueType k ) const
+  {
+    return static_cast<ValueType>( m_Offset + m_Scale * m_Codes[i + j * m_Stride[0] + k * m_Stride[1]] );
+  }
+
+  /** Compress n voxels to codes mapping linearly the range of the voxels
+   * onto the range of the code type. */
+  template <typename TPixel>
+  static void Quantize( const TPixel * voxels, SizeValueType n,
+                        std::vector<CodeType> & codes, double & scale, double & offset )
+  {
+    codes.resize( n );
+    if( n == 0 )
+      {
+      scale = 1.0;
+      offset = 0.0;
+      return;
+      }
+    const auto range = std::minmax_element( voxels, voxels + n );
+    const double minimum = static_cast<double>( *range.first );
+    const double maximum = static_cast<double>( *range.second );
+    const double lowestCode = static_cast<double>( NumericTraits<CodeType>::NonpositiveMin() );
+    const double highestCode = static_cast<double>( NumericTraits<CodeType>::max() );
+    scale = ( maximum > minimum ) ? ( maximum - minimum ) / ( highestCode - lowestCode ) : 1.0;
+    offset = minimum - scale * lowestCode;
+    for( SizeValueType v = 0; v < n; v++ )
+      {
+      const double code = std::floor( ( static_cast<double>( voxels[v] ) - offset ) / scale + 0.5 );
+      codes[v] = static_cast<CodeType>( std::min( highestCode, std::max( lowestCode, code ) ) );
+      }
+  }
+
+private:
+  const CodeType * m_Codes;
+  OffsetValueType  m_Stride[2];
+  double           m_Scale;
+  double           m_Offset;
+};
+
+
+/** \class SumRayAccumulator
+ * \brief Line integral of the voxel values along the ray.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TValue = float>
+class SumRayAccumulator
+{
+public:
+  using ValueType = TValue;
+  using ResultType = TValue;
+
+  template <typename TLength>
+  void Add( TLength length, ValueType value )
+  {
+    m_Sum += length * value;
+  }
+
+  ResultType GetResult() const
+  {
+    return m_Sum;
+  }
+
+private:
+  ValueType m_Sum{ 0 };
+};
+
+
+/** \class ThresholdedSumRayAccumulator
+ * \brief Line integral of the voxel values above a threshold.
+ *
+ * Voxels whose value does not exceed the threshold are ignored, the
+ * threshold is subtracted from the others. This is the integral computed
+ * by SiddonJacobsRayCastInterpolateImageFunction.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TValue = float>
+class ThresholdedSumRayAccumulator
+{
+public:
+  using ValueType = TValue;
+  using ResultType = TValue;
+
+  explicit ThresholdedSumRayAccumulator( double threshold = 0.0 ) : m_Threshold( threshold ) {}
+
+  template <typename TLength>
+  void Add( TLength length, ValueType value )
+  {
+    if( value > m_Threshold ) /* Ignore voxels whose intensities are below the threshold. */
+      {
+      m_Sum += length * ( value - m_Threshold );
+      }
+  }
+
+  ResultType GetResult() const
+  {
+    return m_Sum;
+  }
+
+private:
+  double    m_Threshold;
+  ValueType m_Sum{ 0 };
+};
+
+
+/** \class MaximumIntensityRayAccumulator
+ * \brief Maximum of the voxel values along the ray (MIP).
+ *
+ * The result is 0 for a ray missing the volume.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TValue = float>
+class MaximumIntensityRayAccumulator
+{
+public:
+  using ValueType = TValue;
+  using ResultType = TValue;
+
+  template <typename TLength>
+  void Add( TLength, ValueType value )
+  {
+    m_Maximum = std::max( m_Maximum, value );
+    m_Visited = true;
+  }
+
+  ResultType GetResult() const
+  {
+    return m_Visited ? m_Maximum : ValueType( 0 );
+  }
+
+private:
+  ValueType m_Maximum{ NumericTraits<ValueType>::NonpositiveMin() };
+  bool      m_Visited{ false };
+};
+
+
+/** \class MultiChannelSumRayAccumulator
+ * \brief Line integrals of the channels of multi-channel voxels.
+ *
+ * The voxel values are fixed size vectors of VChannels components, e.g.
+ * the attenuation of the tissues at several energies; every channel is
+ * integrated separately.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TComponent, unsigned int VChannels>
+class MultiChannelSumRayAccumulator
+{
+public:
+  using ValueType = FixedArray<TComponent, VChannels>;
+  using ResultType = FixedArray<TComponent, VChannels>;
+
+  MultiChannelSumRayAccumulator()
+  {
+    m_Sum.Fill( TComponent( 0 ) );
+  }
+
+  template <typename TLength, typename TVoxelValue>
+  void Add( TLength length, const TVoxelValue & value )
+  {
+    for( unsigned int c = 0; c < VChannels; c++ )
+      {
+      m_Sum[c] += length * value[c];
+      }
+  }
+
+  ResultType GetResult() const
+  {
+    return m_Sum;
+  }
+
+private:
+  ResultType m_Sum;
+};
+
+
+/** \class RayCastKernel
+ * \brief Cast a ray with a combination of policies.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TTraversal, typename TVoxelAccess, typename TAccumulator>
+class RayCastKernel
+{
+public:
+  using TraversalType = TTraversal;
+  using VoxelAccessType = TVoxelAccess;
+  using AccumulatorType = TAccumulator;
+  using RealType = typename TraversalType::RealType;
+  using ResultType = typename AccumulatorType::ResultType;
+
+  /** Cast a ray through a volume of the given spacing and size, starting
+   * from the given accumulator. */
+  static ResultType Cast( const double source[3], const RealType ray[3],
+                          const double spacing[3], const SizeValueType size[3],
+                          const VoxelAccessType & access, AccumulatorType accumulator )
+  {
+    Accumulate( source, ray, spacing, size, access, accumulator );
+    return accumulator.GetResult();
+  }
+
+  /** Cast a ray as Cast() does into an accumulator of the caller, which
+   * can be inspected afterwards, e.g. for the counts of a
+   * CountingRayAccumulator. */
+  static void Accumulate( const double source[3], const RealType ray[3],
+                          const double spacing[3], const SizeValueType size[3],
+                          const VoxelAccessType & access, AccumulatorType & accumulator )
+  {
+    TraversalType traversal;
+    traversal.Initialize( source, ray, spacing, size );
+    traversal.Trace( access, accumulator );
+  }
+};
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,592 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRayCastWorkerPool_h
+#define itkRayCastWorkerPool_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkIntTypes.h"
+#include "itkNumericTraits.h"
+#include "itkNumaTopology.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace itk
+{
+
+/** \class RayCastWorkerPool
+ * \brief Persistent pool of worker threads for the ray casting loops.
+ *
+ * The threads are created once, by Start() or by the first call to
+ * ParallelFor(), and are reused by every subsequent call, so that no
+ * thread is spawned and no memory is allocated per metric evaluation or
+ * per rendered projection. The calling thread takes part in the work as
+ * worker 0.
+ *
+ * When a processor set is given, worker w is pinned to the processor
+ * ProcessorSet[w % size]. Pinning is only supported on Linux and is
+ * silently ignored elsewhere.
+ *
+ * The NUMA node of the processor of worker w is available, in the thread
+ * running the range of worker w, from GetCurrentWorkerNode(), so that the
+ * work can read the data placed on its node, see
+ * SiddonJacobsRayCastInterpolateImageFunction::SetVolumeReplicas().
+ *
+ * ParallelFor() gives every worker one contiguous range of the items.
+ * When the cost of the items varies, ParallelForDynamic() balances the
+ * load instead: every worker starts on its own contiguous range and, once
+ * done, steals half of the remaining items of another worker.
+ * ParallelForTiles() uses it to process a two dimensional grid in small
+ * tiles of TileSize x TileSize items, visited along a Hilbert curve so
+ * that the tiles processed by a worker are close to each other.
+ *
+ * Exceptions thrown by a worker are caught and rethrown in the calling
+ * thread once all workers have finished.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class RayCastWorkerPool : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(RayCastWorkerPool);
+
+  /** Standard class type alias. */
+  using Self = RayCastWorkerPool;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RayCastWorkerPool, Object);
+
+  using ProcessorSetType = std::vector<int>;
+
+  /** Set/Get the number of workers, including the calling thread. Changing
+   * it stops the running threads. */
+  void SetNumberOfWorkers( unsigned int numberOfWorkers )
+  {
+    numberOfWorkers = ( numberOfWorkers < 1 ? 1 : numberOfWorkers );
+    if( numberOfWorkers != m_NumberOfWorkers )
+      {
+      this->Stop();
+      m_NumberOfWorkers = numberOfWorkers;
+      this->Modified();
+      }
+  }
+  itkGetConstMacro( NumberOfWorkers, unsigned int );
+
+  /** Set/Get the processors the workers are pinned to. An empty set, the
+   * default, leaves the scheduling to the operating system. Changing it
+   * stops the running threads. */
+  void SetProcessorSet( const ProcessorSetType & processors )
+  {
+    this->Stop();
+    m_ProcessorSet = processors;
+    m_ProcessorNodes.clear();
+    for( int processor : m_ProcessorSet )
+      {
+      m_ProcessorNodes.push_back( NumaTopology::GetNodeOfProcessor( processor ) );
+      }
+    this->Modified();
+  }
+  const ProcessorSetType & GetProcessorSet() const
+  {
+    return m_ProcessorSet;
+  }
+
+  /** Set/Get the edge length, in items, of the tiles of
+   * ParallelForTiles(). Default is 16. */
+  itkSetClampMacro( TileSize, SizeValueType, 1, NumericTraits<SizeValueType>::max() );
+  itkGetConstMacro( TileSize, SizeValueType );
+
+  /** Get the NUMA node of the processor of a worker, or -1 if the worker
+   * is not pinned or the node is unknown. */
+  int GetNodeOfWorker( unsigned int workerId ) const
+  {
+    if( m_ProcessorNodes.empty() )
+      {
+      return -1;
+      }
+    return m_ProcessorNodes[workerId % m_ProcessorNodes.size()];
+  }
+
+  /** Get the NUMA node of the worker running in the calling thread, or -1
+   * outside of the workers or if unknown. */
+  static int GetCurrentWorkerNode()
+  {
+    return CurrentWorkerNode();
+  }
+
+  /** Start the worker threads, if not yet running. Calling it up front
+   * removes the thread creation from the first ParallelFor(). */
+  void Start()
+  {
+    if( m_Threads.size() + 1 == m_NumberOfWorkers )
+      {
+      return;
+      }
+    this->Stop();
+    m_WorkQueues.reset( new WorkQueue[m_NumberOfWorkers] );
+    m_Threads.reserve( m_NumberOfWorkers - 1 );
+    for( unsigned int w = 1; w < m_NumberOfWorkers; w++ )
+      {
+      m_Threads.emplace_back( &Self::WorkerLoop, this, w, m_Generation );
+      }
+  }
+
+  /** Stop and join the worker threads. */
+  void Stop()
+  {
+    {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    m_StopRequested = true;
+    }
+    m_WakeCondition.notify_all();
+    for( auto & thread : m_Threads )
+      {
+      thread.join();
+      }
+    m_Threads.clear();
+    m_StopRequested = false;
+  }
+
+  /** Split [0, numberOfItems) into one contiguous range per worker and call
+   * function( begin, end, workerId ) for every non-empty range. The call
+   * returns when all ranges are processed. */
+  template <typename TFunction>
+  void ParallelFor( SizeValueType numberOfItems, TFunction && function )
+  {
+    this->Run( numberOfItems, std::forward<TFunction>( function ), false );
+  }
+
+  /** Call function( item, item + 1, workerId ) for every item of
+   * [0, numberOfItems), distributed by work stealing. The call returns
+   * when all items are processed. */
+  template <typename TFunction>
+  void ParallelForDynamic( SizeValueType numberOfItems, TFunction && function )
+  {
+    this->Run( numberOfItems, std::forward<TFunction>( function ), true );
+  }
+
+  /** Split a grid of width x height items into tiles of TileSize x TileSize
+   * items and call function( xBegin, xEnd, yBegin, yEnd, workerId ) for
+   * every tile. The tiles are distributed by work stealing, in the order
+   * of a Hilbert curve. */
+  template <typename TFunction>
+  void ParallelForTiles( SizeValueType width, SizeValueType height, TFunction && function )
+  {
+    if( width == 0 || height == 0 )
+      {
+      return;
+      }
+    if( m_NumberOfWorkers <= 1 )
+      {
+      const WorkerNodeGuard nodeGuard( this->GetNodeOfWorker( 0 ) );
+      function( 0, width, 0, height, 0 );
+      return;
+      }
+
+    const SizeValueType tileSize = m_TileSize;
+    const SizeValueType tilesX = ( width + tileSize - 1 ) / tileSize;
+    const SizeValueType tilesY = ( height + tileSize - 1 ) / tileSize;
+
+    // The curve covers squares of curveSize x curveSize tiles, laid out one
+    // after the other along the longer axis of the grid. Positions of the
+    // curve outside the grid are skipped.
+    SizeValueType curveSize = 1;
+    while( curveSize < std::min( tilesX, tilesY ) )
+      {
+      curveSize *= 2;
+      }
+    const SizeValueType squareLength = curveSize * curveSize;
+    const SizeValueType numberOfSquares = ( std::max( tilesX, tilesY ) + curveSize - 1 ) / curveSize;
+
+    auto visitTile = [&]( SizeValueType position, SizeValueType, unsigned int workerId )
+      {
+      SizeValueType tileX, tileY;
+      HilbertCurvePoint( curveSize, position % squareLength, tileX, tileY );
+      if( tilesX >= tilesY )
+        {
+        tileX += ( position / squareLength ) * curveSize;
+        }
+      else
+        {
+        tileY += ( position / squareLength ) * curveSize;
+        }
+      if( tileX < tilesX && tileY < tilesY )
+        {
+        function( tileX * tileSize, std::min( width, ( tileX + 1 ) * tileSize ),
+                  tileY * tileSize, std::min( height, ( tileY + 1 ) * tileSize ),
+                  workerId );
+        }
+      };
+    this->ParallelForDynamic( numberOfSquares * squareLength, visitTile );
+  }
+
+  /** Get the point at distance d along the Hilbert curve filling a square
+   * of n x n points, n being a power of two. */
+  static void HilbertCurvePoint( SizeValueType n, SizeValueType d, SizeValueType & x, SizeValueType & y )
+  {
+    x = 0;
+    y = 0;
+    for( SizeValueType s = 1; s < n; s *= 2 )
+      {
+      const SizeValueType rx = 1 & ( d / 2 );
+      const SizeValueType ry = 1 & ( d ^ rx );
+      if( ry == 0 )
+        {
+        if( rx == 1 )
+          {
+          x = s - 1 - x;
+          y = s - 1 - y;
+          }
+        std::swap( x, y );
+        }
+      x += s * rx;
+      y += s * ry;
+      d /= 4;
+      }
+  }
+
+  /** Pin the calling thread to a processor. Returns false if pinning is
+   * not supported or failed. */
+  static bool PinCurrentThread( int processor )
+  {
+#if defined(__linux__)
+    if( processor < 0 || processor >= CPU_SETSIZE )
+      {
+      return false;
+      }
+    cpu_set_t cpuSet;
+    CPU_ZERO( &cpuSet );
+    CPU_SET( processor, &cpuSet );
+    return pthread_setaffinity_np( pthread_self(), sizeof( cpu_set_t ), &cpuSet ) == 0;
+#else
+    (void)processor;
+    return false;
+#endif
+  }
+
+protected:
+  RayCastWorkerPool()
+  {
+    const unsigned int hardwareThreads = std::thread::hardware_concurrency();
+    m_NumberOfWorkers = ( hardwareThreads > 0 ? hardwareThreads : 1 );
+    m_TileSize = 16;
+  }
+  ~RayCastWorkerPool() override
+  {
+    this->Stop();
+  }
+
+  void PrintSelf(std::ostream& os, Indent indent) const override
+  {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "NumberOfWorkers: " << m_NumberOfWorkers << std::endl;
+    os << indent << "ProcessorSet:";
+    for( int processor : m_ProcessorSet )
+      {
+      os << " " << processor;
+      }
+    os << std::endl;
+    os << indent << "ProcessorNodes:";
+    for( int node : m_ProcessorNodes )
+      {
+      os << " " << node;
+      }
+    os << std::endl;
+    os << indent << "TileSize: " << m_TileSize << std::endl;
+    os << indent << "Running Threads: " << m_Threads.size() << std::endl;
+  }
+
+private:
+  using InvokerType = void (*)( void *, SizeValueType, SizeValueType, unsigned int );
+
+  static int & CurrentWorkerNode()
+  {
+    static thread_local int node = -1;
+    return node;
+  }
+
+  /** Sets the node of the calling thread for the lifetime of the guard. */
+  class WorkerNodeGuard
+  {
+  public:
+    explicit WorkerNodeGuard( int node ) : m_PreviousNode( CurrentWorkerNode() )
+    {
+      CurrentWorkerNode() = node;
+    }
+    ~WorkerNodeGuard()
+    {
+      CurrentWorkerNode() = m_PreviousNode;
+    }
+
+  private:
+    int m_PreviousNode;
+  };
+
+  /** Work queue of a worker: the range [front, back) of the items it has
+   * yet to process, packed in one word so that the owner, taking items at
+   * the front, and the thieves, taking items at the back, update it with a
+   * single compare and swap. Padded to a cache line. */
+  struct WorkQueue
+  {
+    std::atomic<uint64_t> Range;
+    char                  Padding[64 - sizeof( std::atomic<uint64_t> )];
+  };
+
+  static uint64_t PackRange( uint64_t front, uint64_t back )
+  {
+    return ( front << 32 ) | back;
+  }
+
+  template <typename TFunction>
+  void Run( SizeValueType numberOfItems, TFunction && function, bool dynamic )
+  {
+    using FunctionType = typename std::remove_reference<TFunction>::type;
+
+    if( m_NumberOfWorkers <= 1 || numberOfItems <= 1 )
+      {
+      // Serial: still one call per item in the dynamic case, as the
+      // function may only process the first item of its range
+      const WorkerNodeGuard nodeGuard( this->GetNodeOfWorker( 0 ) );
+      if( dynamic )
+        {
+        for( SizeValueType item = 0; item < numberOfItems; item++ )
+          {
+          function( item, item + 1, 0 );
+          }
+        }
+      else if( numberOfItems > 0 )
+        {
+        function( 0, numberOfItems, 0 );
+        }
+      return;
+      }
+    if( dynamic && numberOfItems > NumericTraits<uint32_t>::max() )
+      {
+      itkExceptionMacro(<<"Too many items for the work queues: " << numberOfItems);
+      }
+
+    this->Start();
+    {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    m_JobFunction = const_cast<void *>( static_cast<const void *>( &function ) );
+    m_JobInvoker = []( void * f, SizeValueType begin, SizeValueType end, unsigned int workerId )
+      {
+      ( *static_cast<FunctionType *>( f ) )( begin, end, workerId );
+      };
+    m_JobSize = numberOfItems;
+    m_JobDynamic = dynamic;
+    if( dynamic )
+      {
+      for( unsigned int w = 0; w < m_NumberOfWorkers; w++ )
+        {
+        m_WorkQueues[w].Range.store( PackRange( numberOfItems * w / m_NumberOfWorkers,
+                                                numberOfItems * ( w + 1 ) / m_NumberOfWorkers ),
+                                     std::memory_order_relaxed );
+        }
+      }
+    m_PendingWorkers = m_NumberOfWorkers - 1;
+    m_JobException = nullptr;
+    ++m_Generation;
+    }
+    m_WakeCondition.notify_all();
+
+    {
+    const WorkerNodeGuard nodeGuard( this->GetNodeOfWorker( 0 ) );
+    this->RunRange( 0 );
+    }
+
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_DoneCondition.wait( lock, [this] { return m_PendingWorkers == 0; } );
+    if( m_JobException )
+      {
+      std::exception_ptr exception = m_JobException;
+      m_JobException = nullptr;
+      std::rethrow_exception( exception );
+      }
+  }
+
+  /** Take the item at the front of the queue of a worker. */
+  bool PopItem( unsigned int workerId, SizeValueType & item )
+  {
+    std::atomic<uint64_t> & range = m_WorkQueues[workerId].Range;
+    uint64_t current = range.load( std::memory_order_acquire );
+    for(;;)
+      {
+      const uint64_t front = current >> 32;
+      const uint64_t back = current & 0xffffffffu;
+      if( front >= back )
+        {
+        return false;
+        }
+      if( range.compare_exchange_weak( current, PackRange( front + 1, back ),
+                                       std::memory_order_acq_rel, std::memory_order_acquire ) )
+        {
+        item = front;
+        return true;
+        }
+      }
+  }
+
+  /** Take the back half of the items of another worker. The first item
+   * taken is returned, the others become the queue of the thief, which is
+   * empty at that point. */
+  bool StealItems( unsigned int workerId, SizeValueType & item )
+  {
+    for( unsigned int offset = 1; offset < m_NumberOfWorkers; offset++ )
+      {
+      std::atomic<uint64_t> & victim = m_WorkQueues[( workerId + offset ) % m_NumberOfWorkers].Range;
+      uint64_t current = victim.load( std::memory_order_acquire );
+      for(;;)
+        {
+        const uint64_t front = current >> 32;
+        const uint64_t back = current & 0xffffffffu;
+        if( front >= back )
+          {
+          break;
+          }
+        const uint64_t newBack = back - ( back - front + 1 ) / 2;
+        if( victim.compare_exchange_weak( current, PackRange( front, newBack ),
+                                          std::memory_order_acq_rel, std::memory_order_acquire ) )
+          {
+          item = newBack;
+          m_WorkQueues[workerId].Range.store( PackRange( newBack + 1, back ), std::memory_order_release );
+          return true;
+          }
+        }
+      }
+    return false;
+  }
+
+  void RunRange( unsigned int workerId )
+  {
+    if( m_JobDynamic )
+      {
+      try
+        {
+        SizeValueType item;
+        while( this->PopItem( workerId, item ) || this->StealItems( workerId, item ) )
+          {
+          m_JobInvoker( m_JobFunction, item, item + 1, workerId );
+          }
+        }
+      catch( ... )
+        {
+        std::lock_guard<std::mutex> lock( m_Mutex );
+        if( !m_JobException )
+          {
+          m_JobException = std::current_exception();
+          }
+        }
+      return;
+      }
+
+    const SizeValueType begin = m_JobSize * workerId / m_NumberOfWorkers;
+    const SizeValueType end = m_JobSize * ( workerId + 1 ) / m_NumberOfWorkers;
+    if( begin >= end )
+      {
+      return;
+      }
+    try
+      {
+      m_JobInvoker( m_JobFunction, begin, end, workerId );
+      }
+    catch( ... )
+      {
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      if( !m_JobException )
+        {
+        m_JobException = std::current_exception();
+        }
+      }
+  }
+
+  void WorkerLoop( unsigned int workerId, SizeValueType generation )
+  {
+    if( !m_ProcessorSet.empty() )
+      {
+      PinCurrentThread( m_ProcessorSet[workerId % m_ProcessorSet.size()] );
+      }
+    CurrentWorkerNode() = this->GetNodeOfWorker( workerId );
+
+    for(;;)
+      {
+      {
+      std::unique_lock<std::mutex> lock( m_Mutex );
+      m_WakeCondition.wait( lock, [&] { return m_StopRequested || m_Generation != generation; } );
+      if( m_StopRequested )
+        {
+        return;
+        }
+      generation = m_Generation;
+      }
+
+      this->RunRange( workerId );
+
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      if( --m_PendingWorkers == 0 )
+        {
+        m_DoneCondition.notify_one();
+        }
+      }
+  }
+
+  unsigned int              m_NumberOfWorkers;
+  SizeValueType             m_TileSize;
+  ProcessorSetType          m_ProcessorSet;
+  std::vector<int>          m_ProcessorNodes;
+  std::vector<std::thread>  m_Threads;
+
+  std::mutex                m_Mutex;
+  std::condition_variable   m_WakeCondition;
+  std::condition_variable   m_DoneCondition;
+  bool                      m_StopRequested{ false };
+  SizeValueType             m_Generation{ 0 };
+  unsigned int              m_PendingWorkers{ 0 };
+
+  void *                    m_JobFunction{ nullptr };
+  InvokerType               m_JobInvoker{ nullptr };
+  SizeValueType             m_JobSize{ 0 };
+  bool                      m_JobDynamic{ false };
+  std::unique_ptr<WorkQueue[]> m_WorkQueues;
+  std::exception_ptr        m_JobException;
+};
+
+} // end namespace itk
+
+#endif
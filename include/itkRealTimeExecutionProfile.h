@@ -0,0 +1,311 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRealTimeExecutionProfile_h
+#define itkRealTimeExecutionProfile_h
+
+#include "itkRayCastWorkerPool.h"
+#include "itkLatencyHistogram.h"
+#include "itkNumaTopology.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace itk
+{
+
+/** \class RealTimeExecutionProfile
+ * \brief Execution settings for latency critical registration and DRR loops.
+ *
+ * The profile owns a RayCastWorkerPool whose threads are started once and
+ * optionally pinned to a set of processors. Prepare() pins the calling
+ * thread to the first processor of the set, optionally locks the process
+ * memory and starts the workers. The buffers used per frame can be
+ * pre-faulted with PrefaultImage() so that the first frame does not pay
+ * for page faults.
+ *
+ * Frame latencies are recorded in a LatencyHistogram, which reports the
+ * p50, p99 and maximum latencies without allocating memory.
+ *
+ * On machines with several NUMA nodes, the NumaPolicy places the volume
+ * read by the ray casting loops, see PlaceVolume(): NumaInterleave spreads
+ * its pages over the nodes, NumaReplicate moves it to the first node and
+ * gives every other node a copy, read by the workers pinned to the
+ * processors of that node. In both cases Prepare() spreads the workers
+ * over the nodes when no processor set is given.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class RealTimeExecutionProfile : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(RealTimeExecutionProfile);
+
+  /** Standard class type alias. */
+  using Self = RealTimeExecutionProfile;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RealTimeExecutionProfile, Object);
+
+  using ProcessorSetType = RayCastWorkerPool::ProcessorSetType;
+
+  /** Placement of the volume on the NUMA nodes. */
+  enum NumaPolicyType
+  {
+    NumaDefault,    // Left to the operating system
+    NumaInterleave, // Pages interleaved over the nodes
+    NumaReplicate   // One copy per node
+  };
+
+  /** Set/Get the number of workers of the pool, including the calling
+   * thread. */
+  void SetNumberOfWorkers( unsigned int numberOfWorkers )
+  {
+    m_WorkerPool->SetNumberOfWorkers( numberOfWorkers );
+    this->Modified();
+  }
+  unsigned int GetNumberOfWorkers() const
+  {
+    return m_WorkerPool->GetNumberOfWorkers();
+  }
+
+  /** Set/Get the processors the calling thread and the workers are pinned
+   * to. Empty by default, i.e. no pinning. */
+  void SetProcessorSet( const ProcessorSetType & processors )
+  {
+    m_WorkerPool->SetProcessorSet( processors );
+    this->Modified();
+  }
+  const ProcessorSetType & GetProcessorSet() const
+  {
+    return m_WorkerPool->GetProcessorSet();
+  }
+
+  /** Set/Get whether Prepare() locks the current and future pages of the
+   * process in memory. Requires the corresponding privilege; default is
+   * false. */
+  itkSetMacro( LockMemory, bool );
+  itkGetConstMacro( LockMemory, bool );
+  itkBooleanMacro( LockMemory );
+
+  /** Set/Get the placement of the volume on the NUMA nodes. Default is
+   * NumaDefault. */
+  itkSetMacro( NumaPolicy, NumaPolicyType );
+  itkGetConstMacro( NumaPolicy, NumaPolicyType );
+
+  /** Get the worker pool. */
+  RayCastWorkerPool * GetWorkerPool() const
+  {
+    return m_WorkerPool.GetPointer();
+  }
+
+  /** Spread the workers over the NUMA nodes, alternating between them, if
+   * a NUMA policy is set, no processor set is given and the machine has
+   * several nodes, so that every node has workers to read the pages placed
+   * on it. Called by Prepare(). */
+  void ApplyNumaPolicy()
+  {
+    if( m_NumaPolicy != NumaDefault && m_WorkerPool->GetProcessorSet().empty()
+        && NumaTopology::GetNumberOfNodes() > 1 )
+      {
+      m_WorkerPool->SetProcessorSet( NumaTopology::GetInterleavedProcessorSet() );
+      }
+  }
+
+  /** Pin the calling thread, lock the memory if requested and start the
+   * workers. Returns false if pinning or locking was requested but
+   * failed; the profile remains usable in that case. */
+  bool Prepare()
+  {
+    bool success = true;
+    this->ApplyNumaPolicy();
+    const ProcessorSetType & processors = m_WorkerPool->GetProcessorSet();
+    if( !processors.empty() )
+      {
+      success = RayCastWorkerPool::PinCurrentThread( processors[0] ) && success;
+      }
+    if( m_LockMemory )
+      {
+#if defined(__linux__)
+      success = ( mlockall( MCL_CURRENT | MCL_FUTURE ) == 0 ) && success;
+#else
+      success = false;
+#endif
+      }
+    m_WorkerPool->Start();
+    m_LatencyHistogram.Reset();
+    return success;
+  }
+
+  /** Fault in every page of a buffer so that it is mapped before it is
+   * used. The pages are only read, so that read-only mappings, such as the
+   * prepared volume files, and buffers shared with other threads can be
+   * pre-faulted. Buffers that are written later, like projection images,
+   * are pre-faulted by initializing them instead, e.g. with FillBuffer(). */
+  static void PrefaultBuffer( const void * buffer, std::size_t numberOfBytes )
+  {
+    if( !buffer || numberOfBytes == 0 )
+      {
+      return;
+      }
+    std::size_t pageSize = 4096;
+#if defined(__linux__)
+    const long systemPageSize = sysconf( _SC_PAGESIZE );
+    if( systemPageSize > 0 )
+      {
+      pageSize = static_cast<std::size_t>( systemPageSize );
+      }
+    // Start the read-ahead of file mappings for the whole range at once
+    const std::uintptr_t address = reinterpret_cast<std::uintptr_t>( buffer );
+    const std::uintptr_t begin = address / pageSize * pageSize;
+    madvise( reinterpret_cast<void *>( begin ), address + numberOfBytes - begin, MADV_WILLNEED );
+#endif
+    // Volatile loads, which the compiler cannot remove
+    const volatile char * bytes = static_cast<const volatile char *>( buffer );
+    for( std::size_t offset = 0; offset < numberOfBytes; offset += pageSize )
+      {
+      (void)bytes[offset];
+      }
+    (void)bytes[numberOfBytes - 1];
+  }
+
+  /** Pre-fault the pixel buffer of an image. */
+  template <typename TImage>
+  static void PrefaultImage( const TImage * image )
+  {
+    if( image && image->GetPixelContainer() )
+      {
+      PrefaultBuffer( image->GetBufferPointer(),
+                      image->GetPixelContainer()->Size() * sizeof( typename TImage::PixelType ) );
+      }
+  }
+
+  /** Place the pixels of a volume on the NUMA nodes according to the
+   * NumaPolicy. With NumaInterleave, the pages of the volume are moved in
+   * place. With NumaReplicate, the pages of the volume are moved in place
+   * to the first node, a copy of the volume is allocated on every other
+   * node, and the volume and its copies are returned, indexed by node, for
+   * SiddonJacobsRayCastInterpolateImageFunction::SetVolumeReplicas().
+   * The entries of the node numbers that are not online are null. Nothing
+   * is returned on a machine with a single node, or if the memory
+   * cannot be placed. */
+  template <typename TImage>
+  std::vector< typename TImage::ConstPointer > PlaceVolume( const TImage * volume ) const
+  {
+    std::vector< typename TImage::ConstPointer > replicas;
+    const NumaTopology::NodeSetType nodes = NumaTopology::GetNodes();
+    if( !volume || !volume->GetPixelContainer() || nodes.size() <= 1 )
+      {
+      return replicas;
+      }
+    const SizeValueType numberOfPixels = volume->GetPixelContainer()->Size();
+    const std::size_t numberOfBytes = numberOfPixels * sizeof( typename TImage::PixelType );
+
+    if( m_NumaPolicy == NumaInterleave )
+      {
+      NumaTopology::InterleaveMemory( volume->GetBufferPointer(), numberOfBytes );
+      }
+    else if( m_NumaPolicy == NumaReplicate )
+      {
+      replicas.resize( nodes.back() + 1 );
+      if( !NumaTopology::BindMemory( volume->GetBufferPointer(), numberOfBytes, nodes.front() ) )
+        {
+        replicas.clear();
+        return replicas;
+        }
+      replicas[nodes.front()] = volume;
+      for( unsigned int node : nodes )
+        {
+        if( node == nodes.front() )
+          {
+          continue;
+          }
+        typename TImage::Pointer replica = TImage::New();
+        replica->CopyInformation( volume );
+        replica->SetBufferedRegion( volume->GetBufferedRegion() );
+        replica->Allocate();
+        // The pages are not touched by Allocate(): binding them before the
+        // copy makes the copy fault them in on the node.
+        if( !NumaTopology::BindMemory( replica->GetBufferPointer(), numberOfBytes, node ) )
+          {
+          replicas.clear();
+          return replicas;
+          }
+        std::copy( volume->GetBufferPointer(), volume->GetBufferPointer() + numberOfPixels,
+                   replica->GetBufferPointer() );
+        replicas[node] = replica.GetPointer();
+        }
+      }
+    return replicas;
+  }
+
+  /** Record the latency of a frame, in seconds. */
+  void RecordLatency( double latency )
+  {
+    m_LatencyHistogram.Record( latency );
+  }
+
+  /** Get the histogram of the recorded frame latencies. */
+  const LatencyHistogram & GetLatencyHistogram() const
+  {
+    return m_LatencyHistogram;
+  }
+
+protected:
+  RealTimeExecutionProfile()
+  {
+    m_WorkerPool = RayCastWorkerPool::New();
+    m_LockMemory = false;
+    m_NumaPolicy = NumaDefault;
+  }
+  ~RealTimeExecutionProfile() override {};
+
+  void PrintSelf(std::ostream& os, Indent indent) const override
+  {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "LockMemory: " << m_LockMemory << std::endl;
+    os << indent << "NumaPolicy: " << m_NumaPolicy << std::endl;
+    os << indent << "WorkerPool: " << std::endl;
+    m_WorkerPool->Print( os, indent.GetNextIndent() );
+    os << indent << "Latency: ";
+    m_LatencyHistogram.Print( os );
+    os << std::endl;
+  }
+
+private:
+  RayCastWorkerPool::Pointer m_WorkerPool;
+  bool                       m_LockMemory;
+  NumaPolicyType             m_NumaPolicy;
+  LatencyHistogram           m_LatencyHistogram;
+};
+
+} // end namespace itk
+
+#endif
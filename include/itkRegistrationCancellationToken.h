@@ -0,0 +1,102 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRegistrationCancellationToken_h
+#define itkRegistrationCancellationToken_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMacro.h"
+
+#include <atomic>
+
+namespace itk
+{
+
+/** \class RegistrationCancellationToken
+ * \brief Flag used to cancel a running registration cooperatively.
+ *
+ * Any thread may request the cancellation. The metric polls the token
+ * before every evaluation and between the rows of its ray casting loops,
+ * and aborts the evaluation with a ProcessAborted exception. Polling is
+ * a relaxed atomic load, so the token may be checked from the workers
+ * without synchronization.
+ *
+ * The token does not change the modification time of the object.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class RegistrationCancellationToken : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(RegistrationCancellationToken);
+
+  /** Standard class type alias. */
+  using Self = RegistrationCancellationToken;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RegistrationCancellationToken, Object);
+
+  /** Request the cancellation. May be called from any thread. */
+  void RequestCancellation()
+  {
+    m_CancellationRequested.store( true, std::memory_order_relaxed );
+  }
+
+  /** Clear a previous request. */
+  void Reset()
+  {
+    m_CancellationRequested.store( false, std::memory_order_relaxed );
+  }
+
+  bool IsCancellationRequested() const
+  {
+    return m_CancellationRequested.load( std::memory_order_relaxed );
+  }
+
+  /** Throw a ProcessAborted exception if the cancellation was requested. */
+  void ThrowIfCancellationRequested() const
+  {
+    if( this->IsCancellationRequested() )
+      {
+      throw ProcessAborted( __FILE__, __LINE__ );
+      }
+  }
+
+protected:
+  RegistrationCancellationToken() = default;
+  ~RegistrationCancellationToken() override {};
+
+  void PrintSelf(std::ostream& os, Indent indent) const override
+  {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "CancellationRequested: " << this->IsCancellationRequested() << std::endl;
+  }
+
+private:
+  std::atomic<bool> m_CancellationRequested{ false };
+};
+
+} // end namespace itk
+
+#endif
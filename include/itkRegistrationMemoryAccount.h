@@ -0,0 +1,427 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRegistrationMemoryAccount_h
+#define itkRegistrationMemoryAccount_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkEventObject.h"
+#include "itkIntTypes.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace itk
+{
+
+/** \class RegistrationMemoryAccount
+ * \brief Named allocations of the registration pipeline, with their
+ * current and peak sizes.
+ *
+ * The components of a registration declare what they hold under a name:
+ * the registration method its moving and fixed images, the NUMA replicas
+ * of the moving image and the trace buffers, the metric its gradient
+ * image and the sums of its workers and tiles, the ray casting its
+ * surface mesh and the rays of the slab rendering, and PreparedVolumeCache
+ * its resident volumes. The application may declare its own, e.g. the
+ * outputs of its readers and filters.
+ *
+ * An allocation is keyed by its owner and its name, so that an account
+ * may be shared by the registrations of several patients: the report sums
+ * the allocations of the same name over their owners. Setting an
+ * allocation replaces its previous size; a size of zero removes it. The
+ * account tracks the peak of the total and of every name, and invokes a
+ * MemoryReportEvent after every change, in the thread making it.
+ *
+ * The sizes are those of the buffers, not of the pages actually resident:
+ * a memory mapped prepared volume counts as a whole.
+ *
+ * All methods are thread safe.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class RegistrationMemoryAccount : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(RegistrationMemoryAccount);
+
+  /** Standard class type alias. */
+  using Self = RegistrationMemoryAccount;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RegistrationMemoryAccount, Object);
+
+  /** The allocations of a name, summed over their owners. */
+  struct AllocationRecord
+  {
+    std::string   Name;
+    SizeValueType Bytes;
+    SizeValueType PeakBytes;
+    SizeValueType NumberOfOwners;
+  };
+  using ReportType = std::vector<AllocationRecord>;
+
+  /** Set the size of the allocation of an owner under a name. */
+  void SetAllocation( const void * owner, const std::string & name, SizeValueType bytes );
+
+  /** Remove all the allocations of an owner, e.g. on its destruction. */
+  void ReleaseAllocations( const void * owner );
+
+  /** Get the total size of the allocations, and its peak. */
+  SizeValueType GetTotalBytes() const
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    return m_TotalBytes;
+  }
+  SizeValueType GetPeakBytes() const
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    return m_PeakBytes;
+  }
+
+  /** Get the size of the allocations of a name, summed over their
+   * owners. */
+  SizeValueType GetBytes( const std::string & name ) const
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    auto found = m_Names.find( name );
+    return found != m_Names.end() ? found->second.Bytes : 0;
+  }
+
+  /** Get the allocations by name, the largest first. Names whose
+   * allocations were all removed are kept with their peak. */
+  ReportType GetReport() const;
+
+  /** Print the report as a table, with the total and its peak. */
+  void Report( std::ostream & os ) const;
+
+  /** Restart the peaks from the current sizes. */
+  void ResetPeaks();
+
+  /** Size of the buffer of an image, 0 for no image. */
+  template <typename TImage>
+  static SizeValueType GetImageBytes( const TImage * image )
+  {
+    if( !image || !image->GetPixelContainer() )
+      {
+      return 0;
+      }
+    return static_cast<SizeValueType>( image->GetPixelContainer()->Size() ) * sizeof( typename TImage::PixelType );
+  }
+
+  /** Size of the elements of a vector, including its unused capacity. */
+  template <typename TValue>
+  static SizeValueType GetVectorBytes( const std::vector<TValue> & values )
+  {
+    return static_cast<SizeValueType>( values.capacity() ) * sizeof( TValue );
+  }
+
+protected:
+  RegistrationMemoryAccount()
+    : m_TotalBytes( 0 ), m_PeakBytes( 0 )
+  {}
+  ~RegistrationMemoryAccount() override {};
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  struct NameRecord
+  {
+    SizeValueType Bytes{ 0 };
+    SizeValueType PeakBytes{ 0 };
+    SizeValueType NumberOfOwners{ 0 };
+  };
+
+  /** Invoke a MemoryReportEvent, without the lock. */
+  void InvokeReportEvent( SizeValueType totalBytes, SizeValueType peakBytes );
+
+  mutable std::mutex                                                m_Mutex;
+  std::map< std::pair< const void *, std::string >, SizeValueType > m_Allocations;
+  std::map< std::string, NameRecord >                               m_Names;
+  SizeValueType                                                     m_TotalBytes;
+  SizeValueType                                                     m_PeakBytes;
+};
+
+
+/** \class MemoryReportEvent
+ * \brief Event invoked by a RegistrationMemoryAccount after every change of
+ * its allocations, carrying the total size and its peak.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class MemoryReportEvent : public AnyEvent
+{
+public:
+  using Self = MemoryReportEvent;
+  using Superclass = AnyEvent;
+
+  MemoryReportEvent() = default;
+
+  MemoryReportEvent( SizeValueType totalBytes, SizeValueType peakBytes )
+    : m_TotalBytes( totalBytes ), m_PeakBytes( peakBytes )
+  {}
+
+  MemoryReportEvent( const Self & s ) : AnyEvent( s ),
+    m_TotalBytes( s.m_TotalBytes ), m_PeakBytes( s.m_PeakBytes )
+  {}
+
+  ~MemoryReportEvent() override {}
+
+  const char * GetEventName() const override
+  {
+    return "MemoryReportEvent";
+  }
+
+  bool CheckEvent( const EventObject * e ) const override
+  {
+    return dynamic_cast< const Self * >( e ) != nullptr;
+  }
+
+  EventObject * MakeObject() const override
+  {
+    return new Self( *this );
+  }
+
+  SizeValueType GetTotalBytes() const
+  {
+    return m_TotalBytes;
+  }
+
+  SizeValueType GetPeakBytes() const
+  {
+    return m_PeakBytes;
+  }
+
+private:
+  void operator=( const Self & ) = delete;
+
+  SizeValueType m_TotalBytes{ 0 };
+  SizeValueType m_PeakBytes{ 0 };
+};
+
+
+/** \class MemoryAllocationScope
+ * \brief Scoped allocation of a RegistrationMemoryAccount, for the
+ * buffers living in a function: the allocation is removed at the end of
+ * the scope, also when an exception leaves it.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class MemoryAllocationScope
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(MemoryAllocationScope);
+
+  MemoryAllocationScope( RegistrationMemoryAccount * account, const void * owner, const char * name,
+                         SizeValueType bytes = 0 )
+    : m_Account( account ), m_Owner( owner ), m_Name( name )
+  {
+    this->SetBytes( bytes );
+  }
+
+  ~MemoryAllocationScope()
+  {
+    this->SetBytes( 0 );
+  }
+
+  /** Change the size of the allocation. */
+  void SetBytes( SizeValueType bytes )
+  {
+    if( m_Account )
+      {
+      m_Account->SetAllocation( m_Owner, m_Name, bytes );
+      }
+  }
+
+private:
+  RegistrationMemoryAccount * m_Account;
+  const void *                m_Owner;
+  const char *                m_Name;
+};
+
+
+inline void
+RegistrationMemoryAccount
+::SetAllocation( const void * owner, const std::string & name, SizeValueType bytes )
+{
+  SizeValueType totalBytes;
+  SizeValueType peakBytes;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  const auto key = std::make_pair( owner, name );
+  auto found = m_Allocations.find( key );
+  const SizeValueType previousBytes = found != m_Allocations.end() ? found->second : 0;
+  if( found == m_Allocations.end() && bytes == 0 )
+    {
+    return;
+    }
+
+  NameRecord & record = m_Names[name];
+  if( found == m_Allocations.end() )
+    {
+    m_Allocations.emplace( key, bytes );
+    record.NumberOfOwners++;
+    }
+  else if( bytes == 0 )
+    {
+    m_Allocations.erase( found );
+    record.NumberOfOwners--;
+    }
+  else
+    {
+    found->second = bytes;
+    }
+
+  record.Bytes = record.Bytes - previousBytes + bytes;
+  record.PeakBytes = std::max( record.PeakBytes, record.Bytes );
+  m_TotalBytes = m_TotalBytes - previousBytes + bytes;
+  m_PeakBytes = std::max( m_PeakBytes, m_TotalBytes );
+  totalBytes = m_TotalBytes;
+  peakBytes = m_PeakBytes;
+  }
+  this->InvokeReportEvent( totalBytes, peakBytes );
+}
+
+
+inline void
+RegistrationMemoryAccount
+::ReleaseAllocations( const void * owner )
+{
+  SizeValueType totalBytes;
+  SizeValueType peakBytes;
+  bool released = false;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  auto allocation = m_Allocations.lower_bound( std::make_pair( owner, std::string() ) );
+  while( allocation != m_Allocations.end() && allocation->first.first == owner )
+    {
+    NameRecord & record = m_Names[allocation->first.second];
+    record.Bytes -= allocation->second;
+    record.NumberOfOwners--;
+    m_TotalBytes -= allocation->second;
+    allocation = m_Allocations.erase( allocation );
+    released = true;
+    }
+  totalBytes = m_TotalBytes;
+  peakBytes = m_PeakBytes;
+  }
+  if( released )
+    {
+    this->InvokeReportEvent( totalBytes, peakBytes );
+    }
+}
+
+
+inline RegistrationMemoryAccount::ReportType
+RegistrationMemoryAccount
+::GetReport() const
+{
+  ReportType report;
+  {
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  for( const auto & name : m_Names )
+    {
+    report.push_back( AllocationRecord{ name.first, name.second.Bytes,
+                                        name.second.PeakBytes, name.second.NumberOfOwners } );
+    }
+  }
+  std::stable_sort( report.begin(), report.end(),
+    []( const AllocationRecord & a, const AllocationRecord & b )
+    {
+    return a.Bytes != b.Bytes ? a.Bytes > b.Bytes : a.PeakBytes > b.PeakBytes;
+    } );
+  return report;
+}
+
+
+inline void
+RegistrationMemoryAccount
+::Report( std::ostream & os ) const
+{
+  const ReportType report = this->GetReport();
+  const std::ios::fmtflags flags = os.flags();
+  const std::streamsize precision = os.precision();
+  os.setf( std::ios::fixed, std::ios::floatfield );
+  os.precision( 2 );
+
+  constexpr double MiB = 1024.0 * 1024.0;
+  os << std::left << std::setw( 32 ) << "Allocation" << std::right
+     << std::setw( 12 ) << "MiB" << std::setw( 12 ) << "Peak MiB" << std::setw( 8 ) << "Owners" << std::endl;
+  for( const AllocationRecord & record : report )
+    {
+    os << std::left << std::setw( 32 ) << record.Name << std::right
+       << std::setw( 12 ) << record.Bytes / MiB << std::setw( 12 ) << record.PeakBytes / MiB
+       << std::setw( 8 ) << record.NumberOfOwners << std::endl;
+    }
+  os << std::left << std::setw( 32 ) << "Total" << std::right
+     << std::setw( 12 ) << this->GetTotalBytes() / MiB << std::setw( 12 ) << this->GetPeakBytes() / MiB << std::endl;
+
+  os.flags( flags );
+  os.precision( precision );
+}
+
+
+inline void
+RegistrationMemoryAccount
+::ResetPeaks()
+{
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  for( auto & name : m_Names )
+    {
+    name.second.PeakBytes = name.second.Bytes;
+    }
+  m_PeakBytes = m_TotalBytes;
+}
+
+
+inline void
+RegistrationMemoryAccount
+::InvokeReportEvent( SizeValueType totalBytes, SizeValueType peakBytes )
+{
+  this->InvokeEvent( MemoryReportEvent( totalBytes, peakBytes ) );
+}
+
+
+inline void
+RegistrationMemoryAccount
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "TotalBytes: " << this->GetTotalBytes() << std::endl;
+  os << indent << "PeakBytes: " << this->GetPeakBytes() << std::endl;
+  for( const AllocationRecord & record : this->GetReport() )
+    {
+    os << indent << "  " << record.Name << ": " << record.Bytes
+       << " (peak " << record.PeakBytes << ")" << std::endl;
+    }
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,538 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRegistrationPerformanceCounters_h
+#define itkRegistrationPerformanceCounters_h
+
+#include "itkTwoProjectionRegistrationConfigure.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkEventObject.h"
+#include "itkIntTypes.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <type_traits>
+
+namespace itk
+{
+
+/** \class PerformanceCounterSnapshot
+ * \brief Values of the performance counters of a registration at a point
+ * in time.
+ *
+ * The times are summed over the threads: with several workers they exceed
+ * the wall time.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+struct PerformanceCounterSnapshot
+{
+  uint64_t RaysCast{ 0 };
+  uint64_t RaysMissed{ 0 };           // Rays crossing no voxel of the volume
+  uint64_t VoxelsVisited{ 0 };
+  uint64_t VoxelsAboveThreshold{ 0 };
+  uint64_t MetricEvaluations{ 0 };
+  uint64_t PixelsCounted{ 0 };        // Fixed image pixels summed by the metric
+  double   RaySetupSeconds{ 0.0 };    // Update of the ray setup for a new pose
+  double   TraversalSeconds{ 0.0 };   // Casting of the rays, by tile
+  double   ReductionSeconds{ 0.0 };   // Combination of the sums of the metric
+
+  PerformanceCounterSnapshot & operator+=( const PerformanceCounterSnapshot & other )
+  {
+    RaysCast += other.RaysCast;
+    RaysMissed += other.RaysMissed;
+    VoxelsVisited += other.VoxelsVisited;
+    VoxelsAboveThreshold += other.VoxelsAboveThreshold;
+    MetricEvaluations += other.MetricEvaluations;
+    PixelsCounted += other.PixelsCounted;
+    RaySetupSeconds += other.RaySetupSeconds;
+    TraversalSeconds += other.TraversalSeconds;
+    ReductionSeconds += other.ReductionSeconds;
+    return *this;
+  }
+
+  /** Counts between an earlier snapshot and this one. */
+  PerformanceCounterSnapshot operator-( const PerformanceCounterSnapshot & earlier ) const
+  {
+    PerformanceCounterSnapshot difference;
+    difference.RaysCast = RaysCast - earlier.RaysCast;
+    difference.RaysMissed = RaysMissed - earlier.RaysMissed;
+    difference.VoxelsVisited = VoxelsVisited - earlier.VoxelsVisited;
+    difference.VoxelsAboveThreshold = VoxelsAboveThreshold - earlier.VoxelsAboveThreshold;
+    difference.MetricEvaluations = MetricEvaluations - earlier.MetricEvaluations;
+    difference.PixelsCounted = PixelsCounted - earlier.PixelsCounted;
+    difference.RaySetupSeconds = RaySetupSeconds - earlier.RaySetupSeconds;
+    difference.TraversalSeconds = TraversalSeconds - earlier.TraversalSeconds;
+    difference.ReductionSeconds = ReductionSeconds - earlier.ReductionSeconds;
+    return difference;
+  }
+
+  void Print( std::ostream & os, Indent indent = Indent() ) const
+  {
+    os << indent << "RaysCast: " << RaysCast << std::endl;
+    os << indent << "RaysMissed: " << RaysMissed << std::endl;
+    os << indent << "VoxelsVisited: " << VoxelsVisited << std::endl;
+    os << indent << "VoxelsAboveThreshold: " << VoxelsAboveThreshold << std::endl;
+    os << indent << "MetricEvaluations: " << MetricEvaluations << std::endl;
+    os << indent << "PixelsCounted: " << PixelsCounted << std::endl;
+    os << indent << "RaySetupSeconds: " << RaySetupSeconds << std::endl;
+    os << indent << "TraversalSeconds: " << TraversalSeconds << std::endl;
+    os << indent << "ReductionSeconds: " << ReductionSeconds << std::endl;
+  }
+};
+
+
+/** \class PerformanceCounterBuffer
+ * \brief Counts of one thread, gathered locally and flushed at once into
+ * RegistrationPerformanceCounters.
+ *
+ * The counting code of the ray casting and of the metric only exists when
+ * ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS is defined in
+ * itkTwoProjectionRegistrationConfigure.h, by the CMake option
+ * TwoProjectionRegistration_USE_PERFORMANCE_COUNTERS. Otherwise the
+ * buffer, the timers and the counting accumulator are empty and compile
+ * to nothing.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class PerformanceCounterBuffer
+{
+public:
+  enum CounterType
+    {
+    RaysCast = 0,
+    RaysMissed,
+    VoxelsVisited,
+    VoxelsAboveThreshold,
+    MetricEvaluations,
+    PixelsCounted,
+    RaySetupTime,   // nanoseconds
+    TraversalTime,  // nanoseconds
+    ReductionTime,  // nanoseconds
+    NumberOfCounters
+    };
+
+#if defined(ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS)
+  static constexpr bool Enabled = true;
+
+  void Add( CounterType counter, uint64_t value )
+  {
+    m_Values[counter] += value;
+  }
+
+  uint64_t Get( CounterType counter ) const
+  {
+    return m_Values[counter];
+  }
+
+  void Clear()
+  {
+    for( uint64_t & value : m_Values )
+      {
+      value = 0;
+      }
+  }
+
+  /** Count a ray cast with a CountingRayAccumulator, or with another
+   * accumulator whose voxels are not counted. */
+  template <typename TAccumulator>
+  void CountRay( const TAccumulator & accumulator );
+
+private:
+  uint64_t m_Values[NumberOfCounters]{};
+#else
+  static constexpr bool Enabled = false;
+
+  void Add( CounterType, uint64_t ) {}
+
+  uint64_t Get( CounterType ) const
+  {
+    return 0;
+  }
+
+  void Clear() {}
+
+  template <typename TAccumulator>
+  void CountRay( const TAccumulator & ) {}
+#endif
+};
+
+
+/** \class PerformanceCounterTimer
+ * \brief Add the time between its construction and its destruction to a
+ * time counter of a buffer.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class PerformanceCounterTimer
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(PerformanceCounterTimer);
+
+#if defined(ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS)
+  PerformanceCounterTimer( PerformanceCounterBuffer & buffer, PerformanceCounterBuffer::CounterType counter )
+    : m_Buffer( buffer ), m_Counter( counter ), m_Start( std::chrono::steady_clock::now() )
+  {}
+
+  ~PerformanceCounterTimer()
+  {
+    const auto elapsed = std::chrono::steady_clock::now() - m_Start;
+    m_Buffer.Add( m_Counter,
+                  static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() ) );
+  }
+
+private:
+  PerformanceCounterBuffer &                  m_Buffer;
+  PerformanceCounterBuffer::CounterType       m_Counter;
+  std::chrono::steady_clock::time_point       m_Start;
+#else
+  PerformanceCounterTimer( PerformanceCounterBuffer &, PerformanceCounterBuffer::CounterType ) {}
+#endif
+};
+
+
+/** \class CountingRayAccumulator
+ * \brief Accumulator counting the voxels a ray visits, and those above a
+ * threshold, for another accumulator.
+ *
+ * The voxels of multi-channel volumes all count as above the threshold.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TAccumulator>
+class CountingRayAccumulator
+{
+public:
+  using AccumulatorType = TAccumulator;
+  using ValueType = typename AccumulatorType::ValueType;
+  using ResultType = typename AccumulatorType::ResultType;
+
+  CountingRayAccumulator() = default;
+
+  CountingRayAccumulator( const AccumulatorType & accumulator, double threshold )
+    : m_Accumulator( accumulator ), m_Threshold( threshold )
+  {}
+
+  template <typename TLength, typename TValue>
+  void Add( TLength length, const TValue & value )
+  {
+    m_VoxelsVisited++;
+    m_VoxelsAboveThreshold += IsAboveThreshold( value ) ? 1 : 0;
+    m_Accumulator.Add( length, value );
+  }
+
+  ResultType GetResult() const
+  {
+    return m_Accumulator.GetResult();
+  }
+
+  uint32_t GetVoxelsVisited() const
+  {
+    return m_VoxelsVisited;
+  }
+
+  uint32_t GetVoxelsAboveThreshold() const
+  {
+    return m_VoxelsAboveThreshold;
+  }
+
+private:
+  template <typename TValue>
+  typename std::enable_if< std::is_arithmetic<TValue>::value, bool >::type
+  IsAboveThreshold( const TValue & value ) const
+  {
+    return value > m_Threshold;
+  }
+
+  template <typename TValue>
+  typename std::enable_if< !std::is_arithmetic<TValue>::value, bool >::type
+  IsAboveThreshold( const TValue & ) const
+  {
+    return true;
+  }
+
+  AccumulatorType m_Accumulator;
+  double          m_Threshold{ 0.0 };
+  uint32_t        m_VoxelsVisited{ 0 };
+  uint32_t        m_VoxelsAboveThreshold{ 0 };
+};
+
+
+#if defined(ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS)
+namespace PerformanceCounterDetail
+{
+template <typename TAccumulator>
+inline void CountRay( PerformanceCounterBuffer & buffer, const TAccumulator & )
+{
+  buffer.Add( PerformanceCounterBuffer::RaysCast, 1 );
+}
+
+template <typename TAccumulator>
+inline void CountRay( PerformanceCounterBuffer & buffer, const CountingRayAccumulator<TAccumulator> & accumulator )
+{
+  buffer.Add( PerformanceCounterBuffer::RaysCast, 1 );
+  buffer.Add( PerformanceCounterBuffer::RaysMissed, accumulator.GetVoxelsVisited() == 0 ? 1 : 0 );
+  buffer.Add( PerformanceCounterBuffer::VoxelsVisited, accumulator.GetVoxelsVisited() );
+  buffer.Add( PerformanceCounterBuffer::VoxelsAboveThreshold, accumulator.GetVoxelsAboveThreshold() );
+}
+} // end namespace PerformanceCounterDetail
+
+template <typename TAccumulator>
+inline void
+PerformanceCounterBuffer::CountRay( const TAccumulator & accumulator )
+{
+  PerformanceCounterDetail::CountRay( *this, accumulator );
+}
+
+/** The accumulator the rays are cast with: it counts the voxels when the
+ * counters are enabled, and is TAccumulator otherwise. */
+template <typename TAccumulator>
+using CountedRayAccumulator = CountingRayAccumulator<TAccumulator>;
+
+template <typename TAccumulator>
+inline CountedRayAccumulator<TAccumulator>
+MakeCountedRayAccumulator( const TAccumulator & accumulator, double threshold )
+{
+  return CountingRayAccumulator<TAccumulator>( accumulator, threshold );
+}
+#else
+template <typename TAccumulator>
+using CountedRayAccumulator = TAccumulator;
+
+template <typename TAccumulator>
+inline CountedRayAccumulator<TAccumulator>
+MakeCountedRayAccumulator( const TAccumulator & accumulator, double )
+{
+  return accumulator;
+}
+#endif
+
+
+/** \class RegistrationPerformanceCounters
+ * \brief Performance counters shared by the interpolators and the metric
+ * of a registration.
+ *
+ * The counts are kept per thread: every thread adds its buffers into its
+ * own slot with relaxed atomic additions, so the workers do not contend
+ * for the counters, and GetSnapshot() sums the slots on demand. The ray
+ * casting flushes its buffer once per tile of a projection, or once per
+ * ray for Evaluate(); the metric once per tile and per evaluation.
+ *
+ * TwoProjectionImageRegistrationMethod connects its counters to the metric
+ * and to the interpolators of type
+ * SiddonJacobsRayCastInterpolateImageFunction, and invokes a
+ * PerformanceCountersEvent after every optimizer iteration. The rays of
+ * the surface mesh of MeshRayCastInterpolateImageFunction are not counted.
+ *
+ * When ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS is not defined, the object
+ * holds no counters and the snapshots are zero.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class RegistrationPerformanceCounters : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(RegistrationPerformanceCounters);
+
+  /** Standard class type alias. */
+  using Self = RegistrationPerformanceCounters;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RegistrationPerformanceCounters, Object);
+
+  /** Whether the counters were compiled in. */
+  static constexpr bool Enabled = PerformanceCounterBuffer::Enabled;
+
+#if defined(ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS)
+  /** Add the counts of a buffer to the slot of the calling thread and
+   * clear the buffer. May be called from any thread. */
+  void Flush( PerformanceCounterBuffer & buffer )
+  {
+    Slot & slot = m_Slots[GetThreadSlot()];
+    for( unsigned int c = 0; c < PerformanceCounterBuffer::NumberOfCounters; c++ )
+      {
+      const uint64_t value = buffer.Get( static_cast<PerformanceCounterBuffer::CounterType>( c ) );
+      if( value )
+        {
+        slot.Values[c].fetch_add( value, std::memory_order_relaxed );
+        }
+      }
+    buffer.Clear();
+  }
+
+  /** Sum the slots of all the threads. The counts being flushed while the
+   * snapshot is taken may or may not be included. */
+  PerformanceCounterSnapshot GetSnapshot() const
+  {
+    uint64_t values[PerformanceCounterBuffer::NumberOfCounters] = {};
+    for( unsigned int s = 0; s < NumberOfSlots; s++ )
+      {
+      for( unsigned int c = 0; c < PerformanceCounterBuffer::NumberOfCounters; c++ )
+        {
+        values[c] += m_Slots[s].Values[c].load( std::memory_order_relaxed );
+        }
+      }
+    PerformanceCounterSnapshot snapshot;
+    snapshot.RaysCast = values[PerformanceCounterBuffer::RaysCast];
+    snapshot.RaysMissed = values[PerformanceCounterBuffer::RaysMissed];
+    snapshot.VoxelsVisited = values[PerformanceCounterBuffer::VoxelsVisited];
+    snapshot.VoxelsAboveThreshold = values[PerformanceCounterBuffer::VoxelsAboveThreshold];
+    snapshot.MetricEvaluations = values[PerformanceCounterBuffer::MetricEvaluations];
+    snapshot.PixelsCounted = values[PerformanceCounterBuffer::PixelsCounted];
+    snapshot.RaySetupSeconds = 1e-9 * values[PerformanceCounterBuffer::RaySetupTime];
+    snapshot.TraversalSeconds = 1e-9 * values[PerformanceCounterBuffer::TraversalTime];
+    snapshot.ReductionSeconds = 1e-9 * values[PerformanceCounterBuffer::ReductionTime];
+    return snapshot;
+  }
+
+  /** Set all the counters to zero. */
+  void Reset()
+  {
+    for( unsigned int s = 0; s < NumberOfSlots; s++ )
+      {
+      for( std::atomic<uint64_t> & value : m_Slots[s].Values )
+        {
+        value.store( 0, std::memory_order_relaxed );
+        }
+      }
+  }
+#else
+  void Flush( PerformanceCounterBuffer & ) {}
+
+  PerformanceCounterSnapshot GetSnapshot() const
+  {
+    return PerformanceCounterSnapshot();
+  }
+
+  void Reset() {}
+#endif
+
+protected:
+  RegistrationPerformanceCounters()
+  {
+#if defined(ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS)
+    m_Slots.reset( new Slot[NumberOfSlots] );
+    this->Reset();
+#endif
+  }
+  ~RegistrationPerformanceCounters() override {};
+
+  void PrintSelf(std::ostream& os, Indent indent) const override
+  {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "Enabled: " << Enabled << std::endl;
+    this->GetSnapshot().Print( os, indent );
+  }
+
+#if defined(ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS)
+private:
+  // The threads are spread over a fixed number of slots; threads sharing
+  // a slot only share its cache lines
+  static constexpr unsigned int NumberOfSlots = 64;
+
+  struct Slot
+  {
+    std::atomic<uint64_t> Values[PerformanceCounterBuffer::NumberOfCounters];
+    uint64_t              Padding[16 - PerformanceCounterBuffer::NumberOfCounters];
+  };
+
+  static unsigned int GetThreadSlot()
+  {
+    static std::atomic<unsigned int> nextSlot{ 0 };
+    thread_local const unsigned int slot = nextSlot++ % NumberOfSlots;
+    return slot;
+  }
+
+  std::unique_ptr<Slot[]> m_Slots;
+#endif
+};
+
+
+/** \class PerformanceCountersEvent
+ * \brief Event carrying a snapshot of the performance counters of a
+ * registration, invoked by TwoProjectionImageRegistrationMethod after
+ * every optimizer iteration when the counters are enabled.
+ *
+ * The snapshot counts from the start of the registration, or of the
+ * tracking, to the end of the iteration.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class PerformanceCountersEvent : public AnyEvent
+{
+public:
+  using Self = PerformanceCountersEvent;
+  using Superclass = AnyEvent;
+
+  PerformanceCountersEvent() = default;
+
+  PerformanceCountersEvent( SizeValueType iteration, const PerformanceCounterSnapshot & snapshot )
+    : m_Iteration( iteration ), m_Snapshot( snapshot )
+  {}
+
+  PerformanceCountersEvent( const Self & s ) : AnyEvent( s ),
+    m_Iteration( s.m_Iteration ), m_Snapshot( s.m_Snapshot )
+  {}
+
+  ~PerformanceCountersEvent() override {}
+
+  const char * GetEventName() const override
+  {
+    return "PerformanceCountersEvent";
+  }
+
+  bool CheckEvent( const EventObject * e ) const override
+  {
+    return dynamic_cast< const Self * >( e ) != nullptr;
+  }
+
+  EventObject * MakeObject() const override
+  {
+    return new Self( *this );
+  }
+
+  /** Iteration of the optimizer, counted from 1. */
+  SizeValueType GetIteration() const
+  {
+    return m_Iteration;
+  }
+
+  const PerformanceCounterSnapshot & GetSnapshot() const
+  {
+    return m_Snapshot;
+  }
+
+private:
+  void operator=( const Self & ) = delete;
+
+  SizeValueType              m_Iteration{ 0 };
+  PerformanceCounterSnapshot m_Snapshot;
+};
+
+} // end namespace itk
+
+#endif
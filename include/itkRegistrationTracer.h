@@ -0,0 +1,430 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkRegistrationTracer_h
+#define itkRegistrationTracer_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkIntTypes.h"
+#include "itkNumericTraits.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace itk
+{
+
+/** \class RegistrationTracer
+ * \brief Timeline of the spans of a registration, written as trace events
+ * loadable in chrome://tracing or Perfetto.
+ *
+ * The registration method, the metric and the ray casting open a TraceSpan
+ * around their steps: the initialization and the gradient filter, every
+ * evaluation of the metric and of each of its views, the ray setup, the
+ * projections and every tile of the workers. The registration method also
+ * marks the optimizer iterations with instant events, so that the time
+ * the optimizer spends between two evaluations shows as a gap.
+ *
+ * Every thread records its spans into its own ring buffer, without locks:
+ * a thread only takes a mutex to find its buffer the first time it
+ * records into a tracer. When a buffer is full the oldest events of the
+ * thread are overwritten, and counted by GetNumberOfDroppedEvents().
+ *
+ * The tracer is disabled by default. A disabled tracer costs every span a
+ * single test of a flag that does not change during the registration,
+ * and records nothing. Clear() and WriteTraceEvents() must not run while
+ * spans are being recorded: disable the tracer first, e.g. after the
+ * registration. Both throw while the tracer is enabled or a span is still
+ * open.
+ *
+ * The names of the spans must be string literals: only their pointers are
+ * recorded.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class RegistrationTracer : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(RegistrationTracer);
+
+  /** Standard class type alias. */
+  using Self = RegistrationTracer;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(RegistrationTracer, Object);
+
+  /** An event of the timeline. The times are in nanoseconds from the
+   * creation, or the last Clear(), of the tracer. */
+  struct TraceEvent
+  {
+    const char * Name;
+    const char * Category;
+    int64_t      Start;
+    int64_t      Duration;      // Negative for an instant event
+    const char * ArgumentName;  // nullptr when the event has no argument
+    int64_t      Argument;
+  };
+
+  /** Set/Get whether the spans are recorded. Default is false. */
+  void SetEnabled( bool enabled )
+  {
+    m_Enabled.store( enabled, std::memory_order_relaxed );
+  }
+  bool GetEnabled() const
+  {
+    return m_Enabled.load( std::memory_order_relaxed );
+  }
+  itkBooleanMacro( Enabled );
+
+  /** Set/Get the capacity of the ring buffer of every thread, in events.
+   * Only the buffers of the threads that record for the first time
+   * afterwards have the new capacity. Default is 65536. */
+  itkSetClampMacro( EventsPerThread, SizeValueType, 1, NumericTraits<SizeValueType>::max() );
+  itkGetConstMacro( EventsPerThread, SizeValueType );
+
+  /** Nanoseconds since the creation, or the last Clear(), of the tracer. */
+  int64_t Now() const
+  {
+    return ClockNanoseconds() - m_Epoch.load( std::memory_order_relaxed );
+  }
+
+  /** Record an event into the ring buffer of the calling thread. */
+  void Record( const TraceEvent & event )
+  {
+    RecordInto( this->GetThreadBuffer(), event );
+  }
+
+  /** Open and close a span of the calling thread, see TraceSpan. Closing
+   * records the span. */
+  void OpenSpan()
+  {
+    ThreadBuffer & buffer = this->GetThreadBuffer();
+    buffer.OpenSpans.store( buffer.OpenSpans.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+  }
+  void CloseSpan( const TraceEvent & event )
+  {
+    ThreadBuffer & buffer = this->GetThreadBuffer();
+    RecordInto( buffer, event );
+    buffer.OpenSpans.store( buffer.OpenSpans.load( std::memory_order_relaxed ) - 1, std::memory_order_release );
+  }
+
+  /** Record an instant event, e.g. an optimizer iteration, if enabled. */
+  void Mark( const char * name, const char * category,
+             const char * argumentName = nullptr, int64_t argument = 0 )
+  {
+    if( this->GetEnabled() )
+      {
+      this->Record( TraceEvent{ name, category, this->Now(), -1, argumentName, argument } );
+      }
+  }
+
+  /** Number of events held by the buffers, and number of events
+   * overwritten by newer ones. */
+  SizeValueType GetNumberOfEvents() const
+  {
+    SizeValueType events = 0;
+    std::lock_guard<std::mutex> lock( m_BuffersMutex );
+    for( const auto & buffer : m_Buffers )
+      {
+      const uint64_t written = buffer->Written.load( std::memory_order_acquire );
+      events += static_cast<SizeValueType>( std::min<uint64_t>( written, buffer->Capacity ) );
+      }
+    return events;
+  }
+  SizeValueType GetNumberOfDroppedEvents() const
+  {
+    SizeValueType dropped = 0;
+    std::lock_guard<std::mutex> lock( m_BuffersMutex );
+    for( const auto & buffer : m_Buffers )
+      {
+      const uint64_t written = buffer->Written.load( std::memory_order_acquire );
+      dropped += static_cast<SizeValueType>( written > buffer->Capacity ? written - buffer->Capacity : 0 );
+      }
+    return dropped;
+  }
+
+  /** Size of the buffers of all the threads, in bytes. */
+  SizeValueType GetMemorySize() const
+  {
+    SizeValueType bytes = 0;
+    std::lock_guard<std::mutex> lock( m_BuffersMutex );
+    for( const auto & buffer : m_Buffers )
+      {
+      bytes += buffer->Capacity * sizeof( TraceEvent );
+      }
+    return bytes;
+  }
+
+  /** Empty the buffers of all the threads and restart the clock. The
+   * buffers are kept, since the threads cache a pointer to theirs. Throws
+   * while spans are being recorded. */
+  void Clear()
+  {
+    std::lock_guard<std::mutex> lock( m_BuffersMutex );
+    this->CheckNotRecording( "Clear" );
+    for( const auto & buffer : m_Buffers )
+      {
+      buffer->Written.store( 0, std::memory_order_relaxed );
+      }
+    m_Epoch.store( ClockNanoseconds(), std::memory_order_relaxed );
+  }
+
+  /** Write the events in the JSON trace event format, one track per
+   * thread, the oldest events first. A thread that records while its ring
+   * buffer wraps around overwrites the events being written, so this
+   * throws while spans are being recorded, as Clear() does. */
+  void WriteTraceEvents( std::ostream & os ) const
+  {
+    std::lock_guard<std::mutex> lock( m_BuffersMutex );
+    this->CheckNotRecording( "WriteTraceEvents" );
+
+    const std::ios::fmtflags flags = os.flags();
+    const std::streamsize precision = os.precision();
+    os.setf( std::ios::fixed, std::ios::floatfield );
+    os.precision( 3 );
+
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+       << "\"args\":{\"name\":\"TwoProjectionRegistration\"}}";
+    for( const auto & buffer : m_Buffers )
+      {
+      os << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->Id
+         << ",\"args\":{\"name\":\"thread " << buffer->Id << "\"}}";
+
+      const uint64_t written = buffer->Written.load( std::memory_order_acquire );
+      const uint64_t first = written > buffer->Capacity ? written - buffer->Capacity : 0;
+      for( uint64_t e = first; e < written; e++ )
+        {
+        const TraceEvent & event = buffer->Events[e % buffer->Capacity];
+        os << ",\n{\"name\":\"" << event.Name << "\",\"cat\":\"" << event.Category << "\"";
+        if( event.Duration < 0 )
+          {
+          os << ",\"ph\":\"i\",\"s\":\"t\"";
+          }
+        else
+          {
+          os << ",\"ph\":\"X\",\"dur\":" << 1e-3 * event.Duration;
+          }
+        os << ",\"ts\":" << 1e-3 * event.Start << ",\"pid\":1,\"tid\":" << buffer->Id;
+        if( event.ArgumentName )
+          {
+          os << ",\"args\":{\"" << event.ArgumentName << "\":" << event.Argument << "}";
+          }
+        os << "}";
+        }
+      }
+    os << "\n]}\n";
+
+    os.flags( flags );
+    os.precision( precision );
+  }
+
+  /** Write the events to a file, see WriteTraceEvents(std::ostream &). */
+  void WriteTraceEvents( const std::string & fileName ) const
+  {
+    std::ofstream file( fileName.c_str() );
+    if( !file )
+      {
+      itkExceptionMacro(<<"Cannot open " << fileName << " for writing");
+      }
+    this->WriteTraceEvents( file );
+    if( !file )
+      {
+      itkExceptionMacro(<<"Cannot write the trace events to " << fileName);
+      }
+  }
+
+protected:
+  RegistrationTracer()
+    : m_Enabled( false ),
+      m_EventsPerThread( 65536 ),
+      m_Epoch( ClockNanoseconds() ),
+      m_Serial( NextSerial() )
+  {}
+  ~RegistrationTracer() override {};
+
+  void PrintSelf(std::ostream& os, Indent indent) const override
+  {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "Enabled: " << this->GetEnabled() << std::endl;
+    os << indent << "EventsPerThread: " << m_EventsPerThread << std::endl;
+    os << indent << "NumberOfEvents: " << this->GetNumberOfEvents() << std::endl;
+    os << indent << "NumberOfDroppedEvents: " << this->GetNumberOfDroppedEvents() << std::endl;
+  }
+
+private:
+  /** Ring buffer written by a single thread. */
+  struct ThreadBuffer
+  {
+    ThreadBuffer( std::thread::id thread, unsigned int id, SizeValueType capacity )
+      : Thread( thread ), Id( id ), Events( new TraceEvent[capacity] ), Capacity( capacity )
+    {}
+
+    std::thread::id               Thread;
+    unsigned int                  Id;
+    std::unique_ptr<TraceEvent[]> Events;
+    SizeValueType                 Capacity;
+    std::atomic<uint64_t>         Written{ 0 };
+    std::atomic<unsigned int>     OpenSpans{ 0 };  // Only written by the thread
+  };
+
+  static void RecordInto( ThreadBuffer & buffer, const TraceEvent & event )
+  {
+    const uint64_t written = buffer.Written.load( std::memory_order_relaxed );
+    buffer.Events[written % buffer.Capacity] = event;
+    buffer.Written.store( written + 1, std::memory_order_release );
+  }
+
+  static int64_t ClockNanoseconds()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch() ).count();
+  }
+
+  // Called with the mutex held
+  void CheckNotRecording( const char * method ) const
+  {
+    if( this->GetEnabled() )
+      {
+      itkExceptionMacro(<< method << "() while the tracer is enabled: disable it first");
+      }
+    for( const auto & buffer : m_Buffers )
+      {
+      if( buffer->OpenSpans.load( std::memory_order_acquire ) != 0 )
+        {
+        itkExceptionMacro(<< method << "() while a span of thread " << buffer->Id << " is open");
+        }
+      }
+  }
+
+  // Identifies a tracer, and its buffers, in the cache of the threads: an
+  // address could be reused by a tracer created later. Set once, since the
+  // buffers live as long as the tracer.
+  static uint64_t NextSerial()
+  {
+    static std::atomic<uint64_t> nextSerial{ 1 };
+    return nextSerial++;
+  }
+
+  ThreadBuffer & GetThreadBuffer()
+  {
+    // The last tracer the thread recorded into
+    struct ThreadCache
+    {
+      uint64_t       Serial{ 0 };
+      ThreadBuffer * Buffer{ nullptr };
+    };
+    thread_local ThreadCache cache;
+
+    if( cache.Serial == m_Serial )
+      {
+      return *cache.Buffer;
+      }
+
+    std::lock_guard<std::mutex> lock( m_BuffersMutex );
+    const std::thread::id thread = std::this_thread::get_id();
+    ThreadBuffer * buffer = nullptr;
+    for( const auto & b : m_Buffers )
+      {
+      if( b->Thread == thread )
+        {
+        buffer = b.get();
+        }
+      }
+    if( !buffer )
+      {
+      m_Buffers.emplace_back( new ThreadBuffer( thread, static_cast<unsigned int>( m_Buffers.size() + 1 ),
+                                                m_EventsPerThread ) );
+      buffer = m_Buffers.back().get();
+      }
+    cache.Serial = m_Serial;
+    cache.Buffer = buffer;
+    return *buffer;
+  }
+
+  std::atomic<bool>                           m_Enabled;
+  SizeValueType                               m_EventsPerThread;
+  std::atomic<int64_t>                        m_Epoch;
+  const uint64_t                              m_Serial;
+
+  mutable std::mutex                          m_BuffersMutex;
+  std::vector< std::unique_ptr<ThreadBuffer> > m_Buffers;
+};
+
+
+/** \class TraceSpan
+ * \brief Record the time between its construction and its destruction as
+ * a span of a RegistrationTracer.
+ *
+ * When the tracer is disabled, the span only tests its flag; without a
+ * tracer, nothing is recorded.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+class TraceSpan
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(TraceSpan);
+
+  TraceSpan( RegistrationTracer * tracer, const char * name, const char * category,
+             const char * argumentName = nullptr, int64_t argument = 0 )
+    : m_Tracer( ( tracer && tracer->GetEnabled() ) ? tracer : nullptr )
+  {
+    if( m_Tracer )
+      {
+      m_Event.Name = name;
+      m_Event.Category = category;
+      m_Event.ArgumentName = argumentName;
+      m_Event.Argument = argument;
+      m_Tracer->OpenSpan();
+      m_Event.Start = m_Tracer->Now();
+      }
+  }
+
+  ~TraceSpan()
+  {
+    if( m_Tracer )
+      {
+      m_Event.Duration = m_Tracer->Now() - m_Event.Start;
+      m_Tracer->CloseSpan( m_Event );
+      }
+  }
+
+private:
+  RegistrationTracer *           m_Tracer;
+  RegistrationTracer::TraceEvent m_Event;
+};
+
+} // end namespace itk
+
+#endif
@@ -39,6 +39,17 @@ CIT 6, 89-94 (1998).
 #include "itkTransform.h"
 #include "itkVector.h"
 #include "itkEuler3DTransform.h"
+#include "itkProjectionGeometry.h"
+#include "itkRayCastWorkerPool.h"
+#include "itkRayCastKernel.h"
+#include "itkRegistrationPerformanceCounters.h"
+#include "itkRegistrationTracer.h"
+#include "itkRegistrationMemoryAccount.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 namespace itk
 {
@@ -48,12 +59,55 @@ namespace itk
   *
   * SiddonJacobsRayCastInterpolateImageFunction casts rays through a 3-dimensional
   * image
+  *
+  * By default the projection geometry is the linac geometry defined by
+  * the FocalPointToIsocenterDistance and the ProjectionAngle, and the
+  * projection image has to be placed at -FocalPointToIsocenterDistance
+  * along z. Alternatively a ProjectionGeometry can be connected, which
+  * defines the source and the detector frame of the view directly. The
+  * ray of every image point is then obtained with a single
+  * matrix-vector product from quantities that are only recomputed when
+  * the transform or the geometry changes.
+  *
+  * The input image may have any scalar pixel type. Integer CT images are
+  * best used as read: their voxels are converted to KernelRealType in the
+  * ray loop, which avoids a float copy of the volume and halves the memory
+  * read by every ray for 16-bit voxels.
+  *
+  * RenderProjectionInSlabs() renders a projection from a volume that is
+  * not buffered as a whole: the volume is provided in slabs along z and
+  * the ray traversals are suspended at the slab boundaries and resumed
+  * with the next slab. The voxels are visited, and the path sums
+  * accumulated, in the same order as by the in-core rendering, so both
+  * give the same projection.
+  *
+  * The rays are cast by the RayCastKernel policies: the interpolator is
+  * the combination of the Siddon-Jacobs traversal, plain voxel access and
+  * the thresholded sum. RenderProjectionWith() renders a projection with
+  * another traversal or accumulator, e.g. a maximum intensity projection.
+  *
+  * When the performance counters are compiled in, the rays, the voxels
+  * they visit and the time spent in the ray setup and in the rendering
+  * are counted into a RegistrationPerformanceCounters.
+  *
+  * The ray setup, the projections and their tiles are traced as spans of
+  * a RegistrationTracer, when it is enabled. The rays of Evaluate() are
+  * not: they are traced with the tiles of the metric.
+  *
+  * The rays are traced in the precision TKernelReal, TCoordRep by default.
+  * With float, the ray vectors, the traversal state and the path sums are
+  * single precision; double is the validation path. The entry of every ray
+  * is computed in double precision in both cases, so both start from the
+  * same voxel. They differ where a ray crosses two planes at nearly the
+  * same point: the order of the crossings, and hence the voxel a segment
+  * is attributed to, then depends on the rounding.
+  *
   * \warning This interpolator works for 3-dimensional images only.
   *
   * \ingroup ImageFunctions
   * \ingroup TwoProjectionRegistration
   */
-template <typename TInputImage, typename TCoordRep = float >
+template <typename TInputImage, typename TCoordRep = float, typename TKernelReal = TCoordRep >
 class SiddonJacobsRayCastInterpolateImageFunction :
     public InterpolateImageFunction<TInputImage,TCoordRep>
 {
@@ -84,6 +138,9 @@ public:
 
   using DirectionType = Vector<TCoordRep, 3>;
 
+  using ProjectionGeometryType = ProjectionGeometry<TCoordRep>;
+  using ProjectionGeometryPointer = typename ProjectionGeometryType::Pointer;
+
   /**  Type of the Interpolator Base class */
   using InterpolatorType = InterpolateImageFunction<TInputImage,TCoordRep>;
 
@@ -108,6 +165,9 @@ public:
   /** RealType type alias support. */
   using RealType = typename Superclass::RealType;
 
+  /** Precision of the ray traversal and of the path sums. */
+  using KernelRealType = TKernelReal;
+
   /** Dimension underlying input image. */
   static constexpr unsigned int ImageDimension = Superclass::ImageDimension;
 
@@ -147,6 +207,131 @@ public:
   OutputType EvaluateAtContinuousIndex(
     const ContinuousIndexType &index ) const override;
 
+  /** Interpolate the image at n points equally spaced along a line,
+   * starting at the given point and advancing by step. The ray vector is
+   * affine along the line, which is cheaper than calling Evaluate() for
+   * each point of an image row. The values
+   * are clamped to the range of TValue. */
+  template <typename TValue>
+  void EvaluateLine( const PointType & start,
+                     const typename PointType::VectorType & step,
+                     SizeValueType n,
+                     TValue * values ) const;
+
+  /** Render the buffered region of a projection image in place, one image
+   * row per EvaluateLine() call. When a worker pool is given, the image is
+   * split into tiles distributed over its workers, see
+   * RayCastWorkerPool::ParallelForTiles(). The projection image must be allocated; no
+   * memory is allocated by the rendering itself. */
+  template <typename TProjectionImage>
+  void RenderProjection( TProjectionImage * projection,
+                         RayCastWorkerPool * pool = nullptr ) const;
+
+  /** Render the buffered region of a projection image as
+   * RenderProjection() does, casting the rays with the traversal
+   * TTraversal and a copy of the given accumulator. The rays are computed
+   * in the precision of TTraversal. The voxels are read from the input
+   * image, or its NUMA replicas, as KernelRealType values. */
+  template <typename TTraversal, typename TAccumulator, typename TProjectionImage>
+  void RenderProjectionWith( TProjectionImage * projection,
+                             const TAccumulator & accumulator,
+                             RayCastWorkerPool * pool = nullptr ) const;
+
+  /** Function providing the voxels of the slices [zBegin, zEnd) of the
+   * volume: an image whose largest possible region is the whole volume
+   * and whose buffered region contains the slab. */
+  using SlabSourceType = std::function< InputImageConstPointer( IndexValueType zBegin, IndexValueType zEnd ) >;
+
+  /** Render the buffered region of a projection image in place from a
+   * volume provided in slabs of slabThickness slices. The input image of
+   * the interpolator gives the size and spacing of the volume; its pixels
+   * are not accessed. Rays advancing towards increasing z are traced
+   * through the slabs in increasing order, the other rays in decreasing
+   * order, so that every slab is requested at most twice and only one is
+   * referenced at a time. The result equals that of RenderProjection(). */
+  template <typename TProjectionImage>
+  void RenderProjectionInSlabs( TProjectionImage * projection,
+                                const SlabSourceType & slabSource,
+                                SizeValueType slabThickness,
+                                RayCastWorkerPool * pool = nullptr ) const;
+
+  /** Render the cost of the rays of RenderProjection() into an image
+   * standing for the projection: the number of voxels every ray visits
+   * and, when a second image with the same buffered region is given, the
+   * time spent casting the ray in nanoseconds. The rays are those of the
+   * pixels of the first image, cast as RenderProjection() casts them;
+   * their integrals are discarded. Long rays show as hot spots, e.g. to
+   * tune the tiles or to crop the volume. The timing reads the clock
+   * twice per ray, which only suits diagnostics. */
+  template <typename TCostImage>
+  void RenderRayCost( TCostImage * voxelsVisited,
+                      TCostImage * rayTime = nullptr,
+                      RayCastWorkerPool * pool = nullptr ) const;
+
+  /** Copies of the input image placed on the NUMA nodes, indexed by node,
+   * see RealTimeExecutionProfile::PlaceVolume(). A ray cast by a worker of
+   * a RayCastWorkerPool reads the copy of the node of the worker, when
+   * there is one, and the input image otherwise. The copies must hold the
+   * same voxels as the input image. */
+  using VolumeReplicasType = std::vector< InputImageConstPointer >;
+  void SetVolumeReplicas( const VolumeReplicasType & replicas )
+  {
+    m_VolumeReplicas = replicas;
+    this->Modified();
+  }
+  const VolumeReplicasType & GetVolumeReplicas() const
+  {
+    return m_VolumeReplicas;
+  }
+
+  /** Set/Get the performance counters the rays are counted into, see
+   * RegistrationPerformanceCounters. Every interpolator has its own by
+   * default; the registration method connects its counters. Setting the
+   * counters does not change the modification time, so that the ray setup
+   * and the mesh of derived classes are kept. */
+  void SetPerformanceCounters( RegistrationPerformanceCounters * counters )
+  {
+    m_PerformanceCounters = counters;
+  }
+  RegistrationPerformanceCounters * GetPerformanceCounters() const
+  {
+    return m_PerformanceCounters.GetPointer();
+  }
+
+  /** Set/Get the tracer the spans of the ray casting are recorded into,
+   * see RegistrationTracer. Every interpolator has its own, disabled, by
+   * default; the registration method connects its tracer. Setting the
+   * tracer does not change the modification time. */
+  void SetTracer( RegistrationTracer * tracer )
+  {
+    m_Tracer = tracer;
+  }
+  RegistrationTracer * GetTracer() const
+  {
+    return m_Tracer.GetPointer();
+  }
+
+  /** Set/Get the memory account the buffers of the ray casting are
+   * declared to, see RegistrationMemoryAccount: the rays of
+   * RenderProjectionInSlabs() and the surface mesh of derived classes.
+   * Every interpolator has its own by default; the registration method
+   * connects its account. Setting the account releases the allocations
+   * of the interpolator from the previous one, and does not change the
+   * modification time. Setting a null account gives the interpolator its
+   * own account again. */
+  void SetMemoryAccount( RegistrationMemoryAccount * account )
+  {
+    if( m_MemoryAccount != account )
+      {
+      m_MemoryAccount->ReleaseAllocations( this );
+      m_MemoryAccount = account ? account : RegistrationMemoryAccount::New().GetPointer();
+      }
+  }
+  RegistrationMemoryAccount * GetMemoryAccount() const
+  {
+    return m_MemoryAccount.GetPointer();
+  }
+
   virtual void Initialize(void);
 
   /** Connect the Transform. */
@@ -166,6 +351,13 @@ public:
   itkSetMacro(Threshold, double);
   itkGetMacro(Threshold, double);
 
+  /** Connect a projection geometry. When set, it replaces the linac
+   * geometry defined by FocalPointToIsocenterDistance and
+   * ProjectionAngle, and the physical coordinates of the projection image
+   * are detector coordinates as defined by the geometry. */
+  itkSetObjectMacro( ProjectionGeometry, ProjectionGeometryType );
+  itkGetConstObjectMacro( ProjectionGeometry, ProjectionGeometryType );
+
   /** Check if a point is inside the image buffer.
   * \warning For efficiency, no validity checking of
   * the input image pointer is done. */
@@ -185,10 +377,98 @@ public:
 protected:
   SiddonJacobsRayCastInterpolateImageFunction();
 
-  ~SiddonJacobsRayCastInterpolateImageFunction() override{};
+  ~SiddonJacobsRayCastInterpolateImageFunction() override
+  {
+    m_MemoryAccount->ReleaseAllocations( this );
+  }
 
   void PrintSelf(std::ostream& os, Indent indent) const override;
 
+  /** Integrate the voxel intensities along the ray from the source, both
+   * given in the coordinate system of the input image. Evaluate() and
+   * EvaluateLine() cast every ray through this method. */
+  virtual KernelRealType ComputeRayIntegral( const PointType & sourceWorld, const KernelRealType rayVector[3] ) const;
+
+  /** Policies of the ray casting kernel of the interpolator. */
+  using TraversalType = SiddonRayTraversal<KernelRealType>;
+  using VoxelAccessType = PlainVoxelAccess<PixelType, KernelRealType>;
+  using AccumulatorType = ThresholdedSumRayAccumulator<KernelRealType>;
+
+  /** Traversal state of a ray through the volume. */
+  struct RayState
+  {
+    TraversalType                          Traversal;
+    CountedRayAccumulator<AccumulatorType> Accumulator; // Path sum of the voxels visited so far
+  };
+
+  /** Get the volume read by the current thread: the copy of the input
+   * image placed on the node of the worker, if any, or the input image. */
+  const InputImageType * GetWorkerVolume() const;
+
+  /** Get the spacing and the size of the largest possible region of a
+   * volume, which has its origin at 0 for the ray casting kernel. */
+  static void GetVolumeGeometry( const InputImageType * volume,
+                                 double spacing[3],
+                                 SizeValueType size[3] );
+
+  /** Compute the entry of a ray into a volume, of which only the size and
+   * the spacing are used. */
+  void InitializeRay( const PointType & sourceWorld, const KernelRealType rayVector[3],
+                      const InputImageType * volume, RayState & ray ) const;
+
+  /** Trace a ray through the slices [zBegin, zEnd) of a volume, which
+   * must be buffered. The traversal is suspended at the first voxel
+   * outside the slices. Returns true when the ray has left the volume. */
+  bool TraceRay( RayState & ray, const InputImageType * volume,
+                 IndexValueType zBegin, IndexValueType zEnd ) const;
+
+  /** Call function( k, rayVector ) for the rays of the points k in
+   * [begin, end) of a line of the projection image starting at start and
+   * advancing by step, as EvaluateLine() does. The ray vectors are given
+   * in the precision TRayReal. */
+  template <typename TRayReal, typename TFunction>
+  void CastLine( const PointType & start,
+                 const typename PointType::VectorType & step,
+                 SizeValueType begin,
+                 SizeValueType end,
+                 TFunction && function ) const;
+
+  /** Get the first point, the step between points and the buffer offset of
+   * a row of the buffered region of a projection image. */
+  template <typename TProjectionImage>
+  static void GetProjectionRow( const TProjectionImage * projection,
+                                SizeValueType row,
+                                PointType & start,
+                                typename PointType::VectorType & step,
+                                OffsetValueType & offset );
+
+  /** Clamp a ray integral to the range of a value type. */
+  template <typename TValue, typename TReal>
+  static TValue ClampOutput( TReal d12 );
+
+  /** Get the source of the rays in the coordinate system of the input
+   * image, as of the last update of the ray setup. */
+  const PointType & GetRaySource() const
+  {
+    return m_RaySource;
+  }
+
+  /** Make sure the cached ray setup matches the current transform and
+   * geometry. */
+  void UpdateRaySetup() const
+  {
+    if( this->GetRaySetupMTime() > m_RaySetupMTime.load( std::memory_order_acquire ) )
+      {
+      TraceSpan span( m_Tracer, "RaySetup", "raycast" );
+      PerformanceCounterBuffer counts;
+        {
+        PerformanceCounterTimer timer( counts, PerformanceCounterBuffer::RaySetupTime );
+        this->ComputeRaySetup();
+        }
+      m_PerformanceCounters->Flush( counts );
+      }
+  }
+
   /// Transformation used to calculate the new focal point position
   TransformPointer m_Transform; // Displacement of the volume
   // Overall inverse transform used to calculate the ray position in the input space
@@ -199,14 +479,35 @@ protected:
   double m_FocalPointToIsocenterDistance; // Focal point to isocenter distance
   double m_ProjectionAngle; // Linac gantry rotation angle in radians
 
+  ProjectionGeometryPointer m_ProjectionGeometry;
+
+  VolumeReplicasType m_VolumeReplicas;
+
+  RegistrationPerformanceCounters::Pointer m_PerformanceCounters;
+
+  RegistrationTracer::Pointer m_Tracer;
+
+  RegistrationMemoryAccount::Pointer m_MemoryAccount;
+
 private:
   void ComputeInverseTransform( void ) const;
+  void ComputeRaySetup( void ) const;
+  ModifiedTimeType GetRaySetupMTime( void ) const;
+
   TransformPointer m_GantryRotTransform; // Gantry rotation transform
   TransformPointer m_CamShiftTransform; // Camera shift transform camRotTransform
   TransformPointer m_CamRotTransform; // Camera rotation transform
   TransformPointer m_ComposedTransform; // Composed transform
   PointType        m_SourcePoint; // Coordinate of the source in the standard Z projection geometry
   PointType        m_SourceWorld; // Coordinate of the source in the world coordinate system
+
+  // Ray setup cached per pose: the ray vector of a projection image point p
+  // is m_RayMatrix * ( p[0], p[1], w ), with w = p[2] for the linac geometry
+  // and w = 1 for a connected ProjectionGeometry.
+  mutable std::mutex                    m_RaySetupMutex;
+  mutable std::atomic<ModifiedTimeType> m_RaySetupMTime;
+  mutable PointType                     m_RaySource;
+  mutable Matrix<double, 3, 3>          m_RayMatrix;
 };
 
 } // namespace itk
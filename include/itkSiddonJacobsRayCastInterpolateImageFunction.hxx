@@ -39,13 +39,16 @@ CIT 6, 89-94 (1998).
 #include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
 
 #include "itkMath.h"
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <vector>
 
 namespace itk
 {
 
-template<typename TInputImage, typename TCoordRep>
-SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
 ::SiddonJacobsRayCastInterpolateImageFunction()
 {
   m_FocalPointToIsocenterDistance = 1000.;  // Focal point to isocenter distance in mm.
@@ -78,316 +81,595 @@ SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
   m_CamRotTransform->SetRotation( dtr*(-90.0), 0.0, 0.0 );
 
   m_Threshold = 0;
+
+  m_ProjectionGeometry = nullptr; // linac geometry by default
+  m_PerformanceCounters = RegistrationPerformanceCounters::New();
+  m_Tracer = RegistrationTracer::New();
+  m_MemoryAccount = RegistrationMemoryAccount::New();
+  m_RaySetupMTime = 0;
+  m_RaySource.Fill( 0.0 );
+  m_RayMatrix.SetIdentity();
 }
 
 
-template<typename TInputImage, typename TCoordRep>
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
 void
-SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
 ::PrintSelf(std::ostream& os, Indent indent) const
 {
   this->Superclass::PrintSelf(os,indent);
 
   os << indent << "Threshold: " << m_Threshold << std::endl;
   os << indent << "Transform: " << m_Transform.GetPointer() << std::endl;
+  os << indent << "FocalPointToIsocenterDistance: " << m_FocalPointToIsocenterDistance << std::endl;
+  os << indent << "ProjectionAngle: " << m_ProjectionAngle << std::endl;
+  os << indent << "ProjectionGeometry: " << m_ProjectionGeometry.GetPointer() << std::endl;
+  os << indent << "VolumeReplicas: " << m_VolumeReplicas.size() << std::endl;
+  os << indent << "PerformanceCounters: " << m_PerformanceCounters.GetPointer() << std::endl;
+  os << indent << "Tracer: " << m_Tracer.GetPointer() << std::endl;
+  os << indent << "MemoryAccount: " << m_MemoryAccount.GetPointer() << std::endl;
 }
 
 
-template<typename TInputImage, typename TCoordRep>
-typename SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >::OutputType
-SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+typename SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >::OutputType
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
 ::Evaluate( const PointType& point ) const
 {
-  float rayVector[3];
-  IndexType cIndex;
+  // If the volume was shifted or the geometry changed, recompute the ray setup
+  this->UpdateRaySetup();
 
-  PointType drrPixelWorld;    // Coordinate of a DRR pixel in the world coordinate system
-  OutputType pixval;
+  const double w = m_ProjectionGeometry ? 1.0 : static_cast<double>( point[2] );
 
+  KernelRealType rayVector[3];
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    rayVector[i] = static_cast<KernelRealType>( m_RayMatrix[i][0] * point[0]
+                                     + m_RayMatrix[i][1] * point[1]
+                                     + m_RayMatrix[i][2] * w );
+    }
 
-  float firstIntersection[3];
-  float alphaX1, alphaXN, alphaXmin, alphaXmax;
-  float alphaY1, alphaYN, alphaYmin, alphaYmax;
-  float alphaZ1, alphaZN, alphaZmin, alphaZmax;
-  float alphaMin, alphaMax;
-  float alphaX, alphaY, alphaZ, alphaCmin, alphaCminPrev;
-  float alphaUx, alphaUy, alphaUz;
-  float alphaIntersectionUp[3], alphaIntersectionDown[3];
-  float d12, value;
-  float firstIntersectionIndex[3];
-  int firstIntersectionIndexUp[3], firstIntersectionIndexDown[3];
-  int iU, jU, kU;
+  return ClampOutput<OutputType>( this->ComputeRayIntegral( m_RaySource, rayVector ) );
+}
 
 
-  // Min/max values of the output pixel type AND these values
-  // represented as the output type of the interpolator
-  const OutputType minOutputValue =  itk::NumericTraits<OutputType >::NonpositiveMin();
-  const OutputType maxOutputValue =  itk::NumericTraits<OutputType >::max();
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TValue>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::EvaluateLine( const PointType & start,
+                const typename PointType::VectorType & step,
+                SizeValueType n,
+                TValue * values ) const
+{
+  this->UpdateRaySetup();
+
+  this->template CastLine< KernelRealType >( start, step, 0, n, [this, values]( SizeValueType k, const KernelRealType rayVector[3] )
+    {
+    values[k] = ClampOutput<TValue>( this->ComputeRayIntegral( m_RaySource, rayVector ) );
+    } );
+}
 
-  // If the volume was shifted, recalculate the overall inverse transform
-  unsigned long int interpMTime = this->GetMTime();
-  unsigned long int vTransformMTime = m_Transform->GetMTime();
 
-  if( interpMTime < vTransformMTime )
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TRayReal, typename TFunction>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::CastLine( const PointType & start,
+            const typename PointType::VectorType & step,
+            SizeValueType begin,
+            SizeValueType end,
+            TFunction && function ) const
+{
+  const bool planar = m_ProjectionGeometry.IsNotNull();
+  const double w = planar ? 1.0 : static_cast<double>( start[2] );
+  const double dw = planar ? 0.0 : static_cast<double>( step[2] );
+
+  // The ray vector is affine in the image point, so the ray of point k is
+  // that of the start plus k increments. It is computed from k rather than
+  // accumulated, so that the rays do not depend on where the part of the
+  // line cast starts.
+  double ray[3];
+  double rayIncrement[3];
+  for( unsigned int i = 0; i < 3; i++ )
     {
-    this->ComputeInverseTransform();
-    // The m_SourceWorld should be computed here to avoid the repeatedly calculation
-    // for each projection ray. However, we are in a const function, which prohibits
-    // the modification of class member variables. So the world coordiate of the source
-    // point is calculated for each ray as below. Performance improvement may be made
-    // by using a static variable?
-    // m_SourceWorld = m_InverseTransform->TransformPoint(m_SourcePoint);
+    ray[i] = m_RayMatrix[i][0] * start[0] + m_RayMatrix[i][1] * start[1] + m_RayMatrix[i][2] * w;
+    rayIncrement[i] = m_RayMatrix[i][0] * step[0] + m_RayMatrix[i][1] * step[1] + m_RayMatrix[i][2] * dw;
     }
 
-  PointType SourceWorld = m_InverseTransform->TransformPoint(m_SourcePoint);
-
-  // Get ths input pointers
-  InputImageConstPointer inputPtr=this->GetInputImage();
+  TRayReal rayVector[3];
+  for( SizeValueType k = begin; k < end; k++ )
+    {
+    const double position = static_cast<double>( k );
+    rayVector[0] = static_cast<TRayReal>( ray[0] + position * rayIncrement[0] );
+    rayVector[1] = static_cast<TRayReal>( ray[1] + position * rayIncrement[1] );
+    rayVector[2] = static_cast<TRayReal>( ray[2] + position * rayIncrement[2] );
+    function( k, rayVector );
+    }
+}
 
-  typename InputImageType::SizeType sizeCT;
-  typename InputImageType::RegionType regionCT;
-  typename InputImageType::SpacingType ctPixelSpacing;
-  typename InputImageType::PointType ctOrigin;
 
-  ctPixelSpacing = inputPtr->GetSpacing();
-  ctOrigin = inputPtr->GetOrigin();
-  regionCT = inputPtr->GetLargestPossibleRegion();
-  sizeCT = regionCT.GetSize();
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TProjectionImage>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::RenderProjection( TProjectionImage * projection, RayCastWorkerPool * pool ) const
+{
+  this->template RenderProjectionWith< TraversalType >( projection, AccumulatorType( m_Threshold ), pool );
+}
 
-  drrPixelWorld = m_InverseTransform->TransformPoint(point);
 
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TTraversal, typename TAccumulator, typename TProjectionImage>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::RenderProjectionWith( TProjectionImage * projection,
+                        const TAccumulator & accumulator,
+                        RayCastWorkerPool * pool ) const
+{
+  static_assert( TProjectionImage::ImageDimension == InputImageType::ImageDimension,
+                 "The projection image must have the dimension of the volume" );
 
-  // The following is the Siddon-Jacob fast ray-tracing algorithm
+  using ProjectionPixelType = typename TProjectionImage::PixelType;
+  using CountedAccumulatorType = CountedRayAccumulator< TAccumulator >;
+  using KernelType = RayCastKernel< TTraversal, VoxelAccessType, CountedAccumulatorType >;
+  using RayRealType = typename KernelType::RealType;
 
-  rayVector[0] = drrPixelWorld[0] - SourceWorld[0];
-  rayVector[1] = drrPixelWorld[1] - SourceWorld[1];
-  rayVector[2] = drrPixelWorld[2] - SourceWorld[2];
+  const typename TProjectionImage::RegionType region = projection->GetBufferedRegion();
+  const typename TProjectionImage::SizeType size = region.GetSize();
 
-  /* Calculate the parametric  values of the first  and  the  last
-  intersection points of  the  ray  with the X,  Y, and Z-planes  that
-  define  the  CT volume. */
-  if (rayVector[0] != 0)
+  const SizeValueType rowLength = size[0];
+  SizeValueType numberOfRows = 1;
+  for( unsigned int d = 1; d < TProjectionImage::ImageDimension; d++ )
     {
-    alphaX1  = (0.0 - SourceWorld[0]) / rayVector[0];
-    alphaXN  = (sizeCT[0]*ctPixelSpacing[0] -  SourceWorld[0]) /  rayVector[0];
-    alphaXmin =  std::min(alphaX1, alphaXN);
-    alphaXmax =  std::max(alphaX1, alphaXN);
+    numberOfRows *= size[d];
     }
-  else
+  if( rowLength == 0 || numberOfRows == 0 )
     {
-    alphaXmin =  -2;
-    alphaXmax =  2;
+    return;
     }
 
-  if (rayVector[1] != 0)
+  TraceSpan span( m_Tracer, "RenderProjection", "raycast" );
+
+  // Bring the ray setup up to date once, before the workers share it
+  this->UpdateRaySetup();
+
+  double source[3];
+  for( unsigned int d = 0; d < 3; d++ )
     {
-    alphaY1  = (0.0 - SourceWorld[1]) / rayVector[1];
-    alphaYN  = (sizeCT[1]*ctPixelSpacing[1] -  SourceWorld[1]) /  rayVector[1];
-    alphaYmin =  std::min(alphaY1, alphaYN);
-    alphaYmax =  std::max(alphaY1, alphaYN);
+    source[d] = static_cast<double>( m_RaySource[d] );
     }
-  else
+
+  ProjectionPixelType * buffer = projection->GetBufferPointer();
+
+  // Render the part [beginColumn, endColumn) of the rows [beginRow, endRow)
+  auto renderTile = [&]( SizeValueType beginColumn, SizeValueType endColumn,
+                         SizeValueType beginRow, SizeValueType endRow, unsigned int )
     {
-    alphaYmin =  -2;
-    alphaYmax =  2;
-    }
+    const InputImageType * volume = this->GetWorkerVolume();
+    const VoxelAccessType access( volume );
+    double spacing[3];
+    SizeValueType volumeSize[3];
+    GetVolumeGeometry( volume, spacing, volumeSize );
+
+    PerformanceCounterBuffer counts;
+      {
+      TraceSpan tileSpan( m_Tracer, "Tile", "raycast", "row", static_cast<int64_t>( beginRow ) );
+      PerformanceCounterTimer timer( counts, PerformanceCounterBuffer::TraversalTime );
+      PointType start;
+      typename PointType::VectorType step;
+      OffsetValueType offset;
+      for( SizeValueType row = beginRow; row < endRow; row++ )
+        {
+        GetProjectionRow( projection, row, start, step, offset );
+        ProjectionPixelType * rowBuffer = buffer + offset;
+        this->template CastLine< RayRealType >( start, step, beginColumn, endColumn,
+          [&]( SizeValueType k, const RayRealType rayVector[3] )
+          {
+          CountedAccumulatorType rayAccumulator = MakeCountedRayAccumulator( accumulator, m_Threshold );
+          KernelType::Accumulate( source, rayVector, spacing, volumeSize, access, rayAccumulator );
+          counts.CountRay( rayAccumulator );
+          rowBuffer[k] = ClampOutput<ProjectionPixelType>( rayAccumulator.GetResult() );
+          } );
+        }
+      }
+    m_PerformanceCounters->Flush( counts );
+    };
 
-  if (rayVector[2] != 0)
+  // The cost of the rays varies strongly over the projection: the tiles
+  // are balanced over the workers by work stealing
+  if( pool )
     {
-    alphaZ1  = (0.0 - SourceWorld[2]) / rayVector[2];
-    alphaZN  = (sizeCT[2]*ctPixelSpacing[2] -  SourceWorld[2]) /  rayVector[2];
-    alphaZmin =  std::min(alphaZ1, alphaZN);
-    alphaZmax =  std::max(alphaZ1, alphaZN);
+    pool->ParallelForTiles( rowLength, numberOfRows, renderTile );
     }
   else
     {
-    alphaZmin = -2;
-    alphaZmax = 2;
+    renderTile( 0, rowLength, 0, numberOfRows, 0 );
     }
+}
 
-  /* Get the very first and the last alpha values when the ray
-  intersects with the CT volume. */
-  alphaMin = std::max(std::max(alphaXmin, alphaYmin), alphaZmin);
-  alphaMax = std::min(std::min(alphaXmax, alphaYmax), alphaZmax);
-
-  /* Calculate the parametric values of the first intersection point
-  of the ray with the X, Y, and Z-planes after the ray entered the
-  CT volume. */
-
-  firstIntersection[0] = SourceWorld[0] + alphaMin * rayVector[0];
-  firstIntersection[1] = SourceWorld[1] + alphaMin * rayVector[1];
-  firstIntersection[2] = SourceWorld[2] + alphaMin * rayVector[2];
-
-  /* Transform world coordinate to the continuous index of the CT volume*/
-  firstIntersectionIndex[0] = firstIntersection[0] / ctPixelSpacing[0];
-  firstIntersectionIndex[1] = firstIntersection[1] / ctPixelSpacing[1];
-  firstIntersectionIndex[2] = firstIntersection[2] / ctPixelSpacing[2];
-
-  firstIntersectionIndexUp[0] = (int)ceil(firstIntersectionIndex[0]);
-  firstIntersectionIndexUp[1] = (int)ceil(firstIntersectionIndex[1]);
-  firstIntersectionIndexUp[2] = (int)ceil(firstIntersectionIndex[2]);
 
-  firstIntersectionIndexDown[0] = (int)floor(firstIntersectionIndex[0]);
-  firstIntersectionIndexDown[1] = (int)floor(firstIntersectionIndex[1]);
-  firstIntersectionIndexDown[2] = (int)floor(firstIntersectionIndex[2]);
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TProjectionImage>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::RenderProjectionInSlabs( TProjectionImage * projection,
+                           const SlabSourceType & slabSource,
+                           SizeValueType slabThickness,
+                           RayCastWorkerPool * pool ) const
+{
+  static_assert( TProjectionImage::ImageDimension == InputImageType::ImageDimension,
+                 "The projection image must have the dimension of the volume" );
 
+  using ProjectionPixelType = typename TProjectionImage::PixelType;
 
-  if (rayVector[0] == 0)
+  const InputImageType * volume = this->GetInputImage();
+  if( !volume )
     {
-    alphaX = 2;
-    }
-  else
-    {
-    alphaIntersectionUp[0] = (firstIntersectionIndexUp[0] * ctPixelSpacing[0] -  SourceWorld[0]) / rayVector[0];
-    alphaIntersectionDown[0] = (firstIntersectionIndexDown[0] * ctPixelSpacing[0] -  SourceWorld[0]) / rayVector[0];
-    alphaX = std::max(alphaIntersectionUp[0], alphaIntersectionDown[0]);
+    itkExceptionMacro(<<"No input image giving the geometry of the volume");
     }
 
-  if (rayVector[1] == 0)
+  const typename TProjectionImage::SizeType size = projection->GetBufferedRegion().GetSize();
+  const SizeValueType rowLength = size[0];
+  SizeValueType numberOfRows = 1;
+  for( unsigned int d = 1; d < TProjectionImage::ImageDimension; d++ )
     {
-    alphaY = 2;
+    numberOfRows *= size[d];
     }
-  else
+  if( rowLength == 0 || numberOfRows == 0 )
     {
-    alphaIntersectionUp[1] = (firstIntersectionIndexUp[1] * ctPixelSpacing[1] -  SourceWorld[1]) / rayVector[1];
-    alphaIntersectionDown[1] = (firstIntersectionIndexDown[1] * ctPixelSpacing[1] -  SourceWorld[1]) / rayVector[1];
-    alphaY = std::max(alphaIntersectionUp[1], alphaIntersectionDown[1]);
+    return;
     }
 
-  if (rayVector[2] == 0)
-    {
-    alphaZ = 2;
-    }
-  else
-    {
-    alphaIntersectionUp[2] = (firstIntersectionIndexUp[2] * ctPixelSpacing[2] -  SourceWorld[2]) / rayVector[2];
-    alphaIntersectionDown[2] = (firstIntersectionIndexDown[2] * ctPixelSpacing[2] -  SourceWorld[2]) / rayVector[2];
-    alphaZ = std::max(alphaIntersectionUp[2], alphaIntersectionDown[2]);
-    }
+  TraceSpan span( m_Tracer, "RenderProjectionInSlabs", "raycast" );
+
+  this->UpdateRaySetup();
 
-  /* Calculate alpha incremental values when the ray intercepts with x, y, and z-planes */
-  if (rayVector[0]!=0)
+  // Set up the rays exactly as the in-core rendering does
+  std::vector< RayState > rays( rowLength * numberOfRows );
+  MemoryAllocationScope raysAllocation( m_MemoryAccount, this, "SlabRays",
+                                        RegistrationMemoryAccount::GetVectorBytes( rays ) );
+  auto forEachRow = [pool, numberOfRows]( const std::function< void( SizeValueType, SizeValueType, unsigned int ) > & f )
     {
-    alphaUx = ctPixelSpacing[0] / fabs(rayVector[0]);
-    }
-  else
+    if( pool )
+      {
+      pool->ParallelFor( numberOfRows, f );
+      }
+    else
+      {
+      f( 0, numberOfRows, 0 );
+      }
+    };
+  forEachRow( [&]( SizeValueType beginRow, SizeValueType endRow, unsigned int )
     {
-    alphaUx = 999;
-    }
-  if (rayVector[1]!=0)
+    PointType start;
+    typename PointType::VectorType step;
+    OffsetValueType offset;
+    for( SizeValueType row = beginRow; row < endRow; row++ )
+      {
+      GetProjectionRow( projection, row, start, step, offset );
+      RayState * rowRays = &rays[row * rowLength];
+      this->template CastLine< KernelRealType >( start, step, 0, rowLength,
+        [&]( SizeValueType k, const KernelRealType rayVector[3] )
+        {
+        this->InitializeRay( m_RaySource, rayVector, volume, rowRays[k] );
+        } );
+      }
+    } );
+
+  // Rays advancing towards increasing z meet the slabs in increasing order,
+  // the other rays, including those parallel to the slabs, in decreasing
+  // order. The last slab of the first sweep is the first of the second.
+  slabThickness = std::max< SizeValueType >( slabThickness, 1 );
+  const IndexValueType numberOfSlices = static_cast< IndexValueType >( volume->GetLargestPossibleRegion().GetSize()[2] );
+  const IndexValueType thickness = static_cast< IndexValueType >( slabThickness );
+  const IndexValueType numberOfSlabs = std::max< IndexValueType >( ( numberOfSlices + thickness - 1 ) / thickness, 1 );
+
+  InputImageConstPointer slab;
+  IndexValueType loadedSlab = -1;
+  MemoryAllocationScope slabAllocation( m_MemoryAccount, this, "Slab" );
+  auto traceSlab = [&]( IndexValueType s, int direction )
     {
-    alphaUy = ctPixelSpacing[1] / fabs(rayVector[1]);
-    }
-  else
+    const IndexValueType zBegin = s * thickness;
+    const IndexValueType zEnd = std::min( zBegin + thickness, numberOfSlices );
+    TraceSpan slabSpan( m_Tracer, "Slab", "raycast", "slab", static_cast<int64_t>( s ) );
+    if( s != loadedSlab )
+      {
+      TraceSpan loadSpan( m_Tracer, "LoadSlab", "raycast", "slab", static_cast<int64_t>( s ) );
+      slab = nullptr;
+      slab = slabSource( zBegin, zEnd );
+      if( !slab )
+        {
+        itkExceptionMacro(<<"No slab for the slices " << zBegin << " to " << zEnd);
+        }
+      slabAllocation.SetBytes( RegistrationMemoryAccount::GetImageBytes( slab.GetPointer() ) );
+      loadedSlab = s;
+      }
+    const InputImageType * slabImage = slab.GetPointer();
+    forEachRow( [&]( SizeValueType beginRow, SizeValueType endRow, unsigned int )
+      {
+      PerformanceCounterBuffer counts;
+        {
+        TraceSpan tileSpan( m_Tracer, "Tile", "raycast", "row", static_cast<int64_t>( beginRow ) );
+        PerformanceCounterTimer timer( counts, PerformanceCounterBuffer::TraversalTime );
+        for( SizeValueType r = beginRow * rowLength; r < endRow * rowLength; r++ )
+          {
+          if( rays[r].Traversal.GetIndexStep( 2 ) == direction )
+            {
+            this->TraceRay( rays[r], slabImage, zBegin, zEnd );
+            }
+          }
+        }
+      m_PerformanceCounters->Flush( counts );
+      } );
+    };
+  for( IndexValueType s = 0; s < numberOfSlabs; s++ )
     {
-    alphaUy = 999;
+    traceSlab( s, 1 );
     }
-  if (rayVector[2]!=0)
+  for( IndexValueType s = numberOfSlabs - 1; s >= 0; s-- )
     {
-    alphaUz = ctPixelSpacing[2] / fabs(rayVector[2]);
+    traceSlab( s, -1 );
     }
-  else
+  slab = nullptr;
+  slabAllocation.SetBytes( 0 );
+
+  ProjectionPixelType * buffer = projection->GetBufferPointer();
+  PerformanceCounterBuffer counts;
+  PointType start;
+  typename PointType::VectorType step;
+  OffsetValueType offset;
+  for( SizeValueType row = 0; row < numberOfRows; row++ )
     {
-    alphaUz = 999;
+    GetProjectionRow( projection, row, start, step, offset );
+    for( SizeValueType k = 0; k < rowLength; k++ )
+      {
+      const RayState & ray = rays[row * rowLength + k];
+      counts.CountRay( ray.Accumulator );
+      buffer[offset + k] = ClampOutput<ProjectionPixelType>( ray.Accumulator.GetResult() );
+      }
     }
-  /* Calculate voxel index incremental values along the ray path. */
-  if (SourceWorld[0] < drrPixelWorld[0])
+  m_PerformanceCounters->Flush( counts );
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TCostImage>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::RenderRayCost( TCostImage * voxelsVisited,
+                 TCostImage * rayTime,
+                 RayCastWorkerPool * pool ) const
+{
+  static_assert( TCostImage::ImageDimension == InputImageType::ImageDimension,
+                 "The cost images must have the dimension of the volume" );
+
+  using CostPixelType = typename TCostImage::PixelType;
+  using CountingAccumulatorType = CountingRayAccumulator< AccumulatorType >;
+  using KernelType = RayCastKernel< TraversalType, VoxelAccessType, CountingAccumulatorType >;
+  using RayRealType = typename KernelType::RealType;
+
+  const typename TCostImage::RegionType region = voxelsVisited->GetBufferedRegion();
+  if( rayTime && rayTime->GetBufferedRegion() != region )
     {
-    iU = 1;
+    itkExceptionMacro(<<"The ray time image does not have the buffered region of the voxel count image");
     }
-  else
+
+  const typename TCostImage::SizeType size = region.GetSize();
+  const SizeValueType rowLength = size[0];
+  SizeValueType numberOfRows = 1;
+  for( unsigned int d = 1; d < TCostImage::ImageDimension; d++ )
     {
-    iU = -1;
+    numberOfRows *= size[d];
     }
-  if (SourceWorld[1] < drrPixelWorld[1])
+  if( rowLength == 0 || numberOfRows == 0 )
     {
-    jU = 1;
+    return;
     }
-  else
+
+  TraceSpan span( m_Tracer, "RenderRayCost", "raycast" );
+
+  this->UpdateRaySetup();
+
+  double source[3];
+  for( unsigned int d = 0; d < 3; d++ )
     {
-    jU = -1;
+    source[d] = static_cast<double>( m_RaySource[d] );
     }
 
-  if (SourceWorld[2] < drrPixelWorld[2])
+  CostPixelType * voxelsBuffer = voxelsVisited->GetBufferPointer();
+  CostPixelType * timeBuffer = rayTime ? rayTime->GetBufferPointer() : nullptr;
+  const CountingAccumulatorType prototype( AccumulatorType( m_Threshold ), m_Threshold );
+
+  auto renderTile = [&]( SizeValueType beginColumn, SizeValueType endColumn,
+                         SizeValueType beginRow, SizeValueType endRow, unsigned int )
+    {
+    const InputImageType * volume = this->GetWorkerVolume();
+    const VoxelAccessType access( volume );
+    double spacing[3];
+    SizeValueType volumeSize[3];
+    GetVolumeGeometry( volume, spacing, volumeSize );
+
+    TraceSpan tileSpan( m_Tracer, "Tile", "raycast", "row", static_cast<int64_t>( beginRow ) );
+    PointType start;
+    typename PointType::VectorType step;
+    OffsetValueType offset;
+    for( SizeValueType row = beginRow; row < endRow; row++ )
+      {
+      GetProjectionRow( voxelsVisited, row, start, step, offset );
+      this->template CastLine< RayRealType >( start, step, beginColumn, endColumn,
+        [&]( SizeValueType k, const RayRealType rayVector[3] )
+        {
+        CountingAccumulatorType rayAccumulator = prototype;
+        if( timeBuffer )
+          {
+          const auto rayStart = std::chrono::steady_clock::now();
+          KernelType::Accumulate( source, rayVector, spacing, volumeSize, access, rayAccumulator );
+          const auto elapsed = std::chrono::steady_clock::now() - rayStart;
+          timeBuffer[offset + k] = ClampOutput<CostPixelType>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() );
+          }
+        else
+          {
+          KernelType::Accumulate( source, rayVector, spacing, volumeSize, access, rayAccumulator );
+          }
+        voxelsBuffer[offset + k] = ClampOutput<CostPixelType>( rayAccumulator.GetVoxelsVisited() );
+        } );
+      }
+    };
+
+  if( pool )
     {
-    kU = 1;
+    pool->ParallelForTiles( rowLength, numberOfRows, renderTile );
     }
   else
     {
-    kU = -1;
+    renderTile( 0, rowLength, 0, numberOfRows, 0 );
     }
+}
 
-  d12 = 0.0; /* Initialize the sum of the voxel intensities along the ray path to zero. */
-
-
-  /* Initialize the current ray position. */
-  alphaCmin = std::min(std::min(alphaX, alphaY), alphaZ);
 
-  /* Initialize the current voxel index. */
-  cIndex[0] = firstIntersectionIndexDown[0];
-  cIndex[1] = firstIntersectionIndexDown[1];
-  cIndex[2] = firstIntersectionIndexDown[2];
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TProjectionImage>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::GetProjectionRow( const TProjectionImage * projection,
+                    SizeValueType row,
+                    PointType & start,
+                    typename PointType::VectorType & step,
+                    OffsetValueType & offset )
+{
+  const typename TProjectionImage::RegionType region = projection->GetBufferedRegion();
+  const typename TProjectionImage::SizeType size = region.GetSize();
 
-  while(alphaCmin < alphaMax) /* Check if the ray is still in the CT volume */
+  typename TProjectionImage::IndexType index;
+  SizeValueType remainder = row;
+  index[0] = region.GetIndex()[0];
+  for( unsigned int d = 1; d < TProjectionImage::ImageDimension; d++ )
     {
-    /* Store the current ray position */
-    alphaCminPrev = alphaCmin;
-
-    if ((alphaX <= alphaY) && (alphaX <= alphaZ))
-      {
-      /* Current ray front intercepts with x-plane. Update alphaX. */
-      alphaCmin = alphaX;
-      cIndex[0] = cIndex[0] + iU;
-      alphaX = alphaX + alphaUx;
-      }
-    else if ((alphaY <= alphaX) && (alphaY <= alphaZ))
-      {
-      /* Current ray front intercepts with y-plane. Update alphaY. */
-      alphaCmin = alphaY;
-      cIndex[1] = cIndex[1] + jU;
-      alphaY = alphaY + alphaUy;
-      }
-    else
-      {
-    /* Current ray front intercepts with z-plane. Update alphaZ. */
-    alphaCmin = alphaZ;
-    cIndex[2] = cIndex[2] + kU;
-    alphaZ = alphaZ + alphaUz;
+    index[d] = region.GetIndex()[d] + static_cast<IndexValueType>( remainder % size[d] );
+    remainder /= size[d];
     }
 
-    if ((cIndex[0] >= 0) && (cIndex[0] < static_cast< IndexValueType >(sizeCT[0])) &&
-        (cIndex[1] >= 0) && (cIndex[1] < static_cast< IndexValueType >(sizeCT[1])) &&
-        (cIndex[2] >= 0) && (cIndex[2] < static_cast< IndexValueType >(sizeCT[2])))
-      {
-      /* If it is a valid index, get the voxel intensity. */
-      value = static_cast<float>(inputPtr->GetPixel(cIndex));
-      if (value > m_Threshold) /* Ignore voxels whose intensities are below the threshold. */
-        {
-        d12 += (alphaCmin - alphaCminPrev) * (value - m_Threshold);
-        }
-      }
-    }
+  PointType next;
+  projection->TransformIndexToPhysicalPoint( index, start );
+  index[0]++;
+  projection->TransformIndexToPhysicalPoint( index, next );
+  index[0]--;
+  step = next - start;
+  offset = projection->ComputeOffset( index );
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+template<typename TValue, typename TReal>
+TValue
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::ClampOutput( TReal d12 )
+{
+  // Min/max values of the value type AND these values
+  // represented as the output type of the interpolator
+  const TValue minOutputValue =  itk::NumericTraits<TValue >::NonpositiveMin();
+  const TValue maxOutputValue =  itk::NumericTraits<TValue >::max();
 
   if( d12 < minOutputValue )
     {
-    pixval = minOutputValue;
+    return minOutputValue;
     }
   else if( d12 > maxOutputValue )
     {
-    pixval = maxOutputValue;
+    return maxOutputValue;
     }
-  else
+  return static_cast<TValue>( d12 );
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+const typename SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >::InputImageType *
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::GetWorkerVolume() const
+{
+  // Read the copy of the volume placed on the node of the worker, if any
+  const int node = RayCastWorkerPool::GetCurrentWorkerNode();
+  if( node >= 0 && static_cast< size_t >( node ) < m_VolumeReplicas.size() && m_VolumeReplicas[node] )
+    {
+    return m_VolumeReplicas[node].GetPointer();
+    }
+  return this->GetInputImage();
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::GetVolumeGeometry( const InputImageType * volume, double spacing[3], SizeValueType size[3] )
+{
+  const typename InputImageType::SpacingType ctPixelSpacing = volume->GetSpacing();
+  const typename InputImageType::SizeType sizeCT = volume->GetLargestPossibleRegion().GetSize();
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    spacing[d] = ctPixelSpacing[d];
+    size[d] = sizeCT[d];
+    }
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+typename SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >::KernelRealType
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::ComputeRayIntegral( const PointType & SourceWorld, const KernelRealType rayVector[3] ) const
+{
+  const InputImageType * inputPtr = this->GetWorkerVolume();
+
+  // The whole volume is buffered, the ray is traced in one go
+  RayState ray;
+  this->InitializeRay( SourceWorld, rayVector, inputPtr, ray );
+  this->TraceRay( ray, inputPtr,
+                  NumericTraits< IndexValueType >::NonpositiveMin(),
+                  NumericTraits< IndexValueType >::max() );
+
+  PerformanceCounterBuffer counts;
+  counts.CountRay( ray.Accumulator );
+  m_PerformanceCounters->Flush( counts );
+
+  return ray.Accumulator.GetResult();
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::InitializeRay( const PointType & SourceWorld, const KernelRealType rayVector[3],
+                 const InputImageType * volume, RayState & ray ) const
+{
+  double source[3];
+  double spacing[3];
+  SizeValueType size[3];
+  for( unsigned int d = 0; d < 3; d++ )
     {
-    pixval = static_cast<OutputType>( d12 );
+    source[d] = static_cast<double>( SourceWorld[d] );
     }
-  return ( pixval);
+  GetVolumeGeometry( volume, spacing, size );
 
+  // The Siddon-Jacobs fast ray-tracing algorithm
+  ray.Traversal.Initialize( source, rayVector, spacing, size );
+  ray.Accumulator = MakeCountedRayAccumulator( AccumulatorType( m_Threshold ), m_Threshold );
 }
 
 
-template<typename TInputImage, typename TCoordRep>
-typename SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >::OutputType
-SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+bool
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::TraceRay( RayState & ray, const InputImageType * volume,
+            IndexValueType zBegin, IndexValueType zEnd ) const
+{
+  return ray.Traversal.Trace( VoxelAccessType( volume ), ray.Accumulator, zBegin, zEnd );
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+typename SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >::OutputType
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
 ::EvaluateAtContinuousIndex( const ContinuousIndexType& index ) const
 {
   OutputPointType point;
@@ -397,8 +679,8 @@ SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
 }
 
 
-template<typename TInputImage, typename TCoordRep>
-void SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
 ::ComputeInverseTransform() const
 {
   m_ComposedTransform->SetIdentity();
@@ -430,16 +712,94 @@ void SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
   // The overall inverse transform is computed. The inverse transform will be used by the interpolation
   // procedure.
   m_ComposedTransform->GetInverse( m_InverseTransform);
-  this->Modified();
 }
 
 
-template<typename TInputImage, typename TCoordRep>
-void SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep >
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+ModifiedTimeType
+SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::GetRaySetupMTime() const
+{
+  ModifiedTimeType mtime = this->GetMTime();
+  if( m_Transform )
+    {
+    mtime = std::max( mtime, m_Transform->GetMTime() );
+    }
+  if( m_ProjectionGeometry )
+    {
+    mtime = std::max( mtime, m_ProjectionGeometry->GetMTime() );
+    }
+  return mtime;
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
+::ComputeRaySetup() const
+{
+  std::lock_guard<std::mutex> lock( m_RaySetupMutex );
+
+  // Another thread may have updated the setup while we were waiting
+  const ModifiedTimeType mtime = this->GetRaySetupMTime();
+  if( mtime <= m_RaySetupMTime.load( std::memory_order_relaxed ) )
+    {
+    return;
+    }
+
+  if( !m_Transform )
+    {
+    itkExceptionMacro(<<"Transform has not been assigned");
+    }
+
+  if( m_ProjectionGeometry )
+    {
+    // The geometry is defined in the fixed world, the volume is displaced
+    // by m_Transform. Rays are mapped back into the volume by the inverse
+    // of the volume transform, which is affine.
+    m_Transform->GetInverse( m_InverseTransform );
+    m_RaySource = m_InverseTransform->TransformPoint( m_ProjectionGeometry->GetSourcePosition() );
+
+    const typename TransformType::MatrixType & inverseMatrix = m_InverseTransform->GetMatrix();
+    const typename ProjectionGeometryType::MatrixType & rayMatrix = m_ProjectionGeometry->GetRayMatrix();
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        m_RayMatrix[i][j] = inverseMatrix[i][0] * rayMatrix[0][j]
+                          + inverseMatrix[i][1] * rayMatrix[1][j]
+                          + inverseMatrix[i][2] * rayMatrix[2][j];
+        }
+      }
+    }
+  else
+    {
+    // The source is at the origin of the camera coordinate system, so the
+    // ray to a projection image point is the linear part of the overall
+    // inverse transform applied to that point.
+    this->ComputeInverseTransform();
+    m_RaySource = m_InverseTransform->TransformPoint( m_SourcePoint );
+
+    const typename TransformType::MatrixType & inverseMatrix = m_InverseTransform->GetMatrix();
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        m_RayMatrix[i][j] = inverseMatrix[i][j];
+        }
+      }
+    }
+
+  m_RaySetupMTime.store( mtime, std::memory_order_release );
+}
+
+
+template<typename TInputImage, typename TCoordRep, typename TKernelReal>
+void SiddonJacobsRayCastInterpolateImageFunction< TInputImage, TCoordRep, TKernelReal >
 ::Initialize()
 {
-  this->ComputeInverseTransform();
-  m_SourceWorld = m_InverseTransform->TransformPoint(m_SourcePoint);
+  m_RaySetupMTime.store( 0 );
+  this->ComputeRaySetup();
+  m_SourceWorld = m_RaySource;
 }
 
 } // namespace itk
@@ -0,0 +1,174 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkThresholdSurfaceMesh_h
+#define itkThresholdSurfaceMesh_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class ThresholdSurfaceMesh
+ * \brief Surface of the voxels of a volume above a threshold, with a
+ * bounding volume hierarchy for casting rays.
+ *
+ * The surface is made of the faces separating the voxels above the
+ * threshold from the others, in the frame of the ray casting kernel: the
+ * volume has its origin at (0,0,0) and voxel (i,j,k) covers
+ * [i,i+1) x [j,j+1) x [k,k+1) times the spacing. The faces are axis
+ * aligned rectangles, which are intersected exactly and without the
+ * cracks of a triangulation. The voxel faces of a plane bounding the same
+ * region on the same side are merged greedily into larger rectangles, so
+ * that the number of faces follows the number of flat patches of the
+ * surface rather than its area. The faces are held in a bounding volume
+ * hierarchy split at the median of the longest axis.
+ *
+ * The regions are labelled on the runs of voxels above the threshold
+ * along x, so that the memory used by Build() grows with the number of
+ * runs, not with the number of voxels.
+ *
+ * Every face carries the density of the voxels it bounds: the mean of
+ * the voxel values minus the threshold, either over all the voxels above
+ * the threshold or over the 6-connected region of the voxel. The integral
+ * of a ray is then the density weighted length of the ray inside the
+ * surface, obtained from the intersections alone: exits add and entries
+ * subtract their ray parameter times the density. It approximates the
+ * thresholded line integral of SiddonJacobsRayCastInterpolateImageFunction
+ * by replacing the voxel values with the mean density of their region,
+ * which is a good approximation for a few rigid structures of nearly
+ * uniform density such as bones.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+template <typename TVolumeImage>
+class ThresholdSurfaceMesh : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(ThresholdSurfaceMesh);
+
+  /** Standard class type alias. */
+  using Self = ThresholdSurfaceMesh;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ThresholdSurfaceMesh, Object);
+
+  using VolumeType = TVolumeImage;
+  using PixelType = typename VolumeType::PixelType;
+
+  /** Extract the surface of the voxels of a volume above the threshold
+   * and build the hierarchy. The volume must be buffered as a whole; its
+   * origin is ignored. */
+  void Build( const VolumeType * volume, double threshold, bool meanDensityPerRegion );
+
+  /** Compute the density weighted length, in units of alpha, of the line
+   * source + alpha * ray inside the surface. */
+  double ComputeRayIntegral( const double source[3], const double ray[3] ) const;
+
+  /** Get the number of faces of the surface. */
+  SizeValueType GetNumberOfFaces() const
+  {
+    return m_Faces.size();
+  }
+
+  /** Get the number of regions, 1 when the mean density is not computed
+   * per region, and the density of a region. */
+  SizeValueType GetNumberOfRegions() const
+  {
+    return m_RegionDensities.size();
+  }
+  double GetRegionDensity( SizeValueType region ) const
+  {
+    return m_RegionDensities[region];
+  }
+
+  /** Get the number of nodes of the bounding volume hierarchy. */
+  SizeValueType GetNumberOfNodes() const
+  {
+    return m_Nodes.size();
+  }
+
+  /** Get the size of the faces, the hierarchy and the densities, in
+   * bytes. */
+  SizeValueType GetMemorySize() const
+  {
+    return static_cast<SizeValueType>( m_Faces.capacity() * sizeof( Face ) + m_Nodes.capacity() * sizeof( Node )
+                                       + m_RegionDensities.capacity() * sizeof( double ) );
+  }
+
+protected:
+  ThresholdSurfaceMesh();
+  ~ThresholdSurfaceMesh() override {};
+  void PrintSelf(std::ostream& os, Indent indent) const override;
+
+private:
+  /** A voxel face at Plane along Axis, covering [Min, Max) along the two
+   * following axes. Normal is +1 when the voxels above the threshold lie
+   * below the plane, -1 otherwise. */
+  struct Face
+  {
+    double        Plane;
+    double        Min[2];
+    double        Max[2];
+    double        Density;
+    unsigned char Axis;
+    signed char   Normal;
+  };
+
+  /** A node of the hierarchy. A leaf holds the faces [First, First +
+   * Count); an inner node has Count 0, its first child follows it and its
+   * second child is at First. */
+  struct Node
+  {
+    double        Min[3];
+    double        Max[3];
+    SizeValueType First;
+    SizeValueType Count;
+  };
+
+  /** Get the bounds of a face along an axis. */
+  static void GetFaceBounds( const Face & face, unsigned int axis, double & min, double & max );
+
+  /** Build the node of the faces [begin, end) and its descendants, and
+   * return its index. */
+  SizeValueType BuildNode( SizeValueType begin, SizeValueType end, double padding );
+
+  /** Check whether the line crosses the box of a node. */
+  static bool IntersectsNode( const Node & node, const double source[3],
+                              const double ray[3], const double inverseRay[3] );
+
+  std::vector<Face>   m_Faces;
+  std::vector<Node>   m_Nodes;
+  std::vector<double> m_RegionDensities;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkThresholdSurfaceMesh.hxx"
+#endif
+
+#endif
@@ -0,0 +1,493 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkThresholdSurfaceMesh_hxx
+#define itkThresholdSurfaceMesh_hxx
+
+#include "itkThresholdSurfaceMesh.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace itk
+{
+
+template <typename TVolumeImage>
+ThresholdSurfaceMesh<TVolumeImage>
+::ThresholdSurfaceMesh()
+{
+}
+
+
+template <typename TVolumeImage>
+void
+ThresholdSurfaceMesh<TVolumeImage>
+::Build( const VolumeType * volume, double threshold, bool meanDensityPerRegion )
+{
+  if( !volume )
+    {
+    itkExceptionMacro(<<"No volume to extract the surface from");
+    }
+  const typename VolumeType::RegionType region = volume->GetBufferedRegion();
+  if( region != volume->GetLargestPossibleRegion() )
+    {
+    itkExceptionMacro(<<"The volume must be buffered as a whole");
+    }
+
+  const PixelType * buffer = volume->GetBufferPointer();
+  const typename VolumeType::SpacingType spacing = volume->GetSpacing();
+  IndexValueType size[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    size[d] = static_cast<IndexValueType>( region.GetSize()[d] );
+    }
+  const OffsetValueType stride[3] = { 1, size[0], size[0] * size[1] };
+  const SizeValueType rowsPerSlice = static_cast<SizeValueType>( size[1] );
+  const SizeValueType numberOfRows = rowsPerSlice * static_cast<SizeValueType>( size[2] );
+
+  auto isAbove = [buffer, threshold]( OffsetValueType offset )
+    {
+    return static_cast<double>( buffer[offset] ) > threshold;
+    };
+
+  // The voxels above the threshold as runs along x: the runs of row
+  // j + k * size[1] are [rowFirst[row], rowFirst[row + 1])
+  struct Run
+  {
+    IndexValueType Begin;
+    IndexValueType End;
+  };
+  std::vector<Run>           runs;
+  std::vector<SizeValueType> rowFirst( numberOfRows + 1, 0 );
+  for( SizeValueType row = 0; row < numberOfRows; row++ )
+    {
+    rowFirst[row] = runs.size();
+    const OffsetValueType rowOffset = static_cast<OffsetValueType>( row ) * size[0];
+    for( IndexValueType i = 0; i < size[0]; i++ )
+      {
+      if( isAbove( rowOffset + i ) )
+        {
+        if( runs.size() == rowFirst[row] || runs.back().End != i )
+          {
+          runs.push_back( Run{ i, i + 1 } );
+          }
+        else
+          {
+          runs.back().End = i + 1;
+          }
+        }
+      }
+    }
+  rowFirst[numberOfRows] = runs.size();
+
+  // Label the runs with their 6-connected region, or all with the same
+  // region, by joining the overlapping runs of the previous row and slice
+  std::vector<SizeValueType> parent( runs.size() );
+  for( SizeValueType r = 0; r < runs.size(); r++ )
+    {
+    parent[r] = meanDensityPerRegion ? r : 0;
+    }
+  auto findRoot = [&parent]( SizeValueType r )
+    {
+    while( parent[r] != r )
+      {
+      parent[r] = parent[parent[r]];
+      r = parent[r];
+      }
+    return r;
+    };
+  auto joinRows = [&]( SizeValueType row, SizeValueType otherRow )
+    {
+    SizeValueType r = rowFirst[row];
+    SizeValueType o = rowFirst[otherRow];
+    while( r < rowFirst[row + 1] && o < rowFirst[otherRow + 1] )
+      {
+      if( runs[r].Begin < runs[o].End && runs[o].Begin < runs[r].End )
+        {
+        const SizeValueType root1 = findRoot( r );
+        const SizeValueType root2 = findRoot( o );
+        parent[std::max( root1, root2 )] = std::min( root1, root2 );
+        }
+      if( runs[r].End < runs[o].End )
+        {
+        r++;
+        }
+      else
+        {
+        o++;
+        }
+      }
+    };
+  if( meanDensityPerRegion )
+    {
+    for( SizeValueType row = 0; row < numberOfRows; row++ )
+      {
+      if( row % rowsPerSlice > 0 )
+        {
+        joinRows( row, row - 1 );
+        }
+      if( row >= rowsPerSlice )
+        {
+        joinRows( row, row - rowsPerSlice );
+        }
+      }
+    }
+
+  // Number the regions and sum the values of their voxels. A root has the
+  // lowest index of its region, so it is numbered first.
+  std::vector<SizeValueType> runRegions( runs.size() );
+  std::vector<double>        sums;
+  std::vector<SizeValueType> counts;
+  for( SizeValueType row = 0; row < numberOfRows; row++ )
+    {
+    const OffsetValueType rowOffset = static_cast<OffsetValueType>( row ) * size[0];
+    for( SizeValueType r = rowFirst[row]; r < rowFirst[row + 1]; r++ )
+      {
+      const SizeValueType root = findRoot( r );
+      if( root == r )
+        {
+        runRegions[r] = sums.size();
+        sums.push_back( 0.0 );
+        counts.push_back( 0 );
+        }
+      else
+        {
+        runRegions[r] = runRegions[root];
+        }
+      for( IndexValueType i = runs[r].Begin; i < runs[r].End; i++ )
+        {
+        sums[runRegions[r]] += static_cast<double>( buffer[rowOffset + i] ) - threshold;
+        }
+      counts[runRegions[r]] += static_cast<SizeValueType>( runs[r].End - runs[r].Begin );
+      }
+    }
+
+  m_RegionDensities.resize( sums.size() );
+  for( SizeValueType r = 0; r < sums.size(); r++ )
+    {
+    m_RegionDensities[r] = sums[r] / static_cast<double>( counts[r] );
+    }
+
+  // Region of a voxel above the threshold, from the runs of its row
+  auto getRegion = [&]( const IndexValueType index[3] ) -> SizeValueType
+    {
+    const SizeValueType row = static_cast<SizeValueType>( index[1] ) + static_cast<SizeValueType>( index[2] ) * rowsPerSlice;
+    const auto run = std::upper_bound( runs.begin() + rowFirst[row], runs.begin() + rowFirst[row + 1], index[0],
+      []( IndexValueType i, const Run & candidate )
+      {
+      return i < candidate.Begin;
+      } );
+    return runRegions[( run - runs.begin() ) - 1];
+    };
+
+  // Emit the faces between the voxels above the threshold and the others,
+  // including the faces on the border of the volume. The faces of a plane
+  // facing the same way are merged greedily into rectangles of the same
+  // region: a rectangle is extended along the first axis of the plane,
+  // then along the second while all its cells are faces.
+  m_Faces.clear();
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    const unsigned int b = ( d + 1 ) % 3;
+    const unsigned int c = ( d + 2 ) % 3;
+    const IndexValueType width = size[b];
+    const IndexValueType height = size[c];
+    // Region of the face of every cell of the plane, -1 without a face
+    std::vector<OffsetValueType> cells( static_cast<SizeValueType>( width * height ) );
+    for( IndexValueType plane = 0; plane <= size[d]; plane++ )
+      {
+      for( int direction = -1; direction <= 1; direction += 2 )
+        {
+        // The voxel whose face lies in the plane, on the side opposite to
+        // the normal
+        IndexValueType index[3];
+        index[d] = direction > 0 ? plane - 1 : plane;
+        const IndexValueType neighbor = index[d] + direction;
+        bool empty = true;
+        for( index[c] = 0; index[c] < height; index[c]++ )
+          {
+          for( index[b] = 0; index[b] < width; index[b]++ )
+            {
+            OffsetValueType & cell = cells[index[b] + index[c] * width];
+            cell = -1;
+            if( index[d] < 0 || index[d] >= size[d] )
+              {
+              continue;
+              }
+            const OffsetValueType offset = index[0] + index[1] * stride[1] + index[2] * stride[2];
+            if( isAbove( offset )
+                && !( neighbor >= 0 && neighbor < size[d] && isAbove( offset + direction * stride[d] ) ) )
+              {
+              cell = static_cast<OffsetValueType>( getRegion( index ) );
+              empty = false;
+              }
+            }
+          }
+        if( empty )
+          {
+          continue;
+          }
+
+        for( IndexValueType v = 0; v < height; v++ )
+          {
+          for( IndexValueType u = 0; u < width; u++ )
+            {
+            const OffsetValueType key = cells[u + v * width];
+            if( key < 0 )
+              {
+              continue;
+              }
+            IndexValueType faceWidth = 1;
+            while( u + faceWidth < width && cells[u + faceWidth + v * width] == key )
+              {
+              faceWidth++;
+              }
+            IndexValueType faceHeight = 1;
+            while( v + faceHeight < height
+                   && std::all_of( cells.begin() + u + ( v + faceHeight ) * width,
+                                   cells.begin() + u + faceWidth + ( v + faceHeight ) * width,
+                                   [key]( OffsetValueType cell ) { return cell == key; } ) )
+              {
+              faceHeight++;
+              }
+            for( IndexValueType y = v; y < v + faceHeight; y++ )
+              {
+              std::fill( cells.begin() + u + y * width, cells.begin() + u + faceWidth + y * width, -1 );
+              }
+
+            Face face;
+            face.Plane = plane * spacing[d];
+            face.Min[0] = u * spacing[b];
+            face.Max[0] = ( u + faceWidth ) * spacing[b];
+            face.Min[1] = v * spacing[c];
+            face.Max[1] = ( v + faceHeight ) * spacing[c];
+            face.Density = m_RegionDensities[key];
+            face.Axis = static_cast<unsigned char>( d );
+            face.Normal = static_cast<signed char>( direction );
+            m_Faces.push_back( face );
+            u += faceWidth - 1;
+            }
+          }
+        }
+      }
+    }
+
+  // The boxes are padded so that the rounding of the box test does not
+  // miss the faces on their boundary
+  m_Nodes.clear();
+  if( !m_Faces.empty() )
+    {
+    m_Nodes.reserve( m_Faces.size() / 2 + 1 );
+    const double padding = 1e-6 * std::min( std::min( spacing[0], spacing[1] ), spacing[2] );
+    this->BuildNode( 0, m_Faces.size(), padding );
+    }
+  this->Modified();
+}
+
+
+template <typename TVolumeImage>
+void
+ThresholdSurfaceMesh<TVolumeImage>
+::GetFaceBounds( const Face & face, unsigned int axis, double & min, double & max )
+{
+  if( axis == face.Axis )
+    {
+    min = face.Plane;
+    max = face.Plane;
+    }
+  else
+    {
+    const unsigned int k = ( axis == ( face.Axis + 1u ) % 3 ) ? 0 : 1;
+    min = face.Min[k];
+    max = face.Max[k];
+    }
+}
+
+
+template <typename TVolumeImage>
+SizeValueType
+ThresholdSurfaceMesh<TVolumeImage>
+::BuildNode( SizeValueType begin, SizeValueType end, double padding )
+{
+  const SizeValueType maximumLeafSize = 4;
+
+  const SizeValueType index = m_Nodes.size();
+  m_Nodes.push_back( Node() );
+
+  Node node;
+  double centroidMin[3];
+  double centroidMax[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    node.Min[d] = centroidMin[d] = std::numeric_limits<double>::max();
+    node.Max[d] = centroidMax[d] = std::numeric_limits<double>::lowest();
+    }
+  for( SizeValueType f = begin; f < end; f++ )
+    {
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      double min, max;
+      GetFaceBounds( m_Faces[f], d, min, max );
+      node.Min[d] = std::min( node.Min[d], min );
+      node.Max[d] = std::max( node.Max[d], max );
+      centroidMin[d] = std::min( centroidMin[d], 0.5 * ( min + max ) );
+      centroidMax[d] = std::max( centroidMax[d], 0.5 * ( min + max ) );
+      }
+    }
+  unsigned int axis = 0;
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    node.Min[d] -= padding;
+    node.Max[d] += padding;
+    if( centroidMax[d] - centroidMin[d] > centroidMax[axis] - centroidMin[axis] )
+      {
+      axis = d;
+      }
+    }
+
+  if( end - begin <= maximumLeafSize || !( centroidMax[axis] > centroidMin[axis] ) )
+    {
+    node.First = begin;
+    node.Count = end - begin;
+    m_Nodes[index] = node;
+    return index;
+    }
+
+  // Split the faces at the median of their centroids along the longest axis
+  const SizeValueType middle = begin + ( end - begin ) / 2;
+  std::nth_element( m_Faces.begin() + begin, m_Faces.begin() + middle, m_Faces.begin() + end,
+    [axis]( const Face & face1, const Face & face2 )
+    {
+    double min1, max1, min2, max2;
+    GetFaceBounds( face1, axis, min1, max1 );
+    GetFaceBounds( face2, axis, min2, max2 );
+    return min1 + max1 < min2 + max2;
+    } );
+
+  node.Count = 0;
+  this->BuildNode( begin, middle, padding );
+  node.First = this->BuildNode( middle, end, padding );
+  m_Nodes[index] = node;
+  return index;
+}
+
+
+template <typename TVolumeImage>
+bool
+ThresholdSurfaceMesh<TVolumeImage>
+::IntersectsNode( const Node & node, const double source[3],
+                  const double ray[3], const double inverseRay[3] )
+{
+  double alphaMin = std::numeric_limits<double>::lowest();
+  double alphaMax = std::numeric_limits<double>::max();
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    if( ray[d] == 0 )
+      {
+      if( source[d] < node.Min[d] || source[d] > node.Max[d] )
+        {
+        return false;
+        }
+      }
+    else
+      {
+      const double alpha1 = ( node.Min[d] - source[d] ) * inverseRay[d];
+      const double alpha2 = ( node.Max[d] - source[d] ) * inverseRay[d];
+      alphaMin = std::max( alphaMin, std::min( alpha1, alpha2 ) );
+      alphaMax = std::min( alphaMax, std::max( alpha1, alpha2 ) );
+      }
+    }
+  return alphaMin <= alphaMax;
+}
+
+
+template <typename TVolumeImage>
+double
+ThresholdSurfaceMesh<TVolumeImage>
+::ComputeRayIntegral( const double source[3], const double ray[3] ) const
+{
+  if( m_Nodes.empty() )
+    {
+    return 0.0;
+    }
+
+  double inverseRay[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    inverseRay[d] = ( ray[d] != 0 ) ? 1.0 / ray[d] : 0.0;
+    }
+
+  // The hierarchy is split at the median, its depth is below 64
+  SizeValueType stack[64];
+  unsigned int depth = 0;
+  SizeValueType current = 0;
+  double integral = 0.0;
+  for(;;)
+    {
+    const Node & node = m_Nodes[current];
+    if( IntersectsNode( node, source, ray, inverseRay ) )
+      {
+      if( node.Count == 0 )
+        {
+        stack[depth++] = node.First;
+        current++;
+        continue;
+        }
+      for( SizeValueType f = node.First; f < node.First + node.Count; f++ )
+        {
+        const Face & face = m_Faces[f];
+        const unsigned int a = face.Axis;
+        if( ray[a] == 0 )
+          {
+          continue; // Parallel to the face
+          }
+        const unsigned int b = ( a + 1 ) % 3;
+        const unsigned int c = ( a + 2 ) % 3;
+        const double alpha = ( face.Plane - source[a] ) * inverseRay[a];
+        const double pb = source[b] + alpha * ray[b];
+        const double pc = source[c] + alpha * ray[c];
+        if( pb >= face.Min[0] && pb < face.Max[0] && pc >= face.Min[1] && pc < face.Max[1] )
+          {
+          // The ray leaves the surface where it advances along the normal
+          integral += ( face.Normal * ray[a] > 0 ) ? alpha * face.Density : -alpha * face.Density;
+          }
+        }
+      }
+    if( depth == 0 )
+      {
+      break;
+      }
+    current = stack[--depth];
+    }
+  return integral;
+}
+
+
+template <typename TVolumeImage>
+void
+ThresholdSurfaceMesh<TVolumeImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+  os << indent << "NumberOfFaces: " << m_Faces.size() << std::endl;
+  os << indent << "NumberOfRegions: " << m_RegionDensities.size() << std::endl;
+  os << indent << "NumberOfNodes: " << m_Nodes.size() << std::endl;
+}
+
+} // end namespace itk
+
+#endif
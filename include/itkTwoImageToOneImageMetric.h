@@ -25,6 +25,11 @@
 #include "itkExceptionObject.h"
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkSpatialObject.h"
+#include "itkRayCastWorkerPool.h"
+#include "itkRegistrationCancellationToken.h"
+#include "itkRegistrationPerformanceCounters.h"
+#include "itkRegistrationTracer.h"
+#include "itkRegistrationMemoryAccount.h"
 
 namespace itk
 {
@@ -43,6 +48,17 @@ namespace itk
  * non-grid positions resulting from mapping points through
  * the Transform.
  *
+ * When a RayCastWorkerPool is connected, subclasses distribute tiles of
+ * the fixed image regions over its workers, see
+ * RayCastWorkerPool::ParallelForTiles().
+ *
+ * The sums of the tiles are then combined in an order that depends on the
+ * scheduling, so that the metric value may vary in the last bits from one
+ * evaluation to the next. In the deterministic reduction mode, the regions
+ * are instead split into fixed tiles of ReductionTileSize x
+ * ReductionTileSize pixels, independent of the number of workers, whose
+ * sums are combined pairwise in a fixed order: the value, and therefore
+ * the path of the optimizer, is bit-identical for any number of workers.
  *
  * \ingroup RegistrationMetrics
  * \ingroup TwoProjectionRegistration
@@ -201,6 +217,60 @@ public:
   /** Get Gradient Image. */
   itkGetConstObjectMacro( GradientImage, GradientImageType );
 
+  /** Set/Get the worker pool used to evaluate the metric in parallel. The
+   * metric is evaluated by the calling thread if none is set. */
+  itkSetObjectMacro( WorkerPool, RayCastWorkerPool );
+  itkGetConstObjectMacro( WorkerPool, RayCastWorkerPool );
+
+  /** Set/Get whether the sums over the fixed image regions are reduced
+   * deterministically, independently of the number of workers and of the
+   * scheduling. Default is false. */
+  itkSetMacro( DeterministicReduction, bool );
+  itkGetConstMacro( DeterministicReduction, bool );
+  itkBooleanMacro( DeterministicReduction );
+
+  /** Set/Get the edge length, in pixels, of the tiles of the deterministic
+   * reduction. The result depends on it. Default is 16. */
+  itkSetClampMacro( ReductionTileSize, SizeValueType, 1, NumericTraits<SizeValueType>::max() );
+  itkGetConstMacro( ReductionTileSize, SizeValueType );
+
+  /** Set/Get the token polled to cancel a running evaluation. Subclasses
+   * check it before every evaluation and between the rows of the fixed
+   * image regions. */
+  itkSetObjectMacro( CancellationToken, RegistrationCancellationToken );
+  itkGetConstObjectMacro( CancellationToken, RegistrationCancellationToken );
+
+  /** Set/Get the performance counters the evaluations are counted into,
+   * see RegistrationPerformanceCounters. The metric has its own by
+   * default. Subclasses count the evaluations, the pixels counted and the
+   * time spent in their tiles and in the reduction of their sums. */
+  itkSetObjectMacro( PerformanceCounters, RegistrationPerformanceCounters );
+  itkGetModifiableObjectMacro( PerformanceCounters, RegistrationPerformanceCounters );
+
+  /** Set/Get the tracer the spans of the metric are recorded into, see
+   * RegistrationTracer. The metric has its own, disabled, by default.
+   * Initialize() traces the gradient filter, subclasses trace their
+   * evaluations, their views and their tiles. */
+  itkSetObjectMacro( Tracer, RegistrationTracer );
+  itkGetModifiableObjectMacro( Tracer, RegistrationTracer );
+
+  /** Set/Get the memory account the buffers of the metric are declared
+   * to, see RegistrationMemoryAccount. The metric has its own by default.
+   * Initialize() declares the gradient image, subclasses the sums of their
+   * workers and tiles. Setting a null account gives the metric its own
+   * account again. */
+  virtual void SetMemoryAccount( RegistrationMemoryAccount * account )
+  {
+    if( m_MemoryAccount != account )
+      {
+      // Without an account, the metric has its own again
+      m_MemoryAccount = account ? account : RegistrationMemoryAccount::New().GetPointer();
+      this->Modified();
+      }
+  }
+
+  itkGetModifiableObjectMacro( MemoryAccount, RegistrationMemoryAccount );
+
   /** Set the parameters defining the Transform. */
   void SetTransformParameters( const ParametersType & parameters ) const;
 
@@ -216,9 +286,35 @@ public:
 
 protected:
   TwoImageToOneImageMetric();
-  ~TwoImageToOneImageMetric() override {};
+  ~TwoImageToOneImageMetric() override
+  {
+    m_MemoryAccount->ReleaseAllocations( this );
+  }
   void PrintSelf(std::ostream& os, Indent indent) const override;
 
+  /** Get the number of rows, i.e. lines along the first axis, of a fixed
+   * image region. */
+  static SizeValueType GetNumberOfRows( const FixedImageRegionType & region );
+
+  /** Get the index of the first pixel of a row of a fixed image region. */
+  static typename FixedImageType::IndexType GetRowIndex( const FixedImageRegionType & region,
+                                                         SizeValueType row );
+
+  /** Check whether the cancellation of the evaluation was requested. */
+  bool IsCancellationRequested() const
+  {
+    return m_CancellationToken && m_CancellationToken->IsCancellationRequested();
+  }
+
+  /** Throw a ProcessAborted exception if the cancellation was requested. */
+  void ThrowIfCancellationRequested() const
+  {
+    if( m_CancellationToken )
+      {
+      m_CancellationToken->ThrowIfCancellationRequested();
+      }
+  }
+
   mutable unsigned long       m_NumberOfPixelsCounted;
 
   FixedImageConstPointer      m_FixedImage1;
@@ -236,6 +332,18 @@ protected:
   mutable FixedImageMaskPointer   m_FixedImageMask2;
   mutable MovingImageMaskPointer  m_MovingImageMask;
 
+  RayCastWorkerPool::Pointer  m_WorkerPool;
+  bool                        m_DeterministicReduction;
+  SizeValueType               m_ReductionTileSize;
+
+  RegistrationCancellationToken::Pointer m_CancellationToken;
+
+  RegistrationPerformanceCounters::Pointer m_PerformanceCounters;
+
+  RegistrationTracer::Pointer m_Tracer;
+
+  RegistrationMemoryAccount::Pointer m_MemoryAccount;
+
 private:
   FixedImageRegionType        m_FixedImageRegion1;
   FixedImageRegionType        m_FixedImageRegion2;
@@ -38,6 +38,13 @@ TwoImageToOneImageMetric<TFixedImage,TMovingImage>
   m_ComputeGradient = true; // metric computes gradient by default
   m_NumberOfPixelsCounted = 0; // initialize to zero
   m_GradientImage = nullptr; // computed at initialization
+  m_WorkerPool = nullptr; // evaluated by the calling thread by default
+  m_DeterministicReduction = false;
+  m_ReductionTileSize = 16;
+  m_CancellationToken = nullptr; // evaluations cannot be cancelled by default
+  m_PerformanceCounters = RegistrationPerformanceCounters::New();
+  m_Tracer = RegistrationTracer::New();
+  m_MemoryAccount = RegistrationMemoryAccount::New();
 }
 
 
@@ -135,6 +142,7 @@ TwoImageToOneImageMetric<TFixedImage,TMovingImage>
 
   if ( m_ComputeGradient )
     {
+    TraceSpan span( m_Tracer, "GradientFilter", "metric" );
 
     GradientImageFilterPointer gradientFilter
       = GradientImageFilterType::New();
@@ -159,6 +167,8 @@ TwoImageToOneImageMetric<TFixedImage,TMovingImage>
     m_GradientImage = gradientFilter->GetOutput();
 
     }
+  m_MemoryAccount->SetAllocation( this, "GradientImage",
+                                  RegistrationMemoryAccount::GetImageBytes( m_GradientImage.GetPointer() ) );
 
   // If there are any observers on the metric, call them to give the
   // user code a chance to set parameters on the metric
@@ -166,6 +176,32 @@ TwoImageToOneImageMetric<TFixedImage,TMovingImage>
 }
 
 
+template <typename TFixedImage, typename TMovingImage>
+SizeValueType
+TwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::GetNumberOfRows( const FixedImageRegionType & region )
+{
+  const SizeValueType rowLength = region.GetSize()[0];
+  return rowLength > 0 ? region.GetNumberOfPixels() / rowLength : 0;
+}
+
+
+template <typename TFixedImage, typename TMovingImage>
+typename TFixedImage::IndexType
+TwoImageToOneImageMetric<TFixedImage,TMovingImage>
+::GetRowIndex( const FixedImageRegionType & region, SizeValueType row )
+{
+  typename FixedImageType::IndexType index = region.GetIndex();
+  for( unsigned int i = 1; i < FixedImageDimension; i++ )
+    {
+    const SizeValueType size = region.GetSize()[i];
+    index[i] += static_cast<IndexValueType>( row % size );
+    row /= size;
+    }
+  return index;
+}
+
+
 template <typename TFixedImage, typename TMovingImage>
 void
 TwoImageToOneImageMetric<TFixedImage,TMovingImage>
@@ -188,6 +224,13 @@ TwoImageToOneImageMetric<TFixedImage,TMovingImage>
   os << indent << "Fixed Image Mask 1: " << m_FixedImageMask1.GetPointer() << std::endl;
   os << indent << "Fixed Image Mask 2: " << m_FixedImageMask2.GetPointer() << std::endl;
   os << indent << "Number of Pixels Counted: " << m_NumberOfPixelsCounted << std::endl;
+  os << indent << "Worker Pool: " << m_WorkerPool.GetPointer() << std::endl;
+  os << indent << "Deterministic Reduction: " << m_DeterministicReduction << std::endl;
+  os << indent << "Reduction Tile Size: " << m_ReductionTileSize << std::endl;
+  os << indent << "Cancellation Token: " << m_CancellationToken.GetPointer() << std::endl;
+  os << indent << "Performance Counters: " << m_PerformanceCounters.GetPointer() << std::endl;
+  os << indent << "Tracer: " << m_Tracer.GetPointer() << std::endl;
+  os << indent << "MemoryAccount: " << m_MemoryAccount.GetPointer() << std::endl;
 }
 
 
@@ -23,6 +23,13 @@
 #include "itkTwoImageToOneImageMetric.h"
 #include "itkSingleValuedNonLinearOptimizer.h"
 #include "itkDataObjectDecorator.h"
+#include "itkRealTimeExecutionProfile.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkRegistrationCancellationToken.h"
+
+#include <atomic>
+#include <functional>
+#include <future>
 
 namespace itk
 {
@@ -56,7 +63,24 @@ namespace itk
  *
  * For doing so, a Metric will be continously applied to compare the Fixed
  * image with the Transformed Moving image. This process also requires to
- * interpolate values from the Moving image.
+ * interpolate values from the Moving image. The pixel types of the images
+ * are independent: a CT of integer voxels can be registered directly to
+ * float projection images, see SiddonJacobsRayCastInterpolateImageFunction.
+ *
+ * For the registration of a stream of projection image pairs, the method
+ * provides a tracking mode. InitializeTracking() sets the components up
+ * once, then every call to TrackFrame() registers the current pair of
+ * fixed images, which may have been updated in place or replaced by
+ * images of the same size, starting from the previously registered pose.
+ * The start pose can optionally be extrapolated from the two last poses,
+ * and a separate, typically more bounded, optimizer can be used for the
+ * frames. The latency of every frame is measured. FinalizeTracking(), or
+ * StartRegistration(), ends the tracking.
+ *
+ * StartRegistrationAsync() runs the registration in a separate thread and
+ * returns a future of the final parameters. The registration can be
+ * cancelled from any thread with CancelRegistration(); the metric polls
+ * the cancellation token between evaluations and between image rows.
  *
  * \ingroup RegistrationFilters
  * \ingroup TwoProjectionRegistration
@@ -126,6 +150,87 @@ public:
   /** Method that initiates the optimization process. */
   void StartOptimization(void);
 
+  /** Start the registration in a separate thread and return immediately.
+   * The future holds the final transform parameters, or rethrows the
+   * exception of the registration; a cancelled registration throws a
+   * ProcessAborted exception. The cancellation token is reset first. The
+   * components must not be modified until the future is ready. */
+  std::future<ParametersType> StartRegistrationAsync();
+
+  /** Request the cancellation of a running registration. The metric
+   * evaluation in progress is aborted between two rows of the fixed
+   * images. May be called from any thread. */
+  void CancelRegistration()
+  {
+    m_CancellationToken->RequestCancellation();
+  }
+
+  /** Get the cancellation token connected to the metric. */
+  itkGetModifiableObjectMacro( CancellationToken, RegistrationCancellationToken );
+
+  /** Function called after every optimizer iteration of an asynchronous
+   * registration, with the iteration count and the elapsed time in
+   * seconds. It runs in the registration thread, never in the ray casting
+   * workers, and should return quickly. */
+  using ProgressCallbackType = std::function< void( SizeValueType, double ) >;
+  void SetProgressCallback( const ProgressCallbackType & callback )
+  {
+    m_ProgressCallback = callback;
+  }
+
+  /** Get the number of optimizer iterations completed by the running, or
+   * last, asynchronous registration. May be polled from any thread. */
+  SizeValueType GetProgressIteration() const
+  {
+    return m_ProgressIteration.load( std::memory_order_relaxed );
+  }
+
+  /** Get the performance counters of the registration, see
+   * RegistrationPerformanceCounters. Initialize() connects them to the
+   * metric and to the interpolators of type
+   * SiddonJacobsRayCastInterpolateImageFunction. They are reset by
+   * StartRegistration() and InitializeTracking(), and a
+   * PerformanceCountersEvent carrying their snapshot is invoked after
+   * every optimizer iteration. Without
+   * ITK_TWO_PROJECTION_PERFORMANCE_COUNTERS the counters stay at zero and
+   * no event is invoked. */
+  itkGetModifiableObjectMacro( PerformanceCounters, RegistrationPerformanceCounters );
+
+  /** Sum the performance counters over the threads. */
+  PerformanceCounterSnapshot GetPerformanceCounterSnapshot() const
+  {
+    return m_PerformanceCounters->GetSnapshot();
+  }
+
+  /** Set/Get the tracer of the registration, see RegistrationTracer.
+   * Initialize() connects it to the metric and to the interpolators of
+   * type SiddonJacobsRayCastInterpolateImageFunction. The registration
+   * traces its initialization, its optimizations and its frames, and marks
+   * every optimizer iteration. The tracer is disabled by default; a tracer
+   * may be shared by several registrations. */
+  itkSetObjectMacro( Tracer, RegistrationTracer );
+  itkGetModifiableObjectMacro( Tracer, RegistrationTracer );
+
+  /** Set/Get the memory account of the registration, see
+   * RegistrationMemoryAccount. Initialize() connects it to the metric and
+   * to the interpolators of type SiddonJacobsRayCastInterpolateImageFunction,
+   * and declares the fixed and moving images, the NUMA replicas of the
+   * moving image and the trace buffers; StartOptimization() updates them.
+   * An account may be shared by several registrations, and with a
+   * PreparedVolumeCache, to report the footprint of a node. Setting a null
+   * account gives the registration its own account again. */
+  virtual void SetMemoryAccount( RegistrationMemoryAccount * account )
+  {
+    if( m_MemoryAccount != account )
+      {
+      // Without an account, the registration has its own again
+      m_MemoryAccount = account ? account : RegistrationMemoryAccount::New().GetPointer();
+      this->Modified();
+      }
+  }
+
+  itkGetModifiableObjectMacro( MemoryAccount, RegistrationMemoryAccount );
+
   /** Set/Get the Fixed images. */
   void SetFixedImage1( const FixedImageType * fixedImage1 );
   void SetFixedImage2( const FixedImageType * fixedImage2 );
@@ -191,6 +296,60 @@ public:
   /** Initialize by setting the interconnects between the components. */
   virtual void Initialize();
 
+  /** Set/Get the optimizer used by TrackFrame(). If none is given the
+   * Optimizer is used. It is meant to run a short, bounded optimization,
+   * e.g. a PowellOptimizer with a small number of iterations. */
+  itkSetObjectMacro( TrackingOptimizer, OptimizerType );
+  itkGetConstObjectMacro( TrackingOptimizer, OptimizerType );
+
+  /** Set/Get whether the start pose of a frame is extrapolated from the
+   * two last registered poses (constant velocity) instead of being the
+   * last registered pose. Default is false. */
+  itkSetMacro( UseMotionPrediction, bool );
+  itkGetConstMacro( UseMotionPrediction, bool );
+  itkBooleanMacro( UseMotionPrediction );
+
+  /** Set/Get the real-time execution profile. When set, its worker pool
+   * is connected to the metric, InitializeTracking() pins the calling
+   * thread, starts the workers and pre-faults the images, and the latency
+   * of every frame is recorded in the histogram of the profile. The
+   * moving image is placed on the NUMA nodes according to the NumaPolicy
+   * of the profile; replicas are read by interpolators of type
+   * SiddonJacobsRayCastInterpolateImageFunction. */
+  itkSetObjectMacro( RealTimeProfile, RealTimeExecutionProfile );
+  itkGetModifiableObjectMacro( RealTimeProfile, RealTimeExecutionProfile );
+
+  /** Prepare the tracking mode. The components are connected and the
+   * metric is initialized once; the initial transform parameters are the
+   * start pose of the first frame. The observers of the performance
+   * counters and of the tracer are added to the optimizer of the frames
+   * here, if the counters are compiled in and the tracer is enabled, and
+   * count the iterations over all the frames. */
+  virtual void InitializeTracking();
+
+  /** End the tracking mode: remove the observers added to the optimizer
+   * by InitializeTracking(). */
+  virtual void FinalizeTracking();
+
+  /** Register the current fixed images starting from the last registered
+   * pose. The images may have been modified in place since the previous
+   * frame. */
+  virtual void TrackFrame();
+
+  /** Replace the fixed images by a new pair of the same size and register
+   * them starting from the last registered pose. */
+  virtual void TrackFrame( const FixedImageType * fixedImage1,
+                           const FixedImageType * fixedImage2 );
+
+  /** Get the number of frames registered since InitializeTracking(). */
+  itkGetConstMacro( NumberOfTrackedFrames, SizeValueType );
+
+  /** Get the latency of the last frame, the mean latency and its standard
+   * deviation (jitter) over the tracked frames, in seconds. */
+  itkGetConstMacro( LastFrameLatency, double );
+  itkGetConstMacro( MeanFrameLatency, double );
+  double GetFrameLatencyJitter() const;
+
   /** Returns the transform resulting from the registration process  */
   const TransformOutputType * GetOutput() const;
 
@@ -205,7 +364,12 @@ public:
 
 protected:
   TwoProjectionImageRegistrationMethod();
-  ~TwoProjectionImageRegistrationMethod() override {};
+  ~TwoProjectionImageRegistrationMethod() override
+  {
+    // The observers of the tracking refer to the registration
+    this->FinalizeTracking();
+    m_MemoryAccount->ReleaseAllocations( this );
+  }
   void PrintSelf(std::ostream& os, Indent indent) const override;
 
   /** Method invoked by the pipeline in order to trigger the computation of
@@ -236,6 +400,75 @@ private:
   FixedImageRegionType             m_FixedImageRegion1;
   FixedImageRegionType             m_FixedImageRegion2;
 
+  OptimizerType::Pointer           m_TrackingOptimizer;
+  bool                             m_UseMotionPrediction;
+  bool                             m_TrackingInitialized;
+  ParametersType                   m_PreviousTransformParameters;
+  ParametersType                   m_TrackingStartPosition;
+  SizeValueType                    m_NumberOfTrackedFrames;
+  double                           m_LastFrameLatency;
+  double                           m_MeanFrameLatency;
+  double                           m_FrameLatencySumOfSquares;
+  OptimizerType::Pointer           m_ObservedTrackingOptimizer;
+  bool                             m_TrackingCountersObserved;
+  unsigned long                    m_TrackingCountersTag;
+  bool                             m_TrackingTracerObserved;
+  unsigned long                    m_TrackingTracerTag;
+
+  RealTimeExecutionProfile::Pointer m_RealTimeProfile;
+
+  ParametersType RunAsyncRegistration();
+
+  /** Place the moving image on the NUMA nodes and connect its replicas to
+   * the ray casting interpolators. */
+  void PlaceMovingImage();
+
+  /** Connect the performance counters to the metric and to the ray
+   * casting interpolators. */
+  void ConnectPerformanceCounters();
+
+  /** Invoke a PerformanceCountersEvent after every iteration of an
+   * optimizer. Returns the tag of the observer. */
+  unsigned long AddPerformanceCountersObserver( OptimizerType * optimizer );
+  void RemovePerformanceCountersObserver( OptimizerType * optimizer, unsigned long tag );
+
+  /** Connect the tracer to the metric and to the ray casting
+   * interpolators. */
+  void ConnectTracer();
+
+  /** Mark every iteration of an optimizer on the tracer. Returns the tag
+   * of the observer. */
+  unsigned long AddTracerObserver( OptimizerType * optimizer );
+
+  /** Connect the memory account to the metric and to the ray casting
+   * interpolators. */
+  void ConnectMemoryAccount();
+
+  /** Declare the images, the replicas and the trace buffers held by the
+   * registration to the memory account. */
+  void AccountMemory();
+
+  /** Ray casting interpolators tracing the rays in single and in double
+   * precision. */
+  using SinglePrecisionRayCastInterpolatorType =
+    SiddonJacobsRayCastInterpolateImageFunction< MovingImageType, typename MetricType::CoordinateRepresentationType, float >;
+  using DoublePrecisionRayCastInterpolatorType =
+    SiddonJacobsRayCastInterpolateImageFunction< MovingImageType, typename MetricType::CoordinateRepresentationType, double >;
+  using MovingImageReplicasType = typename SinglePrecisionRayCastInterpolatorType::VolumeReplicasType;
+
+  MovingImageConstPointer          m_PlacedMovingImage;
+  ModifiedTimeType                 m_PlacedMovingImageMTime;
+  MovingImageReplicasType          m_MovingImageReplicas;
+
+  RegistrationCancellationToken::Pointer m_CancellationToken;
+  ProgressCallbackType                   m_ProgressCallback;
+  std::atomic<SizeValueType>             m_ProgressIteration;
+
+  RegistrationPerformanceCounters::Pointer m_PerformanceCounters;
+
+  RegistrationTracer::Pointer m_Tracer;
+
+  RegistrationMemoryAccount::Pointer m_MemoryAccount;
 };
 
 } // end namespace itk
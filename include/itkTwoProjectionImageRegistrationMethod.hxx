@@ -20,6 +20,10 @@
 
 #include "itkTwoProjectionImageRegistrationMethod.h"
 
+#include <chrono>
+#include <cmath>
+#include <initializer_list>
+
 
 namespace itk
 {
@@ -49,6 +53,31 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
   m_FixedImageRegionDefined1 = false;
   m_FixedImageRegionDefined2 = false;
 
+  m_TrackingOptimizer = nullptr; // the Optimizer is used by default
+  m_UseMotionPrediction = false;
+  m_TrackingInitialized = false;
+  m_PreviousTransformParameters = ParametersType(1);
+  m_PreviousTransformParameters.Fill( 0.0f );
+  m_NumberOfTrackedFrames = 0;
+  m_LastFrameLatency = 0.0;
+  m_MeanFrameLatency = 0.0;
+  m_FrameLatencySumOfSquares = 0.0;
+  m_ObservedTrackingOptimizer = nullptr;
+  m_TrackingCountersObserved = false;
+  m_TrackingCountersTag = 0;
+  m_TrackingTracerObserved = false;
+  m_TrackingTracerTag = 0;
+
+  m_RealTimeProfile = nullptr; // no real-time profile by default
+  m_PlacedMovingImage = nullptr;
+  m_PlacedMovingImageMTime = 0;
+
+  m_CancellationToken = RegistrationCancellationToken::New();
+  m_ProgressIteration = 0;
+  m_PerformanceCounters = RegistrationPerformanceCounters::New();
+  m_Tracer = RegistrationTracer::New();
+  m_MemoryAccount = RegistrationMemoryAccount::New();
+
 
   TransformOutputPointer transformDecorator =
     static_cast< TransformOutputType * >(
@@ -100,6 +129,12 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
     mtime = (m > mtime ? m : mtime);
     }
 
+  if (m_TrackingOptimizer)
+    {
+    m = m_TrackingOptimizer->GetMTime();
+    mtime = (m > mtime ? m : mtime);
+    }
+
   if (m_FixedImage1)
     {
     m = m_FixedImage1->GetMTime();
@@ -166,6 +201,7 @@ void
 TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
 ::Initialize()
 {
+  TraceSpan span( m_Tracer, "Initialize", "registration" );
 
   if( !m_FixedImage1 )
     {
@@ -245,7 +281,18 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
     m_Metric->SetFixedImageRegion2( m_FixedImage2->GetBufferedRegion() );
     }
 
+  if( m_RealTimeProfile )
+    {
+    m_Metric->SetWorkerPool( m_RealTimeProfile->GetWorkerPool() );
+    this->PlaceMovingImage();
+    }
+  m_Metric->SetCancellationToken( m_CancellationToken );
+  this->ConnectPerformanceCounters();
+  this->ConnectTracer();
+  this->ConnectMemoryAccount();
+
   m_Metric->Initialize();
+  this->AccountMemory();
 
   // Recover user-defined image origin
 /*  const short Dimension = GetImageDimension<FixedImageType>::ImageDimension;
@@ -284,6 +331,8 @@ void
 TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
 ::StartRegistration( void )
 {
+  // The observers of the tracking would count the iterations twice
+  this->FinalizeTracking();
 
   ParametersType empty(1);
   empty.Fill( 0.0 );
@@ -300,6 +349,7 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
     throw err;
     }
 
+  m_PerformanceCounters->Reset();
   this->StartOptimization();
 }
 
@@ -312,6 +362,9 @@ void
 TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
 ::StartOptimization( void )
 {
+  TraceSpan span( m_Tracer, "StartOptimization", "registration" );
+  const unsigned long countersTag = this->AddPerformanceCountersObserver( m_Optimizer );
+  const unsigned long tracerTag = this->AddTracerObserver( m_Optimizer );
   try
     {
     // do the optimization
@@ -319,6 +372,9 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
     }
   catch( ExceptionObject& err )
     {
+    this->RemovePerformanceCountersObserver( m_Optimizer, countersTag );
+    m_Optimizer->RemoveObserver( tracerTag );
+
     // An error has occurred in the optimization.
     // Update the parameters
     m_LastTransformParameters = m_Optimizer->GetCurrentPosition();
@@ -326,6 +382,9 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
     // Pass exception to caller
     throw err;
     }
+  this->RemovePerformanceCountersObserver( m_Optimizer, countersTag );
+  m_Optimizer->RemoveObserver( tracerTag );
+  this->AccountMemory();
 
   // get the results
   m_LastTransformParameters = m_Optimizer->GetCurrentPosition();
@@ -333,6 +392,439 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
 }
 
 
+/*
+ * Starts the registration in a separate thread
+ */
+template < typename TFixedImage, typename TMovingImage >
+std::future<typename TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>::ParametersType>
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::StartRegistrationAsync( void )
+{
+  m_CancellationToken->Reset();
+  m_ProgressIteration = 0;
+
+  // Keep the registration alive until the thread is done
+  Pointer self = this;
+  return std::async( std::launch::async, [self]() { return self->RunAsyncRegistration(); } );
+}
+
+
+/*
+ * Place the moving image on the NUMA nodes
+ */
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::PlaceMovingImage( void )
+{
+  TraceSpan span( m_Tracer, "PlaceMovingImage", "registration" );
+
+  if( m_RealTimeProfile->GetNumaPolicy() == RealTimeExecutionProfile::NumaDefault )
+    {
+    m_MovingImageReplicas.clear();
+    m_PlacedMovingImage = nullptr;
+    }
+  else
+    {
+    m_RealTimeProfile->ApplyNumaPolicy();
+
+    // The placement copies or moves the whole volume: it is only redone
+    // when the moving image has changed.
+    if( m_PlacedMovingImage != m_MovingImage
+        || m_PlacedMovingImageMTime < m_MovingImage->GetMTime() )
+      {
+      m_MovingImageReplicas = m_RealTimeProfile->PlaceVolume( m_MovingImage.GetPointer() );
+      m_PlacedMovingImage = m_MovingImage;
+      m_PlacedMovingImageMTime = m_MovingImage->GetMTime();
+      }
+    }
+
+  for( InterpolatorType * interpolator : { m_Interpolator1.GetPointer(), m_Interpolator2.GetPointer() } )
+    {
+    if( auto * rayCaster = dynamic_cast< SinglePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      rayCaster->SetVolumeReplicas( m_MovingImageReplicas );
+      }
+    else if( auto * doublePrecisionRayCaster = dynamic_cast< DoublePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      doublePrecisionRayCaster->SetVolumeReplicas( m_MovingImageReplicas );
+      }
+    }
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::ConnectPerformanceCounters( void )
+{
+  m_Metric->SetPerformanceCounters( m_PerformanceCounters );
+  for( InterpolatorType * interpolator : { m_Interpolator1.GetPointer(), m_Interpolator2.GetPointer() } )
+    {
+    if( auto * rayCaster = dynamic_cast< SinglePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      rayCaster->SetPerformanceCounters( m_PerformanceCounters );
+      }
+    else if( auto * doublePrecisionRayCaster = dynamic_cast< DoublePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      doublePrecisionRayCaster->SetPerformanceCounters( m_PerformanceCounters );
+      }
+    }
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+unsigned long
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::AddPerformanceCountersObserver( OptimizerType * optimizer )
+{
+  if( !RegistrationPerformanceCounters::Enabled )
+    {
+    return 0;
+    }
+
+  // The iterations are counted by the observer itself, the optimizers
+  // count them differently
+  SizeValueType iteration = 0;
+  return optimizer->AddObserver( IterationEvent(),
+    [this, iteration]( const EventObject & ) mutable
+      {
+      this->InvokeEvent( PerformanceCountersEvent( ++iteration, m_PerformanceCounters->GetSnapshot() ) );
+      } );
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::RemovePerformanceCountersObserver( OptimizerType * optimizer, unsigned long tag )
+{
+  if( RegistrationPerformanceCounters::Enabled )
+    {
+    optimizer->RemoveObserver( tag );
+    }
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::ConnectTracer( void )
+{
+  m_Metric->SetTracer( m_Tracer );
+  for( InterpolatorType * interpolator : { m_Interpolator1.GetPointer(), m_Interpolator2.GetPointer() } )
+    {
+    if( auto * rayCaster = dynamic_cast< SinglePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      rayCaster->SetTracer( m_Tracer );
+      }
+    else if( auto * doublePrecisionRayCaster = dynamic_cast< DoublePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      doublePrecisionRayCaster->SetTracer( m_Tracer );
+      }
+    }
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::ConnectMemoryAccount( void )
+{
+  m_Metric->SetMemoryAccount( m_MemoryAccount );
+  for( InterpolatorType * interpolator : { m_Interpolator1.GetPointer(), m_Interpolator2.GetPointer() } )
+    {
+    if( auto * rayCaster = dynamic_cast< SinglePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      rayCaster->SetMemoryAccount( m_MemoryAccount );
+      }
+    else if( auto * doublePrecisionRayCaster = dynamic_cast< DoublePrecisionRayCastInterpolatorType * >( interpolator ) )
+      {
+      doublePrecisionRayCaster->SetMemoryAccount( m_MemoryAccount );
+      }
+    }
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::AccountMemory( void )
+{
+  m_MemoryAccount->SetAllocation( this, "FixedImage1", RegistrationMemoryAccount::GetImageBytes( m_FixedImage1.GetPointer() ) );
+  m_MemoryAccount->SetAllocation( this, "FixedImage2", RegistrationMemoryAccount::GetImageBytes( m_FixedImage2.GetPointer() ) );
+  m_MemoryAccount->SetAllocation( this, "MovingImage", RegistrationMemoryAccount::GetImageBytes( m_MovingImage.GetPointer() ) );
+
+  // The replica of the first node is the moving image itself
+  SizeValueType replicaBytes = 0;
+  for( const auto & replica : m_MovingImageReplicas )
+    {
+    if( replica != m_MovingImage )
+      {
+      replicaBytes += RegistrationMemoryAccount::GetImageBytes( replica.GetPointer() );
+      }
+    }
+  m_MemoryAccount->SetAllocation( this, "MovingImageReplicas", replicaBytes );
+  m_MemoryAccount->SetAllocation( this, "TraceBuffers", m_Tracer ? m_Tracer->GetMemorySize() : 0 );
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+unsigned long
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::AddTracerObserver( OptimizerType * optimizer )
+{
+  // The time between the end of an evaluation and the mark of the
+  // iteration, or the next evaluation, is spent by the optimizer
+  SizeValueType iteration = 0;
+  return optimizer->AddObserver( IterationEvent(),
+    [this, iteration]( const EventObject & ) mutable
+      {
+      ++iteration;
+      if( m_Tracer )
+        {
+        m_Tracer->Mark( "Iteration", "optimizer", "iteration", static_cast<int64_t>( iteration ) );
+        }
+      } );
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+typename TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>::ParametersType
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::RunAsyncRegistration( void )
+{
+  if( !m_Optimizer )
+    {
+    itkExceptionMacro(<<"Optimizer is not present");
+    }
+
+  // Publish the progress after every iteration of the optimizer
+  const auto registrationStart = std::chrono::steady_clock::now();
+  const unsigned long observerTag = m_Optimizer->AddObserver( IterationEvent(),
+    [this, registrationStart]( const EventObject & )
+      {
+      const SizeValueType iteration = ++m_ProgressIteration;
+      if( m_ProgressCallback )
+        {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - registrationStart;
+        m_ProgressCallback( iteration, elapsed.count() );
+        }
+      } );
+
+  try
+    {
+    this->StartRegistration();
+    }
+  catch( ExceptionObject & )
+    {
+    m_Optimizer->RemoveObserver( observerTag );
+    if( m_CancellationToken->IsCancellationRequested() )
+      {
+      throw ProcessAborted( __FILE__, __LINE__ );
+      }
+    throw;
+    }
+
+  m_Optimizer->RemoveObserver( observerTag );
+  return m_LastTransformParameters;
+}
+
+
+/*
+ * Prepare the tracking of a stream of fixed images
+ */
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::InitializeTracking( void )
+{
+  this->FinalizeTracking();
+
+  TraceSpan span( m_Tracer, "InitializeTracking", "registration" );
+
+  // The moving image, the interpolators and the metric are set up once
+  // for all frames.
+  this->Initialize();
+
+  if( m_TrackingOptimizer )
+    {
+    m_TrackingOptimizer->SetCostFunction( m_Metric );
+    }
+
+  m_LastTransformParameters = m_InitialTransformParameters;
+  m_PreviousTransformParameters = m_InitialTransformParameters;
+  m_TrackingStartPosition = m_InitialTransformParameters;
+
+  // Move thread creation, pinning and page faults out of the frame loop
+  if( m_RealTimeProfile )
+    {
+    if( !m_RealTimeProfile->Prepare() )
+      {
+      itkWarningMacro(<<"Thread pinning or memory locking of the real-time profile failed");
+      }
+    RealTimeExecutionProfile::PrefaultImage( m_MovingImage.GetPointer() );
+    RealTimeExecutionProfile::PrefaultImage( m_FixedImage1.GetPointer() );
+    RealTimeExecutionProfile::PrefaultImage( m_FixedImage2.GetPointer() );
+    }
+
+  m_NumberOfTrackedFrames = 0;
+  m_LastFrameLatency = 0.0;
+  m_MeanFrameLatency = 0.0;
+  m_FrameLatencySumOfSquares = 0.0;
+  m_PerformanceCounters->Reset();
+
+  // Added once for all frames: adding an observer allocates
+  OptimizerType * optimizer = m_TrackingOptimizer ? m_TrackingOptimizer.GetPointer()
+                                                  : m_Optimizer.GetPointer();
+  m_ObservedTrackingOptimizer = optimizer;
+  if( RegistrationPerformanceCounters::Enabled )
+    {
+    m_TrackingCountersTag = this->AddPerformanceCountersObserver( optimizer );
+    m_TrackingCountersObserved = true;
+    }
+  if( m_Tracer && m_Tracer->GetEnabled() )
+    {
+    m_TrackingTracerTag = this->AddTracerObserver( optimizer );
+    m_TrackingTracerObserved = true;
+    }
+
+  m_TrackingInitialized = true;
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::FinalizeTracking( void )
+{
+  m_TrackingInitialized = false;
+  if( m_ObservedTrackingOptimizer )
+    {
+    if( m_TrackingCountersObserved )
+      {
+      m_ObservedTrackingOptimizer->RemoveObserver( m_TrackingCountersTag );
+      }
+    if( m_TrackingTracerObserved )
+      {
+      m_ObservedTrackingOptimizer->RemoveObserver( m_TrackingTracerTag );
+      }
+    }
+  m_ObservedTrackingOptimizer = nullptr;
+  m_TrackingCountersObserved = false;
+  m_TrackingTracerObserved = false;
+}
+
+
+/*
+ * Replace the fixed images and register them
+ */
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::TrackFrame( const FixedImageType * fixedImage1,
+              const FixedImageType * fixedImage2 )
+{
+  if( !m_TrackingInitialized )
+    {
+    itkExceptionMacro(<<"InitializeTracking() must be called before TrackFrame()");
+    }
+
+  if( !fixedImage1 || !fixedImage2 )
+    {
+    itkExceptionMacro(<<"Fixed images of the frame are not present");
+    }
+
+  // The metric regions were validated against the first pair of images,
+  // the new images must cover them.
+  if( !fixedImage1->GetBufferedRegion().IsInside( m_Metric->GetFixedImageRegion1() ) ||
+      !fixedImage2->GetBufferedRegion().IsInside( m_Metric->GetFixedImageRegion2() ) )
+    {
+    itkExceptionMacro(<<"Fixed images of the frame do not cover the fixed image regions");
+    }
+
+  this->SetFixedImage1( fixedImage1 );
+  this->SetFixedImage2( fixedImage2 );
+  m_Metric->SetFixedImage1( fixedImage1 );
+  m_Metric->SetFixedImage2( fixedImage2 );
+
+  this->TrackFrame();
+}
+
+
+/*
+ * Register the current fixed images starting from the last pose
+ */
+template < typename TFixedImage, typename TMovingImage >
+void
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::TrackFrame( void )
+{
+  if( !m_TrackingInitialized )
+    {
+    itkExceptionMacro(<<"InitializeTracking() must be called before TrackFrame()");
+    }
+
+  TraceSpan span( m_Tracer, "TrackFrame", "registration", "frame", static_cast<int64_t>( m_NumberOfTrackedFrames ) );
+  const auto frameStart = std::chrono::steady_clock::now();
+
+  // Warm start from the last registered pose, optionally extrapolated
+  // with a constant velocity model. The start position is preallocated.
+  for( unsigned int i = 0; i < m_TrackingStartPosition.Size(); i++ )
+    {
+    m_TrackingStartPosition[i] = m_LastTransformParameters[i];
+    if( m_UseMotionPrediction && m_NumberOfTrackedFrames > 1 )
+      {
+      m_TrackingStartPosition[i] += m_LastTransformParameters[i] - m_PreviousTransformParameters[i];
+      }
+    }
+
+  // The observers were added by InitializeTracking()
+  OptimizerType * optimizer = m_ObservedTrackingOptimizer.GetPointer();
+  optimizer->SetInitialPosition( m_TrackingStartPosition );
+
+  try
+    {
+    optimizer->StartOptimization();
+    }
+  catch( ExceptionObject& err )
+    {
+    m_LastTransformParameters = optimizer->GetCurrentPosition();
+    throw err;
+    }
+
+  m_PreviousTransformParameters = m_LastTransformParameters;
+  m_LastTransformParameters = optimizer->GetCurrentPosition();
+  m_Transform->SetParameters( m_LastTransformParameters );
+
+  // Running mean and variance of the frame latency (Welford)
+  const std::chrono::duration<double> latency = std::chrono::steady_clock::now() - frameStart;
+  m_LastFrameLatency = latency.count();
+  m_NumberOfTrackedFrames++;
+  const double delta = m_LastFrameLatency - m_MeanFrameLatency;
+  m_MeanFrameLatency += delta / m_NumberOfTrackedFrames;
+  m_FrameLatencySumOfSquares += delta * ( m_LastFrameLatency - m_MeanFrameLatency );
+
+  if( m_RealTimeProfile )
+    {
+    m_RealTimeProfile->RecordLatency( m_LastFrameLatency );
+    }
+}
+
+
+template < typename TFixedImage, typename TMovingImage >
+double
+TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
+::GetFrameLatencyJitter() const
+{
+  if( m_NumberOfTrackedFrames < 2 )
+    {
+    return 0.0;
+    }
+  return std::sqrt( m_FrameLatencySumOfSquares / ( m_NumberOfTrackedFrames - 1 ) );
+}
+
+
 template < typename TFixedImage, typename TMovingImage >
 void
 TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
@@ -353,6 +845,18 @@ TwoProjectionImageRegistrationMethod<TFixedImage,TMovingImage>
   os << indent << "Fixed Image 2 Region: " << m_FixedImageRegion2 << std::endl;
   os << indent << "Initial Transform Parameters: " << m_InitialTransformParameters << std::endl;
   os << indent << "Last    Transform Parameters: " << m_LastTransformParameters << std::endl;
+  os << indent << "Tracking Optimizer: " << m_TrackingOptimizer.GetPointer() << std::endl;
+  os << indent << "Use Motion Prediction: " << m_UseMotionPrediction << std::endl;
+  os << indent << "Number Of Tracked Frames: " << m_NumberOfTrackedFrames << std::endl;
+  os << indent << "Mean Frame Latency: " << m_MeanFrameLatency << std::endl;
+  os << indent << "Frame Latency Jitter: " << this->GetFrameLatencyJitter() << std::endl;
+  os << indent << "Real Time Profile: " << m_RealTimeProfile.GetPointer() << std::endl;
+  os << indent << "Moving Image Replicas: " << m_MovingImageReplicas.size() << std::endl;
+  os << indent << "Cancellation Token: " << m_CancellationToken.GetPointer() << std::endl;
+  os << indent << "Progress Iteration: " << this->GetProgressIteration() << std::endl;
+  os << indent << "Performance Counters: " << m_PerformanceCounters.GetPointer() << std::endl;
+  os << indent << "Tracer: " << m_Tracer.GetPointer() << std::endl;
+  os << indent << "Memory Account: " << m_MemoryAccount.GetPointer() << std::endl;
 }
 
 
@@ -0,0 +1,286 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkTwoProjectionRegistrationProtocol_h
+#define itkTwoProjectionRegistrationProtocol_h
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace itk
+{
+
+/** \brief Messages exchanged with the resident registration server.
+ *
+ * A client connects to the local Unix-domain socket of the server and
+ * sends fixed size RegistrationRequest messages, each answered by one
+ * RegistrationResponse on the same connection. Image payloads are not
+ * copied through the socket: they live in shared memory buffers whose
+ * file descriptors are passed along with the request (SCM_RIGHTS).
+ *
+ * - RenderDRRJob: one descriptor, the DRR of Views[0] is written into it.
+ * - RegisterJob: two descriptors holding the fixed images of Views[0] and
+ *   Views[1], which are only read.
+ * - ShutdownJob: no descriptor, the server stops accepting connections.
+ *
+ * Image buffers hold Size[0] x Size[1] floats, rows along the first axis,
+ * in the orientation used by the SiddonJacobsRayCastInterpolateImageFunction
+ * (i.e. not flipped). The buffers are sealed against shrinking, so that
+ * a client cannot truncate a buffer the server has mapped. Both ends must
+ * run on the same host, so the messages are in native byte order.
+ *
+ * The helpers are only available on Linux.
+ *
+ * \ingroup TwoProjectionRegistration
+ */
+namespace TwoProjectionRegistrationProtocol
+{
+
+constexpr std::uint32_t Magic = 0x52505054; // "TPPR"
+constexpr std::uint32_t Version = 1;
+constexpr std::size_t MaximumFileNameLength = 1024;
+constexpr std::size_t MaximumMessageLength = 256;
+
+enum JobType : std::uint32_t
+{
+  RenderDRRJob = 1,
+  RegisterJob = 2,
+  ShutdownJob = 3
+};
+
+enum StatusType : std::uint32_t
+{
+  Success = 0,
+  Failure = 1,
+  Cancelled = 2
+};
+
+/** Geometry of one projection view */
+struct ViewGeometry
+{
+  double        ProjectionAngle;  // Gantry angle in degrees
+  double        CentralAxis[2];   // Central axis position in continuous indices
+  double        Spacing[2];       // Pixel spacing in the isocenter plane in mm
+  std::uint32_t Size[2];          // Number of pixels
+};
+
+struct RegistrationRequest
+{
+  std::uint32_t Magic;
+  std::uint32_t Version;
+  std::uint32_t Job;
+  std::uint32_t MaximumNumberOfIterations;   // Register only, 0 for the default
+  char          VolumeFileName[MaximumFileNameLength];
+  double        Threshold;                   // CT intensity threshold
+  double        FocalPointToIsocenterDistance;
+  double        Isocenter[3];                // Continuous voxel indices of the isocenter
+  double        TransformParameters[6];      // Pose to render, or initial pose to register
+  ViewGeometry  Views[2];
+};
+
+struct RegistrationResponse
+{
+  std::uint32_t Magic;
+  std::uint32_t Status;
+  std::uint32_t VolumeCacheHit;              // 1 if the prepared CT was resident
+  std::uint32_t NumberOfIterations;
+  double        TransformParameters[6];      // Registered pose
+  double        MetricValue;
+  double        ElapsedTime;                 // Processing time of the job in seconds
+  char          Message[MaximumMessageLength];
+};
+
+/** Number of payload buffers expected with a job */
+inline unsigned int GetNumberOfBuffers( std::uint32_t job )
+{
+  return job == RenderDRRJob ? 1 : ( job == RegisterJob ? 2 : 0 );
+}
+
+/** Size in bytes of the image buffer of a view */
+inline std::size_t GetBufferSize( const ViewGeometry & view )
+{
+  return static_cast<std::size_t>( view.Size[0] ) * view.Size[1] * sizeof( float );
+}
+
+#if defined(__linux__)
+
+/** Send a message with up to two file descriptors. Returns false on error. */
+inline bool SendMessage( int socket, const void * message, std::size_t length,
+                         const int * descriptors = nullptr, unsigned int numberOfDescriptors = 0 )
+{
+  const char * data = static_cast<const char *>( message );
+  bool first = true;
+  while( length > 0 )
+    {
+    iovec io;
+    io.iov_base = const_cast<char *>( data );
+    io.iov_len = length;
+
+    msghdr header;
+    std::memset( &header, 0, sizeof( header ) );
+    header.msg_iov = &io;
+    header.msg_iovlen = 1;
+
+    // The descriptors travel with the first byte of the message
+    alignas( cmsghdr ) char control[CMSG_SPACE( 2 * sizeof( int ) )];
+    if( first && numberOfDescriptors > 0 )
+      {
+      std::memset( control, 0, sizeof( control ) );
+      header.msg_control = control;
+      header.msg_controllen = CMSG_SPACE( numberOfDescriptors * sizeof( int ) );
+      cmsghdr * controlMessage = CMSG_FIRSTHDR( &header );
+      controlMessage->cmsg_level = SOL_SOCKET;
+      controlMessage->cmsg_type = SCM_RIGHTS;
+      controlMessage->cmsg_len = CMSG_LEN( numberOfDescriptors * sizeof( int ) );
+      std::memcpy( CMSG_DATA( controlMessage ), descriptors, numberOfDescriptors * sizeof( int ) );
+      }
+
+    const ssize_t sent = sendmsg( socket, &header, MSG_NOSIGNAL );
+    if( sent < 0 )
+      {
+      if( errno == EINTR )
+        {
+        continue;
+        }
+      return false;
+      }
+    data += sent;
+    length -= static_cast<std::size_t>( sent );
+    first = false;
+    }
+  return true;
+}
+
+/** Receive a message and up to two file descriptors. Returns false on
+ * error or when the peer closed the connection. */
+inline bool ReceiveMessage( int socket, void * message, std::size_t length,
+                            int * descriptors = nullptr, unsigned int * numberOfDescriptors = nullptr )
+{
+  if( numberOfDescriptors )
+    {
+    *numberOfDescriptors = 0;
+    }
+  char * data = static_cast<char *>( message );
+  while( length > 0 )
+    {
+    iovec io;
+    io.iov_base = data;
+    io.iov_len = length;
+
+    alignas( cmsghdr ) char control[CMSG_SPACE( 2 * sizeof( int ) )];
+    msghdr header;
+    std::memset( &header, 0, sizeof( header ) );
+    header.msg_iov = &io;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof( control );
+
+    const ssize_t received = recvmsg( socket, &header, MSG_CMSG_CLOEXEC );
+    if( received < 0 && errno == EINTR )
+      {
+      continue;
+      }
+    if( received <= 0 )
+      {
+      return false;
+      }
+
+    for( cmsghdr * controlMessage = CMSG_FIRSTHDR( &header ); controlMessage;
+         controlMessage = CMSG_NXTHDR( &header, controlMessage ) )
+      {
+      if( controlMessage->cmsg_level == SOL_SOCKET && controlMessage->cmsg_type == SCM_RIGHTS )
+        {
+        const unsigned int count = ( controlMessage->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+        const int * receivedDescriptors = reinterpret_cast<const int *>( CMSG_DATA( controlMessage ) );
+        for( unsigned int d = 0; d < count; d++ )
+          {
+          if( descriptors && numberOfDescriptors && *numberOfDescriptors < 2 )
+            {
+            descriptors[( *numberOfDescriptors )++] = receivedDescriptors[d];
+            }
+          else
+            {
+            close( receivedDescriptors[d] );
+            }
+          }
+        }
+      }
+
+    data += received;
+    length -= static_cast<std::size_t>( received );
+    }
+  return true;
+}
+
+/** Create an anonymous shared memory buffer of the given size, sealed
+ * against shrinking, and return its file descriptor, or -1 on error. */
+inline int CreateSharedBuffer( std::size_t size )
+{
+  const int descriptor = memfd_create( "TwoProjectionRegistration", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+  if( descriptor < 0 )
+    {
+    return -1;
+    }
+  if( ftruncate( descriptor, static_cast<off_t>( size ) ) != 0
+      || fcntl( descriptor, F_ADD_SEALS, F_SEAL_SHRINK ) != 0 )
+    {
+    close( descriptor );
+    return -1;
+    }
+  return descriptor;
+}
+
+/** Map a shared buffer of at least the given size. With writable false
+ * the mapping is private: writes are possible but not shared. Returns
+ * nullptr if the buffer is too small, is not sealed against shrinking,
+ * since the pages of a truncated buffer raise SIGBUS when accessed, or
+ * cannot be mapped. */
+inline void * MapSharedBuffer( int descriptor, std::size_t size, bool writable )
+{
+  struct stat status;
+  if( size == 0 || fstat( descriptor, &status ) != 0 || static_cast<std::size_t>( status.st_size ) < size )
+    {
+    return nullptr;
+    }
+  const int seals = fcntl( descriptor, F_GET_SEALS );
+  if( seals < 0 || !( seals & F_SEAL_SHRINK ) )
+    {
+    return nullptr;
+    }
+  void * buffer = mmap( nullptr, size, PROT_READ | PROT_WRITE,
+                        writable ? MAP_SHARED : MAP_PRIVATE, descriptor, 0 );
+  return buffer == MAP_FAILED ? nullptr : buffer;
+}
+
+#endif
+
+} // end namespace TwoProjectionRegistrationProtocol
+} // end namespace itk
+
+#endif
@@ -46,6 +46,15 @@ CIT 6, 89-94 (1998).
 
 #include "itkEuler3DTransform.h"
 #include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkMeshRayCastInterpolateImageFunction.h"
+#include "itkFourierSliceProjector.h"
+#include "itkRealTimeExecutionProfile.h"
+#include "itkRegistrationPerformanceCounters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <utility>
 
 
 void raytracing_exe_usage()
@@ -68,6 +77,28 @@ void raytracing_exe_usage()
   std::cerr << "       <-iso float float float> Continous voxel indices of CT isocenter (center of rotation and projection center)\n";
   std::cerr << "       <-rp float>              Projection angle in degrees";
   std::cerr << "       <-threshold float>       CT intensity threshold, below which are ignored [default: 0]\n";
+  std::cerr << "       <-geom>                  Use a projection geometry object equivalent to the linac geometry\n";
+  std::cerr << "       <-pm float x 12>         Use the 3x4 projection matrix (row major) mapping the world onto\n";
+  std::cerr << "                                DRR coordinates in mm instead of the linac geometry\n";
+  std::cerr << "       <-workers int>           Render the DRR with a persistent pool of workers instead of the resample filter\n";
+  std::cerr << "       <-repeat int>            Number of times the DRR is rendered by the workers, to report latencies [default: 1]\n";
+  std::cerr << "       <-numa interleave|replicate>  Placement of the CT on the NUMA nodes for the workers [default: none]\n";
+  std::cerr << "       <-slab int>              Render the DRR again from the CT streamed in slabs of the given number of slices\n";
+  std::cerr << "                                and check that it equals the in-core rendering\n";
+  std::cerr << "       <-kernel joseph|mip|fixedpoint>  Write the DRR rendered with Joseph's method, the maximum intensity\n";
+  std::cerr << "                                projection or the fixed point Siddon-Jacobs traversal instead of\n";
+  std::cerr << "                                the Siddon-Jacobs line integrals\n";
+  std::cerr << "       <-mesh>                  Write the DRR rendered from the surface of the voxels above the threshold,\n";
+  std::cerr << "                                weighted by the mean density of their regions\n";
+  std::cerr << "       <-fourier int>           Write the DRR computed from central slices of the spectrum of the CT\n";
+  std::cerr << "                                oversampled by the given factor, in a projection geometry\n";
+  std::cerr << "       <-precision>             Render the DRR in single and in double precision and check that\n";
+  std::cerr << "                                they deviate by less than 0.01% on average, and by more than 0.1%\n";
+  std::cerr << "                                of the maximum intensity on less than 0.1% of the pixels\n";
+  std::cerr << "       <-cost file>             Write the number of voxels visited by the ray of every DRR pixel,\n";
+  std::cerr << "                                aligned with the DRR\n";
+  std::cerr << "       <-costtime file>         Write the time spent casting the ray of every DRR pixel in ns,\n";
+  std::cerr << "                                aligned with the DRR\n";
   std::cerr << "       <-o file>                Output image filename\n\n";
   std::cerr << "                                by  Jian Wu (eewujian@hotmail.com)\n\n";
   exit(EXIT_FAILURE);
@@ -117,6 +148,21 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
 
   float threshold = 0.;
 
+  bool useGeometry = false;      // Flag for using a projection geometry object
+  bool useProjectionMatrix = false;
+  double projectionMatrix[12];
+
+  int numberOfWorkers = 0;  // Number of workers rendering the DRR in place
+  int numberOfRepeats = 1;
+  itk::RealTimeExecutionProfile::NumaPolicyType numaPolicy = itk::RealTimeExecutionProfile::NumaDefault;
+  int slabThickness = 0;    // Number of slices of the streamed slabs, 0 for in-core rendering only
+  char *kernel_name = nullptr; // Alternative ray casting kernel, see RenderProjectionWith()
+  bool checkPrecision = false;  // Compare the single and double precision renderings
+  bool useMesh = false;         // Render the DRR from the surface mesh
+  unsigned int fourierOversampling = 0; // Render the DRR from the spectrum of the CT, 0 for no
+  char *cost_name = nullptr;      // Voxels visited per ray
+  char *costtime_name = nullptr;  // Time per ray
+
   // Create a timer to record calculation time.
   itk::TimeProbesCollectorBase timer;
 
@@ -244,6 +290,123 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
       customized_2DCX = true;
       }
 
+    if ((ok == false) && (strcmp(argv[1], "-geom") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      useGeometry = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-pm") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      for (double & element : projectionMatrix)
+        {
+        element = atof(argv[1]);
+        argc--; argv++;
+        }
+      useGeometry = true;
+      useProjectionMatrix = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-workers") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfWorkers = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-repeat") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfRepeats = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-numa") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      if (strcmp(argv[1], "interleave") == 0)
+        {
+        numaPolicy = itk::RealTimeExecutionProfile::NumaInterleave;
+        }
+      else if (strcmp(argv[1], "replicate") == 0)
+        {
+        numaPolicy = itk::RealTimeExecutionProfile::NumaReplicate;
+        }
+      else
+        {
+        std::cerr << "Unknown NUMA policy: " << argv[1] << std::endl;
+        raytracing_exe_usage();
+        }
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-slab") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      slabThickness = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-kernel") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      kernel_name = argv[1];
+      if ((strcmp(kernel_name, "joseph") != 0) && (strcmp(kernel_name, "mip") != 0) &&
+          (strcmp(kernel_name, "fixedpoint") != 0))
+        {
+        std::cerr << "Unknown ray casting kernel: " << kernel_name << std::endl;
+        raytracing_exe_usage();
+        }
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-mesh") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      useMesh = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-fourier") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      fourierOversampling = atoi(argv[1]);
+      argc--; argv++;
+      useGeometry = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-precision") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      checkPrecision = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cost") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cost_name = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-costtime") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      costtime_name = argv[1];
+      argc--; argv++;
+      }
+
     if ((ok == false) && (strcmp(argv[1], "-o") == 0))
       {
       argc--; argv++;
@@ -426,7 +589,8 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
               << "Transform: " << transform << std::endl;
     }
 
-  using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction<InputImageType,double>;
+  // The rays are traced in single precision, as in the registration
+  using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction<InputImageType,double,float>;
   InterpolatorType::Pointer interpolator = InterpolatorType::New();
 
   interpolator->SetProjectionAngle( dtr * rprojection ); // Set angle between projection central axis and -z axis
@@ -434,6 +598,37 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
   interpolator->SetThreshold(threshold); // Set intensity threshold, below which are ignored.
   interpolator->SetTransform(transform);
 
+  using GeometryType = InterpolatorType::ProjectionGeometryType;
+  GeometryType::Pointer geometry; // None for the linac geometry
+  if (useGeometry)
+    {
+    // The projection geometry defines the source and the detector frame
+    // directly, in the fixed world coordinate system.
+    geometry = GeometryType::New();
+    if (useProjectionMatrix)
+      {
+      GeometryType::ProjectionMatrixType matrix;
+      for (unsigned int i = 0; i < 3; i++)
+        {
+        for (unsigned int j = 0; j < 4; j++)
+          {
+          matrix[i][j] = projectionMatrix[4*i+j];
+          }
+        }
+      geometry->SetProjectionMatrix( matrix );
+      }
+    else
+      {
+      geometry->SetLinacGeometry( isocenter, scd, dtr * rprojection );
+      }
+    interpolator->SetProjectionGeometry( geometry );
+
+    if (verbose)
+      {
+      std::cout << "Projection geometry: " << geometry << std::endl;
+      }
+    }
+
   interpolator->Initialize();
 
   filter->SetInterpolator( interpolator );
@@ -481,7 +676,9 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
   // Compute the origin (in mm) of the 2D Image
   origin[0] = - im_sx * o2Dx;
   origin[1] = - im_sy * o2Dy;
-  origin[2] = - scd;
+  // The detector plane is implicit in a projection geometry, only the
+  // linac geometry needs the image to be placed at -scd.
+  origin[2] = useGeometry ? 0.0 : - scd;
 
   filter->SetOutputOrigin( origin );
 
@@ -489,6 +686,471 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
   filter->Update();
   timer.Stop("DRR generation");
 
+  // Optionally render the DRR again in place with a persistent worker
+  // pool. The projection image is allocated once and reused by every
+  // rendering, as in a real-time loop.
+  InputImageType::Pointer drr = filter->GetOutput();
+  if (numberOfWorkers > 0)
+    {
+    itk::RealTimeExecutionProfile::Pointer profile = itk::RealTimeExecutionProfile::New();
+    profile->SetNumberOfWorkers( numberOfWorkers );
+    profile->SetNumaPolicy( numaPolicy );
+    profile->Prepare();
+
+    // Give every NUMA node the CT it reads, as placed by the policy
+    interpolator->SetVolumeReplicas( profile->PlaceVolume( interpolator->GetInputImage() ) );
+    if (!interpolator->GetVolumeReplicas().empty())
+      {
+      std::cout << "CT replicated on " << interpolator->GetVolumeReplicas().size() << " NUMA nodes" << std::endl;
+      }
+
+    drr = InputImageType::New();
+    drr->CopyInformation( filter->GetOutput() );
+    drr->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    // Writing the projection maps its pages before the first frame
+    drr->Allocate( true );
+
+    for (int repeat = 0; repeat < numberOfRepeats; repeat++)
+      {
+      const auto renderStart = std::chrono::steady_clock::now();
+      interpolator->RenderProjection( drr.GetPointer(), profile->GetWorkerPool() );
+      const std::chrono::duration<double> latency = std::chrono::steady_clock::now() - renderStart;
+      profile->RecordLatency( latency.count() );
+      }
+
+    std::cout << "DRR rendering with " << numberOfWorkers << " workers: ";
+    profile->GetLatencyHistogram().Print( std::cout );
+    std::cout << std::endl;
+
+    // The tiles are distributed by work stealing, in a different order on
+    // every run: the result must not depend on it
+    InputImageType::Pointer serialDRR = InputImageType::New();
+    serialDRR->CopyInformation( drr );
+    serialDRR->SetRegions( drr->GetLargestPossibleRegion() );
+    serialDRR->Allocate();
+    interpolator->RenderProjection( serialDRR.GetPointer() );
+    if (!std::equal( drr->GetBufferPointer(), drr->GetBufferPointer() + drr->GetPixelContainer()->Size(),
+                     serialDRR->GetBufferPointer() ))
+      {
+      std::cerr << "ERROR: The DRR rendered by the workers differs from the serial rendering" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // Optionally render the DRR from the CT streamed in slabs along z by the
+  // reader, holding one slab at a time, and compare it with the in-core
+  // rendering of the same rays.
+  if (slabThickness > 0)
+    {
+    InputImageType::Pointer inCoreDRR = InputImageType::New();
+    inCoreDRR->CopyInformation( filter->GetOutput() );
+    inCoreDRR->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    inCoreDRR->Allocate();
+    interpolator->RenderProjection( inCoreDRR.GetPointer() );
+
+    InputImageType::Pointer slabDRR = InputImageType::New();
+    slabDRR->CopyInformation( inCoreDRR );
+    slabDRR->SetRegions( inCoreDRR->GetLargestPossibleRegion() );
+    slabDRR->Allocate();
+
+    using ReaderType = itk::ImageFileReader< InputImageType >;
+    ReaderType::Pointer slabReader = ReaderType::New();
+    slabReader->SetFileName( input_name );
+    unsigned int numberOfSlabs = 0;
+    auto slabSource = [&slabReader, &numberOfSlabs]( itk::IndexValueType zBegin, itk::IndexValueType zEnd )
+      {
+      slabReader->UpdateOutputInformation();
+      InputImageType::RegionType slabRegion = slabReader->GetOutput()->GetLargestPossibleRegion();
+      slabRegion.SetIndex( 2, zBegin );
+      slabRegion.SetSize( 2, zEnd - zBegin );
+      slabReader->GetOutput()->SetRequestedRegion( slabRegion );
+      slabReader->Update();
+      numberOfSlabs++;
+      return InputImageType::ConstPointer( slabReader->GetOutput() );
+      };
+
+    try
+      {
+      timer.Start("DRR generation in slabs");
+      interpolator->RenderProjectionInSlabs( slabDRR.GetPointer(), slabSource, slabThickness );
+      timer.Stop("DRR generation in slabs");
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cerr << "ERROR: ExceptionObject caught !" << std::endl;
+      std::cerr << err << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    const itk::SizeValueType numberOfPixels = slabDRR->GetPixelContainer()->Size();
+    if (!std::equal( slabDRR->GetBufferPointer(), slabDRR->GetBufferPointer() + numberOfPixels,
+                     inCoreDRR->GetBufferPointer() ))
+      {
+      std::cerr << "ERROR: The DRR rendered in slabs differs from the in-core rendering" << std::endl;
+      return EXIT_FAILURE;
+      }
+    std::cout << "DRR rendered from " << numberOfSlabs << " slab reads of "
+              << slabThickness << " slices equals the in-core rendering" << std::endl;
+    drr = slabDRR;
+    }
+
+  // Optionally write the cost of the ray of every pixel: the number of
+  // voxels it visits and the time spent casting it. The images are flipped
+  // as the DRR is, so that they overlay the written DRR.
+  if (cost_name || costtime_name)
+    {
+    using CostImageType = itk::Image< float, Dimension >;
+    CostImageType::Pointer voxelsVisited = CostImageType::New();
+    voxelsVisited->CopyInformation( filter->GetOutput() );
+    voxelsVisited->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    voxelsVisited->Allocate();
+    CostImageType::Pointer rayTime;
+    if (costtime_name)
+      {
+      rayTime = CostImageType::New();
+      rayTime->CopyInformation( voxelsVisited );
+      rayTime->SetRegions( voxelsVisited->GetLargestPossibleRegion() );
+      rayTime->Allocate();
+      }
+
+    timer.Start("Ray cost");
+    interpolator->RenderRayCost( voxelsVisited.GetPointer(), rayTime.GetPointer() );
+    timer.Stop("Ray cost");
+
+    // The longest rays bound the latency of the tiles holding them
+    double totalVoxels = 0.0;
+    double maximumVoxels = 0.0;
+    const itk::SizeValueType numberOfPixels = voxelsVisited->GetPixelContainer()->Size();
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      totalVoxels += voxelsVisited->GetBufferPointer()[i];
+      maximumVoxels = std::max( maximumVoxels, static_cast<double>( voxelsVisited->GetBufferPointer()[i] ) );
+      }
+    const double meanVoxels = numberOfPixels > 0 ? totalVoxels / numberOfPixels : 0.0;
+    std::cout << "Voxels visited per ray: mean " << meanVoxels << ", maximum " << maximumVoxels
+              << " (" << ( meanVoxels > 0.0 ? maximumVoxels / meanVoxels : 0.0 ) << " times the mean)" << std::endl;
+    if (totalVoxels <= 0.0)
+      {
+      std::cerr << "ERROR: No ray of the DRR visits the CT" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    // The voxel counts are those of the rays cast by RenderProjection(),
+    // as counted by the performance counters when they are compiled in
+    if (itk::RegistrationPerformanceCounters::Enabled)
+      {
+      itk::SizeValueType numberOfMissedRays = 0;
+      for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+        {
+        numberOfMissedRays += voxelsVisited->GetBufferPointer()[i] == 0.0f ? 1 : 0;
+        }
+      CostImageType::Pointer countedDRR = CostImageType::New();
+      countedDRR->CopyInformation( voxelsVisited );
+      countedDRR->SetRegions( voxelsVisited->GetLargestPossibleRegion() );
+      countedDRR->Allocate();
+      interpolator->GetPerformanceCounters()->Reset();
+      interpolator->RenderProjection( countedDRR.GetPointer() );
+      const itk::PerformanceCounterSnapshot counts = interpolator->GetPerformanceCounters()->GetSnapshot();
+      if (counts.VoxelsVisited != static_cast<uint64_t>( totalVoxels )
+          || counts.RaysCast != numberOfPixels
+          || counts.RaysMissed != numberOfMissedRays)
+        {
+        std::cerr << "ERROR: The ray costs add up to " << totalVoxels << " voxels and "
+                  << numberOfMissedRays << " missed rays, the performance counters to "
+                  << counts.VoxelsVisited << " voxels and " << counts.RaysMissed << " missed rays of "
+                  << counts.RaysCast << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+
+    // The rays of a detector moved 10 m aside miss the CT and visit no voxel
+    CostImageType::Pointer missedVoxels = CostImageType::New();
+    missedVoxels->CopyInformation( voxelsVisited );
+    missedVoxels->SetRegions( voxelsVisited->GetLargestPossibleRegion() );
+    CostImageType::PointType missedOrigin = voxelsVisited->GetOrigin();
+    missedOrigin[0] += 10000.0;
+    missedVoxels->SetOrigin( missedOrigin );
+    missedVoxels->Allocate();
+    missedVoxels->FillBuffer( -1.0f );
+    interpolator->RenderRayCost( missedVoxels.GetPointer() );
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      if (missedVoxels->GetBufferPointer()[i] != 0.0f)
+        {
+        std::cerr << "ERROR: A ray missing the CT visits " << missedVoxels->GetBufferPointer()[i]
+                  << " voxels" << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+
+    using FlipCostFilterType = itk::FlipImageFilter< CostImageType >;
+    FlipCostFilterType::FlipAxesArrayType flipCostAxes;
+    flipCostAxes[0] = 0;
+    flipCostAxes[1] = 1;
+    flipCostAxes[2] = 0;
+    using CostWriterType = itk::ImageFileWriter< CostImageType >;
+    const std::pair< const char *, CostImageType::Pointer > costImages[] =
+      { { cost_name, voxelsVisited }, { costtime_name, rayTime } };
+    for (const auto & costImage : costImages)
+      {
+      if (!costImage.first)
+        {
+        continue;
+        }
+      FlipCostFilterType::Pointer flipCost = FlipCostFilterType::New();
+      flipCost->SetFlipAxes( flipCostAxes );
+      flipCost->SetInput( costImage.second );
+      CostWriterType::Pointer costWriter = CostWriterType::New();
+      costWriter->SetFileName( costImage.first );
+      costWriter->SetInput( flipCost->GetOutput() );
+      try
+        {
+        std::cout << "Writing image: " << costImage.first << std::endl;
+        costWriter->Update();
+        }
+      catch( itk::ExceptionObject & err )
+        {
+        std::cerr << "ERROR: ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  // Optionally render the DRR in single and in double precision, without
+  // rounding to the pixel type, and check the deviation between them. Both
+  // start every ray from the same voxel: they only differ where a ray
+  // crosses two planes at nearly the same point, and the segment between
+  // the crossings goes to another voxel. The pixels of these rays may
+  // deviate by a few percent, hence the number of pixels deviating beyond
+  // a small fraction of the maximum intensity is bounded, as by the
+  // compare options of the test driver, rather than the largest deviation.
+  // TwoProjectionRayCastValidation checks its siddon candidate the same way.
+  if (checkPrecision)
+    {
+    const double meanTolerance = 1.0e-4;           // Of the mean intensity
+    const double pixelTolerance = 1.0e-3;          // Of the maximum intensity
+    const double numberOfPixelsTolerance = 1.0e-3; // Fraction of the pixels
+    using RealImageType = itk::Image< double, Dimension >;
+    RealImageType::Pointer singleDRR = RealImageType::New();
+    singleDRR->CopyInformation( filter->GetOutput() );
+    singleDRR->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    singleDRR->Allocate();
+    RealImageType::Pointer doubleDRR = RealImageType::New();
+    doubleDRR->CopyInformation( singleDRR );
+    doubleDRR->SetRegions( singleDRR->GetLargestPossibleRegion() );
+    doubleDRR->Allocate();
+
+    timer.Start("DRR generation in single precision");
+    interpolator->RenderProjectionWith< itk::SiddonRayTraversal<float> >(
+      singleDRR.GetPointer(), itk::ThresholdedSumRayAccumulator<float>( threshold ) );
+    timer.Stop("DRR generation in single precision");
+    timer.Start("DRR generation in double precision");
+    interpolator->RenderProjectionWith< itk::SiddonRayTraversal<double> >(
+      doubleDRR.GetPointer(), itk::ThresholdedSumRayAccumulator<double>( threshold ) );
+    timer.Stop("DRR generation in double precision");
+
+    double sumOfDeviations = 0.0;
+    double maximumDeviation = 0.0;
+    double sumOfIntensities = 0.0;
+    double maximumIntensity = 0.0;
+    const itk::SizeValueType numberOfPixels = doubleDRR->GetPixelContainer()->Size();
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      const double intensity = std::fabs( doubleDRR->GetBufferPointer()[i] );
+      sumOfIntensities += intensity;
+      maximumIntensity = std::max( maximumIntensity, intensity );
+      }
+    itk::SizeValueType numberOfDeviatingPixels = 0;
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      const double deviation = std::fabs( singleDRR->GetBufferPointer()[i] - doubleDRR->GetBufferPointer()[i] );
+      sumOfDeviations += deviation;
+      maximumDeviation = std::max( maximumDeviation, deviation );
+      if (deviation > pixelTolerance * maximumIntensity)
+        {
+        numberOfDeviatingPixels++;
+        }
+      }
+    const double meanDeviation = sumOfIntensities > 0.0 ? sumOfDeviations / sumOfIntensities : 0.0;
+    const double peakDeviation = maximumIntensity > 0.0 ? maximumDeviation / maximumIntensity : 0.0;
+    std::cout << "Single precision DRR: mean deviation " << 100.0 * meanDeviation
+              << "% of the mean intensity, maximum deviation " << 100.0 * peakDeviation
+              << "% of the maximum intensity, " << numberOfDeviatingPixels << " of "
+              << numberOfPixels << " pixels deviating by more than " << 100.0 * pixelTolerance
+              << "% of the maximum intensity" << std::endl;
+    if (meanDeviation > meanTolerance
+        || numberOfDeviatingPixels > numberOfPixelsTolerance * numberOfPixels)
+      {
+      std::cerr << "ERROR: The single precision DRR deviates from the double precision DRR "
+                << "by more than " << 100.0 * meanTolerance << "% on average, or on more than "
+                << 100.0 * numberOfPixelsTolerance << "% of the pixels by more than "
+                << 100.0 * pixelTolerance << "% of the maximum intensity" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // Optionally render the DRR with another combination of the ray casting
+  // kernel policies: the rays, the voxels and the threshold are those of
+  // the Siddon-Jacobs rendering.
+  if (kernel_name)
+    {
+    InputImageType::Pointer kernelDRR = InputImageType::New();
+    kernelDRR->CopyInformation( filter->GetOutput() );
+    kernelDRR->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    kernelDRR->Allocate();
+
+    timer.Start("DRR generation with another kernel");
+    if (strcmp(kernel_name, "joseph") == 0)
+      {
+      interpolator->RenderProjectionWith< itk::JosephRayTraversal<float> >(
+        kernelDRR.GetPointer(), itk::ThresholdedSumRayAccumulator<float>( threshold ) );
+      }
+    else if (strcmp(kernel_name, "fixedpoint") == 0)
+      {
+      interpolator->RenderProjectionWith< itk::FixedPointSiddonRayTraversal<float> >(
+        kernelDRR.GetPointer(), itk::ThresholdedSumRayAccumulator<float>( threshold ) );
+      }
+    else
+      {
+      interpolator->RenderProjectionWith< itk::SiddonRayTraversal<float> >(
+        kernelDRR.GetPointer(), itk::MaximumIntensityRayAccumulator<float>() );
+      }
+    timer.Stop("DRR generation with another kernel");
+
+    // The line integrals of both traversals estimate the same quantity
+    double siddonSum = 0.0;
+    double kernelSum = 0.0;
+    const itk::SizeValueType numberOfPixels = kernelDRR->GetPixelContainer()->Size();
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      siddonSum += drr->GetBufferPointer()[i];
+      kernelSum += kernelDRR->GetBufferPointer()[i];
+      }
+    std::cout << "DRR rendered with the " << kernel_name << " kernel, total intensity "
+              << kernelSum << " (Siddon-Jacobs: " << siddonSum << ")" << std::endl;
+    if ((strcmp(kernel_name, "joseph") == 0) && (std::fabs( kernelSum - siddonSum ) > 0.1 * std::fabs( siddonSum )))
+      {
+      std::cerr << "ERROR: The line integrals of Joseph's method differ from those of Siddon-Jacobs" << std::endl;
+      return EXIT_FAILURE;
+      }
+    // The fixed point traversal visits the voxels of the exact one
+    if ((strcmp(kernel_name, "fixedpoint") == 0) && (std::fabs( kernelSum - siddonSum ) > 0.001 * std::fabs( siddonSum )))
+      {
+      std::cerr << "ERROR: The fixed point traversal differs from the Siddon-Jacobs traversal" << std::endl;
+      return EXIT_FAILURE;
+      }
+    drr = kernelDRR;
+    }
+
+  // Optionally render the DRR from the surface of the voxels above the
+  // threshold, with the geometry of the Siddon-Jacobs rendering. The mean
+  // densities preserve the integral of the voxels, so the total intensity
+  // only differs by the distribution of the voxels along the rays.
+  if (useMesh)
+    {
+    using MeshInterpolatorType = itk::MeshRayCastInterpolateImageFunction<InputImageType,double,float>;
+    MeshInterpolatorType::Pointer meshInterpolator = MeshInterpolatorType::New();
+    meshInterpolator->SetProjectionAngle( dtr * rprojection );
+    meshInterpolator->SetFocalPointToIsocenterDistance( scd );
+    meshInterpolator->SetThreshold( threshold );
+    meshInterpolator->SetTransform( transform );
+    meshInterpolator->SetProjectionGeometry( geometry );
+    meshInterpolator->SetInputImage( interpolator->GetInputImage() );
+    meshInterpolator->Initialize();
+
+    InputImageType::Pointer meshDRR = InputImageType::New();
+    meshDRR->CopyInformation( filter->GetOutput() );
+    meshDRR->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    meshDRR->Allocate();
+
+    timer.Start("Mesh extraction");
+    const MeshInterpolatorType::MeshType * mesh = meshInterpolator->GetMesh();
+    timer.Stop("Mesh extraction");
+    timer.Start("DRR generation from the mesh");
+    meshInterpolator->RenderProjection( meshDRR.GetPointer() );
+    timer.Stop("DRR generation from the mesh");
+
+    double siddonSum = 0.0;
+    double meshSum = 0.0;
+    const itk::SizeValueType numberOfPixels = meshDRR->GetPixelContainer()->Size();
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      siddonSum += drr->GetBufferPointer()[i];
+      meshSum += meshDRR->GetBufferPointer()[i];
+      }
+    std::cout << "DRR rendered from a mesh of " << mesh->GetNumberOfFaces() << " faces and "
+              << mesh->GetNumberOfRegions() << " regions, total intensity "
+              << meshSum << " (Siddon-Jacobs: " << siddonSum << ")" << std::endl;
+    if (std::fabs( meshSum - siddonSum ) > 0.05 * std::fabs( siddonSum ))
+      {
+      std::cerr << "ERROR: The DRR rendered from the mesh differs from the Siddon-Jacobs DRR" << std::endl;
+      return EXIT_FAILURE;
+      }
+    drr = meshDRR;
+    }
+
+  // Optionally compute the DRR from central slices of the spectrum of the
+  // CT, and report how far it deviates from the Siddon-Jacobs DRR and the
+  // error expected from the divergence of the rays. On a phantom of sharp
+  // edged spheres the mean deviation is about 6% with an oversampling
+  // factor of 2, 4% with 4 and 18% without oversampling, and the total
+  // intensity is within 2% with oversampling; the checks below leave a
+  // margin over these for the edges of a CT.
+  if (fourierOversampling > 0)
+    {
+    using ProjectorType = itk::FourierSliceProjector<InputImageType>;
+    ProjectorType::Pointer projector = ProjectorType::New();
+    projector->SetInput( interpolator->GetInputImage() );
+    projector->SetThreshold( threshold );
+    projector->SetOversamplingFactor( fourierOversampling );
+    projector->SetTransform( transform );
+    projector->SetProjectionGeometry( geometry );
+
+    InputImageType::Pointer fourierDRR = InputImageType::New();
+    fourierDRR->CopyInformation( filter->GetOutput() );
+    fourierDRR->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+    fourierDRR->Allocate();
+
+    timer.Start("Spectrum of the CT");
+    projector->Precompute();
+    timer.Stop("Spectrum of the CT");
+    timer.Start("DRR generation from the spectrum");
+    projector->RenderProjection( fourierDRR.GetPointer() );
+    timer.Stop("DRR generation from the spectrum");
+
+    double siddonSum = 0.0;
+    double fourierSum = 0.0;
+    double sumOfDeviations = 0.0;
+    double maximumDeviation = 0.0;
+    double maximumIntensity = 0.0;
+    const itk::SizeValueType numberOfPixels = fourierDRR->GetPixelContainer()->Size();
+    for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+      {
+      const double intensity = drr->GetBufferPointer()[i];
+      const double deviation = std::fabs( fourierDRR->GetBufferPointer()[i] - intensity );
+      siddonSum += intensity;
+      fourierSum += fourierDRR->GetBufferPointer()[i];
+      sumOfDeviations += deviation;
+      maximumDeviation = std::max( maximumDeviation, deviation );
+      maximumIntensity = std::max( maximumIntensity, std::fabs( intensity ) );
+      }
+    const double meanDeviation = siddonSum != 0.0 ? sumOfDeviations / std::fabs( siddonSum ) : 0.0;
+    const double peakDeviation = maximumIntensity > 0.0 ? maximumDeviation / maximumIntensity : 0.0;
+    std::cout << "DRR computed from the spectrum, total intensity " << fourierSum
+              << " (Siddon-Jacobs: " << siddonSum << "), mean deviation " << 100.0 * meanDeviation
+              << "% of the mean intensity, maximum deviation " << 100.0 * peakDeviation
+              << "% of the maximum intensity, divergence error up to "
+              << projector->EstimateDivergenceError( fourierDRR.GetPointer() ) << " mm" << std::endl;
+    if (std::fabs( fourierSum - siddonSum ) > 0.05 * std::fabs( siddonSum ) || meanDeviation > 0.15)
+      {
+      std::cerr << "ERROR: The DRR computed from the spectrum differs from the Siddon-Jacobs DRR "
+                << "by more than 5% in total or 15% on average" << std::endl;
+      return EXIT_FAILURE;
+      }
+    drr = fourierDRR;
+    }
+
   if (verbose)
     {
     std::cout << "Output image origin: "
@@ -510,7 +1172,7 @@ int GetDRRSiddonJacobsRayTracing( int argc, char *argv[] )
     RescaleFilterType::Pointer rescaler = RescaleFilterType::New();
     rescaler->SetOutputMinimum(   0 );
     rescaler->SetOutputMaximum( 255 );
-    rescaler->SetInput( filter->GetOutput() );
+    rescaler->SetInput( drr );
 
     timer.Start("DRR post-processing");
     rescaler->Update();
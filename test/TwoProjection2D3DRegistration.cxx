@@ -60,12 +60,30 @@
 #include "itkImageFileWriter.h"
 
 #include "itkResampleImageFilter.h"
-#include "itkCastImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkFlipImageFilter.h"
 
 #include "itkCommand.h"
 #include "itkTimeProbesCollectorBase.h"
+#include "itkRealTimeExecutionProfile.h"
+#include "itkPreparedVolumeCache.h"
+#include "itkRegistrationPerformanceCounters.h"
+#include "itkRegistrationTracer.h"
+#include "itkRegistrationMemoryAccount.h"
+
+#include "TwoProjectionRegistrationSetup.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 
 // First we define the command class to allow us to monitor the registration.
@@ -122,6 +140,24 @@ void exe_usage()
   std::cerr << "       <-res float float float float>     Pixel spacing of projection images in the isocenter plane [default: 1x1 mm]  \n";
   std::cerr << "       <-iso float float float> Isocenter location in voxel in indices (center of rotation and projection center)\n";
   std::cerr << "       <-threshold float>       Intensity threshold below which are ignore [default: 0]\n";
+  std::cerr << "       <-track int>             Number of frames re-registered in tracking mode after the registration [default: 0]\n";
+  std::cerr << "       <-predict>               Use motion prediction in tracking mode [default: no]\n";
+  std::cerr << "       <-workers int>           Number of persistent ray casting workers [default: serial]\n";
+  std::cerr << "       <-cpus int,int,...>      Processors the workers are pinned to [default: no pinning]\n";
+  std::cerr << "       <-numa interleave|replicate>  Placement of the CT on the NUMA nodes for the workers [default: none, exits with 77 on a single node]\n";
+  std::cerr << "       <-deterministic>         Reduce the metric sums independently of the number of workers [default: no]\n";
+  std::cerr << "       <-checkworkers int,int,...>  Register again with each number of workers and check that the\n";
+  std::cerr << "                                result is bit-identical (implies -deterministic)\n";
+  std::cerr << "       <-async>                 Run the registration in a separate thread [default: no]\n";
+  std::cerr << "       <-cancel int>            Cancel the asynchronous registration after the given number of iterations, and check that it stops there\n";
+  std::cerr << "       <-counters>              Print the performance counters of the registration [default: no]\n";
+  std::cerr << "       <-trace file>            Write the timeline of the registration as trace events (chrome://tracing)\n";
+  std::cerr << "       <-memory>                Print the memory footprint of the registration and its peak [default: no]\n";
+  std::cerr << "       <-batch file>            Register the cases of a CSV manifest instead of the positional arguments\n";
+  std::cerr << "       <-results file>          CSV results table of the batch mode [default: standard output]\n";
+  std::cerr << "       <-jobs int>              Number of cases registered concurrently in batch mode [default: 1]\n";
+  std::cerr << "       <-cachedir dir>          Directory of the memory mapped prepared CTs in batch mode [default: none]\n";
+  std::cerr << "       <-cachememory MiB>       Memory ceiling of the prepared CTs in batch mode [default: none]\n";
   std::cerr << "       <-o file>                Output image filename\n\n";
   std::cerr << "                                by  Jian Wu\n";
   std::cerr << "                                eewujian@hotmail.com\n";
@@ -130,6 +166,407 @@ void exe_usage()
 }
 
 
+// Batch mode
+// ~~~~~~~~~~
+//
+// In batch mode the cases of a CSV manifest are registered with the
+// settings of the command line. Each line of the manifest holds
+//
+//   case,Image2D1,ProjAngle1,Image2D2,ProjAngle2,Volume3D[,threshold[,isoX,isoY,isoZ]]
+//
+// Empty lines and lines starting with '#' are skipped, as is a header
+// line whose first field is "case". The -threshold and -iso options give
+// the threshold and the isocenter of the cases that have none, and -2dcx
+// the central axes of all the projections. The options of the single
+// case mode that do not apply to a batch, e.g. -track or -async, are
+// rejected. The cases are sorted by CT and
+// threshold and dispensed in that order to the job threads, so that each
+// CT is read and prepared once and shared by the jobs that use it. With
+// -cachedir the prepared CTs are kept as memory mapped files, so that
+// later batches skip reading and preparing them.
+
+namespace
+{
+
+struct BatchCase
+{
+  std::string Name;
+  std::string Image2D1;
+  double      ProjAngle1;
+  std::string Image2D2;
+  double      ProjAngle2;
+  std::string Volume3D;
+  double      Threshold;
+  bool        CustomizedIso;
+  double      Iso[3];
+};
+
+struct BatchResult
+{
+  bool        Success;
+  std::string Message;
+  double      Parameters[6];
+  double      MetricValue;
+  int         NumberOfIterations;
+  bool        VolumeCacheHit;
+  double      ElapsedTime;
+};
+
+struct BatchOptions
+{
+  double scd;
+  bool   customizedRes;
+  double res[4];
+  bool   customizedCentralAxis;
+  double centralAxis[4];   // Continuous indices of the central axis of both views
+  double threshold;        // Threshold of the cases without one
+  bool   customizedIso;
+  double iso[3];           // Isocenter of the cases without one
+  double initialPose[6];   // Rotations in degrees, translations in mm
+  int    numberOfJobs;     // Cases registered concurrently
+  int    numberOfWorkers;  // Ray casting workers per case, 0 for serial
+  bool   deterministic;    // Metric value independent of the number of workers
+  bool   verbose;
+  std::string cacheDirectory; // Prepared volume files, empty for none
+  itk::SizeValueType cacheMemory; // Ceiling of the prepared volumes in bytes, 0 for none
+  bool   printMemory;      // Report the footprint of all the cases
+};
+
+bool ReadBatchManifest( const char * fileName,
+                        const BatchOptions & options,
+                        std::vector<BatchCase> & cases )
+{
+  std::ifstream manifest( fileName );
+  if (!manifest)
+    {
+    std::cerr << "ERROR: Cannot read the manifest " << fileName << std::endl;
+    return false;
+    }
+
+  std::string line;
+  unsigned int lineNumber = 0;
+  while (std::getline(manifest, line))
+    {
+    lineNumber++;
+    if (!line.empty() && line.back() == '\r')
+      {
+      line.pop_back();
+      }
+    if (line.empty() || line[0] == '#')
+      {
+      continue;
+      }
+
+    std::vector<std::string> fields;
+    std::stringstream lineStream(line);
+    std::string field;
+    while (std::getline(lineStream, field, ','))
+      {
+      fields.push_back(field);
+      }
+    if (fields.size() > 0 && fields[0] == "case")
+      {
+      continue;
+      }
+    if (fields.size() != 6 && fields.size() != 7 && fields.size() != 10)
+      {
+      std::cerr << "ERROR: " << fileName << ":" << lineNumber
+                << ": expected 6, 7 or 10 fields" << std::endl;
+      return false;
+      }
+
+    BatchCase batchCase;
+    batchCase.Name = fields[0];
+    batchCase.Image2D1 = fields[1];
+    batchCase.ProjAngle1 = atof(fields[2].c_str());
+    batchCase.Image2D2 = fields[3];
+    batchCase.ProjAngle2 = atof(fields[4].c_str());
+    batchCase.Volume3D = fields[5];
+    batchCase.Threshold = fields.size() > 6 ? atof(fields[6].c_str()) : options.threshold;
+    batchCase.CustomizedIso = fields.size() > 7 || options.customizedIso;
+    for (unsigned int i = 0; i < 3; i++)
+      {
+      batchCase.Iso[i] = fields.size() > 7 ? atof(fields[7 + i].c_str()) : options.iso[i];
+      }
+    cases.push_back(batchCase);
+    }
+  return true;
+}
+
+constexpr unsigned int BatchDimension = 3;
+using BatchImageType = itk::Image< float, BatchDimension >;
+// The CT is cached and registered in its integer pixel type, as in the
+// single case mode
+using BatchVolumeType = itk::Image< short, BatchDimension >;
+using BatchVolumeCacheType = itk::PreparedVolumeCache< BatchVolumeType >;
+
+BatchVolumeType::Pointer ReadBatchVolume( const std::string & fileName )
+{
+  using ReaderType = itk::ImageFileReader< BatchVolumeType >;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( fileName );
+  reader->Update();
+  BatchVolumeType::Pointer volume = reader->GetOutput();
+  volume->DisconnectPipeline();
+  return volume;
+}
+
+// Read a projection image, flipped in y and rescaled to 0-255 as in the
+// single case mode, with its origin placed in the imaging plane.
+BatchImageType::Pointer ReadBatchProjection( const std::string & fileName,
+                                             const BatchOptions & options,
+                                             unsigned int view )
+{
+  using ReaderType = itk::ImageFileReader< BatchImageType >;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( fileName );
+  reader->Update();
+
+  if (options.customizedRes)
+    {
+    BatchImageType::SpacingType spacing;
+    spacing[0] = options.res[2 * view];
+    spacing[1] = options.res[2 * view + 1];
+    spacing[2] = 1.0;
+    reader->GetOutput()->SetSpacing( spacing );
+    }
+
+  using FlipFilterType = itk::FlipImageFilter< BatchImageType >;
+  FlipFilterType::Pointer flipFilter = FlipFilterType::New();
+  FlipFilterType::FlipAxesArrayType flipArray;
+  flipArray[0] = 0;
+  flipArray[1] = 1;
+  flipArray[2] = 0;
+  flipFilter->SetFlipAxes( flipArray );
+  flipFilter->SetInput( reader->GetOutput() );
+
+  using RescaleFilterType = itk::RescaleIntensityImageFilter< BatchImageType, BatchImageType >;
+  RescaleFilterType::Pointer rescaler = RescaleFilterType::New();
+  rescaler->SetOutputMinimum(   0 );
+  rescaler->SetOutputMaximum( 255 );
+  rescaler->SetInput( flipFilter->GetOutput() );
+  rescaler->Update();
+
+  BatchImageType::Pointer image = rescaler->GetOutput();
+  image->DisconnectPipeline();
+  TwoProjectionRegistrationSetup::PlaceProjection( image.GetPointer(), options.scd,
+    options.customizedCentralAxis ? options.centralAxis + 2 * view : nullptr );
+  return image;
+}
+
+BatchResult RegisterBatchCase( const BatchCase & batchCase,
+                               const BatchOptions & options,
+                               BatchVolumeCacheType * cache )
+{
+  using TransformType = TwoProjectionRegistrationSetup::TransformType;
+  using OptimizerType = TwoProjectionRegistrationSetup::OptimizerType;
+  using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< BatchImageType, BatchVolumeType >;
+  using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< BatchVolumeType, double, float >;
+  using RegistrationType = itk::TwoProjectionImageRegistrationMethod< BatchImageType, BatchVolumeType >;
+
+  const double dtr = TwoProjectionRegistrationSetup::DegreesToRadians;
+  const auto caseStart = std::chrono::steady_clock::now();
+
+  BatchResult result;
+  result.Success = false;
+  result.MetricValue = 0.0;
+  result.NumberOfIterations = 0;
+  result.VolumeCacheHit = false;
+  std::fill( result.Parameters, result.Parameters + 6, 0.0 );
+
+  try
+    {
+    // The prepared CT is shared with the other cases of the same CT
+    bool hit = false;
+    BatchVolumeType::ConstPointer volume =
+      cache->GetVolume( batchCase.Volume3D, batchCase.Threshold, ReadBatchVolume, &hit );
+    result.VolumeCacheHit = hit;
+
+    BatchImageType::Pointer fixedImage1 = ReadBatchProjection( batchCase.Image2D1, options, 0 );
+    BatchImageType::Pointer fixedImage2 = ReadBatchProjection( batchCase.Image2D2, options, 1 );
+
+    // The origin of a prepared volume is (0,0,0)
+    TransformType::Pointer transform = TransformType::New();
+    TwoProjectionRegistrationSetup::InitializeTransform( transform,
+      TwoProjectionRegistrationSetup::ComputeIsocenter( volume.GetPointer(), batchCase.CustomizedIso ? batchCase.Iso : nullptr ),
+      options.initialPose );
+
+    // The threshold is already subtracted from the prepared volume
+    InterpolatorType::Pointer interpolator1 = InterpolatorType::New();
+    TwoProjectionRegistrationSetup::InitializeInterpolator( interpolator1.GetPointer(),
+      batchCase.ProjAngle1, options.scd, 0.0, transform );
+
+    InterpolatorType::Pointer interpolator2 = InterpolatorType::New();
+    TwoProjectionRegistrationSetup::InitializeInterpolator( interpolator2.GetPointer(),
+      batchCase.ProjAngle2, options.scd, 0.0, transform );
+
+    MetricType::Pointer metric = MetricType::New();
+    TwoProjectionRegistrationSetup::InitializeMetric( metric.GetPointer(), options.deterministic );
+
+    OptimizerType::Pointer optimizer = OptimizerType::New();
+    TwoProjectionRegistrationSetup::InitializeOptimizer( optimizer );
+
+    RegistrationType::Pointer registration = RegistrationType::New();
+    registration->SetMetric( metric );
+    registration->SetOptimizer( optimizer );
+    registration->SetTransform( transform );
+    registration->SetInterpolator1( interpolator1 );
+    registration->SetInterpolator2( interpolator2 );
+    registration->SetFixedImage1( fixedImage1 );
+    registration->SetFixedImage2( fixedImage2 );
+    registration->SetMovingImage( volume );
+    registration->SetFixedImageRegion1( fixedImage1->GetBufferedRegion() );
+    registration->SetFixedImageRegion2( fixedImage2->GetBufferedRegion() );
+    // The cases and the cache share an account: the footprint of the node
+    registration->SetMemoryAccount( cache->GetMemoryAccount() );
+    const RegistrationType::ParametersType initialParameters = transform->GetParameters();
+    registration->SetInitialTransformParameters( initialParameters );
+
+    // Every job has its own workers
+    if (options.numberOfWorkers > 0)
+      {
+      itk::RealTimeExecutionProfile::Pointer profile = itk::RealTimeExecutionProfile::New();
+      profile->SetNumberOfWorkers( options.numberOfWorkers );
+      registration->SetRealTimeProfile( profile );
+      }
+
+    registration->StartRegistration();
+
+    const RegistrationType::ParametersType finalParameters = registration->GetLastTransformParameters();
+    for (unsigned int i = 0; i < 6; i++)
+      {
+      result.Parameters[i] = i < 3 ? finalParameters[i]/dtr : finalParameters[i];
+      }
+    result.MetricValue = optimizer->GetValue();
+    result.NumberOfIterations = optimizer->GetCurrentIteration();
+    result.Success = true;
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    result.Message = err.GetDescription();
+    }
+
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - caseStart;
+  result.ElapsedTime = elapsed.count();
+  return result;
+}
+
+int RunBatch( const char * manifestFileName,
+              const char * resultsFileName,
+              const BatchOptions & options )
+{
+  std::vector<BatchCase> cases;
+  if (!ReadBatchManifest( manifestFileName, options, cases ))
+    {
+    return EXIT_FAILURE;
+    }
+
+  // Order the cases by CT, keeping the manifest order within a CT
+  std::vector<std::size_t> order( cases.size() );
+  for (std::size_t i = 0; i < order.size(); i++)
+    {
+    order[i] = i;
+    }
+  std::stable_sort( order.begin(), order.end(),
+    [&cases](std::size_t a, std::size_t b)
+    {
+    return std::make_pair( cases[a].Volume3D, cases[a].Threshold )
+         < std::make_pair( cases[b].Volume3D, cases[b].Threshold );
+    } );
+
+  // At most numberOfJobs CTs are in use at a time; one more is kept so
+  // that a CT is never evicted while cases still need it.
+  const unsigned int numberOfJobs = options.numberOfJobs > 0 ? options.numberOfJobs : 1;
+  BatchVolumeCacheType::Pointer cache = BatchVolumeCacheType::New();
+  cache->SetMaximumNumberOfVolumes( numberOfJobs + 1 );
+  cache->SetCacheDirectory( options.cacheDirectory );
+  cache->SetMaximumMemorySize( options.cacheMemory );
+
+  std::vector<BatchResult> results( cases.size() );
+  std::atomic<std::size_t> nextCase( 0 );
+  std::mutex outputMutex;
+
+  const auto batchStart = std::chrono::steady_clock::now();
+  auto runJobs = [&]()
+    {
+    for (std::size_t next = nextCase++; next < order.size(); next = nextCase++)
+      {
+      const std::size_t c = order[next];
+      results[c] = RegisterBatchCase( cases[c], options, cache );
+      if (options.verbose)
+        {
+        std::lock_guard<std::mutex> lock( outputMutex );
+        std::cout << "Case " << cases[c].Name << ": "
+                  << ( results[c].Success ? "done" : results[c].Message )
+                  << " in " << results[c].ElapsedTime << " s" << std::endl;
+        }
+      }
+    };
+
+  std::vector<std::thread> jobs;
+  for (unsigned int j = 1; j < numberOfJobs; j++)
+    {
+    jobs.emplace_back( runJobs );
+    }
+  runJobs();
+  for (auto & job : jobs)
+    {
+    job.join();
+    }
+  const std::chrono::duration<double> batchTime = std::chrono::steady_clock::now() - batchStart;
+
+  // Results table in the manifest order
+  std::ofstream resultsFile;
+  if (resultsFileName)
+    {
+    resultsFile.open( resultsFileName );
+    if (!resultsFile)
+      {
+      std::cerr << "ERROR: Cannot write the results " << resultsFileName << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  std::ostream & table = resultsFileName ? resultsFile : std::cout;
+
+  table << "case,status,rx_deg,ry_deg,rz_deg,tx_mm,ty_mm,tz_mm,metric,iterations,ct_cache_hit,time_s" << std::endl;
+  unsigned int numberOfFailures = 0;
+  for (std::size_t c = 0; c < cases.size(); c++)
+    {
+    const BatchResult & result = results[c];
+    table << cases[c].Name << "," << ( result.Success ? "ok" : "failed" );
+    for (double parameter : result.Parameters)
+      {
+      table << "," << parameter;
+      }
+    table << "," << result.MetricValue
+          << "," << result.NumberOfIterations
+          << "," << ( result.VolumeCacheHit ? 1 : 0 )
+          << "," << result.ElapsedTime << std::endl;
+    if (!result.Success)
+      {
+      std::cerr << "ERROR: Case " << cases[c].Name << ": " << result.Message << std::endl;
+      numberOfFailures++;
+      }
+    }
+
+  std::cout << "Batch: " << cases.size() << " cases, "
+            << cache->GetNumberOfMisses() - cache->GetNumberOfFileHits() << " CT loads, "
+            << cache->GetNumberOfFileHits() << " mapped, "
+            << numberOfJobs << " jobs, "
+            << batchTime.count() << " s" << std::endl;
+
+  if (options.printMemory)
+    {
+    std::cout << "Memory:" << std::endl;
+    cache->GetMemoryAccount()->Report( std::cout );
+    }
+
+  return numberOfFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // end anonymous namespace
+
+
 int TwoProjection2D3DRegistration( int argc, char *argv[] )
 {
   char *fileImage2D1 = nullptr;
@@ -174,9 +611,32 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
 
   double threshold = 0.0;
 
+  int numberOfFrames = 0; // Number of frames registered in tracking mode
+  bool predictMotion = false;
+
+  int numberOfWorkers = 0; // Serial metric evaluation unless a pool is requested
+  itk::RealTimeExecutionProfile::ProcessorSetType processors;
+  itk::RealTimeExecutionProfile::NumaPolicyType numaPolicy = itk::RealTimeExecutionProfile::NumaDefault;
+
+  bool deterministic = false;
+  std::vector<int> checkWorkers; // Numbers of workers the result is checked against
+
+  bool runAsync = false;
+  int cancelIteration = 0; // Iteration after which the registration is cancelled
+
+  bool printCounters = false;
+  char *fileTrace = nullptr; // Trace events of the registration
+  bool printMemory = false;
+
+  char *fileManifest = nullptr; // Batch mode manifest
+  char *fileResults = nullptr;
+  int numberOfJobs = 1;
+  char *cacheDirectory = nullptr;
+  double cacheMemory = 0.0; // MiB
+
   // Parse command line parameters
 
-  if (argc <= 5)
+  if (argc <= 2)
     exe_usage();
 
   while (argc > 1)
@@ -299,6 +759,161 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
       argc--; argv++;
       }
 
+    if ((ok == false) && (strcmp(argv[1], "-track") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfFrames = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-predict") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      predictMotion = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-workers") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfWorkers = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cpus") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      std::stringstream cpuList(argv[1]);
+      std::string cpu;
+      while (std::getline(cpuList, cpu, ','))
+        {
+        processors.push_back(atoi(cpu.c_str()));
+        }
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-numa") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      if (strcmp(argv[1], "interleave") == 0)
+        {
+        numaPolicy = itk::RealTimeExecutionProfile::NumaInterleave;
+        }
+      else if (strcmp(argv[1], "replicate") == 0)
+        {
+        numaPolicy = itk::RealTimeExecutionProfile::NumaReplicate;
+        }
+      else
+        {
+        std::cerr << "Unknown NUMA policy: " << argv[1] << std::endl;
+        exe_usage();
+        }
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-deterministic") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      deterministic = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-checkworkers") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      std::stringstream workerList(argv[1]);
+      std::string workers;
+      while (std::getline(workerList, workers, ','))
+        {
+        checkWorkers.push_back(atoi(workers.c_str()));
+        }
+      deterministic = true;
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-async") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      runAsync = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cancel") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cancelIteration = atoi(argv[1]);
+      runAsync = true;
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-counters") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      printCounters = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-trace") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      fileTrace = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-memory") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      printMemory = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-batch") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      fileManifest = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-results") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      fileResults = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-jobs") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfJobs = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cachedir") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cacheDirectory = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cachememory") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cacheMemory = atof(argv[1]);
+      argc--; argv++;
+      }
+
     if ((ok == false) && (strcmp(argv[1], "-o") == 0))
       {
       argc--; argv++;
@@ -356,6 +971,66 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
       }
     }
 
+  if (fileManifest)
+    {
+    // A batch registers every case once, with its own workers
+    if (numberOfFrames > 0 || predictMotion || runAsync || !checkWorkers.empty()
+        || !processors.empty() || numaPolicy != itk::RealTimeExecutionProfile::NumaDefault
+        || printCounters || fileTrace)
+      {
+      std::cerr << "ERROR: -track, -predict, -async, -cancel, -checkworkers, -cpus, -numa, -counters and -trace"
+                << " cannot be used with -batch" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    BatchOptions options;
+    options.scd = scd;
+    options.customizedRes = customized_2DRES;
+    options.res[0] = image1resX;
+    options.res[1] = image1resY;
+    options.res[2] = image2resX;
+    options.res[3] = image2resY;
+    options.customizedCentralAxis = customized_2DCX;
+    options.centralAxis[0] = image1centerX;
+    options.centralAxis[1] = image1centerY;
+    options.centralAxis[2] = image2centerX;
+    options.centralAxis[3] = image2centerY;
+    options.threshold = threshold;
+    options.customizedIso = customized_iso;
+    options.iso[0] = cx;
+    options.iso[1] = cy;
+    options.iso[2] = cz;
+    options.initialPose[0] = rx;
+    options.initialPose[1] = ry;
+    options.initialPose[2] = rz;
+    options.initialPose[3] = tx;
+    options.initialPose[4] = ty;
+    options.initialPose[5] = tz;
+    options.numberOfJobs = numberOfJobs;
+    options.numberOfWorkers = numberOfWorkers;
+    options.deterministic = deterministic;
+    options.verbose = verbose;
+    options.cacheDirectory = cacheDirectory ? cacheDirectory : "";
+    options.cacheMemory = static_cast<itk::SizeValueType>( cacheMemory * 1024.0 * 1024.0 );
+    options.printMemory = printMemory;
+    return RunBatch( fileManifest, fileResults, options );
+    }
+
+  if (fileVolume3D == nullptr)
+    {
+    std::cerr << "ERROR: Missing positional arguments" << std::endl;
+    exe_usage();
+    }
+
+  // The NUMA placement does nothing on a single node: report the run as
+  // skipped, with the SKIP_RETURN_CODE of the NUMA test, rather than as a
+  // placement that passed
+  if (numaPolicy != itk::RealTimeExecutionProfile::NumaDefault && itk::NumaTopology::GetNumberOfNodes() < 2)
+    {
+    std::cout << "NUMA placement needs several NUMA nodes, the machine has one: skipped" << std::endl;
+    return 77;
+    }
+
   if (verbose)
     {
     if (fileImage2D1)  std::cout << "Input 2D image 1: " << fileImage2D1  << std::endl;
@@ -388,21 +1063,27 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
 
   using InternalImageType = itk::Image< InternalPixelType, Dimension >;
 
-  using TransformType = itk::Euler3DTransform< double >;
+  using TransformType = TwoProjectionRegistrationSetup::TransformType;
 
-  using OptimizerType = itk::PowellOptimizer;
+  using OptimizerType = TwoProjectionRegistrationSetup::OptimizerType;
 
   //using MetricType = itk::GradientDifferenceTwoImageToOneImageMetric<
-  using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< InternalImageType, InternalImageType >;
+  // The CT is registered in its integer pixel type: the voxels are
+  // converted to float in the ray loop, which saves a float copy of the
+  // volume and halves the memory read by every ray.
+  using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< InternalImageType, ImageType3D >;
 
+  // The rays are traced in single precision, while the transform is in
+  // double precision
   using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction<
-    InternalImageType,
-    double >;
+    ImageType3D,
+    double,
+    float >;
 
 
   using RegistrationType = itk::TwoProjectionImageRegistrationMethod<
     InternalImageType,
-    InternalImageType >;
+    ImageType3D >;
 
 
   // Each of the registration components are instantiated in the
@@ -415,8 +1096,7 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   InterpolatorType::Pointer   interpolator2  = InterpolatorType::New();
   RegistrationType::Pointer   registration  = RegistrationType::New();
 
-  metric->ComputeGradientOff();
-  metric->SetSubtractMean( true );
+  TwoProjectionRegistrationSetup::InitializeMetric( metric.GetPointer(), deterministic );
 
   // and passed to the registration method:
 
@@ -426,6 +1106,17 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   registration->SetInterpolator1(  interpolator1  );
   registration->SetInterpolator2(  interpolator2  );
 
+  // Optionally evaluate the metric with a persistent, pinned worker pool.
+  itk::RealTimeExecutionProfile::Pointer profile;
+  if (numberOfWorkers > 0 || !processors.empty())
+    {
+    profile = itk::RealTimeExecutionProfile::New();
+    profile->SetNumberOfWorkers( numberOfWorkers > 0 ? numberOfWorkers : processors.size() );
+    profile->SetProcessorSet( processors );
+    profile->SetNumaPolicy( numaPolicy );
+    registration->SetRealTimeProfile( profile );
+    }
+
   if (debug)
     {
     metric->DebugOn();
@@ -521,76 +1212,36 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   rescaler2D2->SetInput( flipFilter2->GetOutput() );
 
 
-  //  The 3D CT dataset is casted to the internal image type using
-  //  {CastImageFilters}.
-
-  using CastFilterType3D = itk::CastImageFilter<
-    ImageType3D, InternalImageType >;
-
-  CastFilterType3D::Pointer caster3D = CastFilterType3D::New();
-  caster3D->SetInput( image3DIn );
-
   rescaler2D1->Update();
   rescaler2D2->Update();
-  caster3D->Update();
 
 
+  // The 3D CT dataset is used as read, without a cast to the internal
+  // image type
   registration->SetFixedImage1(  rescaler2D1->GetOutput() );
   registration->SetFixedImage2(  rescaler2D2->GetOutput() );
-  registration->SetMovingImage( caster3D->GetOutput() );
+  registration->SetMovingImage( image3DIn );
 
   // Initialise the transform
   // ~~~~~~~~~~~~~~~~~~~~~~~~
 
-  // Set the order of the computation. Default ZXY
-  transform->SetComputeZYX(true);
-
-
-  // The transform is initialised with the translation [tx,ty,tz] and
-  // rotation [rx,ry,rz] specified on the command line
-
-  TransformType::OutputVectorType translation;
-
-  translation[0] = tx;
-  translation[1] = ty;
-  translation[2] = tz;
-
-  transform->SetTranslation(translation);
+  // The transform is initialised with the rotation [rx,ry,rz] and
+  // translation [tx,ty,tz] specified on the command line. The centre of
+  // rotation is set by default to the centre of the 3D volume but can be
+  // offset from this position using a command line specified isocenter
+  // [cx,cy,cz]
 
   // constant for converting degrees to radians
-  const double dtr = ( atan(1.0) * 4.0 ) / 180.0;
-  transform->SetRotation(dtr*rx, dtr*ry, dtr*rz);
+  const double dtr = TwoProjectionRegistrationSetup::DegreesToRadians;
 
-  // The centre of rotation is set by default to the centre of the 3D
-  // volume but can be offset from this position using a command
-  // line specified translation [cx,cy,cz]
+  const double initialPose[6] = { rx, ry, rz, tx, ty, tz };
+  const double isocenterIndices[3] = { cx, cy, cz };
+  const TransformType::InputPointType isocenter =
+    TwoProjectionRegistrationSetup::ComputeIsocenter( image3DIn.GetPointer(), customized_iso ? isocenterIndices : nullptr );
+  TwoProjectionRegistrationSetup::InitializeTransform( transform, isocenter, initialPose );
 
-  ImageType3D::PointType origin3D = image3DIn->GetOrigin();
   const itk::Vector<double, 3> resolution3D = image3DIn->GetSpacing();
-
-  using ImageRegionType3D = ImageType3D::RegionType;
-  using SizeType3D = ImageRegionType3D::SizeType;
-
-  ImageRegionType3D region3D = caster3D->GetOutput()->GetBufferedRegion();
-  SizeType3D        size3D   = region3D.GetSize();
-
-  TransformType::InputPointType isocenter;
-  if (customized_iso)
-    {
-    // Isocenter location given by the user.
-    isocenter[0] = origin3D[0] + resolution3D[0] * cx;
-    isocenter[1] = origin3D[1] + resolution3D[1] * cy;
-    isocenter[2] = origin3D[2] + resolution3D[2] * cz;
-    }
-  else
-    {
-    // Set the center of the image as the isocenter.
-    isocenter[0] = origin3D[0] + resolution3D[0] * static_cast<double>( size3D[0] ) / 2.0;
-    isocenter[1] = origin3D[1] + resolution3D[1] * static_cast<double>( size3D[1] ) / 2.0;
-    isocenter[2] = origin3D[2] + resolution3D[2] * static_cast<double>( size3D[2] ) / 2.0;
-    }
-
-  transform->SetCenter(isocenter);
+  const ImageType3D::SizeType size3D = image3DIn->GetBufferedRegion().GetSize();
 
 
   if (verbose)
@@ -616,47 +1267,27 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   // command line parameters [image1centerX, image1centerY,
   // image2centerX, image2centerY].
 
-  double origin2D1[ Dimension ];
-  double origin2D2[ Dimension ];
-
   // Note: Two 2D images may have different image sizes and pixel dimensions, although
-  // scd are the same.
-
-  const itk::Vector<double, 3> resolution2D1 = imageReader2D1->GetOutput()->GetSpacing();
-  const itk::Vector<double, 3> resolution2D2 = imageReader2D2->GetOutput()->GetSpacing();
-
-  using ImageRegionType2D = InternalImageType::RegionType;
-  using SizeType2D = ImageRegionType2D::SizeType;
-
-  ImageRegionType2D region2D1 = rescaler2D1->GetOutput()->GetBufferedRegion();
-  ImageRegionType2D region2D2 = rescaler2D2->GetOutput()->GetBufferedRegion();
-  SizeType2D        size2D1   = region2D1.GetSize();
-  SizeType2D        size2D2   = region2D2.GetSize();
+  // scd are the same. Without central axis positions given by the user,
+  // the image centers are used.
 
-  if (!customized_2DCX)
-    { // Central axis positions are not given by the user. Use the image centers
-    // as the central axis position.
-    image1centerX = ((double) size2D1[0] - 1.)/2.;
-    image1centerY = ((double) size2D1[1] - 1.)/2.;
-    image2centerX = ((double) size2D2[0] - 1.)/2.;
-    image2centerY = ((double) size2D2[1] - 1.)/2.;
-    }
+  const double centralAxis1[2] = { image1centerX, image1centerY };
+  const double centralAxis2[2] = { image2centerX, image2centerY };
 
   // 2D Image 1
-  origin2D1[0] = - resolution2D1[0] * image1centerX;
-  origin2D1[1] = - resolution2D1[1] * image1centerY;
-  origin2D1[2] = - scd;
-
-  imageReader2D1->GetOutput()->SetOrigin( origin2D1 );
-  rescaler2D1->GetOutput()->SetOrigin( origin2D1 );
+  TwoProjectionRegistrationSetup::PlaceProjection( imageReader2D1->GetOutput(), scd, customized_2DCX ? centralAxis1 : nullptr );
+  TwoProjectionRegistrationSetup::PlaceProjection( rescaler2D1->GetOutput(), scd, customized_2DCX ? centralAxis1 : nullptr );
 
   // 2D Image 2
-  origin2D2[0] = - resolution2D2[0] * image2centerX;
-  origin2D2[1] = - resolution2D2[1] * image2centerY;
-  origin2D2[2] = - scd;
+  TwoProjectionRegistrationSetup::PlaceProjection( imageReader2D2->GetOutput(), scd, customized_2DCX ? centralAxis2 : nullptr );
+  TwoProjectionRegistrationSetup::PlaceProjection( rescaler2D2->GetOutput(), scd, customized_2DCX ? centralAxis2 : nullptr );
 
-  imageReader2D2->GetOutput()->SetOrigin( origin2D2 );
-  rescaler2D2->GetOutput()->SetOrigin( origin2D2 );
+  const itk::Vector<double, 3> resolution2D1 = imageReader2D1->GetOutput()->GetSpacing();
+  const itk::Vector<double, 3> resolution2D2 = imageReader2D2->GetOutput()->GetSpacing();
+  const InternalImageType::SizeType size2D1 = rescaler2D1->GetOutput()->GetBufferedRegion().GetSize();
+  const InternalImageType::SizeType size2D2 = rescaler2D2->GetOutput()->GetBufferedRegion().GetSize();
+  const InternalImageType::PointType origin2D1 = rescaler2D1->GetOutput()->GetOrigin();
+  const InternalImageType::PointType origin2D2 = rescaler2D2->GetOutput()->GetOrigin();
 
   registration->SetFixedImageRegion1( rescaler2D1->GetOutput()->GetBufferedRegion() );
   registration->SetFixedImageRegion2( rescaler2D2->GetOutput()->GetBufferedRegion() );
@@ -691,20 +1322,10 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   // to find a match which aligns bony structures in the images.
 
   // 2D Image 1
-  interpolator1->SetProjectionAngle( dtr*projAngle1 );
-  interpolator1->SetFocalPointToIsocenterDistance(scd);
-  interpolator1->SetThreshold(threshold);
-  interpolator1->SetTransform(transform);
-
-  interpolator1->Initialize();
+  TwoProjectionRegistrationSetup::InitializeInterpolator( interpolator1.GetPointer(), projAngle1, scd, threshold, transform );
 
   // 2D Image 2
-  interpolator2->SetProjectionAngle( dtr*projAngle2 );
-  interpolator2->SetFocalPointToIsocenterDistance(scd);
-  interpolator2->SetThreshold(threshold);
-  interpolator2->SetTransform(transform);
-
-  interpolator2->Initialize();
+  TwoProjectionRegistrationSetup::InitializeInterpolator( interpolator2.GetPointer(), projAngle2, scd, threshold, transform );
 
 
   // Set up the transform and start position
@@ -713,32 +1334,14 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   // The registration start position is intialised using the
   // transformation parameters.
 
-  registration->SetInitialTransformParameters( transform->GetParameters() );
-
-  // We wish to minimize the negative normalized correlation similarity measure.
+  const RegistrationType::ParametersType initialParameters = transform->GetParameters();
+  registration->SetInitialTransformParameters( initialParameters );
 
-  // optimizer->SetMaximize( true );  // for GradientDifferenceTwoImageToOneImageMetric
-  optimizer->SetMaximize( false );  // for NCC
+  // We wish to minimize the negative normalized correlation similarity
+  // measure, with weightings such that one degree equates to one
+  // millimeter.
 
-  optimizer->SetMaximumIteration( 10 );
-  optimizer->SetMaximumLineIteration( 4 ); // for Powell's method
-  optimizer->SetStepLength( 4.0 );
-  optimizer->SetStepTolerance( 0.02 );
-  optimizer->SetValueTolerance( 0.001 );
-
-  // The optimizer weightings are set such that one degree equates to
-  // one millimeter.
-
-  itk::Optimizer::ScalesType weightings( transform->GetNumberOfParameters() );
-
-  weightings[0] = 1./dtr;
-  weightings[1] = 1./dtr;
-  weightings[2] = 1./dtr;
-  weightings[3] = 1.;
-  weightings[4] = 1.;
-  weightings[5] = 1.;
-
-  optimizer->SetScales( weightings );
+  TwoProjectionRegistrationSetup::InitializeOptimizer( optimizer );
 
   if (verbose)
     {
@@ -753,6 +1356,19 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
 
   optimizer->AddObserver( itk::IterationEvent(), observer );
 
+  if (printCounters && verbose)
+    {
+    registration->AddObserver( itk::PerformanceCountersEvent(),
+      [](const itk::EventObject & event)
+      {
+      const auto & countersEvent = static_cast<const itk::PerformanceCountersEvent &>( event );
+      const itk::PerformanceCounterSnapshot & snapshot = countersEvent.GetSnapshot();
+      std::cout << "Iteration " << countersEvent.GetIteration()
+                << ": rays = " << snapshot.RaysCast
+                << ", metric evaluations = " << snapshot.MetricEvaluations << std::endl;
+      } );
+    }
+
 
   // Start the registration
   // ~~~~~~~~~~~~~~~~~~~~~~
@@ -760,18 +1376,80 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   // Create a timer to record calculation time.
   itk::TimeProbesCollectorBase timer;
 
+  if (fileTrace)
+    {
+    registration->GetTracer()->EnabledOn();
+    }
+
   if (verbose)
     {
     std::cout << "Starting the registration now..." << std::endl;
     }
 
+  // Iterations seen by the cancelling observer
+  std::atomic<int> observedIterations( 0 );
+
   try
     {
     timer.Start("Registration");
-    // Start the registration.
-    registration->StartRegistration();
+    if (runAsync)
+      {
+      // Cancel from an iteration observer of the optimizer, as a console
+      // would on a couch motion. The observer runs in the registration
+      // thread; the metric evaluation of the next iteration is aborted.
+      if (cancelIteration > 0)
+        {
+        RegistrationType * reg = registration.GetPointer();
+        optimizer->AddObserver( itk::IterationEvent(),
+          [reg, cancelIteration, &observedIterations](const itk::EventObject &)
+          {
+          if (++observedIterations == cancelIteration)
+            {
+            reg->CancelRegistration();
+            }
+          } );
+        }
+
+      // Start the registration and keep the calling thread responsive.
+      std::future<RegistrationType::ParametersType> result = registration->StartRegistrationAsync();
+      while (result.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+        {
+        if (verbose)
+          {
+          std::cout << "Iterations completed: " << registration->GetProgressIteration() << std::endl;
+          }
+        }
+      result.get();
+      }
+    else
+      {
+      // Start the registration.
+      registration->StartRegistration();
+      }
     timer.Stop("Registration");
     }
+  catch( itk::ProcessAborted & )
+    {
+    std::cout << "Registration cancelled after "
+              << registration->GetProgressIteration() << " iterations" << std::endl;
+
+    // The registration stopped on the cancellation, in the iteration after
+    // the one it was requested at
+    if (cancelIteration <= 0 || !registration->GetCancellationToken()->IsCancellationRequested())
+      {
+      std::cerr << "ERROR: The registration was aborted without a cancellation" << std::endl;
+      return EXIT_FAILURE;
+      }
+    if (observedIterations != cancelIteration
+        || registration->GetProgressIteration() != static_cast<itk::SizeValueType>(cancelIteration))
+      {
+      std::cerr << "ERROR: Expected the registration to stop after " << cancelIteration
+                << " iterations, the observer saw " << observedIterations
+                << " and the progress reports " << registration->GetProgressIteration() << std::endl;
+      return EXIT_FAILURE;
+      }
+    return EXIT_SUCCESS;
+    }
   catch( itk::ExceptionObject & err )
     {
     std::cout << "ExceptionObject caught !" << std::endl;
@@ -779,6 +1457,13 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
     return -1;
     }
 
+  if (cancelIteration > 0)
+    {
+    std::cerr << "ERROR: The registration completed " << observedIterations
+              << " iterations without being cancelled" << std::endl;
+    return EXIT_FAILURE;
+    }
+
   using ParametersType = RegistrationType::ParametersType;
   ParametersType finalParameters = registration->GetLastTransformParameters();
 
@@ -803,6 +1488,280 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   std::cout << " Number Of Iterations = " << numberOfIterations << std::endl;
   std::cout << " Metric value  = " << bestValue          << std::endl;
 
+  if (fileTrace)
+    {
+    itk::RegistrationTracer * tracer = registration->GetTracer();
+    tracer->EnabledOff();
+    if (verbose)
+      {
+      std::cout << "Writing " << tracer->GetNumberOfEvents() << " trace events ("
+                << tracer->GetNumberOfDroppedEvents() << " dropped) to " << fileTrace << std::endl;
+      }
+    if (tracer->GetNumberOfEvents() == 0)
+      {
+      std::cerr << "The registration did not record any trace event" << std::endl;
+      return EXIT_FAILURE;
+      }
+    try
+      {
+      tracer->WriteTraceEvents( fileTrace );
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cerr << err << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  if (printCounters)
+    {
+    if (!itk::RegistrationPerformanceCounters::Enabled)
+      {
+      std::cout << "Performance counters not compiled in, "
+                << "configure with TwoProjectionRegistration_USE_PERFORMANCE_COUNTERS=ON" << std::endl;
+      }
+    else
+      {
+      const itk::PerformanceCounterSnapshot counters = registration->GetPerformanceCounterSnapshot();
+      std::cout << "Performance counters:" << std::endl;
+      counters.Print( std::cout, itk::Indent(1) );
+      if (counters.RaysCast == 0 || counters.MetricEvaluations == 0 || counters.PixelsCounted == 0)
+        {
+        std::cerr << "The registration did not count its rays and metric evaluations" << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  if (printMemory)
+    {
+    // The registration declares the images it holds; the readers and the
+    // filters of the test are declared here. The CT is the moving image.
+    itk::RegistrationMemoryAccount * account = registration->GetMemoryAccount();
+    using MemoryAccount = itk::RegistrationMemoryAccount;
+    account->SetAllocation( imageReader2D1.GetPointer(), "ProjectionReaders", MemoryAccount::GetImageBytes( imageReader2D1->GetOutput() ) );
+    account->SetAllocation( imageReader2D2.GetPointer(), "ProjectionReaders", MemoryAccount::GetImageBytes( imageReader2D2->GetOutput() ) );
+    account->SetAllocation( flipFilter1.GetPointer(), "FlippedProjections", MemoryAccount::GetImageBytes( flipFilter1->GetOutput() ) );
+    account->SetAllocation( flipFilter2.GetPointer(), "FlippedProjections", MemoryAccount::GetImageBytes( flipFilter2->GetOutput() ) );
+    std::cout << "Memory:" << std::endl;
+    account->Report( std::cout );
+    if (account->GetBytes( "MovingImage" ) == 0 || account->GetBytes( "FixedImage1" ) == 0
+        || account->GetBytes( "FixedImage2" ) == 0)
+      {
+      std::cerr << "The registration did not account its images" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+
+  // Check that the result does not depend on the number of workers
+  // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+  // With the deterministic reduction, every metric value, and therefore
+  // the whole path of the optimizer, is the same for any number of workers.
+
+  for (int workers : checkWorkers)
+    {
+    itk::RealTimeExecutionProfile::Pointer checkProfile = itk::RealTimeExecutionProfile::New();
+    checkProfile->SetNumberOfWorkers( workers );
+    checkProfile->SetNumaPolicy( numaPolicy );
+    registration->SetRealTimeProfile( checkProfile );
+    registration->SetInitialTransformParameters( initialParameters );
+    try
+      {
+      registration->StartRegistration();
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cout << "ExceptionObject caught !" << std::endl;
+      std::cout << err << std::endl;
+      return -1;
+      }
+
+    const ParametersType checkParameters = registration->GetLastTransformParameters();
+    bool identical = ( checkParameters.Size() == finalParameters.Size() );
+    for (unsigned int i = 0; identical && i < finalParameters.Size(); i++)
+      {
+      identical = ( std::memcmp( &checkParameters[i], &finalParameters[i], sizeof(double) ) == 0 );
+      }
+    if (!identical)
+      {
+      std::cerr << "ERROR: The registration with " << workers << " workers gives "
+                << checkParameters << " instead of " << finalParameters << std::endl;
+      return EXIT_FAILURE;
+      }
+    std::cout << "Registration with " << workers << " workers: bit-identical result" << std::endl;
+    }
+  if (!checkWorkers.empty())
+    {
+    registration->SetRealTimeProfile( profile );
+    if (!profile)
+      {
+      metric->SetWorkerPool( nullptr );
+      }
+    }
+
+
+  // Track the image pair as a stream of frames
+  // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+  // In tracking mode the prepared volume, interpolators and metric are
+  // kept and every frame is warm-started from the previous pose with a
+  // short optimization. The frames are projections of the volume at
+  // known poses, which move away from the registered pose by a constant
+  // step per frame, and every tracked pose is checked against the pose
+  // its frame was projected at.
+
+  if (numberOfFrames > 0)
+    {
+    OptimizerType::Pointer trackingOptimizer = OptimizerType::New();
+    trackingOptimizer->SetMaximize( false );
+    trackingOptimizer->SetMaximumIteration( 2 );
+    trackingOptimizer->SetMaximumLineIteration( 4 );
+    trackingOptimizer->SetStepLength( 1.0 );
+    trackingOptimizer->SetStepTolerance( 0.02 );
+    trackingOptimizer->SetValueTolerance( 0.001 );
+    trackingOptimizer->SetScales( optimizer->GetScales() );
+
+    registration->SetTrackingOptimizer( trackingOptimizer );
+    registration->SetUseMotionPrediction( predictMotion );
+    registration->SetInitialTransformParameters( finalParameters );
+
+    // Motion per frame, in the units of the parameters, and the largest
+    // error of a tracked pose in degrees and mm
+    const double frameMotion[6] = { 0., 0., 0., 1., 0., 1. };
+    const double rotationTolerance = 0.5;
+    const double translationTolerance = 0.5;
+
+    // Project the volume at a pose, as the fixed images are placed
+    auto projectFrame = [&]( const ParametersType & pose, double projAngle,
+                             const InternalImageType * fixedImage ) -> InternalImageType::Pointer
+      {
+      TransformType::Pointer frameTransform = TransformType::New();
+      frameTransform->SetComputeZYX( true );
+      frameTransform->SetCenter( isocenter );
+      frameTransform->SetParameters( pose );
+
+      InterpolatorType::Pointer frameInterpolator = InterpolatorType::New();
+      TwoProjectionRegistrationSetup::InitializeInterpolator( frameInterpolator.GetPointer(),
+        projAngle, scd, threshold, frameTransform );
+
+      using FrameResampleFilterType = itk::ResampleImageFilter< ImageType3D, InternalImageType >;
+      FrameResampleFilterType::Pointer frameResampler = FrameResampleFilterType::New();
+      frameResampler->SetInput( image3DIn );
+      frameResampler->SetDefaultPixelValue( 0 );
+      frameResampler->SetInterpolator( frameInterpolator );
+      frameResampler->SetSize( fixedImage->GetLargestPossibleRegion().GetSize() );
+      frameResampler->SetOutputOrigin( fixedImage->GetOrigin() );
+      frameResampler->SetOutputSpacing( fixedImage->GetSpacing() );
+
+      Input2DRescaleFilterType::Pointer frameRescaler = Input2DRescaleFilterType::New();
+      frameRescaler->SetOutputMinimum(   0 );
+      frameRescaler->SetOutputMaximum( 255 );
+      frameRescaler->SetInput( frameResampler->GetOutput() );
+      frameRescaler->Update();
+
+      InternalImageType::Pointer projection = frameRescaler->GetOutput();
+      projection->DisconnectPipeline();
+      return projection;
+      };
+
+    std::vector<double> latencies;
+    int numberOfLostFrames = 0;
+    try
+      {
+      registration->InitializeTracking();
+      ParametersType truePose = finalParameters;
+      for (int frame = 0; frame < numberOfFrames; frame++)
+        {
+        for (unsigned int i = 0; i < 6; i++)
+          {
+          truePose[i] += frameMotion[i];
+          }
+        InternalImageType::Pointer frame1 = projectFrame( truePose, projAngle1, rescaler2D1->GetOutput() );
+        InternalImageType::Pointer frame2 = projectFrame( truePose, projAngle2, rescaler2D2->GetOutput() );
+
+        registration->TrackFrame( frame1, frame2 );
+        latencies.push_back( registration->GetLastFrameLatency() );
+
+        const ParametersType trackedPose = registration->GetLastTransformParameters();
+        std::cout << "Frame " << frame << ": " << trackedPose
+                  << " (true pose " << truePose << ")"
+                  << " latency = " << registration->GetLastFrameLatency() << " s" << std::endl;
+
+        bool lost = false;
+        for (unsigned int i = 0; i < 6; i++)
+          {
+          const double error = ( i < 3 ) ? ( trackedPose[i] - truePose[i] ) / dtr
+                                         : trackedPose[i] - truePose[i];
+          lost = lost || std::fabs( error ) > ( i < 3 ? rotationTolerance : translationTolerance );
+          }
+        if (lost)
+          {
+          std::cerr << "ERROR: Frame " << frame << " is tracked at " << trackedPose
+                    << " instead of " << truePose << std::endl;
+          numberOfLostFrames++;
+          }
+        }
+      registration->FinalizeTracking();
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cout << "ExceptionObject caught !" << std::endl;
+      std::cout << err << std::endl;
+      return -1;
+      }
+
+    std::cout << "Tracking: " << registration->GetNumberOfTrackedFrames() << " frames"
+              << ", mean latency = " << registration->GetMeanFrameLatency() << " s"
+              << ", jitter = " << registration->GetFrameLatencyJitter() << " s" << std::endl;
+    if (profile)
+      {
+      std::cout << "Latency histogram: ";
+      profile->GetLatencyHistogram().Print( std::cout );
+      std::cout << std::endl;
+      }
+
+    if (numberOfLostFrames > 0)
+      {
+      std::cerr << "ERROR: " << numberOfLostFrames << " of " << numberOfFrames
+                << " frames are not tracked within " << rotationTolerance << " deg and "
+                << translationTolerance << " mm" << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    // The statistics cover the latencies of all the frames, and only them
+    double meanLatency = 0.0;
+    for (double latency : latencies)
+      {
+      meanLatency += latency / latencies.size();
+      }
+    double sumOfSquares = 0.0;
+    for (double latency : latencies)
+      {
+      sumOfSquares += ( latency - meanLatency ) * ( latency - meanLatency );
+      }
+    const double jitter = latencies.size() > 1 ? std::sqrt( sumOfSquares / ( latencies.size() - 1 ) ) : 0.0;
+    const double latencyTolerance = 1e-9 + 1e-6 * meanLatency;
+    bool consistent = registration->GetNumberOfTrackedFrames() == static_cast<itk::SizeValueType>( numberOfFrames );
+    consistent = consistent && *std::min_element( latencies.begin(), latencies.end() ) > 0.0;
+    consistent = consistent && registration->GetLastFrameLatency() == latencies.back();
+    consistent = consistent && std::fabs( registration->GetMeanFrameLatency() - meanLatency ) <= latencyTolerance;
+    consistent = consistent && std::fabs( registration->GetFrameLatencyJitter() - jitter ) <= latencyTolerance;
+    if (profile)
+      {
+      consistent = consistent
+        && profile->GetLatencyHistogram().GetNumberOfSamples() == static_cast<itk::SizeValueType>( numberOfFrames );
+      }
+    if (!consistent)
+      {
+      std::cerr << "ERROR: The tracking statistics do not match the " << latencies.size()
+                << " frames: expected a mean latency of " << meanLatency
+                << " s and a jitter of " << jitter << " s" << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
 
   // Write out the projection images at the registration position
   // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -812,12 +1771,12 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
   finalTransform->SetParameters( finalParameters );
   finalTransform->SetCenter(isocenter);
 
-  using ResampleFilterType = itk::ResampleImageFilter< InternalImageType, InternalImageType >;
+  using ResampleFilterType = itk::ResampleImageFilter< ImageType3D, InternalImageType >;
 
   // The ResampleImageFilter is the driving force for the projection image generation.
   ResampleFilterType::Pointer resampleFilter1 = ResampleFilterType::New();
 
-  resampleFilter1->SetInput( caster3D->GetOutput() ); // Link the 3D volume.
+  resampleFilter1->SetInput( image3DIn ); // Link the 3D volume.
   resampleFilter1->SetDefaultPixelValue( 0 );
 
   // The parameters of interpolator1, such as ProjectionAngle and FocalPointToIsocenterDistance
@@ -835,7 +1794,7 @@ int TwoProjection2D3DRegistration( int argc, char *argv[] )
 
   // Do the same thing for the output image 2.
   ResampleFilterType::Pointer resampleFilter2 = ResampleFilterType::New();
-  resampleFilter2->SetInput( caster3D->GetOutput() );
+  resampleFilter2->SetInput( image3DIn );
   resampleFilter2->SetDefaultPixelValue( 0 );
 
   // The parameters of interpolator2, such as ProjectionAngle and FocalPointToIsocenterDistance
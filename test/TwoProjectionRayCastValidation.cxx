@@ -0,0 +1,1115 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+/*=========================================================================
+
+ This program validates the fast ray casting engines against a reference:
+ the Siddon-Jacobs ray casting traced in double precision. For a number of
+ random poses of a CT, or of a synthetic head phantom, the two views are
+ rendered by the reference and by every candidate engine in the same
+ geometry, and the candidate DRRs are compared with the reference DRRs:
+
+ - the largest and the root mean square pixel deviation, relative to the
+   largest and to the root mean square reference intensity;
+ - the deviation from 1 of the normalized correlation between the
+   candidate and the reference DRR, i.e. the deviation of the value of the
+   normalized correlation metric at the true pose;
+ - the mean pixel deviation, relative to the mean reference intensity,
+   and the fraction of the pixels deviating by more than 0.1% of the
+   largest reference intensity, as checked by the -precision option of
+   GetDRRSiddonJacobsRayTracing.
+
+ The workers and the slabs engines trace the rays of the single precision
+ Siddon-Jacobs engine, and their DRRs must also be identical to its DRRs.
+
+ For the engines a registration can use, the registration is also started
+ from a random perturbation of every pose with the reference and with the
+ candidate interpolators, the fixed images being the reference DRRs at the
+ true pose; the deviation of the results is the mean distance between the
+ target points mapped by both estimated poses.
+
+ Every candidate has tolerances for the six deviations, with defaults for
+ its engine; the program fails when a candidate exceeds one of them. The
+ projections are written as CSV and the summary of the candidates as JSON.
+
+=========================================================================*/
+
+#include "itkTwoProjectionImageRegistrationMethod.h"
+#include "itkEuler3DTransform.h"
+#include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkMeshRayCastInterpolateImageFunction.h"
+#include "itkFourierSliceProjector.h"
+#include "itkProjectionGeometry.h"
+#include "itkRayCastWorkerPool.h"
+#include "itkRealTimeExecutionProfile.h"
+#include "itkPowellOptimizer.h"
+
+#include "itkImage.h"
+#include "itkImageAlgorithm.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr unsigned int Dimension = 3;
+using ImageType = itk::Image< float, Dimension >;
+using ReferenceImageType = itk::Image< double, Dimension >;
+
+using TransformType = itk::Euler3DTransform< double >;
+using SiddonInterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< ImageType, double, float >;
+using ReferenceInterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< ImageType, double, double >;
+using MeshInterpolatorType = itk::MeshRayCastInterpolateImageFunction< ImageType, double, float >;
+using FourierProjectorType = itk::FourierSliceProjector< ImageType >;
+using GeometryType = SiddonInterpolatorType::ProjectionGeometryType;
+using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< ImageType, ImageType >;
+using RegistrationType = itk::TwoProjectionImageRegistrationMethod< ImageType, ImageType >;
+using ParametersType = TransformType::ParametersType;
+
+// constant for converting degrees to radians
+const double dtr = ( std::atan(1.0) * 4.0 ) / 180.0;
+
+void validation_exe_usage()
+{
+  std::cerr << "\n";
+  std::cerr << "Usage: TwoProjectionRayCastValidation <options> [Volume3D]\n";
+  std::cerr << "       Compares the DRRs, and the registrations, of fast ray casting engines with those\n";
+  std::cerr << "       of the double precision Siddon-Jacobs reference. \n\n";
+  std::cerr << "   where <options> is one or more of the following:\n\n";
+  std::cerr << "       <-h>                     Display (this) usage information\n";
+  std::cerr << "       <-v>                     Verbose output [default: no]\n";
+  std::cerr << "       <-synthetic int>         Use a synthetic head phantom of the given number of voxels per side\n";
+  std::cerr << "                                instead of the volume\n";
+  std::cerr << "       <-iso float float float> Isocenter in voxel indices [default: center of the volume]\n";
+  std::cerr << "       <-threshold float>       CT intensity threshold [default: 0]\n";
+  std::cerr << "       <-scd float>             Source to isocenter distance [default: 1000mm]\n";
+  std::cerr << "       <-angles float float>    Projection angles of the two views in degrees [default: 0 90]\n";
+  std::cerr << "       <-size int int>          Number of pixels of the DRRs [default: 128 128]\n";
+  std::cerr << "       <-res float float>       Pixel spacing of the DRRs [default: 2mm 2mm]\n";
+  std::cerr << "       <-poses int>             Number of random poses [default: 4]\n";
+  std::cerr << "       <-seed int>              Seed of the random poses and starts [default: 1]\n";
+  std::cerr << "       <-pose float float>      Largest rotation (deg) and translation (mm) of the poses [default: 10 10]\n";
+  std::cerr << "       <-perturb float float>   Largest rotation (deg) and translation (mm) of the registration starts\n";
+  std::cerr << "                                from the poses [default: 3 5]\n";
+  std::cerr << "       <-target float>          Half side of the cube of target points [default: 50mm]\n";
+  std::cerr << "       <-workers int>           Number of workers of the workers engine [default: 2]\n";
+  std::cerr << "       <-slab int>              Number of slices of the slabs of the slabs engine [default: 8]\n";
+  std::cerr << "       <-fourier int>           Oversampling factor of the fourier engine [default: 2]\n";
+  std::cerr << "       <-candidate string>      Candidate engine[:max:rms:ncc:registration:mean:pixels], may be repeated.\n";
+  std::cerr << "                                engine is siddon, workers, slabs, fixedpoint, joseph, mesh or fourier; the\n";
+  std::cerr << "                                optional tolerances are the largest and the RMS pixel deviation in percent,\n";
+  std::cerr << "                                the NCC deviation, the registration deviation in mm, the mean pixel deviation\n";
+  std::cerr << "                                and the deviating pixels in percent, negative to not check\n";
+  std::cerr << "                                [default: siddon workers slabs fixedpoint]\n";
+  std::cerr << "       <-csv file>              Output CSV filename of the projections [default: none]\n";
+  std::cerr << "       <-o file>                Output JSON filename of the summary [default: standard output]\n\n";
+  exit(EXIT_FAILURE);
+}
+
+// Tolerances of a candidate; a negative tolerance is not checked
+struct Tolerances
+{
+  double MaximumDeviation;      // Percent of the largest reference intensity
+  double RMSDeviation;          // Percent of the RMS reference intensity
+  double NCCDeviation;          // 1 - NCC of the candidate and reference DRRs
+  double RegistrationDeviation; // Mean target distance in mm
+  double MeanDeviation;         // Percent of the mean reference intensity
+  double DeviatingPixels;       // Percent of the pixels deviating by more
+                                // than DeviatingPixelThreshold
+};
+
+// Deviation of a pixel, relative to the largest reference intensity,
+// beyond which it is counted in the deviating pixels
+const double DeviatingPixelThreshold = 1.0e-3;
+
+struct Candidate
+{
+  std::string Name;
+  std::string Engine;
+  Tolerances  Tolerance;
+};
+
+// The single precision Siddon-Jacobs engine visits the voxels of the
+// reference and only differs by rounding: a ray grazing a voxel boundary
+// may attribute a segment to the neighbouring voxel, and its pixel may
+// deviate by a few percent. It is therefore checked as by the -precision
+// option of GetDRRSiddonJacobsRayTracing, by the mean deviation and by the
+// number of deviating pixels, rather than by the largest deviation. The
+// workers and the slabs engines have the same tolerances, and must also
+// give the DRRs of the siddon engine exactly.
+//
+// The fixed point traversal rounds the ray parameters to its own grid.
+// Joseph's method interpolates the voxels, the mesh flattens the
+// densities of its regions and the Fourier slices approximate the
+// divergent rays by parallel ones. The pixel tolerances of fixedpoint and
+// of joseph are 1.5 times the worst deviations measured over 250 random
+// poses of the 64 voxel synthetic phantom, with 64 x 64 DRRs of 4 mm
+// pixels. The tolerances of mesh and fourier and of the registrations are
+// estimates, yet to be measured: they only catch an engine that renders
+// another image or a registration that does not converge.
+bool GetDefaultTolerances( const std::string & engine, Tolerances & tolerances )
+{
+  if (engine == "siddon" || engine == "workers" || engine == "slabs")
+    {
+    tolerances = Tolerances{ -1.0, -1.0, -1.0, 1.0, 1.0e-2, 1.0e-1 };
+    }
+  else if (engine == "fixedpoint")
+    {
+    tolerances = Tolerances{ 5.5, 0.3, 3.5e-6, -1.0, -1.0, -1.0 };
+    }
+  else if (engine == "joseph")
+    {
+    tolerances = Tolerances{ 35.0, 7.5, 3e-3, -1.0, -1.0, -1.0 };
+    }
+  else if (engine == "mesh")
+    {
+    tolerances = Tolerances{ 100.0, 20.0, 5e-2, 3.0, -1.0, -1.0 };
+    }
+  else if (engine == "fourier")
+    {
+    tolerances = Tolerances{ 100.0, 25.0, 5e-2, -1.0, -1.0, -1.0 };
+    }
+  else
+    {
+    return false;
+    }
+  return true;
+}
+
+bool ParseCandidate( const std::string & text, Candidate & candidate )
+{
+  std::istringstream stream( text );
+  std::getline( stream, candidate.Engine, ':' );
+  if (!GetDefaultTolerances( candidate.Engine, candidate.Tolerance ))
+    {
+    return false;
+    }
+  candidate.Name = text;
+  double * tolerances[] = { &candidate.Tolerance.MaximumDeviation, &candidate.Tolerance.RMSDeviation,
+                            &candidate.Tolerance.NCCDeviation, &candidate.Tolerance.RegistrationDeviation,
+                            &candidate.Tolerance.MeanDeviation, &candidate.Tolerance.DeviatingPixels };
+  std::string value;
+  for (double * tolerance : tolerances)
+    {
+    if (!std::getline( stream, value, ':' ))
+      {
+      break;
+      }
+    *tolerance = atof( value.c_str() );
+    }
+  return true;
+}
+
+// Engines a registration can use through their interpolator
+bool CanRegister( const std::string & engine )
+{
+  return engine == "siddon" || engine == "workers" || engine == "mesh";
+}
+
+// Engines tracing the rays of the single precision Siddon-Jacobs engine,
+// in another order or from a copy of the volume
+bool TracesSiddonRays( const std::string & engine )
+{
+  return engine == "workers" || engine == "slabs";
+}
+
+struct Options
+{
+  double       threshold = 0.0;
+  double       scd = 1000.0;
+  double       angles[2] = { 0.0, 90.0 };
+  unsigned int size[2] = { 128, 128 };
+  double       res[2] = { 2.0, 2.0 };
+  unsigned int numberOfWorkers = 2;
+  unsigned int slabThickness = 8;
+  unsigned int fourierOversampling = 2;
+  TransformType::InputPointType isocenter;
+  std::vector<TransformType::InputPointType> targets;
+};
+
+// Deviations of the DRR of a candidate from the reference DRR
+struct Deviation
+{
+  double MaximumDeviation = 0.0;
+  double RMSDeviation = 0.0;
+  double NCCDeviation = 0.0;
+  double MeanDeviation = 0.0;
+  double DeviatingPixels = 0.0;
+};
+
+// Head phantom: an ellipsoidal skull around soft tissue, with two low
+// density cavities and a dense insert, of extent 200 mm
+ImageType::Pointer CreateSyntheticVolume( unsigned int size )
+{
+  constexpr double Extent = 200.0;
+
+  ImageType::Pointer volume = ImageType::New();
+  ImageType::SizeType volumeSize;
+  volumeSize.Fill( size );
+  volume->SetRegions( volumeSize );
+  ImageType::SpacingType spacing;
+  spacing.Fill( Extent / size );
+  volume->SetSpacing( spacing );
+  volume->Allocate();
+
+  struct Sphere
+  {
+    double Center[3];
+    double Radius;
+    float  Value;
+  };
+  const Sphere spheres[] = { { {  0.3, 0.0,  0.2 }, 0.15, 200.0f },
+                             { { -0.3, 0.0,  0.2 }, 0.15, 200.0f },
+                             { {  0.0, 0.3, -0.3 }, 0.10, 1600.0f } };
+
+  itk::ImageRegionIteratorWithIndex< ImageType > it( volume, volume->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    // Coordinates of the voxel center in units of the half extent
+    double q[3];
+    for( unsigned int d = 0; d < Dimension; d++ )
+      {
+      q[d] = 2.0 * ( it.GetIndex()[d] + 0.5 ) / size - 1.0;
+      }
+    const double r2 = ( q[0] / 0.8 ) * ( q[0] / 0.8 ) + ( q[1] / 0.7 ) * ( q[1] / 0.7 )
+                    + ( q[2] / 0.85 ) * ( q[2] / 0.85 );
+    float value = 0.0f;
+    if( r2 < 1.0 )
+      {
+      value = r2 > 0.81 ? 1800.0f : 1000.0f;
+      for( const Sphere & sphere : spheres )
+        {
+        const double dx = q[0] - sphere.Center[0];
+        const double dy = q[1] - sphere.Center[1];
+        const double dz = q[2] - sphere.Center[2];
+        if( dx * dx + dy * dy + dz * dz < sphere.Radius * sphere.Radius )
+          {
+          value = sphere.Value;
+          }
+        }
+      }
+    it.Set( value );
+    }
+  return volume;
+}
+
+TransformType::Pointer CreateTransform( const Options & options, const ParametersType & parameters )
+{
+  TransformType::Pointer transform = TransformType::New();
+  transform->SetComputeZYX( true );
+  transform->SetCenter( options.isocenter );
+  transform->SetParameters( parameters );
+  return transform;
+}
+
+// Mean distance between the targets mapped by two poses
+double ComputeTargetDistance( const Options & options, const ParametersType & pose1, const ParametersType & pose2 )
+{
+  TransformType::Pointer transform1 = CreateTransform( options, pose1 );
+  TransformType::Pointer transform2 = CreateTransform( options, pose2 );
+  double sum = 0.0;
+  for (const TransformType::InputPointType & target : options.targets)
+    {
+    sum += transform1->TransformPoint( target ).EuclideanDistanceTo( transform2->TransformPoint( target ) );
+    }
+  return sum / options.targets.size();
+}
+
+GeometryType::Pointer CreateGeometry( const Options & options, unsigned int view )
+{
+  GeometryType::Pointer geometry = GeometryType::New();
+  geometry->SetLinacGeometry( options.isocenter, options.scd, dtr * options.angles[view] );
+  return geometry;
+}
+
+// Projection image in detector coordinates centered on the isocenter
+template <typename TProjectionImage>
+typename TProjectionImage::Pointer CreateProjection( const Options & options )
+{
+  typename TProjectionImage::Pointer projection = TProjectionImage::New();
+  typename TProjectionImage::SizeType size;
+  typename TProjectionImage::SpacingType spacing;
+  typename TProjectionImage::PointType origin;
+  for (unsigned int i = 0; i < 2; i++)
+    {
+    size[i] = options.size[i];
+    spacing[i] = options.res[i];
+    origin[i] = -0.5 * ( size[i] - 1 ) * spacing[i];
+    }
+  size[2] = 1;
+  spacing[2] = 1.0;
+  origin[2] = 0.0;
+  projection->SetRegions( size );
+  projection->SetSpacing( spacing );
+  projection->SetOrigin( origin );
+  projection->Allocate();
+  projection->FillBuffer( 0 );
+  return projection;
+}
+
+template <typename TInterpolator>
+typename TInterpolator::Pointer CreateInterpolator( const Options & options, const ImageType * volume,
+                                                    TransformType * transform, unsigned int view )
+{
+  typename TInterpolator::Pointer interpolator = TInterpolator::New();
+  interpolator->SetThreshold( options.threshold );
+  interpolator->SetTransform( transform );
+  interpolator->SetProjectionGeometry( CreateGeometry( options, view ) );
+  interpolator->SetInputImage( volume );
+  interpolator->Initialize();
+  return interpolator;
+}
+
+// Copy of the slices [zBegin, zEnd) of the volume, as read by a streaming
+// reader: the largest possible region is the whole volume
+ImageType::ConstPointer ExtractSlab( const ImageType * volume, itk::IndexValueType zBegin, itk::IndexValueType zEnd )
+{
+  ImageType::RegionType region = volume->GetLargestPossibleRegion();
+  region.SetIndex( 2, zBegin );
+  region.SetSize( 2, zEnd - zBegin );
+
+  ImageType::Pointer slab = ImageType::New();
+  slab->CopyInformation( volume );
+  slab->SetBufferedRegion( region );
+  slab->SetRequestedRegion( region );
+  slab->Allocate();
+  itk::ImageAlgorithm::Copy( volume, slab.GetPointer(), region, region );
+  return ImageType::ConstPointer( slab.GetPointer() );
+}
+
+// Render a view with the engine of a candidate
+void RenderCandidate( const Candidate & candidate,
+                      const Options & options,
+                      const ImageType * volume,
+                      TransformType * transform,
+                      unsigned int view,
+                      itk::RayCastWorkerPool * pool,
+                      FourierProjectorType * fourierProjector,
+                      ImageType * projection )
+{
+  const std::string & engine = candidate.Engine;
+  if (engine == "mesh")
+    {
+    CreateInterpolator< MeshInterpolatorType >( options, volume, transform, view )->RenderProjection( projection );
+    return;
+    }
+  if (engine == "fourier")
+    {
+    fourierProjector->SetTransform( transform );
+    fourierProjector->SetProjectionGeometry( CreateGeometry( options, view ) );
+    fourierProjector->RenderProjection( projection );
+    return;
+    }
+
+  SiddonInterpolatorType::Pointer interpolator =
+    CreateInterpolator< SiddonInterpolatorType >( options, volume, transform, view );
+  if (engine == "workers")
+    {
+    interpolator->RenderProjection( projection, pool );
+    }
+  else if (engine == "slabs")
+    {
+    interpolator->RenderProjectionInSlabs( projection,
+      [volume]( itk::IndexValueType zBegin, itk::IndexValueType zEnd )
+      {
+      return ExtractSlab( volume, zBegin, zEnd );
+      },
+      options.slabThickness );
+    }
+  else if (engine == "fixedpoint")
+    {
+    interpolator->RenderProjectionWith< itk::FixedPointSiddonRayTraversal<float> >(
+      projection, itk::ThresholdedSumRayAccumulator<float>( options.threshold ) );
+    }
+  else if (engine == "joseph")
+    {
+    interpolator->RenderProjectionWith< itk::JosephRayTraversal<float> >(
+      projection, itk::ThresholdedSumRayAccumulator<float>( options.threshold ) );
+    }
+  else
+    {
+    interpolator->RenderProjection( projection );
+    }
+}
+
+Deviation CompareProjections( const ReferenceImageType * reference, const ImageType * candidate )
+{
+  const itk::SizeValueType numberOfPixels = reference->GetPixelContainer()->Size();
+  const double * r = reference->GetBufferPointer();
+  const float * c = candidate->GetBufferPointer();
+
+  double referenceMean = 0.0;
+  double candidateMean = 0.0;
+  double maximumIntensity = 0.0;
+  double sumOfIntensities = 0.0;
+  for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+    {
+    referenceMean += r[i];
+    candidateMean += c[i];
+    maximumIntensity = std::max( maximumIntensity, std::fabs( r[i] ) );
+    sumOfIntensities += std::fabs( r[i] );
+    }
+  referenceMean /= numberOfPixels;
+  candidateMean /= numberOfPixels;
+
+  double maximumDeviation = 0.0;
+  double sumOfDeviations = 0.0;
+  double sumOfSquaredDeviations = 0.0;
+  double sumOfSquaredIntensities = 0.0;
+  itk::SizeValueType numberOfDeviatingPixels = 0;
+  double sxy = 0.0;
+  double sxx = 0.0;
+  double syy = 0.0;
+  for (itk::SizeValueType i = 0; i < numberOfPixels; i++)
+    {
+    const double deviation = std::fabs( c[i] - r[i] );
+    maximumDeviation = std::max( maximumDeviation, deviation );
+    sumOfDeviations += deviation;
+    sumOfSquaredDeviations += deviation * deviation;
+    sumOfSquaredIntensities += r[i] * r[i];
+    if (deviation > DeviatingPixelThreshold * maximumIntensity)
+      {
+      numberOfDeviatingPixels++;
+      }
+    const double x = r[i] - referenceMean;
+    const double y = c[i] - candidateMean;
+    sxy += x * y;
+    sxx += x * x;
+    syy += y * y;
+    }
+
+  // The normalized correlation metric subtracting the means takes the
+  // value -NCC at the true pose
+  Deviation result;
+  result.MaximumDeviation = maximumIntensity > 0.0 ? 100.0 * maximumDeviation / maximumIntensity : 0.0;
+  result.RMSDeviation = sumOfSquaredIntensities > 0.0 ? 100.0 * std::sqrt( sumOfSquaredDeviations / sumOfSquaredIntensities ) : 0.0;
+  result.NCCDeviation = ( sxx > 0.0 && syy > 0.0 ) ? 1.0 - sxy / std::sqrt( sxx * syy ) : ( sxx == syy ? 0.0 : 1.0 );
+  result.MeanDeviation = sumOfIntensities > 0.0 ? 100.0 * sumOfDeviations / sumOfIntensities : 0.0;
+  result.DeviatingPixels = 100.0 * numberOfDeviatingPixels / numberOfPixels;
+  return result;
+}
+
+// Register the fixed images from a start with the interpolators of an
+// engine, "reference" for the double precision reference
+ParametersType Register( const std::string & engine,
+                         const Options & options,
+                         const ImageType * volume,
+                         ImageType * const fixedImages[2],
+                         const ParametersType & start )
+{
+  TransformType::Pointer transform = CreateTransform( options, start );
+
+  RegistrationType::InterpolatorType::Pointer interpolators[2];
+  for (unsigned int view = 0; view < 2; view++)
+    {
+    if (engine == "reference")
+      {
+      interpolators[view] = CreateInterpolator< ReferenceInterpolatorType >( options, volume, transform, view ).GetPointer();
+      }
+    else if (engine == "mesh")
+      {
+      interpolators[view] = CreateInterpolator< MeshInterpolatorType >( options, volume, transform, view ).GetPointer();
+      }
+    else
+      {
+      interpolators[view] = CreateInterpolator< SiddonInterpolatorType >( options, volume, transform, view ).GetPointer();
+      }
+    }
+
+  MetricType::Pointer metric = MetricType::New();
+  metric->ComputeGradientOff();
+  metric->SetSubtractMean( true );
+
+  // The settings of TwoProjection2D3DRegistration
+  itk::Optimizer::ScalesType weightings( TransformType::ParametersDimension );
+  for (unsigned int i = 0; i < TransformType::ParametersDimension; i++)
+    {
+    weightings[i] = i < 3 ? 1./dtr : 1.;
+    }
+  itk::PowellOptimizer::Pointer optimizer = itk::PowellOptimizer::New();
+  optimizer->SetMaximize( false );
+  optimizer->SetMaximumIteration( 10 );
+  optimizer->SetMaximumLineIteration( 4 );
+  optimizer->SetStepLength( 4.0 );
+  optimizer->SetStepTolerance( 0.02 );
+  optimizer->SetValueTolerance( 0.001 );
+  optimizer->SetScales( weightings );
+
+  RegistrationType::Pointer registration = RegistrationType::New();
+  registration->SetMetric( metric );
+  registration->SetOptimizer( optimizer );
+  registration->SetTransform( transform );
+  registration->SetInterpolator1( interpolators[0] );
+  registration->SetInterpolator2( interpolators[1] );
+  registration->SetFixedImage1( fixedImages[0] );
+  registration->SetFixedImage2( fixedImages[1] );
+  registration->SetMovingImage( volume );
+  registration->SetFixedImageRegion1( fixedImages[0]->GetBufferedRegion() );
+  registration->SetFixedImageRegion2( fixedImages[1]->GetBufferedRegion() );
+  registration->SetInitialTransformParameters( start );
+  if (engine == "workers")
+    {
+    itk::RealTimeExecutionProfile::Pointer profile = itk::RealTimeExecutionProfile::New();
+    profile->SetNumberOfWorkers( options.numberOfWorkers );
+    registration->SetRealTimeProfile( profile );
+    }
+
+  registration->StartRegistration();
+  return registration->GetLastTransformParameters();
+}
+
+// Check a deviation against a tolerance, negative tolerances excepted
+bool WithinTolerance( double deviation, double tolerance )
+{
+  return tolerance < 0.0 || deviation <= tolerance;
+}
+
+} // namespace
+
+int TwoProjectionRayCastValidation( int argc, char *argv[] )
+{
+  char *input_name = nullptr;
+  char *csv_name = nullptr;
+  char *output_name = nullptr;
+
+  bool ok;
+  bool verbose = false;
+  bool customized_iso = false;
+  float cx = 0.;
+  float cy = 0.;
+  float cz = 0.;
+  unsigned int syntheticSize = 0;
+  unsigned int numberOfPoses = 4;
+  unsigned int seed = 1;
+  double poseRange[2] = { 10.0, 10.0 };
+  double perturbation[2] = { 3.0, 5.0 };
+  double targetHalfSide = 50.0;
+  std::vector<Candidate> candidates;
+  Options options;
+
+  while (argc > 1)
+    {
+    ok = false;
+
+    if ((ok == false) && (strcmp(argv[1], "-h") == 0))
+      {
+      ok = true;
+      validation_exe_usage();
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-v") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      verbose = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-synthetic") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      syntheticSize = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-iso") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cx=atof(argv[1]);
+      argc--; argv++;
+      cy=atof(argv[1]);
+      argc--; argv++;
+      cz=atof(argv[1]);
+      argc--; argv++;
+      customized_iso = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-threshold") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.threshold=atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-scd") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.scd = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-angles") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.angles[0] = atof(argv[1]);
+      argc--; argv++;
+      options.angles[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-size") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.size[0] = atoi(argv[1]);
+      argc--; argv++;
+      options.size[1] = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-res") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.res[0] = atof(argv[1]);
+      argc--; argv++;
+      options.res[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-poses") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfPoses = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-seed") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      seed = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-pose") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      poseRange[0] = atof(argv[1]);
+      argc--; argv++;
+      poseRange[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-perturb") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      perturbation[0] = atof(argv[1]);
+      argc--; argv++;
+      perturbation[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-target") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      targetHalfSide = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-workers") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.numberOfWorkers = std::max( 1, atoi(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-slab") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.slabThickness = std::max( 1, atoi(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-fourier") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.fourierOversampling = std::max( 1, atoi(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-candidate") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      Candidate candidate;
+      if (!ParseCandidate( argv[1], candidate ))
+        {
+        std::cerr << "ERROR: Invalid candidate " << argv[1] << std::endl;
+        validation_exe_usage();
+        }
+      candidates.push_back( candidate );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-csv") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      csv_name = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-o") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      output_name = argv[1];
+      argc--; argv++;
+      }
+
+    if (ok == false)
+      {
+      if (input_name == nullptr)
+        {
+        input_name = argv[1];
+        argc--;
+        argv++;
+        }
+      else
+        {
+        std::cerr << "ERROR: Can not parse argument " << argv[1] << std::endl;
+        validation_exe_usage();
+        }
+      }
+    }
+
+  if (input_name == nullptr && syntheticSize == 0)
+    {
+    std::cerr << "ERROR: No input volume" << std::endl;
+    validation_exe_usage();
+    }
+
+  if (candidates.empty())
+    {
+    for (const char * text : { "siddon", "workers", "slabs", "fixedpoint" })
+      {
+      Candidate candidate;
+      ParseCandidate( text, candidate );
+      candidates.push_back( candidate );
+      }
+    }
+
+  // The volume has its origin at (0,0,0), like a prepared volume
+  ImageType::Pointer volume;
+  if (syntheticSize > 0)
+    {
+    volume = CreateSyntheticVolume( syntheticSize );
+    }
+  else
+    {
+    using ReaderType = itk::ImageFileReader< ImageType >;
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( input_name );
+    try
+      {
+      reader->Update();
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cerr << "ERROR: ExceptionObject caught !" << std::endl;
+      std::cerr << err << std::endl;
+      return EXIT_FAILURE;
+      }
+    volume = reader->GetOutput();
+    volume->DisconnectPipeline();
+    }
+  ImageType::PointType volumeOrigin;
+  volumeOrigin.Fill( 0.0 );
+  volume->SetOrigin( volumeOrigin );
+
+  const ImageType::SpacingType resolution3D = volume->GetSpacing();
+  const ImageType::SizeType size3D = volume->GetBufferedRegion().GetSize();
+  const float iso[3] = { cx, cy, cz };
+  for (unsigned int i = 0; i < Dimension; i++)
+    {
+    options.isocenter[i] = customized_iso ? resolution3D[i] * iso[i]
+                                          : resolution3D[i] * static_cast<double>( size3D[i] ) / 2.0;
+    }
+
+  // The isocenter and the corners of a cube around it
+  options.targets.push_back( options.isocenter );
+  for (unsigned int corner = 0; corner < 8; corner++)
+    {
+    TransformType::InputPointType target = options.isocenter;
+    for (unsigned int i = 0; i < Dimension; i++)
+      {
+      target[i] += ( corner & ( 1u << i ) ) ? targetHalfSide : -targetHalfSide;
+      }
+    options.targets.push_back( target );
+    }
+
+  // The poses are uniform in the pose range, the registration starts
+  // uniform in the perturbation range around them
+  std::mt19937 generator( seed );
+  std::uniform_real_distribution<double> uniform( -1.0, 1.0 );
+  std::vector<ParametersType> poses( numberOfPoses );
+  std::vector<ParametersType> starts( numberOfPoses );
+  for (unsigned int p = 0; p < numberOfPoses; p++)
+    {
+    poses[p].SetSize( TransformType::ParametersDimension );
+    starts[p].SetSize( TransformType::ParametersDimension );
+    for (unsigned int i = 0; i < TransformType::ParametersDimension; i++)
+      {
+      const double scale = i < 3 ? dtr : 1.0;
+      poses[p][i] = scale * poseRange[i < 3 ? 0 : 1] * uniform( generator );
+      starts[p][i] = poses[p][i] + scale * perturbation[i < 3 ? 0 : 1] * uniform( generator );
+      }
+    }
+
+  // Engines shared by the poses: the workers are started once and the
+  // spectrum is computed once
+  itk::RayCastWorkerPool::Pointer pool = itk::RayCastWorkerPool::New();
+  pool->SetNumberOfWorkers( options.numberOfWorkers );
+  pool->Start();
+  FourierProjectorType::Pointer fourierProjector;
+  for (const Candidate & candidate : candidates)
+    {
+    if (candidate.Engine == "fourier" && !fourierProjector)
+      {
+      fourierProjector = FourierProjectorType::New();
+      fourierProjector->SetInput( volume );
+      fourierProjector->SetThreshold( options.threshold );
+      fourierProjector->SetOversamplingFactor( options.fourierOversampling );
+      fourierProjector->Precompute();
+      }
+    }
+
+  // Worst deviations of every candidate over the poses and the views
+  std::vector<Deviation> worst( candidates.size() );
+  std::vector<double> worstRegistration( candidates.size(), -1.0 );
+  std::vector<std::string> errors( candidates.size() );
+
+  std::ofstream table;
+  if (csv_name)
+    {
+    table.open( csv_name );
+    if (!table)
+      {
+      std::cerr << "ERROR: Cannot write the projections " << csv_name << std::endl;
+      return EXIT_FAILURE;
+      }
+    table << "candidate,pose,view,max_deviation_pct,rms_deviation_pct,ncc_deviation,"
+          << "mean_deviation_pct,deviating_pixels_pct,"
+          << "reference_tre_mm,candidate_tre_mm,registration_deviation_mm" << std::endl;
+    }
+
+  for (unsigned int p = 0; p < numberOfPoses; p++)
+    {
+    TransformType::Pointer transform = CreateTransform( options, poses[p] );
+
+    // The reference DRRs, in double precision for the comparisons and in
+    // single precision as fixed images of the registrations
+    ReferenceImageType::Pointer references[2];
+    ImageType::Pointer fixedImages[2];
+    for (unsigned int view = 0; view < 2; view++)
+      {
+      ReferenceInterpolatorType::Pointer reference =
+        CreateInterpolator< ReferenceInterpolatorType >( options, volume, transform, view );
+      references[view] = CreateProjection< ReferenceImageType >( options );
+      reference->RenderProjection( references[view].GetPointer() );
+      fixedImages[view] = CreateProjection< ImageType >( options );
+      reference->RenderProjection( fixedImages[view].GetPointer() );
+      }
+    ImageType * const fixedImagePointers[2] = { fixedImages[0].GetPointer(), fixedImages[1].GetPointer() };
+
+    // The single precision Siddon-Jacobs DRRs, rendered for the first
+    // candidate that must match them
+    ImageType::Pointer siddonProjections[2];
+
+    bool registered = false;
+    ParametersType referenceEstimate;
+    for (std::size_t k = 0; k < candidates.size(); k++)
+      {
+      const Candidate & candidate = candidates[k];
+      try
+        {
+        Deviation deviations[2];
+        for (unsigned int view = 0; view < 2; view++)
+          {
+          ImageType::Pointer projection = CreateProjection< ImageType >( options );
+          RenderCandidate( candidate, options, volume, transform, view, pool, fourierProjector, projection );
+          deviations[view] = CompareProjections( references[view], projection );
+          worst[k].MaximumDeviation = std::max( worst[k].MaximumDeviation, deviations[view].MaximumDeviation );
+          worst[k].RMSDeviation = std::max( worst[k].RMSDeviation, deviations[view].RMSDeviation );
+          worst[k].NCCDeviation = std::max( worst[k].NCCDeviation, deviations[view].NCCDeviation );
+          worst[k].MeanDeviation = std::max( worst[k].MeanDeviation, deviations[view].MeanDeviation );
+          worst[k].DeviatingPixels = std::max( worst[k].DeviatingPixels, deviations[view].DeviatingPixels );
+
+          if (TracesSiddonRays( candidate.Engine ))
+            {
+            if (!siddonProjections[view])
+              {
+              siddonProjections[view] = CreateProjection< ImageType >( options );
+              CreateInterpolator< SiddonInterpolatorType >( options, volume, transform, view )
+                ->RenderProjection( siddonProjections[view].GetPointer() );
+              }
+            const std::size_t numberOfBytes = projection->GetPixelContainer()->Size() * sizeof( float );
+            if (std::memcmp( projection->GetBufferPointer(), siddonProjections[view]->GetBufferPointer(),
+                             numberOfBytes ) != 0 && errors[k].empty())
+              {
+              std::ostringstream error;
+              error << "view " << view + 1 << " of pose " << p
+                    << " differs from the single precision Siddon-Jacobs DRR";
+              errors[k] = error.str();
+              }
+            }
+          }
+
+        // Register with the reference once per pose, and with the candidate
+        double referenceTRE = -1.0;
+        double candidateTRE = -1.0;
+        double registrationDeviation = -1.0;
+        if (CanRegister( candidate.Engine ))
+          {
+          if (!registered)
+            {
+            referenceEstimate = Register( "reference", options, volume, fixedImagePointers, starts[p] );
+            registered = true;
+            }
+          const ParametersType estimate = Register( candidate.Engine, options, volume, fixedImagePointers, starts[p] );
+          referenceTRE = ComputeTargetDistance( options, poses[p], referenceEstimate );
+          candidateTRE = ComputeTargetDistance( options, poses[p], estimate );
+          registrationDeviation = ComputeTargetDistance( options, referenceEstimate, estimate );
+          worstRegistration[k] = std::max( worstRegistration[k], registrationDeviation );
+          }
+
+        for (unsigned int view = 0; view < 2; view++)
+          {
+          if (csv_name)
+            {
+            table << candidate.Name << "," << p << "," << view + 1
+                  << "," << deviations[view].MaximumDeviation << "," << deviations[view].RMSDeviation
+                  << "," << deviations[view].NCCDeviation
+                  << "," << deviations[view].MeanDeviation << "," << deviations[view].DeviatingPixels
+                  << "," << referenceTRE << "," << candidateTRE << "," << registrationDeviation << std::endl;
+            }
+          if (verbose)
+            {
+            std::cout << candidate.Name << " pose " << p << " view " << view + 1
+                      << ": max " << deviations[view].MaximumDeviation << "%, RMS "
+                      << deviations[view].RMSDeviation << "%, NCC " << deviations[view].NCCDeviation
+                      << ", mean " << deviations[view].MeanDeviation << "%, deviating pixels "
+                      << deviations[view].DeviatingPixels << "%";
+            if (registrationDeviation >= 0.0)
+              {
+              std::cout << ", registration " << registrationDeviation << " mm";
+              }
+            std::cout << std::endl;
+            }
+          }
+        }
+      catch( itk::ExceptionObject & err )
+        {
+        errors[k] = err.GetDescription();
+        }
+      }
+    }
+
+  // Summary of the candidates
+  std::ofstream outputFile;
+  if (output_name)
+    {
+    outputFile.open( output_name );
+    if (!outputFile)
+      {
+      std::cerr << "ERROR: Cannot write the summary " << output_name << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  std::ostream & os = output_name ? outputFile : std::cout;
+
+  bool allPassed = true;
+  os << "{\n";
+  os << "  \"configuration\": { \"volume\": \"" << ( syntheticSize > 0 ? "synthetic" : input_name ) << "\""
+     << ", \"poses\": " << numberOfPoses << ", \"seed\": " << seed
+     << ", \"size\": [" << options.size[0] << ", " << options.size[1] << "]"
+     << ", \"res\": [" << options.res[0] << ", " << options.res[1] << "]"
+     << ", \"threshold\": " << options.threshold
+     << ", \"reference\": \"siddon double\" },\n";
+  os << "  \"candidates\": [\n";
+  for (std::size_t k = 0; k < candidates.size(); k++)
+    {
+    const Candidate & candidate = candidates[k];
+    const Tolerances & tolerance = candidate.Tolerance;
+    const bool passed = errors[k].empty() &&
+                        WithinTolerance( worst[k].MaximumDeviation, tolerance.MaximumDeviation ) &&
+                        WithinTolerance( worst[k].RMSDeviation, tolerance.RMSDeviation ) &&
+                        WithinTolerance( worst[k].NCCDeviation, tolerance.NCCDeviation ) &&
+                        WithinTolerance( worstRegistration[k], tolerance.RegistrationDeviation ) &&
+                        WithinTolerance( worst[k].MeanDeviation, tolerance.MeanDeviation ) &&
+                        WithinTolerance( worst[k].DeviatingPixels, tolerance.DeviatingPixels );
+    if (!passed)
+      {
+      allPassed = false;
+      std::cerr << "ERROR: Candidate " << candidate.Name << " deviates from the reference";
+      if (!errors[k].empty())
+        {
+        std::cerr << ": " << errors[k];
+        }
+      std::cerr << std::endl;
+      }
+
+    os << "    { \"name\": \"" << candidate.Name << "\", \"engine\": \"" << candidate.Engine << "\""
+       << ", \"maximumDeviation\": " << worst[k].MaximumDeviation
+       << ", \"rmsDeviation\": " << worst[k].RMSDeviation
+       << ", \"nccDeviation\": " << worst[k].NCCDeviation
+       << ", \"meanDeviation\": " << worst[k].MeanDeviation
+       << ", \"deviatingPixels\": " << worst[k].DeviatingPixels
+       << ", \"registrationDeviation\": ";
+    if (worstRegistration[k] >= 0.0)
+      {
+      os << worstRegistration[k];
+      }
+    else
+      {
+      os << "null";
+      }
+    os << ", \"tolerances\": [" << tolerance.MaximumDeviation << ", " << tolerance.RMSDeviation
+       << ", " << tolerance.NCCDeviation << ", " << tolerance.RegistrationDeviation
+       << ", " << tolerance.MeanDeviation << ", " << tolerance.DeviatingPixels << "]"
+       << ", \"passed\": " << ( passed ? "true" : "false" )
+       << " }" << ( k + 1 < candidates.size() ? "," : "" ) << "\n";
+    }
+  os << "  ]\n";
+  os << "}\n";
+
+  return allPassed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,835 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+/*=========================================================================
+
+ This program measures the accuracy of the registration end to end. For
+ a number of random ground truth poses of a CT, the two fixed images are
+ rendered in process, in the linac geometry of GetDRRSiddonJacobsRayTracing
+ expressed as a ProjectionGeometry, and
+ TwoProjectionImageRegistrationMethod is started from a random
+ perturbation of the true pose. Every configuration, a combination of the
+ ray casting engine of the registration, the optimizer and the detector
+ subsampling, registers the same cases from the same starts.
+
+ The error of a registration is the target registration error (TRE): the
+ mean distance between the images of target points under the true and the
+ estimated transforms, the targets being the isocenter and the corners of
+ a cube around it. A registration succeeds when its TRE is below a
+ threshold. Each configuration is reported with the mean, median and
+ percentiles of the TRE, the success rate and the wall time of the
+ registrations; the cases are written as CSV and the summary as JSON.
+
+ The registrations of the cases run in parallel, one job per thread.
+
+=========================================================================*/
+
+#include "itkTwoProjectionImageRegistrationMethod.h"
+#include "itkEuler3DTransform.h"
+#include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkMeshRayCastInterpolateImageFunction.h"
+#include "itkProjectionGeometry.h"
+#include "itkPowellOptimizer.h"
+#include "itkAmoebaOptimizer.h"
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+constexpr unsigned int Dimension = 3;
+using ImageType = itk::Image< float, Dimension >;
+
+using TransformType = itk::Euler3DTransform< double >;
+using SiddonInterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< ImageType, double, float >;
+using DoubleInterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< ImageType, double, double >;
+using MeshInterpolatorType = itk::MeshRayCastInterpolateImageFunction< ImageType, double, float >;
+using GeometryType = SiddonInterpolatorType::ProjectionGeometryType;
+using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< ImageType, ImageType >;
+using RegistrationType = itk::TwoProjectionImageRegistrationMethod< ImageType, ImageType >;
+using ParametersType = TransformType::ParametersType;
+
+// constant for converting degrees to radians
+const double dtr = ( std::atan(1.0) * 4.0 ) / 180.0;
+
+void accuracy_exe_usage()
+{
+  std::cerr << "\n";
+  std::cerr << "Usage: TwoProjectionRegistrationAccuracyBenchmark <options> Volume3D\n";
+  std::cerr << "       Registers DRRs of a CT rendered at random known poses and reports the\n";
+  std::cerr << "       target registration error of every configuration. \n\n";
+  std::cerr << "   where <options> is one or more of the following:\n\n";
+  std::cerr << "       <-h>                     Display (this) usage information\n";
+  std::cerr << "       <-v>                     Verbose output [default: no]\n";
+  std::cerr << "       <-iso float float float> Isocenter in voxel indices [default: center of the volume]\n";
+  std::cerr << "       <-threshold float>       CT intensity threshold [default: 0]\n";
+  std::cerr << "       <-scd float>             Source to isocenter distance [default: 1000mm]\n";
+  std::cerr << "       <-angles float float>    Projection angles of the two views in degrees [default: 0 90]\n";
+  std::cerr << "       <-size int int>          Number of pixels of the DRRs [default: 128 128]\n";
+  std::cerr << "       <-res float float>       Pixel spacing of the DRRs [default: 2mm 2mm]\n";
+  std::cerr << "       <-cases int>             Number of random poses [default: 20]\n";
+  std::cerr << "       <-seed int>              Seed of the random poses and starts [default: 1]\n";
+  std::cerr << "       <-pose float float>      Largest rotation (deg) and translation (mm) of the true poses\n";
+  std::cerr << "                                [default: 10 10]\n";
+  std::cerr << "       <-perturb float float>   Largest rotation (deg) and translation (mm) of the starts\n";
+  std::cerr << "                                from the true poses [default: 3 5]\n";
+  std::cerr << "       <-target float>          Half side of the cube of target points [default: 50mm]\n";
+  std::cerr << "       <-success float>         Largest TRE of a successful registration [default: 2mm]\n";
+  std::cerr << "       <-config string>         Configuration engine:optimizer:subsampling, may be repeated,\n";
+  std::cerr << "                                engine is siddon, double or mesh, optimizer is powell or amoeba\n";
+  std::cerr << "                                [default: siddon:powell:1 siddon:powell:2 mesh:powell:2 siddon:amoeba:2]\n";
+  std::cerr << "       <-jobs int>              Number of registrations run in parallel [default: all processors]\n";
+  std::cerr << "       <-minsuccess float>      Fail if the success rate of a configuration is lower [default: 0]\n";
+  std::cerr << "       <-csv file>              Output CSV filename of the cases [default: none]\n";
+  std::cerr << "       <-o file>                Output JSON filename of the summary [default: standard output]\n\n";
+  exit(EXIT_FAILURE);
+}
+
+struct Configuration
+{
+  std::string  Name;
+  std::string  Engine;
+  std::string  Optimizer;
+  unsigned int Subsampling;
+};
+
+bool ParseConfiguration( const std::string & text, Configuration & configuration )
+{
+  std::istringstream stream( text );
+  std::string subsampling;
+  if (!std::getline( stream, configuration.Engine, ':' ) ||
+      !std::getline( stream, configuration.Optimizer, ':' ) ||
+      !std::getline( stream, subsampling ))
+    {
+    return false;
+    }
+  configuration.Name = text;
+  configuration.Subsampling = atoi( subsampling.c_str() );
+  return ( configuration.Engine == "siddon" || configuration.Engine == "double" || configuration.Engine == "mesh" ) &&
+         ( configuration.Optimizer == "powell" || configuration.Optimizer == "amoeba" ) &&
+         configuration.Subsampling > 0;
+}
+
+struct Options
+{
+  double       threshold = 0.0;
+  double       scd = 1000.0;
+  double       angles[2] = { 0.0, 90.0 };
+  unsigned int size[2] = { 128, 128 };
+  double       res[2] = { 2.0, 2.0 };
+  double       successThreshold = 2.0;
+  TransformType::InputPointType isocenter;
+  std::vector<TransformType::InputPointType> targets;
+};
+
+// Ground truth pose of a case and the start of its registrations, in
+// Euler parameters (radians and mm)
+struct Case
+{
+  ParametersType Truth;
+  ParametersType Start;
+};
+
+struct Result
+{
+  bool         Success = false;
+  std::string  Message;
+  double       InitialTRE = 0.0;
+  double       TRE = 0.0;
+  double       MetricValue = 0.0;
+  unsigned int NumberOfIterations = 0;
+  double       ElapsedTime = 0.0;
+};
+
+TransformType::Pointer CreateTransform( const Options & options, const ParametersType & parameters )
+{
+  TransformType::Pointer transform = TransformType::New();
+  transform->SetComputeZYX( true );
+  transform->SetCenter( options.isocenter );
+  transform->SetParameters( parameters );
+  return transform;
+}
+
+// Mean distance between the targets mapped by the true and the estimated
+// poses
+double ComputeTRE( const Options & options, const ParametersType & truth, const ParametersType & estimate )
+{
+  TransformType::Pointer trueTransform = CreateTransform( options, truth );
+  TransformType::Pointer estimatedTransform = CreateTransform( options, estimate );
+  double sum = 0.0;
+  for (const TransformType::InputPointType & target : options.targets)
+    {
+    sum += trueTransform->TransformPoint( target ).EuclideanDistanceTo( estimatedTransform->TransformPoint( target ) );
+    }
+  return sum / options.targets.size();
+}
+
+GeometryType::Pointer CreateGeometry( const Options & options, unsigned int view )
+{
+  GeometryType::Pointer geometry = GeometryType::New();
+  geometry->SetLinacGeometry( options.isocenter, options.scd, dtr * options.angles[view] );
+  return geometry;
+}
+
+// Projection image in detector coordinates centered on the isocenter,
+// subsampled by a factor
+ImageType::Pointer CreateProjection( const Options & options, unsigned int subsampling )
+{
+  ImageType::Pointer projection = ImageType::New();
+  ImageType::SizeType size;
+  ImageType::SpacingType spacing;
+  ImageType::PointType origin;
+  for (unsigned int i = 0; i < 2; i++)
+    {
+    size[i] = std::max( 1u, options.size[i] / subsampling );
+    spacing[i] = options.res[i] * options.size[i] / size[i];
+    origin[i] = -0.5 * ( size[i] - 1 ) * spacing[i];
+    }
+  size[2] = 1;
+  spacing[2] = 1.0;
+  origin[2] = 0.0;
+  projection->SetRegions( size );
+  projection->SetSpacing( spacing );
+  projection->SetOrigin( origin );
+  projection->Allocate();
+  projection->FillBuffer( 0.0f );
+  return projection;
+}
+
+template <typename TInterpolator>
+typename TInterpolator::Pointer CreateInterpolator( const Options & options, const ImageType * volume,
+                                                    TransformType * transform, unsigned int view )
+{
+  typename TInterpolator::Pointer interpolator = TInterpolator::New();
+  interpolator->SetThreshold( options.threshold );
+  interpolator->SetTransform( transform );
+  interpolator->SetProjectionGeometry( CreateGeometry( options, view ) );
+  interpolator->SetInputImage( volume );
+  interpolator->Initialize();
+  return interpolator;
+}
+
+RegistrationType::InterpolatorType::Pointer CreateRegistrationInterpolator( const Configuration & configuration,
+                                                                            const Options & options,
+                                                                            const ImageType * volume,
+                                                                            TransformType * transform,
+                                                                            unsigned int view )
+{
+  if (configuration.Engine == "mesh")
+    {
+    return CreateInterpolator< MeshInterpolatorType >( options, volume, transform, view ).GetPointer();
+    }
+  if (configuration.Engine == "double")
+    {
+    return CreateInterpolator< DoubleInterpolatorType >( options, volume, transform, view ).GetPointer();
+    }
+  return CreateInterpolator< SiddonInterpolatorType >( options, volume, transform, view ).GetPointer();
+}
+
+itk::SingleValuedNonLinearOptimizer::Pointer CreateOptimizer( const Configuration & configuration )
+{
+  itk::Optimizer::ScalesType weightings( TransformType::ParametersDimension );
+  for (unsigned int i = 0; i < TransformType::ParametersDimension; i++)
+    {
+    weightings[i] = i < 3 ? 1./dtr : 1.;
+    }
+
+  if (configuration.Optimizer == "amoeba")
+    {
+    // The simplex starts with steps of 2 degrees and 2 mm
+    itk::AmoebaOptimizer::Pointer optimizer = itk::AmoebaOptimizer::New();
+    itk::AmoebaOptimizer::ParametersType simplexDelta( TransformType::ParametersDimension );
+    for (unsigned int i = 0; i < TransformType::ParametersDimension; i++)
+      {
+      simplexDelta[i] = i < 3 ? 2.0 * dtr : 2.0;
+      }
+    optimizer->SetAutomaticInitialSimplex( false );
+    optimizer->SetInitialSimplexDelta( simplexDelta );
+    optimizer->SetMaximumNumberOfIterations( 200 );
+    optimizer->SetParametersConvergenceTolerance( 0.02 );
+    optimizer->SetFunctionConvergenceTolerance( 0.001 );
+    optimizer->SetScales( weightings );
+    return optimizer.GetPointer();
+    }
+
+  // The settings of TwoProjection2D3DRegistration
+  itk::PowellOptimizer::Pointer optimizer = itk::PowellOptimizer::New();
+  optimizer->SetMaximize( false );
+  optimizer->SetMaximumIteration( 10 );
+  optimizer->SetMaximumLineIteration( 4 );
+  optimizer->SetStepLength( 4.0 );
+  optimizer->SetStepTolerance( 0.02 );
+  optimizer->SetValueTolerance( 0.001 );
+  optimizer->SetScales( weightings );
+  return optimizer.GetPointer();
+}
+
+// Register one case with one configuration. The fixed images are rendered
+// at the true pose with the single precision Siddon-Jacobs ray casting,
+// whatever the engine of the registration.
+Result RegisterCase( const Case & registrationCase,
+                     const Configuration & configuration,
+                     const Options & options,
+                     const ImageType * volume )
+{
+  Result result;
+  result.InitialTRE = ComputeTRE( options, registrationCase.Truth, registrationCase.Start );
+
+  try
+    {
+    TransformType::Pointer trueTransform = CreateTransform( options, registrationCase.Truth );
+    ImageType::Pointer fixedImages[2];
+    for (unsigned int view = 0; view < 2; view++)
+      {
+      SiddonInterpolatorType::Pointer renderer =
+        CreateInterpolator< SiddonInterpolatorType >( options, volume, trueTransform, view );
+      fixedImages[view] = CreateProjection( options, configuration.Subsampling );
+      renderer->RenderProjection( fixedImages[view].GetPointer() );
+      }
+
+    TransformType::Pointer transform = CreateTransform( options, registrationCase.Start );
+
+    MetricType::Pointer metric = MetricType::New();
+    metric->ComputeGradientOff();
+    metric->SetSubtractMean( true );
+
+    itk::SingleValuedNonLinearOptimizer::Pointer optimizer = CreateOptimizer( configuration );
+
+    RegistrationType::Pointer registration = RegistrationType::New();
+    registration->SetMetric( metric );
+    registration->SetOptimizer( optimizer );
+    registration->SetTransform( transform );
+    registration->SetInterpolator1( CreateRegistrationInterpolator( configuration, options, volume, transform, 0 ) );
+    registration->SetInterpolator2( CreateRegistrationInterpolator( configuration, options, volume, transform, 1 ) );
+    registration->SetFixedImage1( fixedImages[0] );
+    registration->SetFixedImage2( fixedImages[1] );
+    registration->SetMovingImage( volume );
+    registration->SetFixedImageRegion1( fixedImages[0]->GetBufferedRegion() );
+    registration->SetFixedImageRegion2( fixedImages[1]->GetBufferedRegion() );
+    registration->SetInitialTransformParameters( registrationCase.Start );
+
+    // The optimizers count their iterations differently, their iteration
+    // events count them the same way for both
+    unsigned int iterations = 0;
+    optimizer->AddObserver( itk::IterationEvent(),
+      [&iterations]( const itk::EventObject & )
+      {
+      iterations++;
+      } );
+
+    const auto start = std::chrono::steady_clock::now();
+    registration->StartRegistration();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const ParametersType estimate = registration->GetLastTransformParameters();
+    result.TRE = ComputeTRE( options, registrationCase.Truth, estimate );
+    result.MetricValue = metric->GetValue( estimate );
+    result.NumberOfIterations = iterations;
+    result.ElapsedTime = elapsed.count();
+    result.Success = true;
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    result.Message = err.GetDescription();
+    }
+  return result;
+}
+
+// Nearest rank percentile of sorted values
+double Percentile( const std::vector<double> & sorted, double percent )
+{
+  if (sorted.empty())
+    {
+    return 0.0;
+    }
+  const std::size_t rank = static_cast<std::size_t>( std::ceil( percent / 100.0 * sorted.size() ) );
+  return sorted[ std::min( sorted.size(), std::max<std::size_t>( rank, 1 ) ) - 1 ];
+}
+
+double Mean( const std::vector<double> & values )
+{
+  double sum = 0.0;
+  for (double value : values)
+    {
+    sum += value;
+    }
+  return values.empty() ? 0.0 : sum / values.size();
+}
+
+} // namespace
+
+int TwoProjectionRegistrationAccuracyBenchmark( int argc, char *argv[] )
+{
+  char *input_name = nullptr;
+  char *csv_name = nullptr;
+  char *output_name = nullptr;
+
+  bool ok;
+  bool verbose = false;
+  bool customized_iso = false;
+  float cx = 0.;
+  float cy = 0.;
+  float cz = 0.;
+  unsigned int numberOfCases = 20;
+  unsigned int seed = 1;
+  double poseRange[2] = { 10.0, 10.0 };
+  double perturbation[2] = { 3.0, 5.0 };
+  double targetHalfSide = 50.0;
+  double minimumSuccessRate = 0.0;
+  unsigned int numberOfJobs = std::max( 1u, std::thread::hardware_concurrency() );
+  std::vector<Configuration> configurations;
+  Options options;
+
+  while (argc > 1)
+    {
+    ok = false;
+
+    if ((ok == false) && (strcmp(argv[1], "-h") == 0))
+      {
+      ok = true;
+      accuracy_exe_usage();
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-v") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      verbose = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-iso") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cx=atof(argv[1]);
+      argc--; argv++;
+      cy=atof(argv[1]);
+      argc--; argv++;
+      cz=atof(argv[1]);
+      argc--; argv++;
+      customized_iso = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-threshold") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.threshold=atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-scd") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.scd = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-angles") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.angles[0] = atof(argv[1]);
+      argc--; argv++;
+      options.angles[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-size") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.size[0] = atoi(argv[1]);
+      argc--; argv++;
+      options.size[1] = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-res") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.res[0] = atof(argv[1]);
+      argc--; argv++;
+      options.res[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cases") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfCases = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-seed") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      seed = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-pose") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      poseRange[0] = atof(argv[1]);
+      argc--; argv++;
+      poseRange[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-perturb") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      perturbation[0] = atof(argv[1]);
+      argc--; argv++;
+      perturbation[1] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-target") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      targetHalfSide = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-success") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      options.successThreshold = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-config") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      Configuration configuration;
+      if (!ParseConfiguration( argv[1], configuration ))
+        {
+        std::cerr << "ERROR: Invalid configuration " << argv[1] << std::endl;
+        accuracy_exe_usage();
+        }
+      configurations.push_back( configuration );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-jobs") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      numberOfJobs = std::max( 1, atoi(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-minsuccess") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      minimumSuccessRate = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-csv") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      csv_name = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-o") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      output_name = argv[1];
+      argc--; argv++;
+      }
+
+    if (ok == false)
+      {
+      if (input_name == nullptr)
+        {
+        input_name = argv[1];
+        argc--;
+        argv++;
+        }
+      else
+        {
+        std::cerr << "ERROR: Can not parse argument " << argv[1] << std::endl;
+        accuracy_exe_usage();
+        }
+      }
+    }
+
+  if (input_name == nullptr)
+    {
+    std::cerr << "ERROR: No input volume" << std::endl;
+    accuracy_exe_usage();
+    }
+
+  if (configurations.empty())
+    {
+    for (const char * text : { "siddon:powell:1", "siddon:powell:2", "mesh:powell:2", "siddon:amoeba:2" })
+      {
+      Configuration configuration;
+      ParseConfiguration( text, configuration );
+      configurations.push_back( configuration );
+      }
+    }
+
+  // The CT is read once and shared by all the registrations, with its
+  // origin at (0,0,0) like a prepared volume
+  using ReaderType = itk::ImageFileReader< ImageType >;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( input_name );
+  try
+    {
+    reader->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "ERROR: ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
+    }
+  ImageType::Pointer volume = reader->GetOutput();
+  volume->DisconnectPipeline();
+  ImageType::PointType volumeOrigin;
+  volumeOrigin.Fill( 0.0 );
+  volume->SetOrigin( volumeOrigin );
+
+  const ImageType::SpacingType resolution3D = volume->GetSpacing();
+  const ImageType::SizeType size3D = volume->GetBufferedRegion().GetSize();
+  const float iso[3] = { cx, cy, cz };
+  for (unsigned int i = 0; i < Dimension; i++)
+    {
+    options.isocenter[i] = customized_iso ? resolution3D[i] * iso[i]
+                                          : resolution3D[i] * static_cast<double>( size3D[i] ) / 2.0;
+    }
+
+  // The isocenter and the corners of a cube around it
+  options.targets.push_back( options.isocenter );
+  for (unsigned int corner = 0; corner < 8; corner++)
+    {
+    TransformType::InputPointType target = options.isocenter;
+    for (unsigned int i = 0; i < Dimension; i++)
+      {
+      target[i] += ( corner & ( 1u << i ) ) ? targetHalfSide : -targetHalfSide;
+      }
+    options.targets.push_back( target );
+    }
+
+  // The true poses are uniform in the pose range, the starts uniform in
+  // the perturbation range around them
+  std::mt19937 generator( seed );
+  std::uniform_real_distribution<double> uniform( -1.0, 1.0 );
+  std::vector<Case> cases( numberOfCases );
+  for (Case & registrationCase : cases)
+    {
+    registrationCase.Truth.SetSize( TransformType::ParametersDimension );
+    registrationCase.Start.SetSize( TransformType::ParametersDimension );
+    for (unsigned int i = 0; i < TransformType::ParametersDimension; i++)
+      {
+      const double scale = i < 3 ? dtr : 1.0;
+      registrationCase.Truth[i] = scale * poseRange[i < 3 ? 0 : 1] * uniform( generator );
+      registrationCase.Start[i] = registrationCase.Truth[i] + scale * perturbation[i < 3 ? 0 : 1] * uniform( generator );
+      }
+    }
+
+  // Every case of every configuration is a job
+  const std::size_t numberOfRuns = configurations.size() * cases.size();
+  std::vector<Result> results( numberOfRuns );
+  std::atomic<std::size_t> nextRun( 0 );
+  std::mutex outputMutex;
+  const auto benchmarkStart = std::chrono::steady_clock::now();
+
+  auto runJobs = [&]()
+    {
+    for (std::size_t run = nextRun++; run < numberOfRuns; run = nextRun++)
+      {
+      const Configuration & configuration = configurations[run / cases.size()];
+      const std::size_t c = run % cases.size();
+      results[run] = RegisterCase( cases[c], configuration, options, volume );
+      if (verbose)
+        {
+        std::lock_guard<std::mutex> lock( outputMutex );
+        std::cout << configuration.Name << " case " << c << ": ";
+        if (results[run].Success)
+          {
+          std::cout << "TRE " << results[run].InitialTRE << " -> " << results[run].TRE
+                    << " mm in " << results[run].ElapsedTime << " s" << std::endl;
+          }
+        else
+          {
+          std::cout << results[run].Message << std::endl;
+          }
+        }
+      }
+    };
+
+  std::vector<std::thread> jobs;
+  for (unsigned int j = 1; j < std::min<std::size_t>( numberOfJobs, numberOfRuns ); j++)
+    {
+    jobs.emplace_back( runJobs );
+    }
+  runJobs();
+  for (auto & job : jobs)
+    {
+    job.join();
+    }
+  const std::chrono::duration<double> benchmarkTime = std::chrono::steady_clock::now() - benchmarkStart;
+
+  // Table of the cases
+  unsigned int numberOfFailures = 0;
+  if (csv_name)
+    {
+    std::ofstream table( csv_name );
+    if (!table)
+      {
+      std::cerr << "ERROR: Cannot write the cases " << csv_name << std::endl;
+      return EXIT_FAILURE;
+      }
+    table << "configuration,case,status,true_rx_deg,true_ry_deg,true_rz_deg,true_tx_mm,true_ty_mm,true_tz_mm,"
+          << "initial_tre_mm,tre_mm,success,metric,iterations,time_s" << std::endl;
+    for (std::size_t run = 0; run < numberOfRuns; run++)
+      {
+      const Result & result = results[run];
+      const Case & registrationCase = cases[run % cases.size()];
+      table << configurations[run / cases.size()].Name << "," << run % cases.size()
+            << "," << ( result.Success ? "ok" : "failed" );
+      for (unsigned int i = 0; i < TransformType::ParametersDimension; i++)
+        {
+        table << "," << ( i < 3 ? registrationCase.Truth[i] / dtr : registrationCase.Truth[i] );
+        }
+      table << "," << result.InitialTRE << "," << result.TRE
+            << "," << ( result.Success && result.TRE <= options.successThreshold ? 1 : 0 )
+            << "," << result.MetricValue << "," << result.NumberOfIterations
+            << "," << result.ElapsedTime << std::endl;
+      }
+    }
+
+  // Summary of the configurations
+  std::ofstream outputFile;
+  if (output_name)
+    {
+    outputFile.open( output_name );
+    if (!outputFile)
+      {
+      std::cerr << "ERROR: Cannot write the summary " << output_name << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  std::ostream & os = output_name ? outputFile : std::cout;
+
+  bool successRateMet = true;
+  os << "{\n";
+  os << "  \"configuration\": { \"volume\": \"" << input_name << "\", \"cases\": " << numberOfCases
+     << ", \"seed\": " << seed << ", \"jobs\": " << numberOfJobs
+     << ", \"poseRange\": [" << poseRange[0] << ", " << poseRange[1] << "]"
+     << ", \"perturbation\": [" << perturbation[0] << ", " << perturbation[1] << "]"
+     << ", \"targetHalfSide\": " << targetHalfSide << ", \"successThreshold\": " << options.successThreshold
+     << ", \"wallSeconds\": " << benchmarkTime.count() << " },\n";
+  os << "  \"results\": [\n";
+  for (std::size_t k = 0; k < configurations.size(); k++)
+    {
+    std::vector<double> initialTREs;
+    std::vector<double> TREs;
+    std::vector<double> seconds;
+    double iterations = 0.0;
+    unsigned int successes = 0;
+    for (std::size_t c = 0; c < cases.size(); c++)
+      {
+      const Result & result = results[k * cases.size() + c];
+      if (!result.Success)
+        {
+        numberOfFailures++;
+        continue;
+        }
+      initialTREs.push_back( result.InitialTRE );
+      TREs.push_back( result.TRE );
+      seconds.push_back( result.ElapsedTime );
+      iterations += result.NumberOfIterations;
+      if (result.TRE <= options.successThreshold)
+        {
+        successes++;
+        }
+      }
+    std::sort( TREs.begin(), TREs.end() );
+    std::sort( seconds.begin(), seconds.end() );
+    const double successRate = cases.empty() ? 0.0 : static_cast<double>( successes ) / cases.size();
+    if (successRate < minimumSuccessRate)
+      {
+      successRateMet = false;
+      }
+
+    os << "    { \"name\": \"" << configurations[k].Name << "\", \"engine\": \"" << configurations[k].Engine
+       << "\", \"optimizer\": \"" << configurations[k].Optimizer
+       << "\", \"subsampling\": " << configurations[k].Subsampling
+       << ", \"registrations\": " << TREs.size()
+       << ", \"initialMeanTRE\": " << Mean( initialTREs )
+       << ", \"meanTRE\": " << Mean( TREs )
+       << ", \"medianTRE\": " << Percentile( TREs, 50.0 )
+       << ", \"p90TRE\": " << Percentile( TREs, 90.0 )
+       << ", \"p95TRE\": " << Percentile( TREs, 95.0 )
+       << ", \"maximumTRE\": " << ( TREs.empty() ? 0.0 : TREs.back() )
+       << ", \"successRate\": " << successRate
+       << ", \"meanSeconds\": " << Mean( seconds )
+       << ", \"p90Seconds\": " << Percentile( seconds, 90.0 )
+       << ", \"meanIterations\": " << ( TREs.empty() ? 0.0 : iterations / TREs.size() )
+       << " }" << ( k + 1 < configurations.size() ? "," : "" ) << "\n";
+    }
+  os << "  ]\n";
+  os << "}\n";
+
+  if (numberOfFailures > 0)
+    {
+    std::cerr << "ERROR: " << numberOfFailures << " registrations failed" << std::endl;
+    return EXIT_FAILURE;
+    }
+  if (!successRateMet)
+    {
+    std::cerr << "ERROR: The success rate of a configuration is below " << minimumSuccessRate << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
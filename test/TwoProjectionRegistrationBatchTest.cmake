@@ -0,0 +1,120 @@
+# Registers the two cases of a batch manifest with
+# TwoProjection2D3DRegistration -batch and checks the results table: both
+# cases succeed and are listed in the manifest order, the second case
+# reuses the CT prepared for the first one and finds the same pose.
+#
+# The batch is then registered again with two concurrent jobs of two
+# workers each. With the deterministic reduction, both runs must find
+# the same poses and metric values, and the CT must still be loaded by a
+# single case; which one depends on the order the jobs reach the cache.
+#
+# Variables: DRIVER, the test driver; IMAGE1 and IMAGE2, the projections
+# at 0 and 90 degrees; VOLUME, the CT; OUTPUT_DIR, the directory of the
+# manifest and of the results.
+
+foreach(variable DRIVER IMAGE1 IMAGE2 VOLUME OUTPUT_DIR)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "${variable} is not set")
+  endif()
+endforeach()
+
+set(manifest ${OUTPUT_DIR}/TwoProjectionRegistrationBatch.csv)
+file(WRITE ${manifest}
+"case,Image2D1,ProjAngle1,Image2D2,ProjAngle2,Volume3D,threshold,isoX,isoY,isoZ
+first,${IMAGE1},0,${IMAGE2},90,${VOLUME},0,99.62,101.18,65
+second,${IMAGE1},0,${IMAGE2},90,${VOLUME},0,99.62,101.18,65
+")
+
+# Run the batch with the extra options and check the table. Sets
+# <prefix>_first and <prefix>_second to the fields of the cases: case,
+# status, the 6 parameters, metric, iterations, hit and time.
+function(run_batch prefix)
+  set(results ${OUTPUT_DIR}/TwoProjectionRegistrationBatchResults${prefix}.csv)
+  file(REMOVE ${results})
+
+  execute_process(
+    COMMAND ${DRIVER} TwoProjection2D3DRegistration
+      -res 1 1 1 1 -deterministic ${ARGN}
+      -batch ${manifest} -results ${results}
+    RESULT_VARIABLE status
+    )
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "The ${prefix} batch registration failed: ${status}")
+  endif()
+  if(NOT EXISTS ${results})
+    message(FATAL_ERROR "The ${prefix} batch registration wrote no results")
+  endif()
+
+  file(STRINGS ${results} lines)
+  list(LENGTH lines numberOfLines)
+  if(NOT numberOfLines EQUAL 3)
+    message(FATAL_ERROR "Expected a header and 2 cases, got ${numberOfLines} lines")
+  endif()
+
+  list(GET lines 0 header)
+  if(NOT header STREQUAL "case,status,rx_deg,ry_deg,rz_deg,tx_mm,ty_mm,tz_mm,metric,iterations,ct_cache_hit,time_s")
+    message(FATAL_ERROR "Unexpected header: ${header}")
+  endif()
+
+  list(GET lines 1 first)
+  list(GET lines 2 second)
+  string(REPLACE "," ";" first "${first}")
+  string(REPLACE "," ";" second "${second}")
+  foreach(row first second)
+    list(LENGTH ${row} numberOfFields)
+    if(NOT numberOfFields EQUAL 12)
+      message(FATAL_ERROR "Expected 12 fields for the ${row} case, got ${numberOfFields}")
+    endif()
+    list(GET ${row} 0 name)
+    list(GET ${row} 1 caseStatus)
+    list(GET ${row} 9 iterations)
+    if(NOT name STREQUAL row)
+      message(FATAL_ERROR "Expected the ${row} case, got ${name}")
+    endif()
+    if(NOT caseStatus STREQUAL "ok")
+      message(FATAL_ERROR "The ${row} case of the ${prefix} batch failed")
+    endif()
+    if(NOT iterations GREATER 0)
+      message(FATAL_ERROR "The ${row} case of the ${prefix} batch did not iterate")
+    endif()
+  endforeach()
+
+  # The same inputs and CT give the same pose and metric
+  foreach(field RANGE 2 8)
+    list(GET first ${field} firstValue)
+    list(GET second ${field} secondValue)
+    if(NOT firstValue STREQUAL secondValue)
+      message(FATAL_ERROR "Field ${field} differs between the cases of the ${prefix} batch: ${firstValue} and ${secondValue}")
+    endif()
+  endforeach()
+
+  message(STATUS "Batch results: ${results}")
+  set(${prefix}_first "${first}" PARENT_SCOPE)
+  set(${prefix}_second "${second}" PARENT_SCOPE)
+endfunction()
+
+run_batch(Serial)
+list(GET Serial_first 10 firstHit)
+list(GET Serial_second 10 secondHit)
+if(NOT firstHit EQUAL 0 OR NOT secondHit EQUAL 1)
+  message(FATAL_ERROR "Expected the CT to be loaded for the first case only, got hits ${firstHit} and ${secondHit}")
+endif()
+
+run_batch(Concurrent -jobs 2 -workers 2)
+list(GET Concurrent_first 10 firstHit)
+list(GET Concurrent_second 10 secondHit)
+math(EXPR numberOfHits "${firstHit} + ${secondHit}")
+if(NOT numberOfHits EQUAL 1)
+  message(FATAL_ERROR "Expected the CT to be loaded by a single concurrent case, got hits ${firstHit} and ${secondHit}")
+endif()
+
+# The concurrent jobs and their workers do not change the result
+foreach(row first second)
+  foreach(field RANGE 2 9)
+    list(GET Serial_${row} ${field} serialValue)
+    list(GET Concurrent_${row} ${field} concurrentValue)
+    if(NOT serialValue STREQUAL concurrentValue)
+      message(FATAL_ERROR "Field ${field} of the ${row} case differs between the serial and the concurrent batch: ${serialValue} and ${concurrentValue}")
+    endif()
+  endforeach()
+endforeach()
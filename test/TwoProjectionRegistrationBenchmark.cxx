@@ -0,0 +1,597 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+/*=========================================================================
+
+ This program measures the throughput of the components of the
+ registration on synthetic data, so that no input file is needed:
+
+ - the ray casting of SiddonJacobsRayCastInterpolateImageFunction, in
+   rays and voxels per second, for every combination of the volume sizes,
+   projection angles and thresholds;
+ - the latency of NormalizedCorrelationTwoImageToOneImageMetric::GetValue()
+   for every volume size;
+ - the scaling of both with the number of workers of a RayCastWorkerPool,
+   from 1 to the number of threads, on the largest volume.
+
+ The volume is an analytic head phantom of fixed physical extent: an
+ ellipsoid of soft tissue in a skull shell, with a few denser spheres, so
+ that the volume sizes only change its sampling. The rays are cast in a
+ ProjectionGeometry equivalent to the linac geometry. Every measurement
+ is repeated and the minimum and median times are reported, in JSON.
+
+=========================================================================*/
+
+#include "itkEuler3DTransform.h"
+#include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
+#include "itkProjectionGeometry.h"
+#include "itkRayCastWorkerPool.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+
+#include "itkImage.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+constexpr unsigned int Dimension = 3;
+using VolumeType = itk::Image< short, Dimension >;
+using ProjectionType = itk::Image< float, Dimension >;
+
+using TransformType = itk::Euler3DTransform< double >;
+using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< VolumeType, double, float >;
+using GeometryType = InterpolatorType::ProjectionGeometryType;
+using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< ProjectionType, VolumeType >;
+
+// constant for converting degrees to radians
+const double dtr = ( std::atan(1.0) * 4.0 ) / 180.0;
+
+// Physical extent of the phantom and of the detector in mm
+const double PhantomExtent = 256.0;
+const double DetectorExtent = 300.0;
+const double FocalPointToIsocenterDistance = 1000.0;
+
+void benchmark_exe_usage()
+{
+  std::cerr << "\n";
+  std::cerr << "Usage: TwoProjectionRegistrationBenchmark <options>\n";
+  std::cerr << "       Measures the ray casting, the metric and their thread scaling on a synthetic phantom. \n\n";
+  std::cerr << "   where <options> is one or more of the following:\n\n";
+  std::cerr << "       <-h>                     Display (this) usage information\n";
+  std::cerr << "       <-v>                     Verbose output [default: no]\n";
+  std::cerr << "       <-size int>              Number of voxels along each axis of the phantom, may be repeated\n";
+  std::cerr << "                                [default: 64 128 256]\n";
+  std::cerr << "       <-angle float>           Projection angle in degrees, may be repeated [default: 0 30 45 90]\n";
+  std::cerr << "       <-threshold float>       CT intensity threshold, may be repeated [default: 0 1100]\n";
+  std::cerr << "       <-drr int>               Number of pixels along each axis of the DRRs [default: 256]\n";
+  std::cerr << "       <-repeat int>            Number of times every measurement is repeated [default: 5]\n";
+  std::cerr << "       <-threads int>           Largest number of workers of the scaling runs [default: all processors]\n";
+  std::cerr << "       <-quick>                 Small sizes and few repetitions, to check the program\n";
+  std::cerr << "       <-o file>                Output JSON filename [default: standard output]\n\n";
+  exit(EXIT_FAILURE);
+}
+
+// Number of voxels crossed by the rays, in place of their line integrals
+class VoxelCountRayAccumulator
+{
+public:
+  using ValueType = float;
+  using ResultType = float;
+
+  template <typename TLength>
+  void Add( TLength, ValueType )
+  {
+    m_Count += 1.0f;
+  }
+
+  ResultType GetResult() const
+  {
+    return m_Count;
+  }
+
+private:
+  float m_Count{ 0.0f };
+};
+
+// Minimum and median of repeated measurements, in seconds
+struct Timing
+{
+  double Minimum;
+  double Median;
+};
+
+template <typename TFunction>
+Timing Measure( unsigned int repeats, TFunction && function )
+{
+  std::vector<double> seconds;
+  for( unsigned int r = 0; r < repeats; r++ )
+    {
+    const auto start = std::chrono::steady_clock::now();
+    function();
+    seconds.push_back( std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+    }
+  std::sort( seconds.begin(), seconds.end() );
+  Timing timing;
+  timing.Minimum = seconds.front();
+  timing.Median = seconds[seconds.size() / 2];
+  return timing;
+}
+
+double Rate( double amount, double seconds )
+{
+  return seconds > 0.0 ? amount / seconds : 0.0;
+}
+
+// Analytic head phantom sampled on size^3 voxels, with its origin at
+// (0,0,0) like a prepared volume
+VolumeType::Pointer CreatePhantom( unsigned int size )
+{
+  VolumeType::Pointer volume = VolumeType::New();
+  VolumeType::SizeType volumeSize;
+  volumeSize.Fill( size );
+  volume->SetRegions( volumeSize );
+  VolumeType::SpacingType spacing;
+  spacing.Fill( PhantomExtent / size );
+  volume->SetSpacing( spacing );
+  volume->Allocate();
+
+  struct Sphere
+  {
+    double Center[3];
+    double Radius;
+    short  Value;
+  };
+  const Sphere spheres[] = { { {  0.3, 0.0,  0.2 }, 0.15, 1200 },
+                             { { -0.3, 0.0,  0.2 }, 0.15, 1200 },
+                             { {  0.0, 0.3, -0.3 }, 0.10, 1600 } };
+
+  itk::ImageRegionIteratorWithIndex< VolumeType > it( volume, volume->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    // Coordinates of the voxel center in units of the half extent
+    double q[3];
+    for( unsigned int d = 0; d < Dimension; d++ )
+      {
+      q[d] = 2.0 * ( it.GetIndex()[d] + 0.5 ) / size - 1.0;
+      }
+    const double r2 = ( q[0] / 0.8 ) * ( q[0] / 0.8 ) + ( q[1] / 0.7 ) * ( q[1] / 0.7 )
+                    + ( q[2] / 0.85 ) * ( q[2] / 0.85 );
+    short value = 0;
+    if( r2 < 1.0 )
+      {
+      value = r2 > 0.81 ? 1800 : 1000;
+      for( const Sphere & sphere : spheres )
+        {
+        const double dx = q[0] - sphere.Center[0];
+        const double dy = q[1] - sphere.Center[1];
+        const double dz = q[2] - sphere.Center[2];
+        if( dx * dx + dy * dy + dz * dz < sphere.Radius * sphere.Radius )
+          {
+          value = sphere.Value;
+          }
+        }
+      }
+    it.Set( value );
+    }
+  return volume;
+}
+
+ProjectionType::Pointer CreateProjection( unsigned int size )
+{
+  ProjectionType::Pointer projection = ProjectionType::New();
+  ProjectionType::SizeType projectionSize;
+  projectionSize[0] = size;
+  projectionSize[1] = size;
+  projectionSize[2] = 1;
+  projection->SetRegions( projectionSize );
+
+  const double spacing = DetectorExtent / size;
+  ProjectionType::SpacingType projectionSpacing;
+  projectionSpacing[0] = spacing;
+  projectionSpacing[1] = spacing;
+  projectionSpacing[2] = 1.0;
+  projection->SetSpacing( projectionSpacing );
+
+  // Detector coordinates centered on the isocenter
+  ProjectionType::PointType origin;
+  origin[0] = -0.5 * ( size - 1 ) * spacing;
+  origin[1] = -0.5 * ( size - 1 ) * spacing;
+  origin[2] = 0.0;
+  projection->SetOrigin( origin );
+  projection->Allocate();
+  projection->FillBuffer( 0.0f );
+  return projection;
+}
+
+TransformType::Pointer CreateTransform()
+{
+  TransformType::Pointer transform = TransformType::New();
+  transform->SetComputeZYX( true );
+  TransformType::InputPointType isocenter;
+  isocenter.Fill( 0.5 * PhantomExtent );
+  transform->SetCenter( isocenter );
+  return transform;
+}
+
+InterpolatorType::Pointer CreateInterpolator( const VolumeType * volume, TransformType * transform,
+                                              double angle, double threshold )
+{
+  GeometryType::PointType isocenter;
+  isocenter.Fill( 0.5 * PhantomExtent );
+  GeometryType::Pointer geometry = GeometryType::New();
+  geometry->SetLinacGeometry( isocenter, FocalPointToIsocenterDistance, dtr * angle );
+
+  InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetThreshold( threshold );
+  interpolator->SetTransform( transform );
+  interpolator->SetProjectionGeometry( geometry );
+  interpolator->SetInputImage( volume );
+  interpolator->Initialize();
+  return interpolator;
+}
+
+// Pose the metric is evaluated at, off the pose of the fixed images
+MetricType::TransformParametersType GetEvaluationPose()
+{
+  MetricType::TransformParametersType parameters( TransformType::ParametersDimension );
+  parameters[0] = 2.0 * dtr;
+  parameters[1] = -1.0 * dtr;
+  parameters[2] = 1.5 * dtr;
+  parameters[3] = 3.0;
+  parameters[4] = -2.0;
+  parameters[5] = 1.0;
+  return parameters;
+}
+
+// Metric of two orthogonal DRRs of the phantom rendered at the current
+// pose of the transform
+MetricType::Pointer CreateMetric( const VolumeType * volume, TransformType * transform,
+                                  unsigned int drrSize, double threshold, itk::RayCastWorkerPool * pool )
+{
+  InterpolatorType::Pointer interpolator1 = CreateInterpolator( volume, transform, 0.0, threshold );
+  InterpolatorType::Pointer interpolator2 = CreateInterpolator( volume, transform, 90.0, threshold );
+  ProjectionType::Pointer fixedImage1 = CreateProjection( drrSize );
+  ProjectionType::Pointer fixedImage2 = CreateProjection( drrSize );
+  interpolator1->RenderProjection( fixedImage1.GetPointer(), pool );
+  interpolator2->RenderProjection( fixedImage2.GetPointer(), pool );
+
+  MetricType::Pointer metric = MetricType::New();
+  metric->ComputeGradientOff();
+  metric->SetSubtractMean( true );
+  metric->SetWorkerPool( pool );
+  metric->SetMovingImage( volume );
+  metric->SetFixedImage1( fixedImage1 );
+  metric->SetFixedImage2( fixedImage2 );
+  metric->SetFixedImageRegion1( fixedImage1->GetBufferedRegion() );
+  metric->SetFixedImageRegion2( fixedImage2->GetBufferedRegion() );
+  metric->SetTransform( transform );
+  metric->SetInterpolator1( interpolator1 );
+  metric->SetInterpolator2( interpolator2 );
+  metric->Initialize();
+  return metric;
+}
+
+void WriteTiming( std::ostream & os, const Timing & timing )
+{
+  os << "\"minimumSeconds\": " << timing.Minimum << ", \"medianSeconds\": " << timing.Median;
+}
+
+} // namespace
+
+int TwoProjectionRegistrationBenchmark( int argc, char *argv[] )
+{
+  char *output_name = nullptr;
+
+  bool ok;
+  bool verbose = false;
+  bool quick = false;
+  std::vector<unsigned int> sizes;
+  std::vector<double> angles;
+  std::vector<double> thresholds;
+  unsigned int drrSize = 256;
+  unsigned int repeats = 5;
+  unsigned int maximumNumberOfThreads = std::max( 1u, std::thread::hardware_concurrency() );
+
+  while (argc > 1)
+    {
+    ok = false;
+
+    if ((ok == false) && (strcmp(argv[1], "-h") == 0))
+      {
+      ok = true;
+      benchmark_exe_usage();
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-v") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      verbose = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-size") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      sizes.push_back( atoi(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-angle") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      angles.push_back( atof(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-threshold") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      thresholds.push_back( atof(argv[1]) );
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-drr") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      drrSize = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-repeat") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      repeats = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-threads") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      maximumNumberOfThreads = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-quick") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      quick = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-o") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      output_name = argv[1];
+      argc--; argv++;
+      }
+
+    if (ok == false)
+      {
+      std::cerr << "ERROR: Can not parse argument " << argv[1] << std::endl;
+      benchmark_exe_usage();
+      }
+    }
+
+  if (quick)
+    {
+    drrSize = 64;
+    repeats = 2;
+    maximumNumberOfThreads = std::min( maximumNumberOfThreads, 2u );
+    }
+  if (sizes.empty())
+    {
+    sizes = quick ? std::vector<unsigned int>{ 32, 64 } : std::vector<unsigned int>{ 64, 128, 256 };
+    }
+  if (angles.empty())
+    {
+    angles = quick ? std::vector<double>{ 0.0, 45.0 } : std::vector<double>{ 0.0, 30.0, 45.0, 90.0 };
+    }
+  if (thresholds.empty())
+    {
+    thresholds = { 0.0, 1100.0 };
+    }
+  if (drrSize == 0 || repeats == 0 || maximumNumberOfThreads == 0 ||
+      std::find( sizes.begin(), sizes.end(), 0u ) != sizes.end())
+    {
+    std::cerr << "ERROR: The sizes, repetitions and threads must be positive" << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::sort( sizes.begin(), sizes.end() );
+
+  std::ofstream file;
+  if (output_name)
+    {
+    file.open( output_name );
+    if (!file)
+      {
+      std::cerr << "ERROR: Can not write " << output_name << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  std::ostream & json = output_name ? static_cast<std::ostream &>( file ) : std::cout;
+  json.precision( 6 );
+
+  const double numberOfRays = static_cast<double>( drrSize ) * drrSize;
+
+  try
+    {
+    json << "{\n";
+    json << "  \"benchmark\": \"TwoProjectionRegistration\",\n";
+    json << "  \"configuration\": { \"drrSize\": " << drrSize << ", \"repeats\": " << repeats
+         << ", \"maximumNumberOfThreads\": " << maximumNumberOfThreads
+         << ", \"phantomExtent\": " << PhantomExtent
+         << ", \"focalPointToIsocenterDistance\": " << FocalPointToIsocenterDistance << " },\n";
+
+    // Ray casting by a single thread
+    json << "  \"rayCasting\": [";
+    bool first = true;
+    for (unsigned int size : sizes)
+      {
+      VolumeType::Pointer volume = CreatePhantom( size );
+      for (double threshold : thresholds)
+        {
+        for (double angle : angles)
+          {
+          TransformType::Pointer transform = CreateTransform();
+          InterpolatorType::Pointer interpolator = CreateInterpolator( volume, transform, angle, threshold );
+          ProjectionType::Pointer projection = CreateProjection( drrSize );
+
+          // The voxels crossed do not depend on the threshold, and are
+          // counted outside of the measurement
+          interpolator->RenderProjectionWith< itk::SiddonRayTraversal<float> >(
+            projection.GetPointer(), VoxelCountRayAccumulator() );
+          double numberOfVoxels = 0.0;
+          for (itk::SizeValueType i = 0; i < projection->GetPixelContainer()->Size(); i++)
+            {
+            numberOfVoxels += projection->GetBufferPointer()[i];
+            }
+
+          const Timing timing = Measure( repeats, [&]()
+            {
+            interpolator->RenderProjection( projection.GetPointer() );
+            } );
+
+          if (verbose)
+            {
+            std::cerr << "Ray casting: size " << size << ", angle " << angle << ", threshold " << threshold
+                      << ": " << Rate( numberOfRays, timing.Median ) << " rays/s" << std::endl;
+            }
+          json << ( first ? "\n" : ",\n" ) << "    { \"volumeSize\": " << size << ", \"angle\": " << angle
+               << ", \"threshold\": " << threshold << ", \"rays\": " << numberOfRays
+               << ", \"voxels\": " << numberOfVoxels << ", ";
+          WriteTiming( json, timing );
+          json << ", \"raysPerSecond\": " << Rate( numberOfRays, timing.Median )
+               << ", \"voxelsPerSecond\": " << Rate( numberOfVoxels, timing.Median ) << " }";
+          first = false;
+          }
+        }
+      }
+    json << "\n  ],\n";
+
+    // Metric latency by a single thread
+    json << "  \"metric\": [";
+    first = true;
+    const MetricType::TransformParametersType pose = GetEvaluationPose();
+    for (unsigned int size : sizes)
+      {
+      VolumeType::Pointer volume = CreatePhantom( size );
+      for (double threshold : thresholds)
+        {
+        TransformType::Pointer transform = CreateTransform();
+        MetricType::Pointer metric = CreateMetric( volume, transform, drrSize, threshold, nullptr );
+        double value = 0.0;
+        const Timing timing = Measure( repeats, [&]()
+          {
+          value = metric->GetValue( pose );
+          } );
+
+        if (verbose)
+          {
+          std::cerr << "Metric: size " << size << ", threshold " << threshold << ": "
+                    << 1000.0 * timing.Median << " ms" << std::endl;
+          }
+        json << ( first ? "\n" : ",\n" ) << "    { \"volumeSize\": " << size << ", \"threshold\": " << threshold
+             << ", \"pixels\": " << 2.0 * numberOfRays << ", \"value\": " << value << ", ";
+        WriteTiming( json, timing );
+        json << " }";
+        first = false;
+        }
+      }
+    json << "\n  ],\n";
+
+    // Thread scaling on the largest volume, at the first angle and
+    // threshold
+    std::vector<unsigned int> numbersOfWorkers;
+    for (unsigned int workers = 1; workers < maximumNumberOfThreads; workers *= 2)
+      {
+      numbersOfWorkers.push_back( workers );
+      }
+    numbersOfWorkers.push_back( maximumNumberOfThreads );
+
+    json << "  \"threadScaling\": [";
+    first = true;
+    VolumeType::Pointer volume = CreatePhantom( sizes.back() );
+    double drrSeconds = 0.0;
+    double metricSeconds = 0.0;
+    for (unsigned int workers : numbersOfWorkers)
+      {
+      itk::RayCastWorkerPool::Pointer pool = itk::RayCastWorkerPool::New();
+      pool->SetNumberOfWorkers( workers );
+      pool->Start();
+
+      TransformType::Pointer transform = CreateTransform();
+      InterpolatorType::Pointer interpolator = CreateInterpolator( volume, transform, angles.front(), thresholds.front() );
+      ProjectionType::Pointer projection = CreateProjection( drrSize );
+      const Timing drrTiming = Measure( repeats, [&]()
+        {
+        interpolator->RenderProjection( projection.GetPointer(), pool );
+        } );
+
+      MetricType::Pointer metric = CreateMetric( volume, transform, drrSize, thresholds.front(), pool );
+      const Timing metricTiming = Measure( repeats, [&]()
+        {
+        metric->GetValue( pose );
+        } );
+
+      if (workers == 1)
+        {
+        drrSeconds = drrTiming.Median;
+        metricSeconds = metricTiming.Median;
+        }
+      if (verbose)
+        {
+        std::cerr << "Scaling: " << workers << " workers: DRR " << 1000.0 * drrTiming.Median << " ms, metric "
+                  << 1000.0 * metricTiming.Median << " ms" << std::endl;
+        }
+      json << ( first ? "\n" : ",\n" ) << "    { \"volumeSize\": " << sizes.back() << ", \"workers\": " << workers
+           << ", \"drr\": { ";
+      WriteTiming( json, drrTiming );
+      json << ", \"raysPerSecond\": " << Rate( numberOfRays, drrTiming.Median )
+           << ", \"speedup\": " << Rate( drrSeconds, drrTiming.Median ) << " }, \"metric\": { ";
+      WriteTiming( json, metricTiming );
+      json << ", \"speedup\": " << Rate( metricSeconds, metricTiming.Median ) << " } }";
+      first = false;
+      }
+    json << "\n  ]\n";
+    json << "}\n";
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,895 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+/*=========================================================================
+
+ This program is a resident registration server. It keeps the CT volumes
+ prepared for ray casting in a least recently used cache, keyed by file
+ name and threshold, and processes DRR rendering and 2D-3D registration
+ jobs received on a local Unix-domain socket. Every connection is served
+ by its own thread, so jobs are processed concurrently. Image payloads are
+ exchanged through shared memory buffers passed along with the requests,
+ see itkTwoProjectionRegistrationProtocol.h.
+
+ With -selftest the program starts the server in a thread and drives it
+ with a stub client: it renders DRRs concurrently, checks that the CT is
+ loaded once and that the DRRs match a local rendering, registers the
+ rendered DRRs, checks that a buffer not sealed against shrinking is
+ rejected and finally shuts the server down while another client keeps
+ an idle connection open.
+
+ With -cachedir the prepared volumes are also kept in a directory as
+ memory mapped files, which later runs and other server processes map
+ instead of loading and preparing the CT again.
+
+=========================================================================*/
+
+#include "itkTwoProjectionImageRegistrationMethod.h"
+#include "itkEuler3DTransform.h"
+#include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkPowellOptimizer.h"
+#include "itkPreparedVolumeCache.h"
+#include "itkTwoProjectionRegistrationProtocol.h"
+
+#include "itkImageFileReader.h"
+
+#include "TwoProjectionRegistrationSetup.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// The CT is cached and ray cast in its integer pixel type, as in the
+// single case mode of TwoProjection2D3DRegistration: the voxels are
+// converted to float in the ray loop. The projections are float.
+constexpr unsigned int Dimension = 3;
+using PixelType = float;
+using ImageType = itk::Image< PixelType, Dimension >;
+using VolumePixelType = short;
+using VolumeType = itk::Image< VolumePixelType, Dimension >;
+using VolumeCacheType = itk::PreparedVolumeCache< VolumeType >;
+
+using TransformType = TwoProjectionRegistrationSetup::TransformType;
+using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< VolumeType, double, float >;
+using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< ImageType, VolumeType >;
+using OptimizerType = TwoProjectionRegistrationSetup::OptimizerType;
+using RegistrationType = itk::TwoProjectionImageRegistrationMethod< ImageType, VolumeType >;
+
+// constant for converting degrees to radians
+const double dtr = TwoProjectionRegistrationSetup::DegreesToRadians;
+
+void server_exe_usage()
+{
+  std::cerr << "\n";
+  std::cerr << "Usage: TwoProjectionRegistrationServer <options> [Volume3D]\n";
+  std::cerr << "       Serves DRR rendering and registration jobs on a local socket. \n\n";
+  std::cerr << "   where <options> is one or more of the following:\n\n";
+  std::cerr << "       <-h>                     Display (this) usage information\n";
+  std::cerr << "       <-v>                     Verbose output [default: no]\n";
+  std::cerr << "       <-socket file>           Path of the Unix-domain socket [required]\n";
+  std::cerr << "       <-cache int>             Maximum number of resident CT volumes [default: 4]\n";
+  std::cerr << "       <-cachedir dir>          Directory of the memory mapped prepared volume files [default: none]\n";
+  std::cerr << "       <-selftest>              Drive the server with a stub client using Volume3D\n";
+  std::cerr << "       <-iso float float float> Continuous voxel indices of the CT isocenter (self test)\n";
+  std::cerr << "       <-threshold float>       CT intensity threshold (self test) [default: 0]\n\n";
+  exit(EXIT_FAILURE);
+}
+
+#if defined(__linux__)
+
+namespace Protocol = itk::TwoProjectionRegistrationProtocol;
+
+VolumeType::Pointer ReadVolume( const std::string & fileName )
+{
+  using ReaderType = itk::ImageFileReader< VolumeType >;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( fileName );
+  reader->Update();
+  VolumeType::Pointer volume = reader->GetOutput();
+  volume->DisconnectPipeline();
+  return volume;
+}
+
+// Transform of the request, rotating about the isocenter. The origin of
+// a prepared volume is (0,0,0).
+TransformType::Pointer CreateTransform( const Protocol::RegistrationRequest & request,
+                                        const VolumeType * volume )
+{
+  TransformType::Pointer transform = TransformType::New();
+  TwoProjectionRegistrationSetup::InitializeTransform( transform,
+    TwoProjectionRegistrationSetup::ComputeIsocenter( volume, request.Isocenter ) );
+
+  TransformType::ParametersType parameters( transform->GetNumberOfParameters() );
+  for( unsigned int i = 0; i < 6; i++ )
+    {
+    parameters[i] = request.TransformParameters[i];
+    }
+  transform->SetParameters( parameters );
+  return transform;
+}
+
+// Wrap a shared buffer as the projection image of a view, without copy
+ImageType::Pointer CreateProjectionImage( const Protocol::ViewGeometry & view,
+                                          double scd,
+                                          float * buffer )
+{
+  ImageType::SizeType size;
+  size[0] = view.Size[0];
+  size[1] = view.Size[1];
+  size[2] = 1;
+
+  ImageType::SpacingType spacing;
+  spacing[0] = view.Spacing[0];
+  spacing[1] = view.Spacing[1];
+  spacing[2] = 1.0;
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( size );
+  image->SetSpacing( spacing );
+  TwoProjectionRegistrationSetup::PlaceProjection( image.GetPointer(), scd, view.CentralAxis );
+  image->GetPixelContainer()->SetImportPointer( buffer, size[0] * size[1], false );
+  return image;
+}
+
+InterpolatorType::Pointer CreateInterpolator( const Protocol::RegistrationRequest & request,
+                                              const Protocol::ViewGeometry & view,
+                                              TransformType * transform,
+                                              const VolumeType * volume )
+{
+  // The threshold is already subtracted from the prepared volume
+  InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage( volume );
+  TwoProjectionRegistrationSetup::InitializeInterpolator( interpolator.GetPointer(), view.ProjectionAngle,
+                                                          request.FocalPointToIsocenterDistance, 0.0, transform );
+  return interpolator;
+}
+
+
+class RegistrationServer
+{
+public:
+  RegistrationServer( VolumeCacheType * cache, bool verbose )
+    : m_Cache( cache ), m_Verbose( verbose )
+  {
+  }
+
+  ~RegistrationServer()
+  {
+    if( m_Socket >= 0 )
+      {
+      close( m_Socket );
+      unlink( m_SocketPath.c_str() );
+      }
+  }
+
+  bool Listen( const std::string & socketPath )
+  {
+    sockaddr_un address;
+    std::memset( &address, 0, sizeof( address ) );
+    if( socketPath.size() >= sizeof( address.sun_path ) )
+      {
+      std::cerr << "ERROR: Socket path too long: " << socketPath << std::endl;
+      return false;
+      }
+    address.sun_family = AF_UNIX;
+    std::strncpy( address.sun_path, socketPath.c_str(), sizeof( address.sun_path ) - 1 );
+
+    m_Socket = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    unlink( socketPath.c_str() );
+    if( m_Socket < 0
+        || bind( m_Socket, reinterpret_cast<sockaddr *>( &address ), sizeof( address ) ) != 0
+        || listen( m_Socket, 16 ) != 0 )
+      {
+      std::cerr << "ERROR: Cannot listen on " << socketPath << ": " << std::strerror( errno ) << std::endl;
+      return false;
+      }
+    m_SocketPath = socketPath;
+    return true;
+  }
+
+  // Accept connections until a shutdown job is received
+  void Run()
+  {
+    // The threads of the finished connections are joined at every new
+    // connection, so that only the running ones are kept. The sockets of
+    // the connections are closed here, once their thread is joined, so
+    // that a socket is never shut down after its descriptor was reused.
+    std::list< ConnectionThread > connections;
+    while( !m_Stop )
+      {
+      const int connection = accept4( m_Socket, nullptr, nullptr, SOCK_CLOEXEC );
+      if( connection < 0 )
+        {
+        if( errno == EINTR || errno == ECONNABORTED )
+          {
+          continue;
+          }
+        break;
+        }
+      for( auto it = connections.begin(); it != connections.end(); )
+        {
+        if( it->Finished )
+          {
+          it->Thread.join();
+          close( it->Socket );
+          it = connections.erase( it );
+          }
+        else
+          {
+          ++it;
+          }
+        }
+      connections.emplace_back();
+      ConnectionThread & connectionThread = connections.back();
+      connectionThread.Socket = connection;
+      connectionThread.Thread = std::thread( [this, connection, &connectionThread]()
+        {
+        this->ServeConnection( connection );
+        connectionThread.Finished = true;
+        } );
+      }
+    // The clients may keep their connection open: stop receiving on it,
+    // a running job is completed and its response is sent
+    for( auto & connectionThread : connections )
+      {
+      shutdown( connectionThread.Socket, SHUT_RD );
+      }
+    for( auto & connectionThread : connections )
+      {
+      connectionThread.Thread.join();
+      close( connectionThread.Socket );
+      }
+  }
+
+private:
+  struct ConnectionThread
+  {
+    std::thread       Thread;
+    int               Socket{ -1 };
+    std::atomic<bool> Finished{ false };
+  };
+
+  void ServeConnection( int connection )
+  {
+    Protocol::RegistrationRequest request;
+    int descriptors[2];
+    unsigned int numberOfDescriptors = 0;
+    while( Protocol::ReceiveMessage( connection, &request, sizeof( request ),
+                                     descriptors, &numberOfDescriptors ) )
+      {
+      Protocol::RegistrationResponse response;
+      std::memset( &response, 0, sizeof( response ) );
+      response.Magic = Protocol::Magic;
+      response.Status = Protocol::Failure;
+
+      const auto jobStart = std::chrono::steady_clock::now();
+      try
+        {
+        this->ProcessJob( request, descriptors, numberOfDescriptors, response );
+        }
+      catch( itk::ExceptionObject & err )
+        {
+        std::strncpy( response.Message, err.GetDescription(), sizeof( response.Message ) - 1 );
+        }
+      catch( std::exception & err )
+        {
+        std::strncpy( response.Message, err.what(), sizeof( response.Message ) - 1 );
+        }
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - jobStart;
+      response.ElapsedTime = elapsed.count();
+
+      for( unsigned int d = 0; d < numberOfDescriptors; d++ )
+        {
+        close( descriptors[d] );
+        }
+
+      if( m_Verbose )
+        {
+        std::cout << "Job " << request.Job << ": status " << response.Status
+                  << ", " << response.ElapsedTime << " s" << std::endl;
+        }
+
+      if( !Protocol::SendMessage( connection, &response, sizeof( response ) ) )
+        {
+        break;
+        }
+      }
+  }
+
+  void ProcessJob( const Protocol::RegistrationRequest & request,
+                   const int * descriptors,
+                   unsigned int numberOfDescriptors,
+                   Protocol::RegistrationResponse & response )
+  {
+    if( request.Magic != Protocol::Magic || request.Version != Protocol::Version )
+      {
+      itkGenericExceptionMacro( << "Unsupported protocol" );
+      }
+    if( numberOfDescriptors != Protocol::GetNumberOfBuffers( request.Job ) )
+      {
+      itkGenericExceptionMacro( << "Unexpected number of buffers for job " << request.Job );
+      }
+
+    if( request.Job == Protocol::ShutdownJob )
+      {
+      // Unblock accept(), the running connections are completed
+      m_Stop = true;
+      shutdown( m_Socket, SHUT_RDWR );
+      response.Status = Protocol::Success;
+      return;
+      }
+    if( request.Job != Protocol::RenderDRRJob && request.Job != Protocol::RegisterJob )
+      {
+      itkGenericExceptionMacro( << "Unknown job " << request.Job );
+      }
+
+    // Map the payloads first, a bad request must not load a CT
+    float * buffers[2] = { nullptr, nullptr };
+    const unsigned int numberOfViews = numberOfDescriptors;
+    bool mapped = true;
+    for( unsigned int v = 0; v < numberOfViews; v++ )
+      {
+      buffers[v] = static_cast<float *>( Protocol::MapSharedBuffer(
+        descriptors[v], Protocol::GetBufferSize( request.Views[v] ), request.Job == Protocol::RenderDRRJob ) );
+      mapped = mapped && buffers[v];
+      }
+
+    try
+      {
+      if( !mapped )
+        {
+        itkGenericExceptionMacro( << "Cannot map the image buffers, they must be sealed against shrinking" );
+        }
+
+      const std::string fileName( request.VolumeFileName,
+                                  strnlen( request.VolumeFileName, sizeof( request.VolumeFileName ) ) );
+      bool hit = false;
+      VolumeType::ConstPointer volume = m_Cache->GetVolume( fileName, request.Threshold, ReadVolume, &hit );
+      response.VolumeCacheHit = hit ? 1 : 0;
+
+      if( request.Job == Protocol::RenderDRRJob )
+        {
+        this->RenderDRR( request, volume, buffers[0] );
+        }
+      else
+        {
+        this->Register( request, volume, buffers, response );
+        }
+      response.Status = Protocol::Success;
+      }
+    catch( ... )
+      {
+      for( unsigned int v = 0; v < numberOfViews; v++ )
+        {
+        if( buffers[v] )
+          {
+          munmap( buffers[v], Protocol::GetBufferSize( request.Views[v] ) );
+          }
+        }
+      throw;
+      }
+
+    for( unsigned int v = 0; v < numberOfViews; v++ )
+      {
+      munmap( buffers[v], Protocol::GetBufferSize( request.Views[v] ) );
+      }
+  }
+
+  void RenderDRR( const Protocol::RegistrationRequest & request,
+                  const VolumeType * volume,
+                  float * buffer )
+  {
+    TransformType::Pointer transform = CreateTransform( request, volume );
+    InterpolatorType::Pointer interpolator =
+      CreateInterpolator( request, request.Views[0], transform, volume );
+
+    // The DRR is written in place into the memory of the client
+    ImageType::Pointer drr =
+      CreateProjectionImage( request.Views[0], request.FocalPointToIsocenterDistance, buffer );
+    interpolator->RenderProjection( drr.GetPointer() );
+  }
+
+  void Register( const Protocol::RegistrationRequest & request,
+                 const VolumeType * volume,
+                 float * const buffers[2],
+                 Protocol::RegistrationResponse & response )
+  {
+    TransformType::Pointer transform = CreateTransform( request, volume );
+
+    MetricType::Pointer metric = MetricType::New();
+    TwoProjectionRegistrationSetup::InitializeMetric( metric.GetPointer() );
+
+    // Same settings as the TwoProjection2D3DRegistration program
+    OptimizerType::Pointer optimizer = OptimizerType::New();
+    TwoProjectionRegistrationSetup::InitializeOptimizer( optimizer,
+      request.MaximumNumberOfIterations > 0 ? request.MaximumNumberOfIterations : 10 );
+
+    ImageType::Pointer fixedImage1 =
+      CreateProjectionImage( request.Views[0], request.FocalPointToIsocenterDistance, buffers[0] );
+    ImageType::Pointer fixedImage2 =
+      CreateProjectionImage( request.Views[1], request.FocalPointToIsocenterDistance, buffers[1] );
+
+    RegistrationType::Pointer registration = RegistrationType::New();
+    registration->SetMetric( metric );
+    registration->SetOptimizer( optimizer );
+    registration->SetTransform( transform );
+    registration->SetInterpolator1( CreateInterpolator( request, request.Views[0], transform, volume ) );
+    registration->SetInterpolator2( CreateInterpolator( request, request.Views[1], transform, volume ) );
+    registration->SetFixedImage1( fixedImage1 );
+    registration->SetFixedImage2( fixedImage2 );
+    registration->SetMovingImage( volume );
+    registration->SetFixedImageRegion1( fixedImage1->GetBufferedRegion() );
+    registration->SetFixedImageRegion2( fixedImage2->GetBufferedRegion() );
+    registration->SetInitialTransformParameters( transform->GetParameters() );
+
+    registration->StartRegistration();
+
+    const RegistrationType::ParametersType finalParameters = registration->GetLastTransformParameters();
+    for( unsigned int i = 0; i < 6; i++ )
+      {
+      response.TransformParameters[i] = finalParameters[i];
+      }
+    response.MetricValue = optimizer->GetValue();
+    response.NumberOfIterations = optimizer->GetCurrentIteration();
+  }
+
+  VolumeCacheType *  m_Cache;
+  bool               m_Verbose;
+  int                m_Socket{ -1 };
+  std::string        m_SocketPath;
+  std::atomic<bool>  m_Stop{ false };
+};
+
+
+// Stub client: connect to the server, returns the socket or -1
+int ConnectToServer( const std::string & socketPath )
+{
+  sockaddr_un address;
+  std::memset( &address, 0, sizeof( address ) );
+  address.sun_family = AF_UNIX;
+  std::strncpy( address.sun_path, socketPath.c_str(), sizeof( address.sun_path ) - 1 );
+
+  const int connection = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if( connection < 0 || connect( connection, reinterpret_cast<sockaddr *>( &address ), sizeof( address ) ) != 0 )
+    {
+    if( connection >= 0 )
+      {
+      close( connection );
+      }
+    return -1;
+    }
+  return connection;
+}
+
+// Stub client: submit one job on its own connection
+bool SubmitJob( const std::string & socketPath,
+                const Protocol::RegistrationRequest & request,
+                const int * descriptors,
+                Protocol::RegistrationResponse & response )
+{
+  const int connection = ConnectToServer( socketPath );
+  if( connection < 0 )
+    {
+    return false;
+    }
+  const bool ok = Protocol::SendMessage( connection, &request, sizeof( request ),
+                                         descriptors, Protocol::GetNumberOfBuffers( request.Job ) )
+    && Protocol::ReceiveMessage( connection, &response, sizeof( response ) );
+  close( connection );
+  return ok && response.Magic == Protocol::Magic;
+}
+
+
+// Largest deviations of the registered pose from the pose of the DRRs in
+// the self-test, in degrees and mm
+constexpr double PoseRotationTolerance = 1.0;
+constexpr double PoseTranslationTolerance = 1.0;
+
+int RunSelfTest( const std::string & socketPath,
+                 const std::string & volumeFileName,
+                 const double isocenter[3],
+                 double threshold,
+                 const std::string & cacheDirectory,
+                 bool verbose )
+{
+  VolumeCacheType::Pointer cache = VolumeCacheType::New();
+  cache->SetCacheDirectory( cacheDirectory );
+  RegistrationServer server( cache, verbose );
+  if( !server.Listen( socketPath ) )
+    {
+    return EXIT_FAILURE;
+    }
+  std::thread serverThread( &RegistrationServer::Run, &server );
+
+  // Ground truth pose of the DRRs, as in the GetDRR tests
+  Protocol::RegistrationRequest request;
+  std::memset( &request, 0, sizeof( request ) );
+  request.Magic = Protocol::Magic;
+  request.Version = Protocol::Version;
+  std::strncpy( request.VolumeFileName, volumeFileName.c_str(), sizeof( request.VolumeFileName ) - 1 );
+  request.Threshold = threshold;
+  request.FocalPointToIsocenterDistance = 1000.0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    request.Isocenter[i] = isocenter[i];
+    }
+  const double truePose[6] = { -3.0 * dtr, 4.0 * dtr, 2.0 * dtr, 5.0, 5.0, 5.0 };
+  for( unsigned int v = 0; v < 2; v++ )
+    {
+    Protocol::ViewGeometry & view = request.Views[v];
+    view.ProjectionAngle = 90.0 * v;
+    view.Size[0] = 256;
+    view.Size[1] = 256;
+    view.Spacing[0] = 1.0;
+    view.Spacing[1] = 1.0;
+    view.CentralAxis[0] = ( view.Size[0] - 1.0 ) / 2.0;
+    view.CentralAxis[1] = ( view.Size[1] - 1.0 ) / 2.0;
+    }
+  const std::size_t bufferSize = Protocol::GetBufferSize( request.Views[0] );
+
+  bool success = true;
+  auto check = [&success]( bool condition, const char * message )
+    {
+    if( !condition )
+      {
+      std::cerr << "ERROR: " << message << std::endl;
+      success = false;
+      }
+    };
+
+  // Render both views concurrently: the CT must be loaded only once
+  int drrBuffers[2];
+  float * drrs[2];
+  Protocol::RegistrationResponse renderResponses[2];
+  {
+  std::vector< std::thread > clients;
+  for( unsigned int v = 0; v < 2; v++ )
+    {
+    drrBuffers[v] = Protocol::CreateSharedBuffer( bufferSize );
+    drrs[v] = static_cast<float *>( Protocol::MapSharedBuffer( drrBuffers[v], bufferSize, true ) );
+    check( drrs[v] != nullptr, "Cannot create the DRR buffers" );
+    }
+  for( unsigned int v = 0; v < 2 && success; v++ )
+    {
+    clients.emplace_back( [&, v]()
+      {
+      Protocol::RegistrationRequest viewRequest = request;
+      viewRequest.Job = Protocol::RenderDRRJob;
+      viewRequest.Views[0] = request.Views[v];
+      std::copy( truePose, truePose + 6, viewRequest.TransformParameters );
+      if( !SubmitJob( socketPath, viewRequest, &drrBuffers[v], renderResponses[v] ) )
+        {
+        renderResponses[v].Status = Protocol::Failure;
+        }
+      } );
+    }
+  for( auto & client : clients )
+    {
+    client.join();
+    }
+  }
+  if( success )
+    {
+    check( renderResponses[0].Status == Protocol::Success && renderResponses[1].Status == Protocol::Success,
+           "DRR rendering failed" );
+    check( cache->GetNumberOfMisses() == 1, "The CT was loaded more than once" );
+    }
+
+  // The second rendering of a view hits the cache and gives the same DRR
+  if( success )
+    {
+    const int descriptor = Protocol::CreateSharedBuffer( bufferSize );
+    const float * drr = static_cast<const float *>( Protocol::MapSharedBuffer( descriptor, bufferSize, true ) );
+
+    Protocol::RegistrationRequest viewRequest = request;
+    viewRequest.Job = Protocol::RenderDRRJob;
+    std::copy( truePose, truePose + 6, viewRequest.TransformParameters );
+    Protocol::RegistrationResponse response;
+    check( SubmitJob( socketPath, viewRequest, &descriptor, response )
+           && response.Status == Protocol::Success, "Second DRR rendering failed" );
+    check( response.VolumeCacheHit == 1, "The second rendering missed the cache" );
+    check( drr && std::memcmp( drr, drrs[0], bufferSize ) == 0, "The second rendering differs" );
+
+    // Compare with a local rendering of the same prepared volume
+    VolumeType::Pointer volume = ReadVolume( volumeFileName );
+    VolumeCacheType::PrepareVolume( volume, threshold );
+    TransformType::Pointer transform = CreateTransform( viewRequest, volume );
+    InterpolatorType::Pointer interpolator =
+      CreateInterpolator( viewRequest, viewRequest.Views[0], transform, volume );
+    std::vector< float > local( bufferSize / sizeof( float ) );
+    ImageType::Pointer localDRR =
+      CreateProjectionImage( viewRequest.Views[0], viewRequest.FocalPointToIsocenterDistance, local.data() );
+    interpolator->RenderProjection( localDRR.GetPointer() );
+    check( std::memcmp( local.data(), drrs[0], bufferSize ) == 0, "The served DRR differs from the local one" );
+
+    if( drr )
+      {
+      munmap( const_cast<float *>( drr ), bufferSize );
+      }
+    close( descriptor );
+    }
+
+  // Register the DRRs from the identity while another client renders
+  if( success )
+    {
+    Protocol::RegistrationRequest registerRequest = request;
+    registerRequest.Job = Protocol::RegisterJob;
+    Protocol::RegistrationResponse registerResponse;
+
+    Protocol::RegistrationRequest viewRequest = request;
+    viewRequest.Job = Protocol::RenderDRRJob;
+    viewRequest.Views[0] = request.Views[1];
+    const int descriptor = Protocol::CreateSharedBuffer( bufferSize );
+    Protocol::RegistrationResponse renderResponse;
+
+    std::thread renderClient( [&]()
+      {
+      if( !SubmitJob( socketPath, viewRequest, &descriptor, renderResponse ) )
+        {
+        renderResponse.Status = Protocol::Failure;
+        }
+      } );
+    const bool submitted = SubmitJob( socketPath, registerRequest, drrBuffers, registerResponse );
+    renderClient.join();
+    close( descriptor );
+
+    check( submitted && registerResponse.Status == Protocol::Success, registerResponse.Message );
+    check( renderResponse.Status == Protocol::Success, "Concurrent DRR rendering failed" );
+
+    std::cout << "Registered pose:";
+    for( double parameter : registerResponse.TransformParameters )
+      {
+      std::cout << " " << parameter;
+      }
+    std::cout << std::endl
+              << "Metric value: " << registerResponse.MetricValue
+              << ", iterations: " << registerResponse.NumberOfIterations
+              << ", time: " << registerResponse.ElapsedTime << " s" << std::endl;
+
+    // The registration must recover the pose of the DRRs
+    if( success )
+      {
+      bool recovered = true;
+      for( unsigned int i = 0; i < 6; i++ )
+        {
+        const double tolerance = i < 3 ? PoseRotationTolerance * dtr : PoseTranslationTolerance;
+        recovered = recovered && std::fabs( registerResponse.TransformParameters[i] - truePose[i] ) <= tolerance;
+        }
+      check( recovered, "The registered pose differs from the pose of the DRRs" );
+      }
+    }
+
+  // A buffer that is not sealed against shrinking could be truncated by
+  // the client while the server reads it, and is rejected
+  if( success )
+    {
+    const int descriptor = memfd_create( "TwoProjectionRegistration", MFD_CLOEXEC );
+    check( descriptor >= 0 && ftruncate( descriptor, static_cast<off_t>( bufferSize ) ) == 0,
+           "Cannot create the unsealed buffer" );
+
+    Protocol::RegistrationRequest viewRequest = request;
+    viewRequest.Job = Protocol::RenderDRRJob;
+    Protocol::RegistrationResponse response;
+    check( SubmitJob( socketPath, viewRequest, &descriptor, response )
+           && response.Status == Protocol::Failure, "An unsealed buffer was accepted" );
+    if( descriptor >= 0 )
+      {
+      close( descriptor );
+      }
+    }
+
+  // Shut the server down while another client keeps its connection open
+  // without sending anything: the server must not wait for it
+  const int idleConnection = ConnectToServer( socketPath );
+  check( idleConnection >= 0, "Cannot open the idle connection" );
+  Protocol::RegistrationRequest shutdownRequest = request;
+  shutdownRequest.Job = Protocol::ShutdownJob;
+  Protocol::RegistrationResponse shutdownResponse;
+  check( SubmitJob( socketPath, shutdownRequest, nullptr, shutdownResponse )
+         && shutdownResponse.Status == Protocol::Success, "Shutdown failed" );
+  serverThread.join();
+  if( idleConnection >= 0 )
+    {
+    close( idleConnection );
+    }
+
+  for( unsigned int v = 0; v < 2; v++ )
+    {
+    if( drrs[v] )
+      {
+      munmap( drrs[v], bufferSize );
+      }
+    close( drrBuffers[v] );
+    }
+
+  // A new cache on the same directory maps the prepared volume file
+  if( success && !cacheDirectory.empty() )
+    {
+    VolumeCacheType::Pointer fileCache = VolumeCacheType::New();
+    fileCache->SetCacheDirectory( cacheDirectory );
+    VolumeType::ConstPointer mapped = fileCache->GetVolume( volumeFileName, threshold, ReadVolume );
+    check( fileCache->GetNumberOfFileHits() == 1, "The prepared volume file was not mapped" );
+
+    VolumeType::Pointer volume = ReadVolume( volumeFileName );
+    VolumeCacheType::PrepareVolume( volume, threshold );
+    check( mapped->GetBufferedRegion() == volume->GetBufferedRegion()
+           && mapped->GetSpacing() == volume->GetSpacing()
+           && std::memcmp( mapped->GetBufferPointer(), volume->GetBufferPointer(),
+                           volume->GetPixelContainer()->Size() * sizeof( VolumePixelType ) ) == 0,
+           "The mapped prepared volume differs from the prepared CT" );
+    }
+
+  std::cout << "Volume cache: " << cache->GetNumberOfHits() << " hits, "
+            << cache->GetNumberOfMisses() << " misses, "
+            << cache->GetNumberOfFileHits() << " file hits" << std::endl;
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
+
+} // end anonymous namespace
+
+
+int TwoProjectionRegistrationServer( int argc, char *argv[] )
+{
+  char *socketPath = nullptr;
+  char *volumeFileName = nullptr;
+  std::string cacheDirectory;
+
+  bool ok;
+  bool verbose = false;
+  bool selfTest = false;
+  int cacheSize = 4;
+  double isocenter[3] = { 0.0, 0.0, 0.0 };
+  double threshold = 0.0;
+
+  while (argc > 1)
+    {
+    ok = false;
+
+    if ((ok == false) && (strcmp(argv[1], "-h") == 0))
+      {
+      ok = true;
+      server_exe_usage();
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-v") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      verbose = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-socket") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      socketPath = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cache") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cacheSize = atoi(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-cachedir") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      cacheDirectory = argv[1];
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-selftest") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      selfTest = true;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-iso") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      isocenter[0] = atof(argv[1]);
+      argc--; argv++;
+      isocenter[1] = atof(argv[1]);
+      argc--; argv++;
+      isocenter[2] = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if ((ok == false) && (strcmp(argv[1], "-threshold") == 0))
+      {
+      argc--; argv++;
+      ok = true;
+      threshold = atof(argv[1]);
+      argc--; argv++;
+      }
+
+    if (ok == false)
+      {
+      if (volumeFileName == nullptr)
+        {
+        volumeFileName = argv[1];
+        argc--;
+        argv++;
+        }
+      else
+        {
+        std::cerr << "ERROR: Can not parse argument " << argv[1] << std::endl;
+        server_exe_usage();
+        }
+      }
+    }
+
+  if (socketPath == nullptr || (selfTest && volumeFileName == nullptr))
+    {
+    server_exe_usage();
+    }
+
+#if defined(__linux__)
+  try
+    {
+    if (selfTest)
+      {
+      return RunSelfTest( socketPath, volumeFileName, isocenter, threshold, cacheDirectory, verbose );
+      }
+
+    VolumeCacheType::Pointer cache = VolumeCacheType::New();
+    cache->SetMaximumNumberOfVolumes( cacheSize );
+    cache->SetCacheDirectory( cacheDirectory );
+
+    RegistrationServer server( cache, verbose );
+    if (!server.Listen( socketPath ))
+      {
+      return EXIT_FAILURE;
+      }
+    std::cout << "Listening on " << socketPath << std::endl;
+    server.Run();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "ERROR: ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+#else
+  (void)verbose;
+  (void)selfTest;
+  (void)cacheSize;
+  (void)cacheDirectory;
+  (void)isocenter;
+  (void)threshold;
+  std::cerr << "ERROR: The registration server requires Linux" << std::endl;
+  return EXIT_FAILURE;
+#endif
+}
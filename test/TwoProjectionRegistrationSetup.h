@@ -0,0 +1,146 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef TwoProjectionRegistrationSetup_h
+#define TwoProjectionRegistrationSetup_h
+
+// Setup of the registration shared by TwoProjection2D3DRegistration, in
+// the single case and in the batch modes, and by
+// TwoProjectionRegistrationServer: the geometry of the views, the
+// transform, the metric and the optimizer. The programs only differ by
+// where the images and the parameters come from.
+
+#include "itkEuler3DTransform.h"
+#include "itkPowellOptimizer.h"
+
+#include <cmath>
+
+namespace TwoProjectionRegistrationSetup
+{
+
+using TransformType = itk::Euler3DTransform< double >;
+using OptimizerType = itk::PowellOptimizer;
+
+// constant for converting degrees to radians
+const double DegreesToRadians = ( std::atan(1.0) * 4.0 ) / 180.0;
+
+// Isocenter at continuous voxel indices of the volume, or at the center
+// of the volume if no indices are given
+template <typename TVolume>
+TransformType::InputPointType ComputeIsocenter( const TVolume * volume, const double * indices = nullptr )
+{
+  const typename TVolume::PointType origin = volume->GetOrigin();
+  const typename TVolume::SpacingType spacing = volume->GetSpacing();
+  const typename TVolume::SizeType size = volume->GetBufferedRegion().GetSize();
+
+  TransformType::InputPointType isocenter;
+  for (unsigned int i = 0; i < 3; i++)
+    {
+    const double index = indices ? indices[i] : static_cast<double>( size[i] ) / 2.0;
+    isocenter[i] = origin[i] + spacing[i] * index;
+    }
+  return isocenter;
+}
+
+// Rotate about the isocenter in the ZYX order. If given, the pose holds
+// the rotations about x, y and z in degrees and the translation in mm.
+inline void InitializeTransform( TransformType * transform,
+                                 const TransformType::InputPointType & isocenter,
+                                 const double * pose = nullptr )
+{
+  transform->SetComputeZYX(true);
+  if (pose)
+    {
+    TransformType::OutputVectorType translation;
+    translation[0] = pose[3];
+    translation[1] = pose[4];
+    translation[2] = pose[5];
+    transform->SetTranslation(translation);
+    transform->SetRotation(DegreesToRadians*pose[0], DegreesToRadians*pose[1], DegreesToRadians*pose[2]);
+    }
+  transform->SetCenter(isocenter);
+}
+
+// Place a projection image in the imaging plane, at the source to
+// isocenter distance from the focal point, with the central axis at
+// continuous pixel indices, or at the center of the image if none are
+// given
+template <typename TImage>
+void PlaceProjection( TImage * image, double scd, const double * centralAxis = nullptr )
+{
+  const typename TImage::SpacingType spacing = image->GetSpacing();
+  const typename TImage::SizeType size = image->GetLargestPossibleRegion().GetSize();
+
+  typename TImage::PointType origin;
+  for (unsigned int i = 0; i < 2; i++)
+    {
+    const double center = centralAxis ? centralAxis[i] : ((double) size[i] - 1.)/2.;
+    origin[i] = - spacing[i] * center;
+    }
+  origin[2] = - scd;
+  image->SetOrigin( origin );
+}
+
+// Project the volume onto a view at a projection angle in degrees. The
+// voxels below the threshold do not contribute to the projection.
+template <typename TInterpolator>
+void InitializeInterpolator( TInterpolator * interpolator,
+                             double projectionAngle,
+                             double scd,
+                             double threshold,
+                             TransformType * transform )
+{
+  interpolator->SetProjectionAngle( DegreesToRadians*projectionAngle );
+  interpolator->SetFocalPointToIsocenterDistance(scd);
+  interpolator->SetThreshold(threshold);
+  interpolator->SetTransform(transform);
+  interpolator->Initialize();
+}
+
+// Normalized correlation of the mean subtracted images, without gradient
+template <typename TMetric>
+void InitializeMetric( TMetric * metric, bool deterministic = false )
+{
+  metric->ComputeGradientOff();
+  metric->SetSubtractMean( true );
+  metric->SetDeterministicReduction( deterministic );
+}
+
+// Minimize the negative normalized correlation with Powell's method. The
+// weightings are set such that one degree equates to one millimeter.
+inline void InitializeOptimizer( OptimizerType * optimizer, unsigned int maximumNumberOfIterations = 10 )
+{
+  optimizer->SetMaximize( false );
+  optimizer->SetMaximumIteration( maximumNumberOfIterations );
+  optimizer->SetMaximumLineIteration( 4 );
+  optimizer->SetStepLength( 4.0 );
+  optimizer->SetStepTolerance( 0.02 );
+  optimizer->SetValueTolerance( 0.001 );
+
+  itk::Optimizer::ScalesType weightings( 6 );
+  weightings[0] = 1./DegreesToRadians;
+  weightings[1] = 1./DegreesToRadians;
+  weightings[2] = 1./DegreesToRadians;
+  weightings[3] = 1.;
+  weightings[4] = 1.;
+  weightings[5] = 1.;
+  optimizer->SetScales( weightings );
+}
+
+} // end namespace TwoProjectionRegistrationSetup
+
+#endif
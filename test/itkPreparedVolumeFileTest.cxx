@@ -0,0 +1,372 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+// Round trip of every section of the prepared volume file format: the
+// pyramid levels, their minimum and maximum grids, the bricked layout and
+// the slabs, on a volume whose sizes are not multiples of the pyramid
+// blocks, the grid cells or the bricks. Also checks that invalid files are
+// rejected, that writing to a mapped volume leaves the file unchanged,
+// that the source key changes with the source, and that the cache
+// prepares integer volumes like the interpolator thresholds.
+
+#include "itkPreparedVolumeFile.h"
+#include "itkPreparedVolumeCache.h"
+#include "itkImage.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using PixelType = short;
+using ImageType = itk::Image< PixelType, 3 >;
+using FileType = itk::PreparedVolumeFile< ImageType >;
+
+// Voxels of a level, x fastest, with their size
+struct Level
+{
+  uint64_t               Size[3];
+  std::vector<PixelType> Voxels;
+
+  PixelType At( uint64_t i, uint64_t j, uint64_t k ) const
+  {
+    return Voxels[( k * Size[1] + j ) * Size[0] + i];
+  }
+};
+
+// Reference of the pyramid: average of the blocks of 2x2x2 voxels,
+// partial blocks averaging the voxels they hold
+Level Downsample( const Level & level )
+{
+  Level downsampled;
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    downsampled.Size[d] = ( level.Size[d] + 1 ) / 2;
+    }
+  for( uint64_t z = 0; z < downsampled.Size[2]; z++ )
+    {
+    for( uint64_t y = 0; y < downsampled.Size[1]; y++ )
+      {
+      for( uint64_t x = 0; x < downsampled.Size[0]; x++ )
+        {
+        double sum = 0.0;
+        unsigned int count = 0;
+        for( uint64_t k = 2 * z; k < std::min( 2 * z + 2, level.Size[2] ); k++ )
+          {
+          for( uint64_t j = 2 * y; j < std::min( 2 * y + 2, level.Size[1] ); j++ )
+            {
+            for( uint64_t i = 2 * x; i < std::min( 2 * x + 2, level.Size[0] ); i++ )
+              {
+              sum += level.At( i, j, k );
+              count++;
+              }
+            }
+          }
+        downsampled.Voxels.push_back( static_cast<PixelType>( sum / count ) );
+        }
+      }
+    }
+  return downsampled;
+}
+
+bool Check( bool condition, const std::string & message )
+{
+  if( !condition )
+    {
+    std::cerr << "ERROR: " << message << std::endl;
+    }
+  return condition;
+}
+
+} // namespace
+
+int itkPreparedVolumeFileTest( int argc, char * argv[] )
+{
+  if( argc < 2 )
+    {
+    std::cerr << "Usage: " << argv[0] << " OutputDirectory" << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string fileName = std::string( argv[1] ) + "/itkPreparedVolumeFileTest.pvol";
+  const std::string truncatedFileName = std::string( argv[1] ) + "/itkPreparedVolumeFileTestTruncated.pvol";
+
+  constexpr unsigned int NumberOfLevels = 3;
+  constexpr unsigned int GridCellSize = 4;
+  constexpr unsigned int BrickSize = 8;
+  constexpr double       Threshold = 10.0;
+  constexpr uint64_t     SourceKey = 12345;
+  constexpr uint64_t     SourceHash = 67890;
+
+  // Volume of 21 x 18 x 13 voxels
+  ImageType::Pointer volume = ImageType::New();
+  ImageType::SizeType size = { { 21, 18, 13 } };
+  volume->SetRegions( size );
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.5;
+  spacing[1] = 2.0;
+  spacing[2] = 2.5;
+  volume->SetSpacing( spacing );
+  volume->Allocate();
+
+  std::vector<Level> levels( NumberOfLevels );
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    levels[0].Size[d] = size[d];
+    }
+  for( uint64_t k = 0; k < size[2]; k++ )
+    {
+    for( uint64_t j = 0; j < size[1]; j++ )
+      {
+      for( uint64_t i = 0; i < size[0]; i++ )
+        {
+        levels[0].Voxels.push_back( static_cast<PixelType>( ( i * 7 + j * 13 + k * 29 ) % 200 - 50 ) );
+        }
+      }
+    }
+  std::copy( levels[0].Voxels.begin(), levels[0].Voxels.end(), volume->GetBufferPointer() );
+  for( unsigned int level = 1; level < NumberOfLevels; level++ )
+    {
+    levels[level] = Downsample( levels[level - 1] );
+    }
+
+  bool passed = true;
+  try
+    {
+    FileType::Pointer writer = FileType::New();
+    writer->SetNumberOfLevels( NumberOfLevels );
+    writer->SetGridCellSize( GridCellSize );
+    writer->SetBrickSize( BrickSize );
+    writer->Write( fileName, volume, Threshold, SourceKey, SourceHash );
+
+    // Header
+    FileType::Pointer file = FileType::New();
+    passed &= Check( !file->Read( fileName, SourceKey + 1 ), "A file of another source key was read" );
+    passed &= Check( !file->IsMapped(), "A rejected file remains mapped" );
+    if( !Check( file->Read( fileName, SourceKey ), "The file cannot be read" ) )
+      {
+      return EXIT_FAILURE;
+      }
+    passed &= Check( file->GetNumberOfLevels() == NumberOfLevels, "Wrong number of levels" );
+    passed &= Check( file->GetGridCellSize() == GridCellSize, "Wrong grid cell size" );
+    passed &= Check( file->GetBrickSize() == BrickSize, "Wrong brick size" );
+    passed &= Check( file->GetThreshold() == Threshold, "Wrong threshold" );
+    passed &= Check( file->GetSourceKey() == SourceKey, "Wrong source key" );
+    passed &= Check( file->GetSourceHash() == SourceHash, "Wrong source hash" );
+
+    for( unsigned int level = 0; level < NumberOfLevels; level++ )
+      {
+      const Level & expected = levels[level];
+      const std::string name = "level " + std::to_string( level );
+
+      // Pyramid level
+      ImageType::ConstPointer levelVolume = file->GetVolume( level );
+      const ImageType::SizeType levelSize = levelVolume->GetLargestPossibleRegion().GetSize();
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        passed &= Check( levelSize[d] == expected.Size[d], "Wrong size of " + name );
+        passed &= Check( levelVolume->GetSpacing()[d] == spacing[d] * ( 1 << level ), "Wrong spacing of " + name );
+        passed &= Check( levelVolume->GetOrigin()[d] == 0.0, "Wrong origin of " + name );
+        }
+      passed &= Check( std::equal( expected.Voxels.begin(), expected.Voxels.end(), levelVolume->GetBufferPointer() ),
+                       "Wrong voxels of " + name );
+
+      // Minimum and maximum grid
+      ImageType::SizeType gridSize;
+      const FileType::MinMaxType * grid = file->GetMinMaxGrid( level, gridSize );
+      bool gridPassed = true;
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        gridPassed &= ( gridSize[d] == ( expected.Size[d] + GridCellSize - 1 ) / GridCellSize );
+        }
+      for( uint64_t z = 0; gridPassed && z < gridSize[2]; z++ )
+        {
+        for( uint64_t y = 0; y < gridSize[1]; y++ )
+          {
+          for( uint64_t x = 0; x < gridSize[0]; x++ )
+            {
+            PixelType minimum = itk::NumericTraits<PixelType>::max();
+            PixelType maximum = itk::NumericTraits<PixelType>::NonpositiveMin();
+            for( uint64_t k = z * GridCellSize; k < std::min<uint64_t>( ( z + 1 ) * GridCellSize, expected.Size[2] ); k++ )
+              {
+              for( uint64_t j = y * GridCellSize; j < std::min<uint64_t>( ( y + 1 ) * GridCellSize, expected.Size[1] ); j++ )
+                {
+                for( uint64_t i = x * GridCellSize; i < std::min<uint64_t>( ( x + 1 ) * GridCellSize, expected.Size[0] ); i++ )
+                  {
+                  minimum = std::min( minimum, expected.At( i, j, k ) );
+                  maximum = std::max( maximum, expected.At( i, j, k ) );
+                  }
+                }
+              }
+            const FileType::MinMaxType & cell = grid[( z * gridSize[1] + y ) * gridSize[0] + x];
+            gridPassed &= ( cell.Minimum == minimum && cell.Maximum == maximum );
+            }
+          }
+        }
+      passed &= Check( gridPassed, "Wrong minimum and maximum grid of " + name );
+      }
+
+    // Bricked layout of level 0, padded with zeros
+    const PixelType * bricks = file->GetBrickedVoxels();
+    if( Check( bricks != nullptr, "No bricked voxels" ) )
+      {
+      uint64_t numberOfBricks[3];
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        numberOfBricks[d] = ( size[d] + BrickSize - 1 ) / BrickSize;
+        }
+      bool bricksPassed = true;
+      for( uint64_t k = 0; k < numberOfBricks[2] * BrickSize; k++ )
+        {
+        for( uint64_t j = 0; j < numberOfBricks[1] * BrickSize; j++ )
+          {
+          for( uint64_t i = 0; i < numberOfBricks[0] * BrickSize; i++ )
+            {
+            const uint64_t brick = ( ( k / BrickSize ) * numberOfBricks[1] + j / BrickSize ) * numberOfBricks[0] + i / BrickSize;
+            const uint64_t inBrick = ( ( k % BrickSize ) * BrickSize + j % BrickSize ) * BrickSize + i % BrickSize;
+            const bool inside = i < size[0] && j < size[1] && k < size[2];
+            const PixelType expected = inside ? levels[0].At( i, j, k ) : PixelType( 0 );
+            bricksPassed &= ( bricks[brick * BrickSize * BrickSize * BrickSize + inBrick] == expected );
+            }
+          }
+        }
+      passed &= Check( bricksPassed, "Wrong bricked voxels" );
+      }
+
+    // Slabs, and their release
+    for( unsigned int level = 0; level < 2; level++ )
+      {
+      const Level & expected = levels[level];
+      const itk::IndexValueType zBegin = 1;
+      const itk::IndexValueType zEnd = static_cast<itk::IndexValueType>( expected.Size[2] ) - 1;
+      for( unsigned int pass = 0; pass < 2; pass++ )
+        {
+        ImageType::ConstPointer slab = file->GetSlab( level, zBegin, zEnd );
+        const ImageType::RegionType buffered = slab->GetBufferedRegion();
+        passed &= Check( slab->GetLargestPossibleRegion().GetSize()[2] == expected.Size[2]
+                         && buffered.GetIndex()[2] == zBegin
+                         && buffered.GetSize()[2] == static_cast<itk::SizeValueType>( zEnd - zBegin ),
+                         "Wrong regions of a slab" );
+        bool slabPassed = true;
+        for( itk::IndexValueType k = zBegin; k < zEnd; k++ )
+          {
+          for( uint64_t j = 0; j < expected.Size[1]; j++ )
+            {
+            for( uint64_t i = 0; i < expected.Size[0]; i++ )
+              {
+              ImageType::IndexType index;
+              index[0] = i;
+              index[1] = j;
+              index[2] = k;
+              slabPassed &= ( slab->GetPixel( index ) == expected.At( i, j, k ) );
+              }
+            }
+          }
+        passed &= Check( slabPassed, "Wrong voxels of a slab" + std::string( pass > 0 ? " after its release" : "" ) );
+        // The released pages are read again from the file
+        file->ReleaseSlab( level, zBegin, zEnd );
+        }
+      }
+
+    bool invalidSlabRejected = false;
+    try
+      {
+      file->GetSlab( 0, 5, 5 );
+      }
+    catch( itk::ExceptionObject & )
+      {
+      invalidSlabRejected = true;
+      }
+    passed &= Check( invalidSlabRejected, "An empty slab was accepted" );
+
+    // Writing to a mapped volume makes a private copy of the page
+    ImageType::ConstPointer mapped = file->GetVolume( 0 );
+    const_cast<PixelType *>( mapped->GetBufferPointer() )[0] = 1234;
+    FileType::Pointer otherFile = FileType::New();
+    passed &= Check( otherFile->Read( fileName, SourceKey )
+                     && otherFile->GetVolume( 0 )->GetBufferPointer()[0] == levels[0].Voxels[0],
+                     "Writing to a mapped volume changed the file" );
+
+    // A truncated file is rejected
+    std::vector<char> content;
+      {
+      std::ifstream input( fileName.c_str(), std::ios::binary );
+      content.assign( std::istreambuf_iterator<char>( input ), std::istreambuf_iterator<char>() );
+      }
+      {
+      std::ofstream output( truncatedFileName.c_str(), std::ios::binary | std::ios::trunc );
+      output.write( content.data(), content.size() / 2 );
+      }
+    FileType::Pointer truncatedFile = FileType::New();
+    passed &= Check( !truncatedFile->Read( truncatedFileName, SourceKey ), "A truncated file was read" );
+
+    // The source key depends on the path, the size and the threshold
+    const uint64_t fileKey = FileType::ComputeSourceKey( fileName, Threshold );
+    passed &= Check( fileKey != 0 && fileKey == FileType::ComputeSourceKey( fileName, Threshold ),
+                     "The source key is not reproducible" );
+    passed &= Check( fileKey != FileType::ComputeSourceKey( fileName, Threshold + 1.0 ),
+                     "The source key does not depend on the threshold" );
+    passed &= Check( FileType::ComputeSourceKey( fileName + ".missing", Threshold ) == 0,
+                     "A missing source has a key" );
+    const uint64_t truncatedKey = FileType::ComputeSourceKey( truncatedFileName, Threshold );
+    passed &= Check( truncatedKey != fileKey, "Two sources have the same key" );
+      {
+      std::ofstream output( truncatedFileName.c_str(), std::ios::binary | std::ios::app );
+      output.write( content.data(), 1 );
+      }
+    passed &= Check( FileType::ComputeSourceKey( truncatedFileName, Threshold ) != truncatedKey,
+                     "The source key did not change with the source" );
+
+    // Preparing an integer volume with a fractional threshold keeps every
+    // voxel above the threshold, rounding the difference up
+    ImageType::Pointer thresholded = ImageType::New();
+    ImageType::SizeType thresholdedSize;
+    thresholdedSize.Fill( 1 );
+    thresholdedSize[0] = 5;
+    thresholded->SetRegions( thresholdedSize );
+    ImageType::PointType thresholdedOrigin;
+    thresholdedOrigin.Fill( -7.0 );
+    thresholded->SetOrigin( thresholdedOrigin );
+    thresholded->Allocate();
+    const PixelType values[5] = { -3, 100, 101, 150, 32767 };
+    const PixelType expected[5] = { 0, 0, 1, 50, 32667 };
+    std::copy( values, values + 5, thresholded->GetBufferPointer() );
+    itk::PreparedVolumeCache< ImageType >::PrepareVolume( thresholded, 100.5 );
+    passed &= Check( thresholded->GetOrigin()[0] == 0.0, "The prepared volume origin is not zero" );
+    passed &= Check( std::equal( expected, expected + 5, thresholded->GetBufferPointer() ),
+                     "Wrong voxels of the prepared volume" );
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cerr << "ERROR: ExceptionObject caught !" << std::endl;
+    std::cerr << err << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+// Checks the voxel accesses and accumulators of the ray casting kernel
+// against PlainVoxelAccess and SumRayAccumulator, on rays crossing a
+// volume whose sizes are not multiples of the bricks:
+// - BrickedVoxelAccess gives the same integrals;
+// - QuantizedVoxelAccess gives integrals within the quantization step;
+// - MultiChannelSumRayAccumulator gives the integrals of every channel.
+// It also checks that the integral of a ray entering the volume through a
+// face does not depend on whether its first intersection rounds onto,
+// before or after the face, and that FixedPointSiddonRayTraversal visits
+// the voxels of SiddonRayTraversal<double>, with the same lengths, on
+// random rays, axis-parallel rays and rays through the planes, edges and
+// corners of the voxels.
+
+#include "itkRayCastKernel.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using TraversalType = itk::SiddonRayTraversal< double >;
+using PlainAccessType = itk::PlainVoxelAccess< double, double >;
+using SumType = itk::SumRayAccumulator< double >;
+
+const itk::SizeValueType Size[3] = { 13, 11, 9 };
+const double             Spacing[3] = { 1.5, 2.0, 2.5 };
+constexpr unsigned int   BrickSize = 4;
+
+// Rays from sources on a sphere around the volume, towards points of the
+// volume, including rays parallel to the planes of the voxels
+std::vector< std::vector<double> > CreateRays()
+{
+  const double center[3] = { 0.5 * Size[0] * Spacing[0], 0.5 * Size[1] * Spacing[1], 0.5 * Size[2] * Spacing[2] };
+  std::vector< std::vector<double> > rays;
+  for( unsigned int s = 0; s < 24; s++ )
+    {
+    const double theta = 0.3 + 0.25 * s;
+    const double phi = 0.1 + 0.13 * s;
+    const double source[3] = { center[0] + 100.0 * std::cos( theta ) * std::cos( phi ),
+                               center[1] + 100.0 * std::sin( theta ) * std::cos( phi ),
+                               center[2] + 100.0 * std::sin( phi ) };
+    for( unsigned int t = 0; t < 5; t++ )
+      {
+      const double target[3] = { center[0] + 2.1 * t - 4.0, center[1] - 1.7 * t + 3.0, center[2] + 0.9 * t - 2.0 };
+      rays.push_back( { source[0], source[1], source[2],
+                        2.0 * ( target[0] - source[0] ), 2.0 * ( target[1] - source[1] ),
+                        2.0 * ( target[2] - source[2] ) } );
+      }
+    }
+  // Along the axes
+  rays.push_back( { -10.0, 7.1, 3.3, 40.0, 0.0, 0.0 } );
+  rays.push_back( { 5.2, 40.0, 11.7, 0.0, -60.0, 0.0 } );
+  rays.push_back( { 9.9, 4.4, -20.0, 0.0, 0.0, 50.0 } );
+  return rays;
+}
+
+template <typename TAccess, typename TAccumulator>
+typename TAccumulator::ResultType Cast( const std::vector<double> & ray, const TAccess & access,
+                                        const TAccumulator & accumulator )
+{
+  return itk::RayCastKernel< TraversalType, TAccess, TAccumulator >::Cast(
+    ray.data(), ray.data() + 3, Spacing, Size, access, accumulator );
+}
+
+// Rays entering the volume through each of its faces, at oblique angles
+std::vector< std::vector<double> > CreateFaceRays()
+{
+  std::vector< std::vector<double> > rays;
+  for( unsigned int face = 0; face < 6; face++ )
+    {
+    const unsigned int axis = face / 2;
+    const bool upper = ( face % 2 ) != 0;
+    for( unsigned int t = 0; t < 40; t++ )
+      {
+      std::vector<double> ray( 6 );
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        ray[d] = ( 0.2 + 0.6 * ( ( t * ( 3 + 2 * d ) ) % 40 ) / 40.0 ) * Size[d] * Spacing[d];
+        ray[3 + d] = 0.3 * std::sin( 1.0 + t + 2.0 * d ) * Size[d] * Spacing[d];
+        }
+      ray[axis] = upper ? Size[axis] * Spacing[axis] + 7.3 : -7.3;
+      ray[3 + axis] = ( upper ? -1.0 : 1.0 ) * ( 20.0 + t );
+      rays.push_back( ray );
+      }
+    }
+  return rays;
+}
+
+// Voxels visited by a traversal and the lengths of their segments, the
+// value of every voxel being its offset in the volume
+class RecordingRayAccumulator
+{
+public:
+  using ValueType = double;
+  using ResultType = double;
+
+  template <typename TLength>
+  void Add( TLength length, ValueType value )
+  {
+    m_Voxels.push_back( static_cast<itk::SizeValueType>( value ) );
+    m_Lengths.push_back( static_cast<double>( length ) );
+  }
+
+  ResultType GetResult() const
+  {
+    return 0.0;
+  }
+
+  std::vector<itk::SizeValueType> m_Voxels;
+  std::vector<double>             m_Lengths;
+};
+
+template <typename TTraversal>
+RecordingRayAccumulator Record( const std::vector<double> & ray, const double spacing[3], const PlainAccessType & access )
+{
+  RecordingRayAccumulator recorder;
+  itk::RayCastKernel< TTraversal, PlainAccessType, RecordingRayAccumulator >::Accumulate(
+    ray.data(), ray.data() + 3, spacing, Size, access, recorder );
+  return recorder;
+}
+
+// Rays for the comparison of the traversals in a volume of the given
+// spacing: random rays, and rays parallel to one or two axes from sources
+// on the planes of the voxels or within the voxels
+std::vector< std::vector<double> > CreateTraversalRays( const double spacing[3] )
+{
+  const double extent[3] = { Size[0] * spacing[0], Size[1] * spacing[1], Size[2] * spacing[2] };
+  std::vector< std::vector<double> > rays;
+
+  std::mt19937 generator( 2019 );
+  std::uniform_real_distribution<double> unit( 0.0, 1.0 );
+  for( unsigned int r = 0; r < 2000; r++ )
+    {
+    std::vector<double> ray( 6 );
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      const double target = ( 1.2 * unit( generator ) - 0.1 ) * extent[d];
+      ray[d] = ( 3.0 * unit( generator ) - 1.0 ) * extent[d];
+      ray[3 + d] = target - ray[d];
+      }
+    rays.push_back( ray );
+    }
+
+  for( unsigned int r = 0; r < 200; r++ )
+    {
+    std::vector<double> ray( 6 );
+    const unsigned int axis = r % 3;
+    for( unsigned int d = 0; d < 3; d++ )
+      {
+      const double plane = std::floor( unit( generator ) * ( Size[d] + 1 ) );
+      ray[d] = ( ( r / 3 ) % 2 ) ? plane * spacing[d] : ( plane + unit( generator ) ) * spacing[d];
+      ray[3 + d] = 0.0;
+      }
+    ray[axis] = -10.0;
+    ray[3 + axis] = extent[axis] + 20.0;
+    if( r % 2 )
+      {
+      // Parallel to a single axis
+      const unsigned int other = ( axis + 1 ) % 3;
+      ray[3 + other] = ( unit( generator ) - 0.5 ) * extent[other];
+      }
+    rays.push_back( ray );
+    }
+  return rays;
+}
+
+// Rays along the diagonals of the voxels, in the eight directions, from
+// corners of the voxels: they cross the planes of the three axes at the
+// same points
+std::vector< std::vector<double> > CreateDiagonalRays( const double spacing[3] )
+{
+  std::vector< std::vector<double> > rays;
+  for( int i = -2; i < static_cast<int>( Size[0] ); i++ )
+    {
+    for( unsigned int s = 0; s < 8; s++ )
+      {
+      std::vector<double> ray( 6 );
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        const bool forward = ( s & ( 1u << d ) ) == 0;
+        const double corner = forward ? i - 3.0 : static_cast<double>( Size[d] ) - i + 3.0;
+        ray[d] = corner * spacing[d];
+        ray[3 + d] = ( forward ? 40.0 : -40.0 ) * spacing[d];
+        }
+      rays.push_back( ray );
+      }
+    }
+  return rays;
+}
+
+// Check that two traversals visit the same voxels with the same lengths.
+// Where the ray leaves the volume at a crossing of several planes, one of
+// them may visit the voxels between the planes with a zero length, which
+// is ignored if allowed.
+bool CheckSameVoxels( const RecordingRayAccumulator & expected, const RecordingRayAccumulator & visited,
+                      bool ignoreZeroLengths )
+{
+  double pathLength = 0.0;
+  for( double length : expected.m_Lengths )
+    {
+    pathLength += length;
+    }
+  const double tolerance = 1.0e-12 * pathLength;
+
+  std::vector<itk::SizeValueType> expectedVoxels;
+  std::vector<double>             expectedLengths;
+  std::vector<itk::SizeValueType> visitedVoxels;
+  std::vector<double>             visitedLengths;
+  for( size_t n = 0; n < expected.m_Voxels.size(); n++ )
+    {
+    if( !ignoreZeroLengths || expected.m_Lengths[n] > tolerance )
+      {
+      expectedVoxels.push_back( expected.m_Voxels[n] );
+      expectedLengths.push_back( expected.m_Lengths[n] );
+      }
+    }
+  for( size_t n = 0; n < visited.m_Voxels.size(); n++ )
+    {
+    if( !ignoreZeroLengths || visited.m_Lengths[n] > tolerance )
+      {
+      visitedVoxels.push_back( visited.m_Voxels[n] );
+      visitedLengths.push_back( visited.m_Lengths[n] );
+      }
+    }
+
+  if( visitedVoxels != expectedVoxels )
+    {
+    return false;
+    }
+  for( size_t n = 0; n < expectedLengths.size(); n++ )
+    {
+    if( std::fabs( visitedLengths[n] - expectedLengths[n] ) > tolerance )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+bool Check( bool condition, const std::string & message )
+{
+  if( !condition )
+    {
+    std::cerr << "ERROR: " << message << std::endl;
+    }
+  return condition;
+}
+
+} // namespace
+
+int itkRayCastKernelTest( int, char *[] )
+{
+  bool passed = true;
+
+  const itk::IndexValueType bufferedIndex[3] = { 0, 0, 0 };
+  const itk::SizeValueType  numberOfVoxels = Size[0] * Size[1] * Size[2];
+
+  // Voxels with distinct values, and a volume of ones giving the length of
+  // the rays inside the volume
+  std::vector<double> voxels( numberOfVoxels );
+  for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+    {
+    voxels[v] = static_cast<double>( ( v * 7919 ) % 1009 ) - 200.0;
+    }
+  const std::vector<double> ones( numberOfVoxels, 1.0 );
+  const PlainAccessType plainAccess( voxels.data(), bufferedIndex, Size );
+  const PlainAccessType onesAccess( ones.data(), bufferedIndex, Size );
+
+  // Bricked layout, padded to whole bricks with a value that must not be
+  // read
+  itk::SizeValueType numberOfBricks[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    numberOfBricks[d] = ( Size[d] + BrickSize - 1 ) / BrickSize;
+    }
+  std::vector<double> bricks( numberOfBricks[0] * numberOfBricks[1] * numberOfBricks[2]
+                              * BrickSize * BrickSize * BrickSize, 1.0e9 );
+  for( itk::SizeValueType k = 0; k < Size[2]; k++ )
+    {
+    for( itk::SizeValueType j = 0; j < Size[1]; j++ )
+      {
+      for( itk::SizeValueType i = 0; i < Size[0]; i++ )
+        {
+        const itk::SizeValueType brick = i / BrickSize + ( j / BrickSize ) * numberOfBricks[0]
+                                       + ( k / BrickSize ) * numberOfBricks[0] * numberOfBricks[1];
+        const itk::SizeValueType voxel = i % BrickSize + ( j % BrickSize ) * BrickSize
+                                       + ( k % BrickSize ) * BrickSize * BrickSize;
+        bricks[brick * BrickSize * BrickSize * BrickSize + voxel] = voxels[i + ( j + k * Size[1] ) * Size[0]];
+        }
+      }
+    }
+  const itk::BrickedVoxelAccess< double, double > brickedAccess( bricks.data(), Size, BrickSize );
+
+  // Quantized to 8 and 16 bits
+  std::vector<unsigned char> codes8;
+  double scale8;
+  double offset8;
+  itk::QuantizedVoxelAccess< unsigned char, double >::Quantize( voxels.data(), numberOfVoxels, codes8, scale8, offset8 );
+  const itk::QuantizedVoxelAccess< unsigned char, double > quantizedAccess8( codes8.data(), Size, scale8, offset8 );
+  std::vector<short> codes16;
+  double scale16;
+  double offset16;
+  itk::QuantizedVoxelAccess< short, double >::Quantize( voxels.data(), numberOfVoxels, codes16, scale16, offset16 );
+  const itk::QuantizedVoxelAccess< short, double > quantizedAccess16( codes16.data(), Size, scale16, offset16 );
+
+  // Two channels: the voxels and an affine function of them
+  using ChannelsType = itk::FixedArray< double, 2 >;
+  std::vector<ChannelsType> channels( numberOfVoxels );
+  std::vector<double> secondChannel( numberOfVoxels );
+  for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+    {
+    secondChannel[v] = 3.0 - 0.5 * voxels[v];
+    channels[v][0] = voxels[v];
+    channels[v][1] = secondChannel[v];
+    }
+  const itk::PlainVoxelAccess< ChannelsType, ChannelsType > channelsAccess( channels.data(), bufferedIndex, Size );
+  const PlainAccessType secondChannelAccess( secondChannel.data(), bufferedIndex, Size );
+
+  unsigned int raysInVolume = 0;
+  for( const std::vector<double> & ray : CreateRays() )
+    {
+    const double expected = Cast( ray, plainAccess, SumType() );
+    const double length = Cast( ray, onesAccess, SumType() );
+    if( length > 0.0 )
+      {
+      raysInVolume++;
+      }
+
+    passed &= Check( Cast( ray, brickedAccess, SumType() ) == expected,
+                     "Wrong integral with BrickedVoxelAccess" );
+
+    // Every voxel value is within half a quantization step
+    const double quantized8 = Cast( ray, quantizedAccess8, SumType() );
+    passed &= Check( std::fabs( quantized8 - expected ) <= 0.5 * scale8 * length + 1.0e-9,
+                     "Integral with 8-bit QuantizedVoxelAccess beyond the quantization error" );
+    const double quantized16 = Cast( ray, quantizedAccess16, SumType() );
+    passed &= Check( std::fabs( quantized16 - expected ) <= 0.5 * scale16 * length + 1.0e-9,
+                     "Integral with 16-bit QuantizedVoxelAccess beyond the quantization error" );
+
+    const ChannelsType integrals = Cast( ray, channelsAccess, itk::MultiChannelSumRayAccumulator< double, 2 >() );
+    passed &= Check( integrals[0] == expected && integrals[1] == Cast( ray, secondChannelAccess, SumType() ),
+                     "Wrong integrals with MultiChannelSumRayAccumulator" );
+    }
+  passed &= Check( raysInVolume > 100, "Too few rays cross the volume" );
+
+  // Moving the source by a few units in the last place moves the first
+  // intersection onto, before or after the face, which must not change the
+  // voxel the traversal starts from
+  for( const std::vector<double> & ray : CreateFaceRays() )
+    {
+    const double expected = Cast( ray, plainAccess, SumType() );
+    for( int ulps = -3; ulps <= 3; ulps++ )
+      {
+      std::vector<double> nudged( ray );
+      for( unsigned int d = 0; d < 3; d++ )
+        {
+        for( int u = 0; u < std::abs( ulps ); u++ )
+          {
+          nudged[d] = std::nextafter( nudged[d], ( ulps > 0 ) ? 1.0e9 : -1.0e9 );
+          }
+        }
+      passed &= Check( std::fabs( Cast( nudged, plainAccess, SumType() ) - expected ) <= 1.0e-9 * ( 1.0 + std::fabs( expected ) ),
+                       "The integral depends on the rounding of the entry of the ray" );
+      }
+    }
+
+  // The fixed point traversal visits the voxels of the exact one, in the
+  // anisotropic volume and in an isotropic one
+  std::vector<double> offsets( numberOfVoxels );
+  for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+    {
+    offsets[v] = static_cast<double>( v );
+    }
+  const PlainAccessType offsetsAccess( offsets.data(), bufferedIndex, Size );
+  const double isotropicSpacing[3] = { 2.0, 2.0, 2.0 };
+  for( const double * spacing : { Spacing, isotropicSpacing } )
+    {
+    unsigned int raysCompared = 0;
+    for( const std::vector<double> & ray : CreateTraversalRays( spacing ) )
+      {
+      const RecordingRayAccumulator exact = Record< itk::SiddonRayTraversal<double> >( ray, spacing, offsetsAccess );
+      if( !exact.m_Voxels.empty() )
+        {
+        raysCompared++;
+        }
+      passed &= Check( CheckSameVoxels( exact, Record< itk::FixedPointSiddonRayTraversal<double> >( ray, spacing, offsetsAccess ), false ),
+                       "FixedPointSiddonRayTraversal visits other voxels than SiddonRayTraversal" );
+      }
+    passed &= Check( raysCompared > 1000, "Too few rays cross the volume in the comparison of the traversals" );
+
+    for( const std::vector<double> & ray : CreateDiagonalRays( spacing ) )
+      {
+      const RecordingRayAccumulator exact = Record< itk::SiddonRayTraversal<double> >( ray, spacing, offsetsAccess );
+      passed &= Check( CheckSameVoxels( exact, Record< itk::FixedPointSiddonRayTraversal<double> >( ray, spacing, offsetsAccess ), true ),
+                       "FixedPointSiddonRayTraversal visits other voxels than SiddonRayTraversal along a diagonal" );
+      }
+    }
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+// Checks that the loops of RayCastWorkerPool visit every item exactly
+// once, and ParallelForDynamic() one item per call, for any number of
+// workers including the serial case of one worker.
+
+#include "itkRayCastWorkerPool.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+
+bool CheckVisits( const std::vector< std::atomic<int> > & visits, const char * loop, unsigned int numberOfWorkers )
+{
+  for( std::size_t item = 0; item < visits.size(); item++ )
+    {
+    if( visits[item] != 1 )
+      {
+      std::cerr << "ERROR: " << loop << " with " << numberOfWorkers << " workers visited item "
+                << item << " " << visits[item] << " times" << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+
+} // namespace
+
+int itkRayCastWorkerPoolTest( int, char *[] )
+{
+  bool passed = true;
+
+  for( unsigned int numberOfWorkers : { 1u, 2u, 4u } )
+    {
+    itk::RayCastWorkerPool::Pointer pool = itk::RayCastWorkerPool::New();
+    pool->SetNumberOfWorkers( numberOfWorkers );
+    pool->SetTileSize( 3 );
+
+    for( itk::SizeValueType numberOfItems : { 0ul, 1ul, 10ul, 1000ul } )
+      {
+      // ParallelFor: contiguous ranges
+      std::vector< std::atomic<int> > visits( numberOfItems );
+      for( auto & visit : visits )
+        {
+        visit = 0;
+        }
+      pool->ParallelFor( numberOfItems,
+        [&]( itk::SizeValueType begin, itk::SizeValueType end, unsigned int )
+        {
+        for( itk::SizeValueType item = begin; item < end; item++ )
+          {
+          visits[item]++;
+          }
+        } );
+      passed &= CheckVisits( visits, "ParallelFor", numberOfWorkers );
+
+      // ParallelForDynamic: one item per call, whatever the number of
+      // workers. The function only processes the first item of its range.
+      for( auto & visit : visits )
+        {
+        visit = 0;
+        }
+      std::atomic<itk::SizeValueType> calls( 0 );
+      std::atomic<bool> singleItems( true );
+      pool->ParallelForDynamic( numberOfItems,
+        [&]( itk::SizeValueType item, itk::SizeValueType end, unsigned int workerId )
+        {
+        if( end != item + 1 || workerId >= numberOfWorkers )
+          {
+          singleItems = false;
+          }
+        visits[item]++;
+        calls++;
+        } );
+      passed &= CheckVisits( visits, "ParallelForDynamic", numberOfWorkers );
+      if( !singleItems || calls != numberOfItems )
+        {
+        std::cerr << "ERROR: ParallelForDynamic with " << numberOfWorkers << " workers made " << calls
+                  << " calls for " << numberOfItems << " items" << std::endl;
+        passed = false;
+        }
+      }
+
+    // ParallelForTiles: every point of the grid in exactly one tile
+    const itk::SizeValueType width = 17;
+    const itk::SizeValueType height = 10;
+    std::vector< std::atomic<int> > points( width * height );
+    for( auto & point : points )
+      {
+      point = 0;
+      }
+    pool->ParallelForTiles( width, height,
+      [&]( itk::SizeValueType xBegin, itk::SizeValueType xEnd,
+           itk::SizeValueType yBegin, itk::SizeValueType yEnd, unsigned int )
+      {
+      for( itk::SizeValueType y = yBegin; y < yEnd; y++ )
+        {
+        for( itk::SizeValueType x = xBegin; x < xEnd; x++ )
+          {
+          points[y * width + x]++;
+          }
+        }
+      } );
+    passed &= CheckVisits( points, "ParallelForTiles", numberOfWorkers );
+
+    // Exceptions of the workers are rethrown in the calling thread
+    bool caught = false;
+    try
+      {
+      pool->ParallelForDynamic( 100,
+        []( itk::SizeValueType item, itk::SizeValueType, unsigned int )
+        {
+        if( item == 57 )
+          {
+          throw std::runtime_error( "item 57" );
+          }
+        } );
+      }
+    catch( const std::exception & )
+      {
+      caught = true;
+      }
+    if( !caught )
+      {
+      std::cerr << "ERROR: The exception of a worker was not rethrown with "
+                << numberOfWorkers << " workers" << std::endl;
+      passed = false;
+      }
+    }
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,326 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+// Checks the guarantees of the real-time execution profile:
+// - PrefaultBuffer() only reads, so read-only mappings can be pre-faulted;
+// - in the steady state, rendering a projection on the worker pool,
+//   evaluating the metric of a registration prepared for tracking and
+//   tracking a frame with the tracer enabled make no heap allocation. The
+//   allocations are counted by replacing the global operator new of the
+//   test driver. The frames are registered by an optimizer running a
+//   fixed number of evaluations, since the allocations of the optimizers
+//   themselves are not covered.
+
+#include "itkRealTimeExecutionProfile.h"
+#include "itkTwoProjectionImageRegistrationMethod.h"
+#include "itkNormalizedCorrelationTwoImageToOneImageMetric.h"
+#include "itkSiddonJacobsRayCastInterpolateImageFunction.h"
+#include "itkEuler3DTransform.h"
+#include "itkPowellOptimizer.h"
+#include "itkSingleValuedNonLinearOptimizer.h"
+#include "itkImage.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+
+std::atomic<bool>          countAllocations( false );
+std::atomic<unsigned long> numberOfAllocations( 0 );
+
+} // namespace
+
+void * operator new( std::size_t size )
+{
+  if( countAllocations.load( std::memory_order_relaxed ) )
+    {
+    numberOfAllocations.fetch_add( 1, std::memory_order_relaxed );
+    }
+  if( void * pointer = std::malloc( size > 0 ? size : 1 ) )
+    {
+    return pointer;
+    }
+  throw std::bad_alloc();
+}
+
+void operator delete( void * pointer ) noexcept
+{
+  std::free( pointer );
+}
+
+void operator delete( void * pointer, std::size_t ) noexcept
+{
+  std::free( pointer );
+}
+
+namespace
+{
+
+constexpr unsigned int Dimension = 3;
+using ImageType = itk::Image< float, Dimension >;
+using TransformType = itk::Euler3DTransform< double >;
+using InterpolatorType = itk::SiddonJacobsRayCastInterpolateImageFunction< ImageType, double, float >;
+using GeometryType = InterpolatorType::ProjectionGeometryType;
+using MetricType = itk::NormalizedCorrelationTwoImageToOneImageMetric< ImageType, ImageType >;
+using RegistrationType = itk::TwoProjectionImageRegistrationMethod< ImageType, ImageType >;
+
+// Evaluates the cost function a fixed number of times at the initial
+// position, without allocating
+class FixedIterationOptimizer : public itk::SingleValuedNonLinearOptimizer
+{
+public:
+  using Self = FixedIterationOptimizer;
+  using Superclass = itk::SingleValuedNonLinearOptimizer;
+  using Pointer = itk::SmartPointer<Self>;
+
+  itkNewMacro( Self );
+  itkTypeMacro( FixedIterationOptimizer, SingleValuedNonLinearOptimizer );
+
+  itkSetMacro( NumberOfIterations, unsigned int );
+
+  void StartOptimization() override
+  {
+    this->SetCurrentPosition( this->GetInitialPosition() );
+    for( unsigned int i = 0; i < m_NumberOfIterations; i++ )
+      {
+      this->GetValue( this->GetCurrentPosition() );
+      this->InvokeEvent( itk::IterationEvent() );
+      }
+  }
+
+protected:
+  FixedIterationOptimizer() = default;
+
+private:
+  unsigned int m_NumberOfIterations{ 1 };
+};
+
+// Count the allocations made by a function, in all threads
+template <typename TFunction>
+unsigned long CountAllocations( TFunction && function )
+{
+  numberOfAllocations = 0;
+  countAllocations = true;
+  function();
+  countAllocations = false;
+  return numberOfAllocations;
+}
+
+// A 32^3 volume of 4 mm voxels holding a ball
+ImageType::Pointer CreateVolume()
+{
+  ImageType::Pointer volume = ImageType::New();
+  ImageType::SizeType size;
+  size.Fill( 32 );
+  volume->SetRegions( size );
+  ImageType::SpacingType spacing;
+  spacing.Fill( 4.0 );
+  volume->SetSpacing( spacing );
+  volume->Allocate();
+  itk::ImageRegionIteratorWithIndex< ImageType > it( volume, volume->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    double r2 = 0.0;
+    for( unsigned int d = 0; d < Dimension; d++ )
+      {
+      const double q = it.GetIndex()[d] - 15.5 + 0.3 * d;
+      r2 += q * q;
+      }
+    it.Set( r2 < 144.0 ? 1000.0f + static_cast<float>( it.GetIndex()[2] ) : 0.0f );
+    }
+  return volume;
+}
+
+ImageType::Pointer CreateProjection()
+{
+  ImageType::Pointer projection = ImageType::New();
+  ImageType::SizeType size;
+  size[0] = 48;
+  size[1] = 48;
+  size[2] = 1;
+  ImageType::SpacingType spacing;
+  spacing.Fill( 3.0 );
+  ImageType::PointType origin;
+  origin[0] = -0.5 * ( size[0] - 1 ) * spacing[0];
+  origin[1] = -0.5 * ( size[1] - 1 ) * spacing[1];
+  origin[2] = 0.0;
+  projection->SetRegions( size );
+  projection->SetSpacing( spacing );
+  projection->SetOrigin( origin );
+  projection->Allocate( true );
+  return projection;
+}
+
+InterpolatorType::Pointer CreateInterpolator( const ImageType * volume, TransformType * transform, double angle )
+{
+  TransformType::InputPointType isocenter;
+  isocenter.Fill( 64.0 );
+  GeometryType::Pointer geometry = GeometryType::New();
+  geometry->SetLinacGeometry( isocenter, 1000.0, angle );
+
+  InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetTransform( transform );
+  interpolator->SetProjectionGeometry( geometry );
+  interpolator->SetInputImage( volume );
+  interpolator->Initialize();
+  return interpolator;
+}
+
+} // namespace
+
+int itkRealTimeExecutionProfileTest( int, char *[] )
+{
+  bool passed = true;
+
+#if defined(__linux__)
+  // A read-only mapping, like the prepared volume files: writing to it
+  // would raise SIGSEGV
+  const std::size_t mappingSize = 1 << 20;
+  void * mapping = mmap( nullptr, mappingSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( mapping != MAP_FAILED )
+    {
+    itk::RealTimeExecutionProfile::PrefaultBuffer( static_cast<char *>( mapping ) + 100, mappingSize - 100 );
+    munmap( mapping, mappingSize );
+    }
+#endif
+
+  ImageType::Pointer volume = CreateVolume();
+  itk::RealTimeExecutionProfile::PrefaultImage( volume.GetPointer() );
+
+  TransformType::Pointer transform = TransformType::New();
+  TransformType::InputPointType isocenter;
+  isocenter.Fill( 64.0 );
+  transform->SetComputeZYX( true );
+  transform->SetCenter( isocenter );
+
+  itk::RealTimeExecutionProfile::Pointer profile = itk::RealTimeExecutionProfile::New();
+  profile->SetNumberOfWorkers( 2 );
+  profile->Prepare();
+
+  // Rendering: the first projection sets up the pose, the next ones are
+  // the steady state
+  const double dtr = ( std::atan( 1.0 ) * 4.0 ) / 180.0;
+  InterpolatorType::Pointer interpolators[2] = { CreateInterpolator( volume, transform, 0.0 ),
+                                                 CreateInterpolator( volume, transform, 90.0 * dtr ) };
+  ImageType::Pointer fixedImages[2] = { CreateProjection(), CreateProjection() };
+  for( unsigned int view = 0; view < 2; view++ )
+    {
+    interpolators[view]->RenderProjection( fixedImages[view].GetPointer(), profile->GetWorkerPool() );
+    }
+  const unsigned long renderingAllocations = CountAllocations( [&]()
+    {
+    for( unsigned int repeat = 0; repeat < 10; repeat++ )
+      {
+      interpolators[repeat % 2]->RenderProjection( fixedImages[repeat % 2].GetPointer(), profile->GetWorkerPool() );
+      }
+    } );
+  if( renderingAllocations != 0 )
+    {
+    std::cerr << "ERROR: " << renderingAllocations << " allocations in 10 renderings" << std::endl;
+    passed = false;
+    }
+
+  // Metric evaluations of a registration prepared for tracking
+  MetricType::Pointer metric = MetricType::New();
+  metric->ComputeGradientOff();
+  metric->SetSubtractMean( true );
+
+  itk::PowellOptimizer::Pointer optimizer = itk::PowellOptimizer::New();
+  optimizer->SetMaximumIteration( 1 );
+
+  RegistrationType::Pointer registration = RegistrationType::New();
+  registration->SetMetric( metric );
+  registration->SetOptimizer( optimizer );
+  registration->SetTransform( transform );
+  registration->SetInterpolator1( interpolators[0] );
+  registration->SetInterpolator2( interpolators[1] );
+  registration->SetFixedImage1( fixedImages[0] );
+  registration->SetFixedImage2( fixedImages[1] );
+  registration->SetMovingImage( volume );
+  registration->SetFixedImageRegion1( fixedImages[0]->GetBufferedRegion() );
+  registration->SetFixedImageRegion2( fixedImages[1]->GetBufferedRegion() );
+  registration->SetInitialTransformParameters( transform->GetParameters() );
+  registration->SetRealTimeProfile( profile );
+  registration->InitializeTracking();
+
+  for( bool deterministic : { false, true } )
+    {
+    metric->SetDeterministicReduction( deterministic );
+    MetricType::TransformParametersType parameters = transform->GetParameters();
+    parameters[3] = 2.0;
+    metric->GetValue( parameters );
+    const unsigned long metricAllocations = CountAllocations( [&]()
+      {
+      for( unsigned int repeat = 0; repeat < 10; repeat++ )
+        {
+        parameters[3] = 0.5 * repeat;
+        metric->GetValue( parameters );
+        }
+      } );
+    if( metricAllocations != 0 )
+      {
+      std::cerr << "ERROR: " << metricAllocations << " allocations in 10 metric evaluations"
+                << ( deterministic ? " with the deterministic reduction" : "" ) << std::endl;
+      passed = false;
+      }
+    }
+
+  // Tracked frames, with the tracer marking the iterations: the first
+  // frame allocates the trace buffers of the threads
+  FixedIterationOptimizer::Pointer trackingOptimizer = FixedIterationOptimizer::New();
+  trackingOptimizer->SetNumberOfIterations( 3 );
+  registration->SetTrackingOptimizer( trackingOptimizer );
+  registration->GetTracer()->EnabledOn();
+  registration->InitializeTracking();
+  registration->TrackFrame();
+  const unsigned long trackingAllocations = CountAllocations( [&]()
+    {
+    for( unsigned int frame = 0; frame < 10; frame++ )
+      {
+      registration->TrackFrame();
+      }
+    } );
+  registration->GetTracer()->EnabledOff();
+  registration->FinalizeTracking();
+  if( trackingAllocations != 0 )
+    {
+    std::cerr << "ERROR: " << trackingAllocations << " allocations in 10 tracked frames" << std::endl;
+    passed = false;
+    }
+  if( registration->GetNumberOfTrackedFrames() != 11 )
+    {
+    std::cerr << "ERROR: " << registration->GetNumberOfTrackedFrames() << " tracked frames instead of 11" << std::endl;
+    passed = false;
+    }
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+// Checks the surface of ThresholdSurfaceMesh:
+// - the coplanar voxel faces are merged, a box having 6 faces and a ball
+//   far fewer faces than voxel faces;
+// - the regions and their densities;
+// - on regions of uniform intensity, the ray integrals are the exact
+//   thresholded line integrals, summed over the voxels from the length
+//   of the ray inside every voxel;
+// - casting rays through the surface of boxes is faster than through
+//   their voxels with the Siddon-Jacobs traversal.
+
+#include "itkThresholdSurfaceMesh.h"
+#include "itkRayCastKernel.h"
+#include "itkImage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using ImageType = itk::Image< float, 3 >;
+using MeshType = itk::ThresholdSurfaceMesh< ImageType >;
+using VoxelAccessType = itk::PlainVoxelAccess< float, double >;
+using VoxelKernelType = itk::RayCastKernel< itk::SiddonRayTraversal< double >, VoxelAccessType,
+                                            itk::ThresholdedSumRayAccumulator< double > >;
+
+constexpr double Threshold = 100.0;
+
+ImageType::Pointer CreateVolume()
+{
+  ImageType::Pointer volume = ImageType::New();
+  ImageType::SizeType size;
+  size[0] = 40;
+  size[1] = 30;
+  size[2] = 20;
+  volume->SetRegions( size );
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.5;
+  spacing[1] = 2.0;
+  spacing[2] = 2.5;
+  volume->SetSpacing( spacing );
+  volume->Allocate();
+  volume->FillBuffer( 50.0f );
+  return volume;
+}
+
+void FillBox( ImageType * volume, const int begin[3], const int end[3], float value )
+{
+  const ImageType::SizeType size = volume->GetBufferedRegion().GetSize();
+  for( int k = begin[2]; k < end[2]; k++ )
+    {
+    for( int j = begin[1]; j < end[1]; j++ )
+      {
+      for( int i = begin[0]; i < end[0]; i++ )
+        {
+        volume->GetBufferPointer()[i + size[0] * ( j + size[1] * k )] = value;
+        }
+      }
+    }
+}
+
+// The number of voxel faces between the voxels above the threshold and
+// the others, as one face per voxel face
+itk::SizeValueType CountVoxelFaces( const ImageType * volume )
+{
+  const ImageType::SizeType size = volume->GetBufferedRegion().GetSize();
+  const float * buffer = volume->GetBufferPointer();
+  auto isAbove = [&]( long i, long j, long k )
+    {
+    return i >= 0 && j >= 0 && k >= 0 && i < static_cast<long>( size[0] ) && j < static_cast<long>( size[1] )
+           && k < static_cast<long>( size[2] ) && buffer[i + size[0] * ( j + size[1] * k )] > Threshold;
+    };
+  itk::SizeValueType count = 0;
+  for( long k = 0; k < static_cast<long>( size[2] ); k++ )
+    {
+    for( long j = 0; j < static_cast<long>( size[1] ); j++ )
+      {
+      for( long i = 0; i < static_cast<long>( size[0] ); i++ )
+        {
+        if( isAbove( i, j, k ) )
+          {
+          count += !isAbove( i - 1, j, k ) + !isAbove( i + 1, j, k ) + !isAbove( i, j - 1, k )
+                 + !isAbove( i, j + 1, k ) + !isAbove( i, j, k - 1 ) + !isAbove( i, j, k + 1 );
+          }
+        }
+      }
+    }
+  return count;
+}
+
+// Rays from sources around the volume towards points inside it. The
+// targets are off the voxel planes: a ray through an edge of the surface
+// may miss both faces of the edge.
+std::vector< std::vector<double> > CreateRays( unsigned int numberOfRays )
+{
+  std::vector< std::vector<double> > rays;
+  for( unsigned int r = 0; r < numberOfRays; r++ )
+    {
+    const double theta = 0.7 + 2.39996 * r;
+    const double phi = 0.4 * std::sin( 0.37 * r );
+    const double source[3] = { 30.0 + 200.0 * std::cos( theta ) * std::cos( phi ),
+                               30.0 + 200.0 * std::sin( theta ) * std::cos( phi ),
+                               25.0 + 200.0 * std::sin( phi ) };
+    const double target[3] = { 5.1234 + ( r * 7 ) % 50, 5.3183 + ( r * 11 ) % 50, 3.2718 + ( r * 13 ) % 44 };
+    rays.push_back( { source[0], source[1], source[2],
+                      2.0 * ( target[0] - source[0] ), 2.0 * ( target[1] - source[1] ),
+                      2.0 * ( target[2] - source[2] ) } );
+    }
+  return rays;
+}
+
+// Exact thresholded integral of a line, in units of alpha: the sum over
+// the voxels above the threshold of their value minus the threshold times
+// the length of the line inside them
+double ComputeExactIntegral( const ImageType * volume, const double source[3], const double ray[3] )
+{
+  const ImageType::SizeType size = volume->GetBufferedRegion().GetSize();
+  const ImageType::SpacingType spacing = volume->GetSpacing();
+  const float * buffer = volume->GetBufferPointer();
+  double integral = 0.0;
+  itk::SizeValueType offset = 0;
+  for( unsigned int k = 0; k < size[2]; k++ )
+    {
+    for( unsigned int j = 0; j < size[1]; j++ )
+      {
+      for( unsigned int i = 0; i < size[0]; i++, offset++ )
+        {
+        if( !( buffer[offset] > Threshold ) )
+          {
+          continue;
+          }
+        const unsigned int index[3] = { i, j, k };
+        double alphaMin = -1e300;
+        double alphaMax = 1e300;
+        for( unsigned int d = 0; d < 3; d++ )
+          {
+          const double min = index[d] * spacing[d];
+          const double max = ( index[d] + 1 ) * spacing[d];
+          if( ray[d] == 0.0 )
+            {
+            if( source[d] < min || source[d] >= max )
+              {
+              alphaMax = alphaMin;
+              }
+            continue;
+            }
+          const double alpha1 = ( min - source[d] ) / ray[d];
+          const double alpha2 = ( max - source[d] ) / ray[d];
+          alphaMin = std::max( alphaMin, std::min( alpha1, alpha2 ) );
+          alphaMax = std::min( alphaMax, std::max( alpha1, alpha2 ) );
+          }
+        if( alphaMax > alphaMin )
+          {
+          integral += ( alphaMax - alphaMin ) * ( buffer[offset] - Threshold );
+          }
+        }
+      }
+    }
+  return integral;
+}
+
+bool CheckIntegrals( const MeshType * mesh, const ImageType * volume, const char * name )
+{
+  unsigned int raysThroughRegions = 0;
+  for( const std::vector<double> & ray : CreateRays( 500 ) )
+    {
+    const double expected = ComputeExactIntegral( volume, ray.data(), ray.data() + 3 );
+    const double integral = mesh->ComputeRayIntegral( ray.data(), ray.data() + 3 );
+    if( std::fabs( integral - expected ) > 1e-9 * std::max( 1.0, std::fabs( expected ) ) )
+      {
+      std::cerr << "ERROR: " << name << ": the integral of a ray through the surface is " << integral
+                << " instead of " << expected << std::endl;
+      return false;
+      }
+    if( expected > 0.0 )
+      {
+      raysThroughRegions++;
+      }
+    }
+  if( raysThroughRegions < 100 )
+    {
+    std::cerr << "ERROR: " << name << ": only " << raysThroughRegions << " rays cross the regions" << std::endl;
+    return false;
+    }
+  return true;
+}
+
+bool Check( bool condition, const std::string & message )
+{
+  if( !condition )
+    {
+    std::cerr << "ERROR: " << message << std::endl;
+    }
+  return condition;
+}
+
+} // namespace
+
+int itkThresholdSurfaceMeshTest( int, char *[] )
+{
+  bool passed = true;
+
+  // Two boxes of uniform intensity: 6 faces each
+  ImageType::Pointer boxes = CreateVolume();
+  const int boxBegin1[3] = { 4, 3, 2 };
+  const int boxEnd1[3] = { 30, 25, 15 };
+  const int boxBegin2[3] = { 33, 5, 5 };
+  const int boxEnd2[3] = { 40, 10, 20 };
+  FillBox( boxes, boxBegin1, boxEnd1, 600.0f );
+  FillBox( boxes, boxBegin2, boxEnd2, 1500.0f );
+
+  MeshType::Pointer mesh = MeshType::New();
+  mesh->Build( boxes, Threshold, true );
+  passed &= Check( mesh->GetNumberOfFaces() == 12, "The surface of two boxes has "
+                   + std::to_string( mesh->GetNumberOfFaces() ) + " faces instead of 12" );
+  passed &= Check( mesh->GetNumberOfRegions() == 2
+                   && mesh->GetRegionDensity( 0 ) == 500.0 && mesh->GetRegionDensity( 1 ) == 1400.0,
+                   "Wrong regions of two boxes" );
+  passed &= CheckIntegrals( mesh, boxes, "boxes" );
+
+  // A single region: its density is the mean over both boxes
+  MeshType::Pointer singleRegionMesh = MeshType::New();
+  singleRegionMesh->Build( boxes, Threshold, false );
+  const double volume1 = 26.0 * 22.0 * 13.0;
+  const double volume2 = 7.0 * 5.0 * 15.0;
+  passed &= Check( singleRegionMesh->GetNumberOfFaces() == 12 && singleRegionMesh->GetNumberOfRegions() == 1
+                   && std::fabs( singleRegionMesh->GetRegionDensity( 0 )
+                                 - ( 500.0 * volume1 + 1400.0 * volume2 ) / ( volume1 + volume2 ) ) < 1e-9,
+                   "Wrong surface of two boxes as a single region" );
+
+  // Casting through the 12 faces of the boxes is faster than through their
+  // voxels. The best of a few repetitions is kept against the noise.
+  const std::vector< std::vector<double> > rays = CreateRays( 20000 );
+  const itk::IndexValueType bufferedIndex[3] = { 0, 0, 0 };
+  itk::SizeValueType size[3];
+  double spacing[3];
+  for( unsigned int d = 0; d < 3; d++ )
+    {
+    size[d] = boxes->GetBufferedRegion().GetSize()[d];
+    spacing[d] = boxes->GetSpacing()[d];
+    }
+  const VoxelAccessType access( boxes->GetBufferPointer(), bufferedIndex, size );
+  double meshTime = 1e30;
+  double voxelTime = 1e30;
+  double meshSum = 0.0;
+  double voxelSum = 0.0;
+  for( unsigned int repeat = 0; repeat < 3; repeat++ )
+    {
+    auto start = std::chrono::steady_clock::now();
+    for( const std::vector<double> & ray : rays )
+      {
+      meshSum += mesh->ComputeRayIntegral( ray.data(), ray.data() + 3 );
+      }
+    meshTime = std::min( meshTime, std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+    start = std::chrono::steady_clock::now();
+    for( const std::vector<double> & ray : rays )
+      {
+      voxelSum += VoxelKernelType::Cast( ray.data(), ray.data() + 3, spacing, size, access,
+                                         itk::ThresholdedSumRayAccumulator< double >( Threshold ) );
+      }
+    voxelTime = std::min( voxelTime, std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+    }
+  std::cout << "Rays through the surface: " << 1e9 * meshTime / rays.size() << " ns, through the voxels: "
+            << 1e9 * voxelTime / rays.size() << " ns" << std::endl;
+  passed &= Check( meshSum > 0.0 && voxelSum > 0.0, "The timed rays miss the boxes" );
+  passed &= Check( meshTime < voxelTime, "Casting rays through the surface is not faster than through the voxels" );
+
+  // A ball and an L-shaped region: the integrals are exact and the faces
+  // of every plane are merged
+  ImageType::Pointer shapes = CreateVolume();
+  const ImageType::SizeType shapesSize = shapes->GetBufferedRegion().GetSize();
+  for( unsigned int k = 0; k < shapesSize[2]; k++ )
+    {
+    for( unsigned int j = 0; j < shapesSize[1]; j++ )
+      {
+      for( unsigned int i = 0; i < shapesSize[0]; i++ )
+        {
+        const double x = ( i - 14.5 ) / 11.0;
+        const double y = ( j - 14.5 ) / 11.0;
+        const double z = ( k - 9.5 ) / 8.0;
+        if( x * x + y * y + z * z < 1.0 )
+          {
+          shapes->GetBufferPointer()[i + shapesSize[0] * ( j + shapesSize[1] * k )] = 900.0f;
+          }
+        }
+      }
+    }
+  const int lBegin1[3] = { 30, 2, 2 };
+  const int lEnd1[3] = { 38, 28, 6 };
+  const int lBegin2[3] = { 30, 2, 6 };
+  const int lEnd2[3] = { 34, 28, 18 };
+  FillBox( shapes, lBegin1, lEnd1, 300.0f );
+  FillBox( shapes, lBegin2, lEnd2, 300.0f );
+
+  MeshType::Pointer shapesMesh = MeshType::New();
+  shapesMesh->Build( shapes, Threshold, true );
+  const itk::SizeValueType voxelFaces = CountVoxelFaces( shapes );
+  std::cout << "Faces of the ball and the L: " << shapesMesh->GetNumberOfFaces() << ", voxel faces: "
+            << voxelFaces << std::endl;
+  passed &= Check( shapesMesh->GetNumberOfRegions() == 2, "Wrong regions of the ball and the L" );
+  passed &= Check( 4 * shapesMesh->GetNumberOfFaces() < voxelFaces, "The faces of the ball are not merged" );
+  passed &= CheckIntegrals( shapesMesh, shapes, "ball and L" );
+
+  // An empty surface
+  MeshType::Pointer emptyMesh = MeshType::New();
+  emptyMesh->Build( CreateVolume(), Threshold, true );
+  const std::vector<double> ray = CreateRays( 1 )[0];
+  passed &= Check( emptyMesh->GetNumberOfFaces() == 0 && emptyMesh->GetNumberOfRegions() == 0
+                   && emptyMesh->ComputeRayIntegral( ray.data(), ray.data() + 3 ) == 0.0,
+                   "The surface of an empty volume is not empty" );
+
+  if( !passed )
+    {
+    return EXIT_FAILURE;
+    }
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+# ==========================================================================
+#
+#   Copyright Insight Software Consortium
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#          http://www.apache.org/licenses/LICENSE-2.0.txt
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+# ==========================================================================
+
+# Render batches of DRRs and evaluate the metric through the NumPy
+# interface, and check them against single pose calls and that the GIL is
+# released during the batch calls.
+
+import math
+import sys
+import threading
+import time
+
+import numpy as np
+
+import itk
+
+# The interface is installed with the itk package; in the build tree it
+# is found in the wrapping directory given as argument
+if len(sys.argv) > 1:
+    sys.path.insert(0, sys.argv[1])
+import twoprojectionregistration as tpr
+
+# A box and a ball of different densities in a 32 x 48 x 40 CT
+ct = np.zeros((40, 48, 32), dtype=np.int16)
+ct[10:30, 12:36, 8:24] = 100
+z, y, x = np.mgrid[0:40, 0:48, 0:32]
+ct[(x - 20) ** 2 + (y - 20) ** 2 + (z - 24) ** 2 < 36] = 400
+ct_spacing = (1.0, 1.0, 1.5)
+isocenter = [16.0, 24.0, 30.0]
+
+geometries = []
+for angle in (0.0, 0.5 * math.pi):
+    geometry = itk.ProjectionGeometry[itk.D].New()
+    geometry.SetLinacGeometry(isocenter, 1000.0, angle)
+    geometries.append(geometry)
+
+size = (64, 64)
+spacing = (1.0, 1.0)
+origin = (-31.5, -31.5)
+poses = np.array([[0.0, 0.0, 0.0, 0.0, 0.0, 0.0],
+                  [0.02, -0.01, 0.03, 1.0, -2.0, 0.5],
+                  [0.0, 0.0, 0.0, 4.0, 0.0, 0.0]])
+
+# The DRRs are written into the given array
+out = np.zeros((len(poses),) + size, dtype=np.float32)
+drrs = tpr.render_drr(ct, geometries[0], poses, size, spacing, origin, ct_spacing,
+                      center=isocenter, out=out)
+if drrs is not out:
+    print('The DRRs were not rendered into the given array')
+    sys.exit(1)
+if not np.all(np.isfinite(drrs)) or drrs[0].max() <= 0.0:
+    print('The DRRs are empty')
+    sys.exit(1)
+
+# Every DRR of the batch is that of its pose alone
+for k in range(len(poses)):
+    drr = tpr.render_drr(ct, geometries[0], poses[k], size, spacing, origin, ct_spacing,
+                         center=isocenter, workers=2)
+    if not np.array_equal(drr[0], drrs[k]):
+        print('The DRR of pose {0} differs from the batch'.format(k))
+        sys.exit(1)
+if np.array_equal(drrs[0], drrs[2]):
+    print('The pose is ignored')
+    sys.exit(1)
+
+# The metric is minimal at the pose the fixed images were rendered at
+fixed_images = [drrs[0],
+                tpr.render_drr(ct, geometries[1], poses[0], size, spacing, origin, ct_spacing,
+                               center=isocenter)[0]]
+values = tpr.evaluate_metric(ct, geometries, fixed_images, poses, (spacing, spacing),
+                             (origin, origin), ct_spacing, center=isocenter)
+print('Metric values: {0}'.format(values))
+if len(values) != len(poses) or values[0] > -0.999 or not np.all(values[1:] > values[0]):
+    print('The metric is not minimal at the pose of the fixed images')
+    sys.exit(1)
+for k in range(len(poses)):
+    value = tpr.evaluate_metric(ct, geometries, fixed_images, poses[k], (spacing, spacing),
+                                (origin, origin), ct_spacing, center=isocenter)
+    if abs(value[0] - values[k]) > 1e-12:
+        print('The metric of pose {0} differs from the batch'.format(k))
+        sys.exit(1)
+
+# Another Python thread runs while a large batch is rendered: it ticks in
+# the middle of the call, which it could not do if the GIL were held
+many_poses = np.zeros((200, 6))
+many_poses[:, 3] = np.linspace(-5.0, 5.0, len(many_poses))
+call = []
+
+
+def render_batch():
+    begin = time.perf_counter()
+    tpr.render_drr(ct, geometries[0], many_poses, size, spacing, origin, ct_spacing,
+                   center=isocenter)
+    call.extend([begin, time.perf_counter()])
+
+
+ticks = []
+worker = threading.Thread(target=render_batch)
+worker.start()
+while worker.is_alive():
+    ticks.append(time.perf_counter())
+    time.sleep(0.001)
+worker.join()
+quarter = 0.25 * (call[1] - call[0])
+if not any(call[0] + quarter < tick < call[1] - quarter for tick in ticks):
+    print('The GIL is held while a batch is rendered ({0} s)'.format(call[1] - call[0]))
+    sys.exit(1)
+
+sys.exit(0)
@@ -0,0 +1,150 @@
+# ==========================================================================
+#
+#   Copyright Insight Software Consortium
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#          http://www.apache.org/licenses/LICENSE-2.0.txt
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+# ==========================================================================
+
+"""NumPy interface to the DRR rendering and the two-projection metric.
+
+The functions hand a whole batch of poses to itk.ProjectionBatchEvaluator
+in a single call, instead of crossing the binding once per pose. The CT,
+the fixed images and the DRRs are NumPy arrays that are viewed, not
+copied, by the ITK images: the CT must be C contiguous to avoid a copy,
+and the DRRs are written in place into the returned array, or into the
+array given as ``out``. The ray casting runs in C++ without the GIL, so
+other Python threads keep running while a batch is rendered; the arrays
+must not be modified by them during the call.
+
+Conventions:
+
+- Arrays are indexed in NumPy order: ``ct[z, y, x]``, ``drr[row, column]``.
+  Spacings and origins are given in ITK order: ``(x, y, z)`` and
+  ``(column, row)``.
+- The CT has its origin at (0, 0, 0), as a prepared volume.
+- The detector coordinates of the DRRs are those of the
+  itk.ProjectionGeometry: pixel ``(row, column)`` lies at
+  ``origin + spacing * (column, row)``.
+- A pose is a row of six Euler3DTransform parameters: the rotations about
+  x, y and z in radians, then the translation in mm, about ``center``.
+"""
+
+import numpy as np
+
+import itk
+
+__all__ = ['render_drr', 'evaluate_metric']
+
+
+def _volume_view(ct_array, ct_spacing):
+    ct_array = np.ascontiguousarray(ct_array)
+    volume = itk.image_view_from_array(ct_array)
+    volume.SetSpacing([float(s) for s in ct_spacing])
+    volume.SetOrigin([0.0, 0.0, 0.0])
+    return volume
+
+
+def _projection_view(array, spacing, origin):
+    projection = itk.image_view_from_array(array)
+    projection.SetSpacing([float(spacing[0]), float(spacing[1]), 1.0])
+    projection.SetOrigin([float(origin[0]), float(origin[1]), 0.0])
+    return projection
+
+
+def _pose_matrix(poses):
+    poses = np.ascontiguousarray(poses, dtype=np.float64).reshape(-1, 6)
+    return poses, itk.vnl_matrix_from_array(poses)
+
+
+def _evaluator(volume, threshold, center, compute_zyx, workers):
+    evaluator = itk.ProjectionBatchEvaluator[type(volume)].New()
+    evaluator.SetInput(volume)
+    evaluator.SetThreshold(float(threshold))
+    if center is None:
+        # The center of the volume
+        size = np.array(volume.GetLargestPossibleRegion().GetSize(), dtype=np.float64)
+        center = size * np.array(volume.GetSpacing()) / 2.0
+    evaluator.SetCenter([float(c) for c in center])
+    evaluator.SetComputeZYX(bool(compute_zyx))
+    if workers > 1:
+        pool = itk.RayCastWorkerPool.New()
+        pool.SetNumberOfWorkers(int(workers))
+        evaluator.SetWorkerPool(pool)
+    return evaluator
+
+
+def render_drr(ct_array, geometry, poses, size, spacing=(1.0, 1.0), origin=(0.0, 0.0),
+               ct_spacing=(1.0, 1.0, 1.0), threshold=0.0, center=None, compute_zyx=False,
+               workers=1, out=None):
+    """Render the DRRs of a batch of poses.
+
+    ct_array    -- CT volume, indexed [z, y, x]
+    geometry    -- itk.ProjectionGeometry[itk.D] of the view
+    poses       -- array of shape (6,) or (N, 6)
+    size        -- (rows, columns) of the DRRs
+    spacing     -- detector pixel spacing (column, row) in mm
+    origin      -- detector coordinates (column, row) of the first pixel
+    ct_spacing  -- voxel spacing (x, y, z) in mm
+    threshold   -- CT intensity below which the voxels are ignored
+    center      -- center of rotation of the poses, the center of the CT
+                   by default
+    compute_zyx -- order of the rotations, see Euler3DTransform
+    workers     -- number of threads each DRR is split over
+    out         -- float32 array of shape (N, rows, columns) receiving the
+                   DRRs, allocated when not given
+
+    Returns the array of shape (N, rows, columns) holding the DRRs.
+    """
+    volume = _volume_view(ct_array, ct_spacing)
+    poses, pose_matrix = _pose_matrix(poses)
+    shape = (poses.shape[0], int(size[0]), int(size[1]))
+    if out is None:
+        out = np.empty(shape, dtype=np.float32)
+    elif out.shape != shape or out.dtype != np.float32 or not out.flags['C_CONTIGUOUS']:
+        raise ValueError('out must be a C contiguous float32 array of shape {0}'.format(shape))
+    projections = _projection_view(out, spacing, origin)
+
+    evaluator = _evaluator(volume, threshold, center, compute_zyx, workers)
+    evaluator.RenderProjections(geometry, pose_matrix, projections)
+    return out
+
+
+def evaluate_metric(ct_array, geometries, fixed_images, poses, spacings=((1.0, 1.0), (1.0, 1.0)),
+                    origins=((0.0, 0.0), (0.0, 0.0)), ct_spacing=(1.0, 1.0, 1.0), threshold=0.0,
+                    center=None, compute_zyx=False, subtract_mean=True, workers=1):
+    """Evaluate the normalized correlation metric of a batch of poses.
+
+    geometries   -- the two itk.ProjectionGeometry[itk.D] views
+    fixed_images -- the two fixed images, float32 arrays indexed
+                    [row, column]
+    spacings     -- detector pixel spacings (column, row) of the fixed
+                    images in mm
+    origins      -- detector coordinates (column, row) of their first
+                    pixels
+
+    The other arguments are those of render_drr(). Returns the metric
+    value of every pose, -1 for a perfect correlation.
+    """
+    volume = _volume_view(ct_array, ct_spacing)
+    poses, pose_matrix = _pose_matrix(poses)
+    fixed = []
+    for image, spacing, origin in zip(fixed_images, spacings, origins):
+        image = np.ascontiguousarray(image, dtype=np.float32)
+        # A single slice view of the 2D image
+        fixed.append(_projection_view(image.reshape((1,) + image.shape), spacing, origin))
+
+    evaluator = _evaluator(volume, threshold, center, compute_zyx, workers)
+    evaluator.SetSubtractMean(bool(subtract_mean))
+    values = evaluator.EvaluateMetric(geometries[0], fixed[0], geometries[1], fixed[1], pose_matrix)
+    return itk.array_from_vnl_vector(values)